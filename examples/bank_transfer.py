@@ -41,6 +41,9 @@ def main():
     # when r1, r2:
     @when(r1, r2)
     def _(r1, r2):
+        # behaviors run with fresh globals, so import what they use
+        from veronapy import when
+
         r1.accounts[from_acct].balance -= 100
         r2.accounts[to_acct].balance += 100
 
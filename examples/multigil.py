@@ -1,6 +1,18 @@
 import os
 import time
-from veronapy import region, when, wait
+from veronapy import behavior, region, when, when_each, wait
+
+
+@behavior
+def work(r):
+    import time
+    r.start = time.time()
+    val = 0
+    for i in range(100000):
+        val = val + i
+
+    r.val = val
+    r.end = time.time()
 
 
 def main():
@@ -21,17 +33,7 @@ def main():
 
         r.make_shareable()
 
-    for r in regions:
-        @when(r)
-        def _(r):
-            import time
-            r.start = time.time()
-            val = 0
-            for i in range(100000):
-                val = val + i
-
-            r.val = val
-            r.end = time.time()
+    when_each(regions, work)
 
     @when(*regions)
     def _(*regions):
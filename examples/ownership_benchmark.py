@@ -0,0 +1,61 @@
+"""Microbenchmark for region ownership lookups.
+
+Every operation on an isolated object looks up the region which owns it. This
+captures a large number of objects into a region and then measures how many
+ownership lookups per second can be performed, along with the probe lengths
+of the global object table.
+"""
+
+import argparse
+import time
+
+import veronapy
+from veronapy import region, wait
+
+
+class Item:
+    """A simple captured object."""
+
+    def __init__(self, value: int):
+        """Constructor."""
+        self.value = value
+
+
+def main():
+    """Main function of the script."""
+    parser = argparse.ArgumentParser("Ownership lookup benchmark")
+    parser.add_argument("--objects", type=int, default=100000)
+    parser.add_argument("--repeats", type=int, default=10)
+    args = parser.parse_args()
+
+    r = region("bench")
+    start = time.perf_counter()
+    with r:
+        r.items = [Item(i) for i in range(args.objects)]
+
+    elapsed = time.perf_counter() - start
+    print("captured {} objects in {:.3f}s".format(args.objects, elapsed))
+
+    lookups = 0
+    start = time.perf_counter()
+    with r:
+        items = r.items
+        for _ in range(args.repeats):
+            for item in items:
+                # one lookup for the item, plus one for the attribute access
+                item.value
+                lookups += 2
+
+    elapsed = time.perf_counter() - start
+    print("{} lookups in {:.3f}s ({:.0f} lookups/sec)".format(lookups, elapsed,
+                                                             lookups / elapsed))
+
+    if hasattr(veronapy, "table_stats"):
+        stats = veronapy.table_stats()
+        print("table: {length} entries, capacity {capacity}, {tombstones} tombstones".format(**stats))
+        print("probe length (groups): mean {mean_probe:.3f}, max {max_probe}".format(**stats))
+
+
+if __name__ == "__main__":
+    main()
+    wait()
@@ -1,3 +1,5 @@
+from typing import Any, Callable, Generator, Mapping, Optional, Sequence, Tuple, Union
+
 
 class Merge:
     """An object that contains references to the objects merged into a region."""
@@ -10,8 +12,17 @@ class RegionIsolationError(Exception):
 class region:
     """An object that reifies a region and permits manipulations of the entire region."""
 
-    def __init__(self, name: str = None):
-        """Constructor."""
+    def __init__(self, name: str = None, traverse: bool = False):
+        """Constructor.
+
+        Args:
+            name: the name of the region
+            traverse: if True, objects captured by the region are discovered
+                using their type's traversal function, which finds every
+                reference (including __slots__ and extension fields).
+                Otherwise only sequence items, mapping values and __dict__
+                values are captured.
+        """
 
     @property
     def is_shared(self) -> bool:
@@ -36,6 +47,14 @@ class region:
             merged into this region.
         """
 
+    def update(self, attributes: Mapping[str, Any]):
+        """Sets many attributes of the region at once.
+
+        This function will raise an error if this region is not open. All
+        of the values are captured into the region together, which is
+        faster than setting the attributes one at a time.
+        """
+
     def detach_all(self, name: str = None) -> "region":
         """Detaches all objects from this region.
 
@@ -44,5 +63,134 @@ class region:
         """
 
 
-def when(*regions: region):
+class behavior:
+    """A function registered to run as a behavior.
+
+    The function is registered with the runtime once, so scheduling it with
+    `when(...).call` does not need to ship it again. Like the thunks passed
+    to `when`, it can only capture immutable values from an enclosing scope,
+    which are copied each time it is scheduled.
+    """
+
+    def __init__(self, func: Callable):
+        """Constructor.
+
+        Args:
+            func: the function to register
+        """
+
+    def __call__(self, *args, **kwargs) -> Any:
+        """Calls the function directly on the calling thread."""
+
+
+class read:
+    """Marks a region passed to `when` as only read by the behavior.
+
+    Behaviors that only read a region can run at the same time as each
+    other, but never at the same time as a behavior that writes it. While a
+    region is open for reading it cannot be changed, and the objects in it
+    are made immortal so that readers can share them.
+    """
+
+    def __init__(self, region: region):
+        """Constructor.
+
+        Args:
+            region: the shared region to read
+        """
+
+
+class future:
+    """The result of a behavior scheduled with `when`.
+
+    A behavior can return None, an immutable value (which is passed back in
+    the same way as behavior arguments) or a free, closed region. If the
+    behavior raises, or returns anything else, the exception is raised from
+    `result` as a WhenError (and is still raised by `wait`).
+    """
+
+    def result(self, timeout: Optional[float] = None) -> Any:
+        """Waits for the behavior to finish and returns its result.
+
+        Waiting inside a behavior blocks its worker, and will deadlock if the
+        behavior being waited on needs one of the caller's regions.
+
+        Args:
+            timeout: the number of seconds to wait, or None to wait forever
+
+        Raises:
+            TimeoutError: if the behavior does not finish in time
+        """
+
+    def done(self) -> bool:
+        """Returns whether the behavior has finished."""
+
+    def __await__(self) -> Generator[Any, None, Any]:
+        """Waits for the result inside an asyncio event loop, or inside a
+        coroutine behavior.
+
+        The running loop watches a file descriptor which is signalled when
+        awaited behaviors finish, so no thread is blocked while waiting.
+        This needs a loop which supports `add_reader`, so it is not
+        available on Windows.
+
+        A coroutine behavior (an `async def` thunk or behavior function) is
+        suspended while it waits, keeping its regions, and its worker runs
+        other behaviors in the meantime. Behaviors cannot await anything
+        other than futures.
+        """
+
+
+class when_factory:
+    """Schedules work to be done when a set of regions are open."""
+
+    def __call__(self, thunk: Callable) -> future:
+        """Schedules the thunk to be called with the regions."""
+
+    def call(self, func: Union[behavior, Callable], *args) -> future:
+        """Schedules the function to be called with the regions, followed by args.
+
+        The arguments must be immutable (numbers, strings, bytes, and tuples
+        or frozensets of them). They are marshalled once when the behavior is
+        scheduled, and the behavior unmarshals its own copy when it runs.
+        """
+
+
+def when(*regions: Union[region, read]) -> when_factory:
     """Returns a decorator that schedules work to be done when the regions are open."""
+
+
+def join(*futures: future, timeout: Optional[float] = None) -> Tuple:
+    """Waits for all of the futures and returns a tuple of their results."""
+
+
+def when_each(regions: Sequence[Union[region, read]], func: Union[behavior, Callable], *args):
+    """Schedules the function to be called once for each region, followed by args.
+
+    This is equivalent to calling `when(r).call(func, *args)` for each
+    region, but all of the behaviors are scheduled in a single batch and
+    share a single marshalled copy of the arguments, which each behavior
+    unmarshals when it runs.
+    """
+
+
+def io_read(file: Any, size: int) -> future:
+    """Reads up to size bytes from a file or descriptor, returning a future for the bytes.
+
+    The read runs on the I/O reactor, so a coroutine behavior which awaits it
+    gives its worker back in the meantime. An empty result means end of file.
+    Failures are raised as OSError by the future. Like a behavior, a pending
+    operation keeps wait() from returning.
+    """
+
+
+def io_write(file: Any, data: bytes) -> future:
+    """Writes all of the data to a file or descriptor, returning a future for the number of bytes written.
+
+    The data is copied before this returns. Writes to the same descriptor
+    happen in the order they were made.
+    """
+
+
+def io_sleep(seconds: float) -> future:
+    """Returns a future which completes with None after the delay."""
@@ -1,5 +1,6 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <marshal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,7 @@
 #ifdef _WIN32
 #include <windows.h>
 typedef volatile long long atomic_llong;
+typedef volatile LONG atomic_int;
 typedef PVOID voidptr_t;
 typedef volatile PVOID atomic_voidptr_t;
 typedef volatile LONG atomic_bool;
@@ -19,6 +21,7 @@ typedef CRITICAL_SECTION mtx_t;
 typedef HANDLE thrd_t;
 typedef int thrd_return_t;
 #define thrd_success 0
+#define thrd_timedout 1
 #define mtx_plain 0
 typedef int (*thrd_start_t)(void *);
 #define thread_local __declspec(thread)
@@ -33,11 +36,64 @@ atomic_llong atomic_decrement(atomic_llong *ptr)
   return InterlockedDecrement64(ptr);
 }
 
+atomic_llong atomic_add(atomic_llong *ptr, long long value)
+{
+  return InterlockedAdd64(ptr, value);
+}
+
 voidptr_t atomic_exchange_ptr(atomic_voidptr_t *ptr, atomic_voidptr_t val)
 {
   return InterlockedExchangePointer(ptr, val);
 }
 
+long long atomic_load_llong(atomic_llong *ptr)
+{
+  return InterlockedOr64(ptr, 0);
+}
+
+int atomic_load_int(atomic_int *ptr)
+{
+  return InterlockedOr(ptr, 0);
+}
+
+int atomic_exchange_int(atomic_int *ptr, int val)
+{
+  return InterlockedExchange(ptr, val);
+}
+
+bool atomic_compare_exchange_int(atomic_int *ptr, int *expected, int desired)
+{
+  int prev;
+
+  prev = InterlockedCompareExchange(ptr, desired, *expected);
+  if (prev == *expected)
+  {
+    return true;
+  }
+
+  *expected = prev;
+  return false;
+}
+
+void atomic_store_llong(atomic_llong *ptr, long long val)
+{
+  InterlockedExchange64(ptr, val);
+}
+
+bool atomic_compare_exchange_llong(atomic_llong *ptr, long long *expected, long long desired)
+{
+  long long prev;
+
+  prev = InterlockedCompareExchange64(ptr, desired, *expected);
+  if (prev == *expected)
+  {
+    return true;
+  }
+
+  *expected = prev;
+  return false;
+}
+
 bool atomic_compare_exchange_ptr(atomic_voidptr_t *ptr, atomic_voidptr_t *expected, atomic_voidptr_t desired)
 {
   atomic_voidptr_t prev;
@@ -71,6 +127,26 @@ voidptr_t atomic_load_ptr(atomic_voidptr_t *ptr)
   return *ptr;
 }
 
+void atomic_store_ptr(atomic_voidptr_t *ptr, voidptr_t val)
+{
+  InterlockedExchangePointer(ptr, val);
+}
+
+void atomic_fence_acquire()
+{
+  MemoryBarrier();
+}
+
+void atomic_fence_release()
+{
+  MemoryBarrier();
+}
+
+void atomic_fence()
+{
+  MemoryBarrier();
+}
+
 bool atomic_load_bool(atomic_bool *ptr)
 {
   return *ptr;
@@ -135,6 +211,26 @@ int cnd_wait(cnd_t *cond, mtx_t *mtx)
   return thrd_success;
 }
 
+int cnd_timedwait(cnd_t *cond, mtx_t *mtx, const struct timespec *ts)
+{
+  struct timespec now;
+  long long ms;
+
+  timespec_get(&now, TIME_UTC);
+  ms = (ts->tv_sec - now.tv_sec) * 1000LL + (ts->tv_nsec - now.tv_nsec) / 1000000;
+  if (ms <= 0)
+  {
+    return thrd_timedout;
+  }
+
+  if (!SleepConditionVariableCS(cond, mtx, (DWORD)ms))
+  {
+    return GetLastError() == ERROR_TIMEOUT ? thrd_timedout : -1;
+  }
+
+  return thrd_success;
+}
+
 int thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
 {
   *thr = CreateThread(NULL, 0, func, arg, 0, NULL);
@@ -162,7 +258,20 @@ int thrd_join(thrd_t thr, int *res)
   return GetLastError();
 }
 #else
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdatomic.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#define VPY_FUTEX
+#endif
 
 typedef intptr_t voidptr_t;
 typedef atomic_intptr_t atomic_voidptr_t;
@@ -177,11 +286,66 @@ long long atomic_decrement(atomic_llong *ptr)
   return atomic_fetch_sub(ptr, 1) - 1;
 }
 
+long long atomic_add(atomic_llong *ptr, long long value)
+{
+  return atomic_fetch_add(ptr, value) + value;
+}
+
+long long atomic_load_llong(atomic_llong *ptr)
+{
+  return atomic_load(ptr);
+}
+
+void atomic_store_llong(atomic_llong *ptr, long long val)
+{
+  atomic_store(ptr, val);
+}
+
+bool atomic_compare_exchange_llong(atomic_llong *ptr, long long *expected, long long desired)
+{
+  return atomic_compare_exchange_strong(ptr, expected, desired);
+}
+
+int atomic_load_int(atomic_int *ptr)
+{
+  return atomic_load(ptr);
+}
+
+int atomic_exchange_int(atomic_int *ptr, int val)
+{
+  return atomic_exchange(ptr, val);
+}
+
+bool atomic_compare_exchange_int(atomic_int *ptr, int *expected, int desired)
+{
+  return atomic_compare_exchange_strong(ptr, expected, desired);
+}
+
 voidptr_t atomic_load_ptr(atomic_voidptr_t *ptr)
 {
   return atomic_load(ptr);
 }
 
+void atomic_store_ptr(atomic_voidptr_t *ptr, voidptr_t val)
+{
+  atomic_store(ptr, val);
+}
+
+void atomic_fence_acquire()
+{
+  atomic_thread_fence(memory_order_acquire);
+}
+
+void atomic_fence_release()
+{
+  atomic_thread_fence(memory_order_release);
+}
+
+void atomic_fence()
+{
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
 bool atomic_load_bool(atomic_bool *ptr)
 {
   return atomic_load(ptr);
@@ -208,6 +372,7 @@ bool atomic_compare_exchange_bool(atomic_bool *ptr, bool *expected, bool desired
 }
 
 #ifdef __APPLE__
+#include <errno.h>
 #include <pthread.h>
 
 typedef pthread_mutex_t mtx_t;
@@ -219,6 +384,7 @@ typedef thrd_return_t (*thrd_start_t)(void *);
 #define VPY_PTHREAD
 #define mtx_plain PTHREAD_MUTEX_NORMAL
 #define thrd_success 0
+#define thrd_timedout ETIMEDOUT
 
 int mtx_init(mtx_t *mtx, int type)
 {
@@ -265,6 +431,11 @@ int cnd_wait(cnd_t *cond, mtx_t *mtx)
   return pthread_cond_wait(cond, mtx);
 }
 
+int cnd_timedwait(cnd_t *cond, mtx_t *mtx, const struct timespec *ts)
+{
+  return pthread_cond_timedwait(cond, mtx, ts);
+}
+
 int thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
 {
   return pthread_create(thr, NULL, func, arg);
@@ -291,21 +462,192 @@ typedef int thrd_return_t;
 /*                  Hashtable Implementation                   */
 /***************************************************************/
 
-typedef struct hashtable_entry_s
+/*
+ * The hashtables below are read far more often than they are written (every
+ * ownership check on every interpreter may end up here) and so reads are
+ * lock-free. The entries live in an array which is published through an
+ * atomic pointer: a reader loads the array once and probes it without taking
+ * any locks. Writers are serialised by the table mutex. An insert writes the
+ * value, then the key, then the control byte, so a reader which observes a
+ * control byte will also observe the key and its value.
+ *
+ * Resizing is incremental so that no single write pays for rehashing the
+ * whole table (and holds the lock for the duration). A new, empty array is
+ * published and the previous one becomes the migrating array. Each write then
+ * copies a bounded number of slots across. Until the migration is finished a
+ * key may be in either array (or both), so lookups which miss in the current
+ * array consult the migrating one. Entries are copied rather than moved, so
+ * that a reader can never miss a key which is in transit, and writers update
+ * or remove a key in both arrays. Once drained, the old array is retired
+ * rather than freed, as a reader may still be probing it.
+ *
+ * Retired arrays are freed after a grace period. Each reader counts itself in
+ * one of two reader counts, picked by the parity of the table's epoch when it
+ * starts, for the length of a lookup. An array retired in epoch t can only be
+ * held by readers which started in epoch t or before. Writers move to the
+ * next epoch once the count which the new epoch will share is empty, so the
+ * readers of the epoch before t have gone by the time t ends. The array is
+ * then freed once the count for t is empty too. Lookups are short, so a
+ * retired array is normally freed by one of the next few writes.
+ *
+ * A reader can still race with a writer: the migration may start or finish
+ * between loading the arrays and probing them, or a slot may be removed and
+ * reused for another key while it is being read. A reader therefore checks
+ * that the arrays it loaded are still the published ones once it is done,
+ * and each group has a count which writers bump around reusing one of its
+ * slots, which the reader checks around reading a slot of that group. Only
+ * a lookup which actually overlapped one of these is retried, so readers
+ * never wait for the writer lock, however long a writer holds it.
+ *
+ * The layout is that of a Swiss table: keys and values are kept in separate
+ * arrays, and each slot has a control byte which is either empty, deleted,
+ * or holds the low 7 bits of the key's hash. Slots are probed a group of 16
+ * at a time by comparing the control bytes of the whole group against the
+ * hash in a single SIMD operation (SSE2 or NEON, with a scalar fallback), so
+ * that keys are only compared for the (rare) slots whose hash bits match.
+ *
+ * Removed entries are marked as deleted so that probe chains passing through
+ * them remain intact. Deleted slots are reused by later inserts and are
+ * dropped whenever the array is rebuilt, which happens when they make up too
+ * much of the table (compaction) or when the table is mostly empty (shrink).
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HT_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HT_NEON
+#endif
+
+#define HT_GROUP_WIDTH 16
+// Number of slots of the migrating array copied by each write
+#define HT_MIGRATE_STEP (8 * HT_GROUP_WIDTH)
+#define HT_CTRL_EMPTY ((uint8_t)0x80)
+#define HT_CTRL_DELETED ((uint8_t)0xFE)
+#define HT_CTRL_IS_FULL(c) ((c) < 0x80)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HT_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(HT_SSE2)
+#define HT_PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define HT_PREFETCH(addr)
+#endif
+
+// A bitmask over the slots in a group. With NEON each slot has 4 bits.
+typedef uint64_t ht_bitmask;
+
+#ifdef HT_NEON
+#define HT_BITMASK_SHIFT 2
+#define HT_BITMASK_SLOT 0xFULL
+#else
+#define HT_BITMASK_SHIFT 0
+#define HT_BITMASK_SLOT 0x1ULL
+#endif
+
+typedef struct hashtable_array_s
 {
-  voidptr_t key;
-  voidptr_t value;
-} ht_entry;
+  Py_ssize_t capacity;
+  // The next retired array waiting for its readers to finish
+  struct hashtable_array_s *retired;
+  // The epoch in which the array was retired
+  long long retired_epoch;
+  atomic_voidptr_t *keys;
+  atomic_voidptr_t *values;
+  // One count per group, odd while a writer is reusing one of its slots
+  atomic_llong *reuse;
+  // One control byte per slot, aligned to the group width
+  uint8_t *ctrl;
+} ht_array;
 
 typedef struct hashtable_s
 {
-  ht_entry *entries;
-  Py_ssize_t capacity;
+  // The currently published ht_array
+  atomic_voidptr_t array;
+  // The ht_array being migrated into array, or NULL
+  atomic_voidptr_t migrating;
+  // The next slot of the migrating array to be copied
+  Py_ssize_t migrate_index;
+  // Number of live entries
   Py_ssize_t length;
+  // Number of deleted slots in the current array
+  Py_ssize_t tombstones;
+  // The table never shrinks below its initial capacity
+  Py_ssize_t min_capacity;
   bool threadsafe;
+  // Retired arrays which readers may still be probing, newest first
+  ht_array *retired;
+  // The current epoch, and the number of readers which started in an epoch
+  // of each parity
+  atomic_llong epoch;
+  atomic_llong readers[2];
+  // Serialises writers. Readers never take it.
   mtx_t mutex;
 } ht;
 
+static int ht_ctz(ht_bitmask mask)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+/** Returns the slots in the group whose control byte equals value. */
+static ht_bitmask ht_group_match(const uint8_t *ctrl, uint8_t value)
+{
+#if defined(HT_SSE2)
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  return (ht_bitmask)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#elif defined(HT_NEON)
+  uint8x16_t cmp = vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(value));
+  return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+#else
+  ht_bitmask mask = 0;
+  for (int i = 0; i < HT_GROUP_WIDTH; ++i)
+  {
+    if (ctrl[i] == value)
+    {
+      mask |= 1ULL << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+/** Pops the lowest slot from the bitmask. */
+static int ht_bitmask_next(ht_bitmask *mask)
+{
+  int index = ht_ctz(*mask) >> HT_BITMASK_SHIFT;
+  *mask &= ~(HT_BITMASK_SLOT << (index << HT_BITMASK_SHIFT));
+  return index;
+}
+
+static ht_array *ht_array_new(Py_ssize_t capacity)
+{
+  size_t size = sizeof(ht_array) + 2 * capacity * sizeof(atomic_voidptr_t) +
+                (capacity / HT_GROUP_WIDTH) * sizeof(atomic_llong) + capacity + HT_GROUP_WIDTH;
+  ht_array *array = (ht_array *)calloc(1, size);
+  if (array == NULL)
+  {
+    return NULL;
+  }
+
+  array->capacity = capacity;
+  array->retired = NULL;
+  array->retired_epoch = 0;
+  array->keys = (atomic_voidptr_t *)(array + 1);
+  array->values = array->keys + capacity;
+  array->reuse = (atomic_llong *)(array->values + capacity);
+  array->ctrl = (uint8_t *)(((uintptr_t)(array->reuse + capacity / HT_GROUP_WIDTH) + HT_GROUP_WIDTH - 1) & ~(uintptr_t)(HT_GROUP_WIDTH - 1));
+  memset(array->ctrl, HT_CTRL_EMPTY, capacity);
+  return array;
+}
+
 static ht *ht_create(Py_ssize_t capacity, bool threadsafe)
 {
   ht *table = (ht *)malloc(sizeof(ht));
@@ -314,21 +656,34 @@ static ht *ht_create(Py_ssize_t capacity, bool threadsafe)
     return NULL;
   }
 
-  table->entries = (ht_entry *)calloc(capacity, sizeof(ht_entry));
-  if (table->entries == NULL)
+  if (capacity < HT_GROUP_WIDTH)
+  {
+    capacity = HT_GROUP_WIDTH;
+  }
+
+  ht_array *array = ht_array_new(capacity);
+  if (array == NULL)
   {
     free(table);
     return NULL;
   }
 
-  table->capacity = capacity;
+  table->array = (voidptr_t)array;
+  table->migrating = (voidptr_t)NULL;
+  table->migrate_index = 0;
   table->length = 0;
+  table->tombstones = 0;
+  table->min_capacity = capacity;
+  table->retired = NULL;
+  table->epoch = 0;
+  table->readers[0] = 0;
+  table->readers[1] = 0;
 
   if (threadsafe)
   {
     if (mtx_init(&table->mutex, mtx_plain) != thrd_success)
     {
-      free(table->entries);
+      free(array);
       free(table);
       return NULL;
     }
@@ -344,7 +699,19 @@ static ht *ht_create(Py_ssize_t capacity, bool threadsafe)
 
 static void ht_free(ht *table)
 {
-  free(table->entries);
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->migrating);
+  free(array);
+  array = (ht_array *)atomic_load_ptr(&table->array);
+  free(array);
+
+  array = table->retired;
+  while (array != NULL)
+  {
+    ht_array *retired = array->retired;
+    free(array);
+    array = retired;
+  }
+
   if (table->threadsafe)
   {
     mtx_destroy(&table->mutex);
@@ -361,141 +728,663 @@ static void ht_lock(ht *table)
   }
 }
 
+/**
+ * Frees the retired arrays which no reader can still be probing, moving to the
+ * next epoch first if the readers of the previous one have all finished. Must
+ * be called with the table lock held.
+ */
+static void ht_reclaim(ht *table)
+{
+  long long epoch = atomic_load_llong(&table->epoch);
+  if (table->retired->retired_epoch == epoch &&
+      atomic_load_llong(&table->readers[(epoch + 1) & 1]) == 0)
+  {
+    epoch = atomic_increment(&table->epoch);
+  }
+
+  ht_array **link = &table->retired;
+  while (*link != NULL)
+  {
+    ht_array *array = *link;
+    long long retired_epoch = array->retired_epoch;
+    // once two epochs have passed, the count for this one has been empty
+    if (retired_epoch < epoch &&
+        (retired_epoch + 2 <= epoch ||
+         atomic_load_llong(&table->readers[retired_epoch & 1]) == 0))
+    {
+      *link = array->retired;
+      free(array);
+    }
+    else
+    {
+      link = &array->retired;
+    }
+  }
+}
+
 static void ht_unlock(ht *table)
 {
   if (table->threadsafe)
   {
+    if (table->retired != NULL)
+    {
+      ht_reclaim(table);
+    }
+
     mtx_unlock(&table->mutex);
   }
 }
 
-#if SIZEOF_VOID_P == 8
-#define HASH_SHIFT 3
-#else
-#define HASH_SHIFT 2
-#endif
-
-static Py_ssize_t hash_key(voidptr_t key)
-{
-  return (Py_ssize_t)(key >> HASH_SHIFT);
+/**
+ * Pointers from the same arena share most of their bits and differ mainly in
+ * the middle, so they are passed through a full-avalanche mixer (the murmur3
+ * finalizer). The top bits select the starting group and the low 7 bits are
+ * stored in the control byte.
+ */
+static uint64_t hash_key(voidptr_t key)
+{
+  uint64_t hash = (uint64_t)(uintptr_t)key;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
 }
 
-static voidptr_t ht_get(ht *table, voidptr_t key)
+#define HT_H1(hash) ((Py_ssize_t)((hash) >> 7))
+#define HT_H2(hash) ((uint8_t)((hash) & 0x7F))
+
+/**
+ * Lock-free lookup in a single array. Sets value to 0 if the key is not
+ * present. Returns false if the slot holding the key may have been reused for
+ * another key while it was being read, in which case the lookup is retried.
+ */
+static bool ht_array_get(ht_array *array, voidptr_t key, voidptr_t *value)
 {
-  ht_lock(table);
-  Py_ssize_t hash = hash_key(key);
-  Py_ssize_t index = (hash & (table->capacity - 1));
+  uint64_t hash = hash_key(key);
+  uint8_t h2 = HT_H2(hash);
+  Py_ssize_t group_mask = array->capacity / HT_GROUP_WIDTH - 1;
+  Py_ssize_t group = HT_H1(hash) & group_mask;
 
-  voidptr_t result = 0;
-  while (table->entries[index].key != 0)
+  for (Py_ssize_t probe = 0; probe <= group_mask; ++probe)
   {
-    if (table->entries[index].key == key)
+    const uint8_t *ctrl = array->ctrl + group * HT_GROUP_WIDTH;
+    long long reuse = atomic_load_llong(&array->reuse[group]);
+    ht_bitmask match = ht_group_match(ctrl, h2);
+    // pairs with the fence taken by writers before publishing a control byte
+    atomic_fence_acquire();
+    while (match != 0)
     {
-      result = table->entries[index].value;
-      break;
+      Py_ssize_t index = group * HT_GROUP_WIDTH + ht_bitmask_next(&match);
+      // a matching control byte almost always means a hit, so overlap the
+      // fetch of the value with the key comparison
+      HT_PREFETCH(&array->values[index]);
+      if (atomic_load_ptr(&array->keys[index]) == key)
+      {
+        *value = atomic_load_ptr(&array->values[index]);
+        // the slot must be read before the count is checked again
+        atomic_fence_acquire();
+        return (reuse & 1) == 0 && atomic_load_llong(&array->reuse[group]) == reuse;
+      }
     }
 
-    index++;
-    if (index >= table->capacity)
+    if (ht_group_match(ctrl, HT_CTRL_EMPTY) != 0)
     {
-      index = 0;
+      break;
     }
+
+    // triangular probing visits every group of a power-of-two table
+    group = (group + probe + 1) & group_mask;
   }
 
-  ht_unlock(table);
-  return result;
+  *value = 0;
+  return true;
 }
 
-static void ht_set_entry(ht *table, voidptr_t key, voidptr_t value)
+/**
+ * Lock-free lookup. Returns 0 if the key is not present. Looks the key up in
+ * the current array and then in the migrating array, and retries if either
+ * was replaced or the slot found was reused part way through.
+ */
+static voidptr_t ht_get(ht *table, voidptr_t key)
 {
-  Py_ssize_t hash = hash_key(key);
-  Py_ssize_t index = (hash & (table->capacity - 1));
+  voidptr_t value;
+  long long epoch = 0;
+
+  if (table->threadsafe)
+  {
+    // the arrays are loaded after this, so a writer retiring one of them
+    // either sees this reader or has already unpublished it
+    epoch = atomic_load_llong(&table->epoch);
+    atomic_increment(&table->readers[epoch & 1]);
+  }
 
-  while (table->entries[index].key != 0)
+  for (;;)
   {
-    if (table->entries[index].key == key)
+    // a rebuild publishes the migrating array before the new array
+    ht_array *migrating = (ht_array *)atomic_load_ptr(&table->migrating);
+    ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+    bool valid = ht_array_get(array, key, &value);
+    if (valid && value == 0 && migrating != NULL)
     {
-      table->entries[index].value = value;
+      // the key may not have been copied across yet
+      valid = ht_array_get(migrating, key, &value);
     }
 
-    index++;
-    if (index >= table->capacity)
+    // the slots must be read before the arrays are checked again
+    atomic_fence_acquire();
+    if (valid && atomic_load_ptr(&table->array) == (voidptr_t)array &&
+        atomic_load_ptr(&table->migrating) == (voidptr_t)migrating)
     {
-      index = 0;
+      break;
     }
   }
 
-  table->entries[index].key = key;
-  table->entries[index].value = value;
-  table->length++;
+  if (table->threadsafe)
+  {
+    atomic_decrement(&table->readers[epoch & 1]);
+  }
+
+  return value;
 }
 
-static bool ht_should_expand(Py_ssize_t length, Py_ssize_t capacity)
+static void ht_set_ctrl(ht_array *array, Py_ssize_t index, uint8_t value)
 {
-  return length * 2 >= capacity;
+  // the key and value must be visible before the control byte
+  atomic_fence_release();
+  ((volatile uint8_t *)array->ctrl)[index] = value;
 }
 
-static bool ht_expand_if_needed(ht *table, Py_ssize_t min_length)
+/**
+ * Finds the slot holding key. Must be called with the table lock held (or on
+ * an array which has not been published yet). Returns -1 if the key is not
+ * present, in which case insert (if not NULL) is set to the first free slot
+ * on the probe sequence.
+ */
+static Py_ssize_t ht_find_slot(ht_array *array, voidptr_t key, Py_ssize_t *insert)
 {
-  if (!ht_should_expand(min_length, table->capacity))
-  {
-    return true;
-  }
+  uint64_t hash = hash_key(key);
+  uint8_t h2 = HT_H2(hash);
+  Py_ssize_t group_mask = array->capacity / HT_GROUP_WIDTH - 1;
+  Py_ssize_t group = HT_H1(hash) & group_mask;
+  Py_ssize_t free_slot = -1;
 
-  Py_ssize_t new_capacity = table->capacity * 2;
-  while (ht_should_expand(min_length, new_capacity))
+  for (Py_ssize_t probe = 0; probe <= group_mask; ++probe)
   {
-    new_capacity = 2 * new_capacity;
-  }
+    const uint8_t *ctrl = array->ctrl + group * HT_GROUP_WIDTH;
+    ht_bitmask match = ht_group_match(ctrl, h2);
+    while (match != 0)
+    {
+      Py_ssize_t index = group * HT_GROUP_WIDTH + ht_bitmask_next(&match);
+      if (atomic_load_ptr(&array->keys[index]) == key)
+      {
+        return index;
+      }
+    }
 
-  ht *new_table = ht_create(new_capacity, false);
-  if (new_table == 0)
-  {
-    return false;
-  }
+    if (free_slot < 0)
+    {
+      ht_bitmask deleted = ht_group_match(ctrl, HT_CTRL_DELETED);
+      if (deleted != 0)
+      {
+        free_slot = group * HT_GROUP_WIDTH + ht_bitmask_next(&deleted);
+      }
+    }
 
-  for (Py_ssize_t i = 0; i < table->capacity; ++i)
-  {
-    ht_entry entry = table->entries[i];
-    if (entry.key != 0)
+    ht_bitmask empty = ht_group_match(ctrl, HT_CTRL_EMPTY);
+    if (empty != 0)
     {
-      ht_set_entry(new_table, entry.key, entry.value);
+      if (free_slot < 0)
+      {
+        free_slot = group * HT_GROUP_WIDTH + ht_bitmask_next(&empty);
+      }
+
+      break;
     }
+
+    group = (group + probe + 1) & group_mask;
   }
 
-  free(table->entries);
-  table->entries = new_table->entries;
-  table->capacity = new_table->capacity;
-  table->length = new_table->length;
-  free(new_table);
-  return true;
+  if (insert != NULL)
+  {
+    *insert = free_slot;
+  }
+
+  return -1;
 }
 
-static bool ht_set(ht *table, voidptr_t key, voidptr_t value)
+/**
+ * Writes an entry into an array. Must be called with the table lock held (or
+ * on an array which has not been published yet). Returns true if the key was
+ * not previously present. If a deleted slot was reused, reused is set to true.
+ */
+static bool ht_set_entry(ht_array *array, voidptr_t key, voidptr_t value, bool *reused)
 {
-  bool result = true;
-  assert(key != 0);
-  if (key == 0)
+  Py_ssize_t index;
+  Py_ssize_t found = ht_find_slot(array, key, &index);
+
+  *reused = false;
+  if (found >= 0)
   {
+    atomic_store_ptr(&array->values[found], value);
     return false;
   }
 
-  ht_lock(table);
-
-  if (!ht_expand_if_needed(table, table->length))
+  *reused = array->ctrl[index] == HT_CTRL_DELETED;
+  if (*reused)
   {
-    ht_unlock(table);
-    return false;
+    // a reader may still be reading the key which was removed from this slot
+    atomic_increment(&array->reuse[index / HT_GROUP_WIDTH]);
   }
 
-  if (result)
+  atomic_store_ptr(&array->values[index], value);
+  atomic_store_ptr(&array->keys[index], key);
+  ht_set_ctrl(array, index, HT_H2(hash_key(key)));
+  if (*reused)
   {
-    ht_set_entry(table, key, value);
+    atomic_increment(&array->reuse[index / HT_GROUP_WIDTH]);
   }
 
-  ht_unlock(table);
+  return true;
+}
 
-  return result;
+static bool ht_should_expand(Py_ssize_t length, Py_ssize_t capacity)
+{
+  // maximum load factor of 7/8
+  return length * 8 >= capacity * 7;
+}
+
+static bool ht_should_compact(Py_ssize_t tombstones, Py_ssize_t capacity)
+{
+  return tombstones * 4 >= capacity;
+}
+
+static bool ht_should_shrink(Py_ssize_t length, Py_ssize_t capacity, Py_ssize_t min_capacity)
+{
+  return capacity > min_capacity && length * 8 < capacity;
+}
+
+/**
+ * Copies up to count slots of the migrating array into the current array.
+ * When the last slot has been copied the migrating array is retired. Must be
+ * called with the table lock held.
+ */
+static void ht_migrate(ht *table, Py_ssize_t count)
+{
+  bool reused;
+  ht_array *migrating = (ht_array *)atomic_load_ptr(&table->migrating);
+  if (migrating == NULL)
+  {
+    return;
+  }
+
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  Py_ssize_t end = migrating->capacity;
+  if (count < end - table->migrate_index)
+  {
+    end = table->migrate_index + count;
+  }
+
+  for (Py_ssize_t i = table->migrate_index; i < end; ++i)
+  {
+    if (HT_CTRL_IS_FULL(migrating->ctrl[i]))
+    {
+      // the key may already have been written to the new array, in which
+      // case both copies hold the same value
+      if (ht_set_entry(array, atomic_load_ptr(&migrating->keys[i]), atomic_load_ptr(&migrating->values[i]), &reused) && reused)
+      {
+        table->tombstones--;
+      }
+    }
+  }
+
+  table->migrate_index = end;
+  if (end < migrating->capacity)
+  {
+    return;
+  }
+
+  atomic_store_ptr(&table->migrating, (voidptr_t)NULL);
+  if (table->threadsafe)
+  {
+    // readers which loaded it may still be probing it
+    migrating->retired = table->retired;
+    migrating->retired_epoch = atomic_load_llong(&table->epoch);
+    table->retired = migrating;
+  }
+  else
+  {
+    free(migrating);
+  }
+}
+
+/**
+ * Starts rebuilding the table into a new array of the given capacity. The new
+ * (empty) array is published straight away and the entries are copied across
+ * by subsequent writes, dropping any deleted slots. Must be called with the
+ * table lock held.
+ */
+static bool ht_rebuild(ht *table, Py_ssize_t new_capacity)
+{
+  // only one migration can be in flight at a time
+  ht_migrate(table, PY_SSIZE_T_MAX);
+
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  ht_array *new_array = ht_array_new(new_capacity);
+  if (new_array == NULL)
+  {
+    return false;
+  }
+
+  // the old array must be visible as migrating before the new array is
+  atomic_store_ptr(&table->migrating, (voidptr_t)array);
+  table->migrate_index = 0;
+  atomic_store_ptr(&table->array, (voidptr_t)new_array);
+  table->tombstones = 0;
+  return true;
+}
+
+/** Grows the table (or compacts it) so that it can hold min_length entries. */
+static bool ht_expand_if_needed(ht *table, Py_ssize_t min_length)
+{
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  if (!ht_should_expand(min_length + table->tombstones, array->capacity))
+  {
+    return true;
+  }
+
+  // if clearing out the deleted slots frees up enough room we keep the capacity
+  Py_ssize_t new_capacity = array->capacity;
+  while (ht_should_expand(min_length, new_capacity))
+  {
+    new_capacity = 2 * new_capacity;
+  }
+
+  return ht_rebuild(table, new_capacity);
+}
+
+/** Compacts or shrinks the table after a removal, if required. */
+static bool ht_shrink_if_needed(ht *table)
+{
+  if (atomic_load_ptr(&table->migrating) != (voidptr_t)NULL)
+  {
+    // reconsidered on a later removal, once the migration has finished
+    return true;
+  }
+
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  Py_ssize_t new_capacity = array->capacity;
+  while (ht_should_shrink(table->length, new_capacity, table->min_capacity))
+  {
+    new_capacity = new_capacity / 2;
+  }
+
+  if (new_capacity == array->capacity && !ht_should_compact(table->tombstones, array->capacity))
+  {
+    return true;
+  }
+
+  return ht_rebuild(table, new_capacity);
+}
+
+/** Inserts or updates an entry. Must be called with the table lock held. */
+static bool ht_set_locked(ht *table, voidptr_t key, voidptr_t value)
+{
+  if (!ht_expand_if_needed(table, table->length + 1))
+  {
+    return false;
+  }
+
+  bool reused;
+  bool present = false;
+  ht_array *migrating = (ht_array *)atomic_load_ptr(&table->migrating);
+  if (migrating != NULL)
+  {
+    Py_ssize_t index = ht_find_slot(migrating, key, NULL);
+    if (index >= 0)
+    {
+      // keep the copy which has not been migrated yet up to date
+      atomic_store_ptr(&migrating->values[index], value);
+      present = true;
+    }
+  }
+
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  if (ht_set_entry(array, key, value, &reused))
+  {
+    if (!present)
+    {
+      table->length++;
+    }
+
+    if (reused)
+    {
+      table->tombstones--;
+    }
+  }
+
+  ht_migrate(table, HT_MIGRATE_STEP);
+  return true;
+}
+
+static bool ht_set(ht *table, voidptr_t key, voidptr_t value)
+{
+  assert(key != 0);
+  if (key == 0)
+  {
+    return false;
+  }
+
+  ht_lock(table);
+  bool result = ht_set_locked(table, key, value);
+  ht_unlock(table);
+
+  return result;
+}
+
+/**
+ * Inserts a batch of entries. The lock is taken once for the whole batch and
+ * the table is grown (at most) once beforehand to fit all of them.
+ */
+static bool ht_set_many(ht *table, const voidptr_t *keys, const voidptr_t *values, Py_ssize_t count)
+{
+  bool result = true;
+  if (count == 0)
+  {
+    return true;
+  }
+
+  ht_lock(table);
+
+  if (!ht_expand_if_needed(table, table->length + count))
+  {
+    ht_unlock(table);
+    return false;
+  }
+
+  for (Py_ssize_t i = 0; i < count && result; ++i)
+  {
+    assert(keys[i] != 0);
+    result = ht_set_locked(table, keys[i], values[i]);
+  }
+
+  ht_unlock(table);
+
+  return result;
+}
+
+/** Removes a key from an array. Returns true if the key was present. */
+static bool ht_array_remove(ht_array *array, voidptr_t key)
+{
+  Py_ssize_t index = ht_find_slot(array, key, NULL);
+  if (index < 0)
+  {
+    return false;
+  }
+
+  // a reader which still matches the key will see the cleared value
+  atomic_store_ptr(&array->values[index], 0);
+  ht_set_ctrl(array, index, HT_CTRL_DELETED);
+  return true;
+}
+
+/**
+ * Removes a key from the table. Must be called with the table lock held.
+ * Returns true if the key was present.
+ */
+static bool ht_remove_locked(ht *table, voidptr_t key)
+{
+  bool removed = false;
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  if (ht_array_remove(array, key))
+  {
+    table->tombstones++;
+    removed = true;
+  }
+
+  ht_array *migrating = (ht_array *)atomic_load_ptr(&table->migrating);
+  if (migrating != NULL && ht_array_remove(migrating, key))
+  {
+    removed = true;
+  }
+
+  if (removed)
+  {
+    table->length--;
+  }
+
+  return removed;
+}
+
+/** Removes a key from the table. Returns true if the key was present. */
+static bool ht_remove(ht *table, voidptr_t key)
+{
+  if (key == 0)
+  {
+    return false;
+  }
+
+  ht_lock(table);
+
+  bool removed = ht_remove_locked(table, key);
+
+  ht_migrate(table, HT_MIGRATE_STEP);
+  if (removed)
+  {
+    // a failed rebuild leaves the (still valid) array in place
+    ht_shrink_if_needed(table);
+  }
+
+  ht_unlock(table);
+
+  return removed;
+}
+
+/**
+ * Gets the value of a key. Must be called with the table lock held. Keys which
+ * have not been migrated yet are only present in the migrating array.
+ */
+static voidptr_t ht_get_locked(ht *table, voidptr_t key)
+{
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  Py_ssize_t index = ht_find_slot(array, key, NULL);
+  if (index >= 0)
+  {
+    return atomic_load_ptr(&array->values[index]);
+  }
+
+  ht_array *migrating = (ht_array *)atomic_load_ptr(&table->migrating);
+  if (migrating != NULL)
+  {
+    index = ht_find_slot(migrating, key, NULL);
+    if (index >= 0)
+    {
+      return atomic_load_ptr(&migrating->values[index]);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Sets each of the keys which currently map to expected to value, or removes
+ * them if value is 0, under a single hold of the lock. The keys which did not
+ * map to expected are dropped from keys, and the number kept is returned.
+ */
+static Py_ssize_t ht_replace_many(ht *table, voidptr_t *keys, Py_ssize_t count, voidptr_t expected, voidptr_t value)
+{
+  Py_ssize_t kept = 0;
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  ht_lock(table);
+
+  for (Py_ssize_t i = 0; i < count; ++i)
+  {
+    if (ht_get_locked(table, keys[i]) != expected)
+    {
+      continue;
+    }
+
+    if (value == 0 ? ht_remove_locked(table, keys[i]) : ht_set_locked(table, keys[i], value))
+    {
+      keys[kept++] = keys[i];
+    }
+  }
+
+  ht_migrate(table, HT_MIGRATE_STEP);
+  if (value == 0 && kept > 0)
+  {
+    ht_shrink_if_needed(table);
+  }
+
+  ht_unlock(table);
+
+  return kept;
+}
+
+/**
+ * Computes the mean and maximum number of groups probed to find each key in
+ * the table. Used for diagnostics.
+ */
+static void ht_probe_stats(ht *table, double *mean, Py_ssize_t *max)
+{
+  ht_lock(table);
+
+  ht_array *array = (ht_array *)atomic_load_ptr(&table->array);
+  Py_ssize_t group_mask = array->capacity / HT_GROUP_WIDTH - 1;
+  Py_ssize_t total = 0;
+  Py_ssize_t count = 0;
+  *max = 0;
+  for (Py_ssize_t i = 0; i < array->capacity; ++i)
+  {
+    if (!HT_CTRL_IS_FULL(array->ctrl[i]))
+    {
+      continue;
+    }
+
+    Py_ssize_t group = HT_H1(hash_key(atomic_load_ptr(&array->keys[i]))) & group_mask;
+    Py_ssize_t probes = 1;
+    while (group != i / HT_GROUP_WIDTH)
+    {
+      group = (group + probes) & group_mask;
+      probes++;
+    }
+
+    total += probes;
+    count++;
+    if (probes > *max)
+    {
+      *max = probes;
+    }
+  }
+
+  *mean = count == 0 ? 0.0 : (double)total / (double)count;
+
+  ht_unlock(table);
 }
 
 /***************************************************************/
@@ -534,12 +1423,21 @@ char VPY_DEBUG_FMT_BUF[1024];
   }
 
 #define VPY_CHECKREGIONOPEN(region, ret)                         \
-  if (!region->is_open)                                          \
+  if (!region->is_open && !is_read_granted(region))              \
   {                                                              \
     PyErr_SetString(RegionIsolationError, "Region is not open"); \
     return ret;                                                  \
   }
 
+#define VPY_CHECKREGIONWRITABLE(region, ret)                               \
+  if (!region->is_open)                                                    \
+  {                                                                        \
+    PyErr_SetString(RegionIsolationError,                                  \
+                    is_read_granted(region) ? "Region is open read-only"   \
+                                            : "Region is not open");       \
+    return ret;                                                            \
+  }
+
 #define VPY_CHECKARG0REGION(ret)                                 \
   PyTypeObject *arg0_type = Py_TYPE(arg0);                       \
   PyTypeObject *arg0_isolated_type = arg0_type;                  \
@@ -547,9 +1445,12 @@ char VPY_DEBUG_FMT_BUF[1024];
   if (arg0_region == NULL)                                       \
   {                                                              \
     arg0_type = arg0_isolated_type;                              \
-    capture_object(region, arg0);                                \
-    arg0_region = region;                                        \
-    arg0_isolated_type = Py_TYPE(arg0);                          \
+    if (region->is_open)                                         \
+    {                                                            \
+      capture_object(region, arg0);                              \
+      arg0_region = region;                                      \
+      arg0_isolated_type = Py_TYPE(arg0);                        \
+    }                                                            \
   }                                                              \
   else if (arg0_region == region)                                \
   {                                                              \
@@ -570,9 +1471,12 @@ char VPY_DEBUG_FMT_BUF[1024];
   if (arg1_region == NULL)                                        \
   {                                                               \
     arg1_type = arg1_isolated_type;                               \
-    capture_object(region, arg1);                                 \
-    arg1_region = region;                                         \
-    arg1_isolated_type = Py_TYPE(arg1);                           \
+    if (region->is_open)                                          \
+    {                                                             \
+      capture_object(region, arg1);                               \
+      arg1_region = region;                                       \
+      arg1_isolated_type = Py_TYPE(arg1);                         \
+    }                                                             \
   }                                                               \
   else if (arg1_region == region)                                 \
   {                                                               \
@@ -586,92 +1490,118 @@ char VPY_DEBUG_FMT_BUF[1024];
     return ret;                                                   \
   }
 
-#define VPY_LENFUNC(interface, name)                 \
-  Py_ssize_t Isolated_##name(PyObject *self)         \
-  {                                                  \
-    PyTypeObject *isolated_type = Py_TYPE(self);     \
-    PyTypeObject *type = get_type(isolated_type);    \
-    VPY_CHECKTYPE(type, 0)                           \
-    RegionObject *region = get_region(self);         \
-    VPY_CHECKREGION(region, 0)                       \
-    VPY_CHECKREGIONOPEN(region, 0);                  \
-    self->ob_type = type;                            \
-    Py_ssize_t length = type->interface->name(self); \
-    self->ob_type = isolated_type;                   \
-    return length;                                   \
-  }
-
-#define VPY_INQUIRY(interface, name)              \
-  int Isolated_##name(PyObject *self)             \
-  {                                               \
-    PyTypeObject *isolated_type = Py_TYPE(self);  \
-    PyTypeObject *type = get_type(isolated_type); \
-    VPY_CHECKTYPE(type, 0)                        \
-    RegionObject *region = get_region(self);      \
-    VPY_CHECKREGION(region, 0)                    \
-    VPY_CHECKREGIONOPEN(region, 0);               \
-    self->ob_type = type;                         \
-    int result = type->interface->name(self);     \
-    self->ob_type = isolated_type;                \
-    return result;                                \
-  }
-
-#define VPY_UNARYFUNC(interface, name)              \
-  PyObject *Isolated_##name(PyObject *self)         \
-  {                                                 \
-    PyTypeObject *isolated_type = Py_TYPE(self);    \
-    PyTypeObject *type = get_type(isolated_type);   \
-    VPY_CHECKTYPE(type, NULL)                       \
-    RegionObject *region = get_region(self);        \
-    VPY_CHECKREGION(region, NULL)                   \
-    VPY_CHECKREGIONOPEN(region, NULL);              \
-    self->ob_type = type;                           \
-    PyObject *result = type->interface->name(self); \
-    self->ob_type = isolated_type;                  \
-    return result;                                  \
-  }
-
-#define VPY_BINARYFUNC(interface, name)                     \
-  PyObject *Isolated_##name(PyObject *self, PyObject *arg0) \
-  {                                                         \
-    PyTypeObject *isolated_type = Py_TYPE(self);            \
-    PyTypeObject *type = get_type(isolated_type);           \
-    VPY_CHECKTYPE(type, NULL)                               \
-    RegionObject *region = get_region(self);                \
-    VPY_CHECKREGION(region, NULL)                           \
-    VPY_CHECKREGIONOPEN(region, NULL);                      \
-    if (arg0 != NULL)                                       \
-    {                                                       \
-      VPY_CHECKARG0REGION(NULL);                            \
-    }                                                       \
-    self->ob_type = type;                                   \
-    PyObject *result = type->interface->name(self, arg0);   \
-    self->ob_type = isolated_type;                          \
-    return result;                                          \
-  }
-
-#define VPY_TERNARYFUNC(interface, name)                                    \
-  PyObject *Isolated_##name(PyObject *self, PyObject *arg0, PyObject *arg1) \
-  {                                                                         \
-    PyTypeObject *isolated_type = Py_TYPE(self);                            \
-    PyTypeObject *type = get_type(isolated_type);                           \
-    VPY_CHECKTYPE(type, NULL)                                               \
-    RegionObject *region = get_region(self);                                \
-    VPY_CHECKREGION(region, NULL)                                           \
-    VPY_CHECKREGIONOPEN(region, NULL);                                      \
-    if (arg0 != NULL)                                                       \
-    {                                                                       \
-      VPY_CHECKARG0REGION(NULL);                                            \
-    }                                                                       \
-    if (arg1 != NULL)                                                       \
-    {                                                                       \
-      VPY_CHECKARG1REGION(NULL);                                            \
-    }                                                                       \
-    self->ob_type = type;                                                   \
-    PyObject *result = type->interface->name(self, arg0, arg1);             \
-    self->ob_type = isolated_type;                                          \
-    return result;                                                          \
-  }
+#define VPY_LENFUNC(interface, name)                         \
+  Py_ssize_t Isolated_##name(PyObject *self)                 \
+  {                                                          \
+    PyTypeObject *isolated_type = Py_TYPE(self);             \
+    PyTypeObject *type = get_type(isolated_type);            \
+    VPY_CHECKTYPE(type, 0)                                   \
+    RegionObject *region = get_region(self);                 \
+    VPY_CHECKREGION(region, 0)                               \
+    VPY_CHECKREGIONOPEN(region, 0);                          \
+    if (!region->is_open)                                    \
+    {                                                        \
+      return read_length(self, type, type->interface->name); \
+    }                                                        \
+    self->ob_type = type;                                    \
+    Py_ssize_t length = type->interface->name(self);         \
+    self->ob_type = isolated_type;                           \
+    return length;                                           \
+  }
+
+#define VPY_INQUIRY(interface, name)                       \
+  int Isolated_##name(PyObject *self)                      \
+  {                                                        \
+    PyTypeObject *isolated_type = Py_TYPE(self);           \
+    PyTypeObject *type = get_type(isolated_type);          \
+    VPY_CHECKTYPE(type, 0)                                 \
+    RegionObject *region = get_region(self);               \
+    VPY_CHECKREGION(region, 0)                             \
+    VPY_CHECKREGIONOPEN(region, 0);                        \
+    if (!region->is_open)                                  \
+    {                                                      \
+      return read_bool(self, type, type->interface->name); \
+    }                                                      \
+    self->ob_type = type;                                  \
+    int result = type->interface->name(self);              \
+    self->ob_type = isolated_type;                         \
+    return result;                                         \
+  }
+
+#define VPY_UNARYFUNC(interface, name, method)                      \
+  PyObject *Isolated_##name(PyObject *self)                         \
+  {                                                                 \
+    PyTypeObject *isolated_type = Py_TYPE(self);                    \
+    PyTypeObject *type = get_type(isolated_type);                   \
+    VPY_CHECKTYPE(type, NULL)                                       \
+    RegionObject *region = get_region(self);                        \
+    VPY_CHECKREGION(region, NULL)                                   \
+    VPY_CHECKREGIONOPEN(region, NULL);                              \
+    if (!region->is_open)                                           \
+    {                                                               \
+      return read_unary(self, type, type->interface->name, method); \
+    }                                                               \
+    self->ob_type = type;                                           \
+    PyObject *result = type->interface->name(self);                 \
+    self->ob_type = isolated_type;                                  \
+    return result;                                                  \
+  }
+
+#define VPY_BINARYFUNC_CHECKED(interface, name, method, check)             \
+  PyObject *Isolated_##name(PyObject *self, PyObject *arg0)                \
+  {                                                                        \
+    PyTypeObject *isolated_type = Py_TYPE(self);                           \
+    PyTypeObject *type = get_type(isolated_type);                          \
+    VPY_CHECKTYPE(type, NULL)                                              \
+    RegionObject *region = get_region(self);                               \
+    VPY_CHECKREGION(region, NULL)                                          \
+    check(region, NULL);                                                   \
+    if (arg0 != NULL)                                                      \
+    {                                                                      \
+      VPY_CHECKARG0REGION(NULL);                                           \
+    }                                                                      \
+    if (!region->is_open)                                                  \
+    {                                                                      \
+      return read_binary(self, type, type->interface->name, method, arg0); \
+    }                                                                      \
+    self->ob_type = type;                                                  \
+    PyObject *result = type->interface->name(self, arg0);                  \
+    self->ob_type = isolated_type;                                         \
+    return result;                                                         \
+  }
+
+#define VPY_BINARYFUNC(interface, name, method) VPY_BINARYFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONOPEN)
+#define VPY_INPLACEBINARYFUNC(interface, name, method) VPY_BINARYFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONWRITABLE)
+
+#define VPY_TERNARYFUNC_CHECKED(interface, name, method, check)                   \
+  PyObject *Isolated_##name(PyObject *self, PyObject *arg0, PyObject *arg1)       \
+  {                                                                               \
+    PyTypeObject *isolated_type = Py_TYPE(self);                                  \
+    PyTypeObject *type = get_type(isolated_type);                                 \
+    VPY_CHECKTYPE(type, NULL)                                                     \
+    RegionObject *region = get_region(self);                                      \
+    VPY_CHECKREGION(region, NULL)                                                 \
+    check(region, NULL);                                                          \
+    if (arg0 != NULL)                                                             \
+    {                                                                             \
+      VPY_CHECKARG0REGION(NULL);                                                  \
+    }                                                                             \
+    if (arg1 != NULL)                                                             \
+    {                                                                             \
+      VPY_CHECKARG1REGION(NULL);                                                  \
+    }                                                                             \
+    if (!region->is_open)                                                         \
+    {                                                                             \
+      return read_ternary(self, type, type->interface->name, method, arg0, arg1); \
+    }                                                                             \
+    self->ob_type = type;                                                         \
+    PyObject *result = type->interface->name(self, arg0, arg1);                   \
+    self->ob_type = isolated_type;                                                \
+    return result;                                                                \
+  }
+
+#define VPY_TERNARYFUNC(interface, name, method) VPY_TERNARYFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONOPEN)
+#define VPY_INPLACETERNARYFUNC(interface, name, method) VPY_TERNARYFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONWRITABLE)
 
 #define VPY_OBJOBJARGPROC(interface, name)                            \
   int Isolated_##name(PyObject *self, PyObject *arg0, PyObject *arg1) \
@@ -682,7 +1612,7 @@ char VPY_DEBUG_FMT_BUF[1024];
     VPY_CHECKTYPE(type, -1)                                           \
     RegionObject *region = get_region(self);                          \
     VPY_CHECKREGION(region, -1)                                       \
-    VPY_CHECKREGIONOPEN(region, -1);                                  \
+    VPY_CHECKREGIONWRITABLE(region, -1);                               \
     VPY_CHECKARG0REGION(-1);                                          \
     if (arg1 != NULL)                                                 \
     {                                                                 \
@@ -694,20 +1624,27 @@ char VPY_DEBUG_FMT_BUF[1024];
     return rc;                                                        \
   }
 
-#define VPY_SSIZEARGFUNC(interface, name)                   \
-  PyObject *Isolated_##name(PyObject *self, Py_ssize_t arg) \
-  {                                                         \
-    PyTypeObject *isolated_type = Py_TYPE(self);            \
-    PyTypeObject *type = get_type(isolated_type);           \
-    VPY_CHECKTYPE(type, NULL)                               \
-    RegionObject *region = get_region(self);                \
-    VPY_CHECKREGION(region, NULL)                           \
-    VPY_CHECKREGIONOPEN(region, NULL);                      \
-    self->ob_type = type;                                   \
-    PyObject *result = type->interface->name(self, arg);    \
-    self->ob_type = isolated_type;                          \
-    return result;                                          \
-  }
+#define VPY_SSIZEARGFUNC_CHECKED(interface, name, method, check)         \
+  PyObject *Isolated_##name(PyObject *self, Py_ssize_t arg)              \
+  {                                                                      \
+    PyTypeObject *isolated_type = Py_TYPE(self);                         \
+    PyTypeObject *type = get_type(isolated_type);                        \
+    VPY_CHECKTYPE(type, NULL)                                            \
+    RegionObject *region = get_region(self);                             \
+    VPY_CHECKREGION(region, NULL)                                        \
+    check(region, NULL);                                                 \
+    if (!region->is_open)                                                \
+    {                                                                    \
+      return read_ssize(self, type, type->interface->name, method, arg); \
+    }                                                                    \
+    self->ob_type = type;                                                \
+    PyObject *result = type->interface->name(self, arg);                 \
+    self->ob_type = isolated_type;                                       \
+    return result;                                                       \
+  }
+
+#define VPY_SSIZEARGFUNC(interface, name, method) VPY_SSIZEARGFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONOPEN)
+#define VPY_INPLACESSIZEARGFUNC(interface, name, method) VPY_SSIZEARGFUNC_CHECKED(interface, name, method, VPY_CHECKREGIONWRITABLE)
 
 #define VPY_SSIZEOBJARGPROC(interface, name)                           \
   int Isolated_##name(PyObject *self, Py_ssize_t arg0, PyObject *arg1) \
@@ -718,7 +1655,7 @@ char VPY_DEBUG_FMT_BUF[1024];
     VPY_CHECKTYPE(type, -1)                                            \
     RegionObject *region = get_region(self);                           \
     VPY_CHECKREGION(region, -1)                                        \
-    VPY_CHECKREGIONOPEN(region, -1);                                   \
+    VPY_CHECKREGIONWRITABLE(region, -1);                                \
     if (arg1 != NULL)                                                  \
     {                                                                  \
       VPY_CHECKARG1REGION(-1);                                         \
@@ -729,24 +1666,27 @@ char VPY_DEBUG_FMT_BUF[1024];
     return rc;                                                         \
   }
 
-#define VPY_OBJOBJPROC(interface, name)               \
-  int Isolated_##name(PyObject *self, PyObject *arg0) \
-  {                                                   \
-    PyTypeObject *isolated_type = Py_TYPE(self);      \
-    int rc;                                           \
-    PyTypeObject *type = get_type(isolated_type);     \
-    VPY_CHECKTYPE(type, -1)                           \
-    RegionObject *region = get_region(self);          \
-    VPY_CHECKREGION(region, -1)                       \
-    VPY_CHECKREGIONOPEN(region, -1);                  \
-    if (arg0 != NULL)                                 \
-    {                                                 \
-      VPY_CHECKARG0REGION(-1);                        \
-    }                                                 \
-    self->ob_type = type;                             \
-    rc = type->interface->name(self, arg0);           \
-    self->ob_type = isolated_type;                    \
-    return rc;                                        \
+#define VPY_OBJOBJPROC(interface, name)                              \
+  int Isolated_##name(PyObject *self, PyObject *arg0)                \
+  {                                                                  \
+    PyTypeObject *isolated_type = Py_TYPE(self);                     \
+    PyTypeObject *type = get_type(isolated_type);                    \
+    VPY_CHECKTYPE(type, -1)                                          \
+    RegionObject *region = get_region(self);                         \
+    VPY_CHECKREGION(region, -1)                                      \
+    VPY_CHECKREGIONOPEN(region, -1);                                 \
+    if (arg0 != NULL)                                                \
+    {                                                                \
+      VPY_CHECKARG0REGION(-1);                                       \
+    }                                                                \
+    if (!region->is_open)                                            \
+    {                                                                \
+      return read_contains(self, type, type->interface->name, arg0); \
+    }                                                                \
+    self->ob_type = type;                                            \
+    int rc = type->interface->name(self, arg0);                      \
+    self->ob_type = isolated_type;                                   \
+    return rc;                                                       \
   }
 
 #define VPY_ERROR(x) printf("veronapy Error: %s\n", x);
@@ -770,54 +1710,98 @@ static void print_debug(char *fmt, ...)
 }
 #endif
 
+// Number of verified tuples and frozensets remembered by each interpreter
+#define IMM_CACHE_SIZE 1024
+// Smaller collections are cheaper to check than to look up in the cache
+#define IMM_CACHE_MIN_LENGTH 8
+
+static bool is_imm(PyObject *value);
+static bool imm_cache_contains(PyObject *value);
+static void imm_cache_add(PyObject *value);
+
+/** Whether all instances of exactly this type are immutable. */
+static bool is_imm_type(PyTypeObject *type)
+{
+  // ordered by how commonly they are found in object graphs
+  return type == &PyUnicode_Type || type == &PyLong_Type ||
+         type == Py_TYPE(Py_None) || type == &PyBool_Type ||
+         type == &PyFloat_Type || type == &PyBytes_Type ||
+         type == &PyComplex_Type || type == &PyRange_Type;
+}
+
 /**
- * Check if a value is immutable. This is done either by seeing if it is one of the
- * basic immutable types, or by checking if it is a tuple or frozenset containing
- * only immutable values.
+ * Whether a tuple or frozenset is deeply immutable. The result can never
+ * change, as the items of these collections are fixed, so large collections
+ * are remembered once verified.
  */
-static bool is_imm(PyObject *value)
+static bool is_imm_collection(PyObject *value)
 {
-  if (Py_IsNone(value) || PyBool_Check(value) || PyLong_Check(value) ||
-      PyFloat_Check(value) || PyComplex_Check(value) ||
-      PyUnicode_Check(value) || PyBytes_Check(value) || PyRange_Check(value))
+  bool is_tuple = PyTuple_Check(value);
+  Py_ssize_t length = is_tuple ? PyTuple_GET_SIZE(value) : PySet_GET_SIZE(value);
+  bool cacheable = length >= IMM_CACHE_MIN_LENGTH;
+
+  if (cacheable && imm_cache_contains(value))
   {
     return true;
   }
 
-  if (PyFrozenSet_Check(value) || PyTuple_Check(value))
+  if (is_tuple)
   {
-    Py_ssize_t i, len;
-    PyObject *seq = PySequence_List(value);
-    if (seq == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to enumerate over sequence");
-      return false;
-    }
-
-    len = PySequence_Length(seq);
-    for (i = 0; i < len; i++)
+    for (Py_ssize_t i = 0; i < length; i++)
     {
-      PyObject *item = PySequence_GetItem(seq, i);
-      if (item == NULL)
+      if (!is_imm(PyTuple_GET_ITEM(value, i)))
       {
-        PyErr_SetString(PyExc_RuntimeError, "Unable to get item from sequence");
         return false;
       }
-
+    }
+  }
+  else
+  {
+    Py_ssize_t pos = 0;
+    PyObject *item;
+    Py_hash_t hash;
+    while (_PySet_NextEntry(value, &pos, &item, &hash))
+    {
       if (!is_imm(item))
       {
-        Py_DECREF(item);
-        Py_DECREF(seq);
         return false;
       }
-
-      Py_DECREF(item);
     }
+  }
+
+  if (cacheable)
+  {
+    imm_cache_add(value);
+  }
+
+  return true;
+}
+
+/**
+ * Check if a value is immutable. This is done either by seeing if it is one of the
+ * basic immutable types, or by checking if it is a tuple or frozenset containing
+ * only immutable values.
+ */
+static bool is_imm(PyObject *value)
+{
+  PyTypeObject *type = Py_TYPE(value);
+  if (is_imm_type(type))
+  {
+    return true;
+  }
 
-    Py_DECREF(seq);
+  if (PyBool_Check(value) || PyLong_Check(value) ||
+      PyFloat_Check(value) || PyComplex_Check(value) ||
+      PyUnicode_Check(value) || PyBytes_Check(value) || PyRange_Check(value))
+  {
     return true;
   }
 
+  if (PyFrozenSet_Check(value) || PyTuple_Check(value))
+  {
+    return is_imm_collection(value);
+  }
+
   return false;
 }
 
@@ -862,14 +1846,20 @@ static PyObject *get_source(PyObject *obj)
     return NULL;
   }
 
+  Py_DECREF(inspect);
+  Py_DECREF(textwrap);
+
   PyObject *source = PyObject_CallOneArg(getsource, obj);
+  Py_DECREF(getsource);
   if (source == NULL)
   {
+    Py_DECREF(dedent);
     PyErr_SetString(PyExc_RuntimeError, "Unable to get source of object");
     return NULL;
   }
 
-  source = PyObject_CallOneArg(dedent, source);
+  Py_SETREF(source, PyObject_CallOneArg(dedent, source));
+  Py_DECREF(dedent);
   if (source == NULL)
   {
     PyErr_SetString(PyExc_RuntimeError, "Unable to dedent object source");
@@ -883,6 +1873,23 @@ static PyObject *get_source(PyObject *obj)
 /*              Region struct and functions                    */
 /***************************************************************/
 
+#if PY_VERSION_HEX >= 0x030C0000 && PY_VERSION_HEX < 0x030E0000 && SIZEOF_VOID_P > 4 && !defined(Py_GIL_DISABLED)
+// The reference count given to objects sealed for concurrent readers. It
+// counts as immortal, so releasing a reference leaves it alone, but taking
+// one still increments its low 32 bits. A sealed object which still has
+// exactly this count once the readers have finished was never referenced by
+// any of them, and can have its own count back. Elsewhere taking a reference
+// to an immortal object leaves no trace, and sealed objects stay immortal.
+#define VPY_SEAL_REFCNT ((Py_ssize_t)0x80000000)
+#endif
+
+/** An object sealed for concurrent readers, and its own reference count. */
+typedef struct sealed_object_s
+{
+  PyObject *object;
+  Py_ssize_t refcnt;
+} SealedObject;
+
 /** Backing object for the `region` type. */
 typedef struct region_object_s
 {
@@ -893,6 +1900,9 @@ typedef struct region_object_s
   // cases this points back to the region itself, but can
   // point to others if this region has been merged with another.
   PyObject *alias;
+  // Upper bound on the height of the tree of aliases rooted at this region.
+  // Used to keep the trees shallow when merging (union by rank).
+  int rank;
   // Unique ID for the region.
   long long id;
   // Whether the region is open or closed. Closed regions cannot
@@ -901,6 +1911,9 @@ typedef struct region_object_s
   // Whether the region is shared. Shared regions can be used by
   // multiple interpreters via the `when` construct.
   bool is_shared;
+  // Whether captured object graphs are walked using tp_traverse, rather
+  // than through the sequence, mapping and __dict__ protocols.
+  bool traverse;
   // Parent region. If this is NULL, then the region is free.
   PyObject *parent;
   // List of object graphs captured by this region. May include other
@@ -909,6 +1922,33 @@ typedef struct region_object_s
   // The last behavior scheduled on this region. This is used as part
   // of the implementation of `when`.
   atomic_voidptr_t last;
+  // The number of read requests on the region which have been granted and
+  // not yet released. Only the behaviors which made them may read the
+  // region (see is_read_granted).
+  atomic_llong readers;
+  // A write request waiting for the readers before it to finish
+  atomic_voidptr_t writer;
+  // Whether the region's object graph has been sealed for concurrent
+  // readers since the region was last opened for writing
+  bool sealed;
+  // The objects which were sealed, so that they can be given their own
+  // reference counts back when the region is next opened for writing
+  SealedObject *sealed_objects;
+  Py_ssize_t sealed_length;
+  Py_ssize_t sealed_capacity;
+  // Hashtable mapping isolated types to their subtypes for this region, or
+  // to the number of objects of that type captured so far (see
+  // REGION_TYPE_MIN_OBJECTS). Created when the first object is captured.
+  ht *types;
+  // The tag shared by all objects captured by this region. Created when
+  // the first object is captured.
+  struct region_tag_object_s *tag;
+  // The objects whose tag was published to the object tables (rather than
+  // given by their type), so that the entries can be redirected when the
+  // region is merged and removed when it is released
+  voidptr_t *tagged;
+  Py_ssize_t tagged_length;
+  Py_ssize_t tagged_capacity;
 } RegionObject;
 
 /** Every captured object has a region tag associated with it. */
@@ -919,28 +1959,93 @@ typedef struct region_tag_object_s
   RegionObject *region;
 } RegionTagObject;
 
+#if PY_VERSION_HEX >= 0x030C0000 // Python 3.12
+// PyType_FromMetaclass is needed to create the per-region types
+#define VPY_REGION_TYPES
+#endif
+
+// The number of objects of a type which a region captures before it is given
+// a type of its own. The types are shared by every interpreter, and so are
+// immortal like the regions themselves: this bounds their cost to a fraction
+// of that of the objects, and keeps small regions from creating any.
+#define REGION_TYPE_MIN_OBJECTS 32
+
+/**
+ * Objects captured into a region are given a subtype of their isolated type
+ * which is specific to that region. These subtypes are instances of this
+ * metatype, which holds the region tag, so that finding the region of an
+ * object is a matter of following its type pointer. Objects for which such a
+ * type cannot be created (e.g. due to a metaclass conflict) have their tags
+ * stored in the object hashtables instead.
+ */
+typedef struct isolated_type_object_s
+{
+  PyHeapTypeObject ht_base;
+  // The region tag shared by all objects of this type
+  RegionTagObject *tag;
+} IsolatedTypeObject;
+
+static PyTypeObject IsolatedTypeType;
+
+static bool is_read_granted(RegionObject *region);
+
+/** Whether the type is a per-region isolated type. */
+static bool is_region_type(PyTypeObject *type)
+{
+#ifdef VPY_REGION_TYPES
+  return Py_IS_TYPE((PyObject *)type, &IsolatedTypeType);
+#else
+  return false;
+#endif
+}
+
 /** The state object for the veronapy module. */
 typedef struct vpy_state_s
 {
-  // A dictionary mapping types to their isolated versions. This is used
-  // to ensure that each type is isolated only once. If the type was isolated
-  // on another interpreter, it will be cached here after being loaded from the
-  // global table.
-  PyObject *isolated_types;
+  // A hashtable mapping types to their isolated versions. This is used
+  // to ensure that each type is isolated only once on this interpreter.
+  // Isolated types are immortal and keep their inner type alive.
+  ht *isolated_types;
   // A dictionary mapping type IDs to a tuple of type object and source code
   // string. When a type is isolated, this is populated. If the type was isolated
   // on another interpreter, it will be cached here after being loaded from the
   // global table.
   PyObject *frozen_types;
-  // A dictionary mapping object pointers to region tags. If an object was isolated
+  // A hashtable mapping object pointers to region tags. If an object was isolated
   // on another interpreter, it will be cached here after being loaded from the
-  // global table.
-  PyObject *object_regions;
+  // global table. Region tags are immortal, so no references are held.
+  ht *object_regions;
+  // The value of object_regions_generation when object_regions was last
+  // known to agree with the global table
+  long long object_regions_generation;
+  // Tuples and frozensets which are known to be deeply immutable, along with
+  // a ring buffer of references to them. The references keep the addresses
+  // from being reused, and the oldest is evicted when the ring is full.
+  ht *immutables;
+  PyObject **immutables_ring;
+  Py_ssize_t immutables_next;
+  // A dictionary mapping code objects of thunks created on this interpreter
+  // to the addresses of their interned code blobs.
+  PyObject *code_blobs;
+  // A dictionary mapping code blob hashes to a tuple of the blob address and
+  // the code object unmarshalled from it on this interpreter.
+  PyObject *code_cache;
+  // Wakes the event loop of this interpreter for futures that it awaits
+  struct notifier_s *notifier;
+  // The event loop which watches the notifier
+  PyObject *notify_loop;
+  // The future objects awaited by the event loop
+  PyObject *awaiting;
 } VPYState;
 
 // Hashtable mapping object pointers to region tags.
 static ht *global_object_regions;
 
+// Incremented whenever entries are removed from global_object_regions. The
+// interpreters drop their caches when it changes, as the address of a removed
+// entry can be reused by an object which is then captured into another region.
+static atomic_llong object_regions_generation = 0;
+
 // Hashtable mapping type IDs to source code string pointers. This is used to
 // load frozen types from the global table into a new interpreter.
 static ht *global_frozen_types;
@@ -964,6 +2069,7 @@ static const char *REGION_ATTRS[] = {
     "is_shared",
     "make_shareable",
     "detach_all",
+    "update",
     "__enter__",
     "__exit__",
     "__lt__",
@@ -972,6 +2078,32 @@ static const char *REGION_ATTRS[] = {
     NULL,
 };
 
+static bool imm_cache_contains(PyObject *value)
+{
+  return ht_get(vpy_state->immutables, (voidptr_t)value) != 0;
+}
+
+static void imm_cache_add(PyObject *value)
+{
+  PyObject *evicted = vpy_state->immutables_ring[vpy_state->immutables_next];
+  if (evicted != NULL)
+  {
+    ht_remove(vpy_state->immutables, (voidptr_t)evicted);
+    Py_DECREF(evicted);
+  }
+
+  // the cache is only an optimisation, so failing to add to it is not an error
+  if (!ht_set(vpy_state->immutables, (voidptr_t)value, (voidptr_t)1))
+  {
+    vpy_state->immutables_ring[vpy_state->immutables_next] = NULL;
+    return;
+  }
+
+  Py_INCREF(value);
+  vpy_state->immutables_ring[vpy_state->immutables_next] = value;
+  vpy_state->immutables_next = (vpy_state->immutables_next + 1) % IMM_CACHE_SIZE;
+}
+
 /** Tests whether the region is free, i.e. has no parent. */
 static bool is_free(RegionObject *region) { return region->parent == NULL; }
 
@@ -991,7 +2123,11 @@ static bool owns(RegionObject *lhs, RegionObject *rhs)
   return owns(lhs, (RegionObject *)rhs->parent);
 }
 
-/** Resolves the true region, following aliases as necessary. */
+/**
+ * Resolves the true region, following aliases as necessary. The aliases form
+ * a union-find structure, and every region on the path is pointed at its
+ * grandparent as we go (path halving), so that the next lookup is shorter.
+ */
 static RegionObject *resolve_region(RegionObject *start)
 {
   RegionObject *region = start;
@@ -1034,6 +2170,12 @@ static PyObject *get_type_name(PyObject *source)
 static PyTypeObject *get_type(PyTypeObject *isolated_type)
 {
   PyTypeObject *type;
+  if (is_region_type(isolated_type))
+  {
+    // per-region types derive from the isolated type
+    isolated_type = isolated_type->tp_base;
+  }
+
   // When the isolated type is created, the frozen type ID will be stored
   // using an `__isolated__` attribute.
   PyObject *type_id_long = (PyObject *)PyDict_GetItemString(PyType_GetDict(isolated_type), "__isolated__");
@@ -1110,13 +2252,38 @@ static PyTypeObject *get_type(PyTypeObject *isolated_type)
 }
 
 /**
- * Gets the region tag for the object. This function may make a blocking call to
- * the global captured object hashtable.
+ * Gets the region tag for the object, first from its type, then from the
+ * interpreter cache and finally from the global captured object hashtable.
  */
 static RegionTagObject *get_tag(PyObject *value, bool with_errors)
 {
-  PyObject *long_key = PyLong_FromVoidPtr(value);
-  RegionTagObject *region_tag = (RegionTagObject *)PyDict_GetItem(vpy_state->object_regions, long_key);
+  PyTypeObject *type = Py_TYPE(value);
+  if (is_region_type(type))
+  {
+    return ((IsolatedTypeObject *)type)->tag;
+  }
+
+  long long generation = atomic_load_llong(&object_regions_generation);
+  if (vpy_state->object_regions_generation != generation)
+  {
+    // entries were removed on another interpreter, so some may be stale
+    ht *object_regions = ht_create(1024, false);
+    if (object_regions == NULL)
+    {
+      if (with_errors)
+      {
+        PyErr_NoMemory();
+      }
+
+      return NULL;
+    }
+
+    ht_free(vpy_state->object_regions);
+    vpy_state->object_regions = object_regions;
+    vpy_state->object_regions_generation = generation;
+  }
+
+  RegionTagObject *region_tag = (RegionTagObject *)ht_get(vpy_state->object_regions, (voidptr_t)value);
   if (region_tag != NULL)
   {
     // we have already cached this (or it was captured on this interpreter)
@@ -1136,8 +2303,7 @@ static RegionTagObject *get_tag(PyObject *value, bool with_errors)
   }
 
   // cache this for later
-  int rc = PyDict_SetItem((PyObject *)vpy_state->object_regions, long_key, (PyObject *)region_tag);
-  if (rc < 0)
+  if (!ht_set(vpy_state->object_regions, (voidptr_t)value, (voidptr_t)region_tag))
   {
     if (with_errors)
     {
@@ -1170,2826 +2336,8155 @@ static RegionObject *get_region(PyObject *value)
   return region;
 }
 
-static int capture_object(RegionObject *region, PyObject *value);
-
-/** Attempts to capture all the items in a sequence into the given region */
-static int capture_sequence(RegionObject *region, PyObject *sequence)
+/** Removes the region tag of an object which is being finalized. */
+static void release_tag(PyObject *value)
 {
-  PyObject *iterator = PyObject_GetIter(sequence);
-  PyObject *item;
-
-  if (iterator == NULL)
+  if (is_region_type(Py_TYPE(value)))
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get iterator from sequence");
-    return -1;
+    // the tag belongs to the type
+    return;
   }
 
-  while ((item = PyIter_Next(iterator)))
+  ht_remove(vpy_state->object_regions, (voidptr_t)value);
+  if (ht_remove(global_object_regions, (voidptr_t)value))
   {
-    int rc;
-    if (item == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError,
-                      "Unable to get sequence item from iterator");
-      Py_DECREF(iterator);
-      return -1;
-    }
-
-    rc = capture_object(region, item);
-    if (rc != 0)
-    {
-      Py_DECREF(iterator);
-      Py_DECREF(item);
-      return rc;
-    }
-
-    Py_DECREF(item);
+    atomic_increment(&object_regions_generation);
   }
+}
 
-  Py_DECREF(iterator);
+static PyTypeObject RegionTagType;
+static PyTypeObject *isolate_type(PyTypeObject *type);
+static Py_ssize_t ssize_length(Py_ssize_t value);
 
-  if (PyErr_Occurred())
+/**
+ * Gets (creating if needed) the tag shared by all the objects in the region.
+ * If the region is later merged, the tag is redirected by get_region.
+ */
+static RegionTagObject *get_region_tag(RegionObject *region)
+{
+  if (region->tag == NULL)
   {
-    return -1;
+    region->tag = (RegionTagObject *)PyObject_CallOneArg((PyObject *)&RegionTagType, (PyObject *)region);
   }
 
-  return 0;
+  return region->tag;
 }
 
-/** Attempts to capture all the values in a mapping into the given region */
-static int capture_mapping(RegionObject *region, PyObject *mapping)
+/** Records objects of the region whose tags were published to the tables. */
+static int record_tagged(RegionObject *region, const voidptr_t *objects, Py_ssize_t count)
 {
-  PyObject *values = PyMapping_Values(mapping);
-  if (values == NULL)
+  voidptr_t *tagged;
+  Py_ssize_t capacity = region->tagged_capacity;
+
+  if (region->tagged_length + count > capacity)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get values from mapping");
-    return -1;
+    capacity = capacity == 0 ? 64 : capacity;
+    while (region->tagged_length + count > capacity)
+    {
+      capacity *= 2;
+    }
+
+    tagged = (voidptr_t *)realloc(region->tagged, sizeof(voidptr_t) * capacity);
+    if (tagged == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    region->tagged = tagged;
+    region->tagged_capacity = capacity;
   }
 
-  int rc = capture_sequence(region, values);
-  Py_DECREF(values);
-  return rc;
+  memcpy(region->tagged + region->tagged_length, objects, sizeof(voidptr_t) * count);
+  region->tagged_length += count;
+  return 0;
 }
 
-static PyTypeObject RegionTagType;
-static PyTypeObject *isolate_type(PyTypeObject *type);
-
 /**
- * Attempts to capture an object into the given region.
- * This function will find all the types of all the objects
- * in the graph for which value is the root and capture them into the
- * region. If they have already been captured, it will use the type it
- * previously captured.
- *
- * This makes a blocking call to the global hashtable of captured objects.
+ * Moves the table entries of a region which has been merged into target over
+ * to the tag of target. Entries which no longer hold the tag of the region
+ * (their objects having been finalized) are dropped rather than moved.
  */
-static int capture_object(RegionObject *region, PyObject *value)
+static int redirect_tagged(RegionObject *region, RegionObject *target)
 {
-  PyObject *tag;
-  PyTypeObject *isolated_type;
-  int rc = 0;
-  PyTypeObject *type = Py_TYPE(value);
-  RegionObject *value_region = get_region(value);
-
-  if (is_imm(value) || value_region == region)
+  if (region->tagged_length == 0)
   {
-    // this value is either immutable, or already captured by the region.
     return 0;
   }
 
-  if (value_region != NULL)
+  RegionTagObject *tag = get_region_tag(target);
+  if (tag == NULL)
   {
-    // this value is captured by another region
-    PyErr_SetString(RegionIsolationError,
-                    "Object already captured by another region");
     return -1;
   }
 
-  PRINTDBG("capture_object %p\n", value);
+  // interpreter caches holding the old tag still resolve it through the alias
+  Py_ssize_t count = ht_replace_many(global_object_regions, region->tagged, region->tagged_length,
+                                     (voidptr_t)region->tag, (voidptr_t)tag);
+  int rc = record_tagged(target, region->tagged, count);
 
-  // ALERT THIS INCREF MAKES THIS OBJECT IMMORTAL
-  // Remove once we have region-based memory management
-  Py_INCREF(value);
-  // ALERT THIS INCREF MAKES THIS OBJECT IMMORTAL
+  free(region->tagged);
+  region->tagged = NULL;
+  region->tagged_length = 0;
+  region->tagged_capacity = 0;
+  return rc;
+}
 
-  if (value->ob_type == region->ob_base.ob_type)
+/** Removes the table entries of a region which is being released. */
+static void release_tagged(RegionObject *region)
+{
+  // the table is freed (and its entries forgotten) when the system stops
+  if (region->tagged_length > 0 && global_object_regions != NULL)
   {
-    // this is a region object, so we need to add it to our graph
-    RegionObject *child = (RegionObject *)value;
-    if (is_free(child))
-    {
-      Py_INCREF(region);
-      child->parent = (PyObject *)region;
-      return 0;
-    }
-    else if (!owns(region, child))
+    // every interpreter (this one included) drops its cache on seeing the
+    // new generation, rather than searching it for the removed keys
+    if (ht_replace_many(global_object_regions, region->tagged, region->tagged_length,
+                        (voidptr_t)region->tag, 0) > 0)
     {
-      PyErr_SetString(RegionIsolationError,
-                      "Region already attached to a different region graph");
-      return -1;
+      atomic_increment(&object_regions_generation);
     }
   }
 
-  if (PySequence_Check(value))
+  free(region->tagged);
+  region->tagged = NULL;
+  region->tagged_length = 0;
+  region->tagged_capacity = 0;
+}
+
+/**
+ * Gets (creating if needed) the subtype of the isolated type which is used for
+ * objects in this region. Returns NULL if no such type can be created, in which
+ * case the region of the object must be recorded in the object hashtables.
+ */
+static PyTypeObject *get_region_type(RegionObject *region, PyTypeObject *isolated_type)
+{
+#ifdef VPY_REGION_TYPES
+  PyTypeObject *region_type;
+  voidptr_t entry;
+  if (Py_TYPE(isolated_type) != &PyType_Type)
   {
-    rc = capture_sequence(region, value);
-    if (rc != 0)
-    {
-      return rc;
-    }
+    // the type has a metaclass of its own, which would conflict with ours
+    // (and which CPython 3.14 no longer allows here if it overrides tp_new)
+    return NULL;
   }
-  else if (PyMapping_Check(value))
+
+  if (region->types == NULL)
   {
-    rc = capture_mapping(region, value);
-    if (rc != 0)
+    region->types = ht_create(16, true);
+    if (region->types == NULL)
     {
-      return rc;
+      return NULL;
     }
   }
 
-  if (PyObject_HasAttrString(value, "__dict__"))
+  // types are aligned, so an odd entry is a count of the objects captured
+  entry = ht_get(region->types, (voidptr_t)isolated_type);
+  if (entry != 0 && (entry & 1) == 0)
   {
-    PyObject *dict = PyObject_GetAttrString(value, "__dict__");
-    PyObject *values = PyDict_Values(dict);
-    if (values == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to get values from __dict__");
-      return -1;
-    }
-
-    rc = capture_sequence(region, values);
-    Py_DECREF(values);
+    return (PyTypeObject *)entry;
+  }
 
-    if (rc != 0)
-    {
-      return rc;
-    }
+  if ((entry >> 1) + 1 < REGION_TYPE_MIN_OBJECTS)
+  {
+    // the object is tagged through the tables until there are enough
+    ht_set(region->types, (voidptr_t)isolated_type, (((entry >> 1) + 1) << 1) | 1);
+    return NULL;
   }
 
-  isolated_type =
-      (PyTypeObject *)PyDict_GetItem(vpy_state->isolated_types, (PyObject *)type);
+  PyType_Slot slots[] = {
+      {0, NULL} /* Sentinel */
+  };
 
-  if (isolated_type == NULL)
+  const char *name_format = "%s_region_%lli";
+  char *name = (char *)malloc(strlen(name_format) + strlen(isolated_type->tp_name) + ssize_length(region->id) + 1);
+  if (name == NULL)
   {
-    // first time we've seen this type on this interpreter, isolate it
-    isolated_type = isolate_type(type);
-    if (isolated_type == NULL)
-    {
-      return -1;
-    }
+    return NULL;
+  }
 
-    rc = PyDict_SetItem(vpy_state->isolated_types, (PyObject *)type,
-                        (PyObject *)isolated_type);
-    if (rc < 0)
-    {
-      PyErr_SetString(RegionIsolationError,
-                      "Unable to add isolated type to interpreter");
-      return -1;
-    }
+  sprintf(name, name_format, isolated_type->tp_name, region->id);
+  PyType_Spec spec = {
+      .name = name,
+      .basicsize = (int)isolated_type->tp_basicsize,
+      .itemsize = (int)isolated_type->tp_itemsize,
+      .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HEAPTYPE,
+      .slots = slots,
+  };
+
+  region_type = (PyTypeObject *)PyType_FromMetaclass(&IsolatedTypeType, NULL, &spec, (PyObject *)isolated_type);
+  free(name);
+  if (region_type == NULL)
+  {
+    PyErr_Clear();
+    return NULL;
   }
 
-  tag = PyObject_CallOneArg((PyObject *)&RegionTagType, (PyObject *)region);
+  Py_SET_REFCNT((PyObject *)region_type, _Py_IMMORTAL_REFCNT);
+
+  RegionTagObject *tag = get_region_tag(region);
   if (tag == NULL)
   {
-    PyErr_SetString(RegionIsolationError, "Unable to create region tag");
-    return -1;
+    PyErr_Clear();
+    return NULL;
   }
 
-  Py_INCREF(tag);
-  PyObject *long_key = PyLong_FromVoidPtr(value);
-  if (long_key == NULL)
+  ((IsolatedTypeObject *)region_type)->tag = tag;
+
+  if (!ht_set(region->types, (voidptr_t)isolated_type, (voidptr_t)region_type))
   {
-    Py_DECREF(tag);
-    return -1;
+    return NULL;
   }
 
-  // store in the interpreter cache
-  rc = PyDict_SetItem(vpy_state->object_regions, long_key, tag);
-  if (rc < 0)
+  PRINTDBG("created region type %p for %s\n", region_type, isolated_type->tp_name);
+
+  return region_type;
+#else
+  return NULL;
+#endif
+}
+
+/** Worklist used to capture an object graph without recursion. */
+typedef struct capture_state_s
+{
+  // Objects waiting to be captured. The stack holds a reference to each.
+  PyObject **stack;
+  Py_ssize_t length;
+  Py_ssize_t capacity;
+  // Every object which has been pushed onto the stack, keyed by address
+  ht *visited;
+  // Reference which tp_traverse should not push (see capture_traverse)
+  PyObject *skip;
+  // Objects (and their tags) to be added to the object hashtables. These are
+  // published in one batch once the capture is finished.
+  voidptr_t *tagged;
+  voidptr_t *tags;
+  Py_ssize_t tagged_length;
+  Py_ssize_t tagged_capacity;
+} CaptureState;
+
+/** Pushes an object onto the worklist, unless it has already been seen. */
+static int capture_push(CaptureState *state, PyObject *value)
+{
+  if (ht_get(state->visited, (voidptr_t)value) != 0)
   {
-    PyErr_SetString(RegionIsolationError, "Unable to set region tag");
-    Py_DECREF(tag);
-    return -1;
+    return 0;
   }
 
-  // blocking call to global table
-  if (!ht_set(global_object_regions, (voidptr_t)value, (voidptr_t)tag))
+  if (!ht_set(state->visited, (voidptr_t)value, (voidptr_t)1))
   {
-    PyErr_SetString(RegionIsolationError, "Unable to set region tag in global object table");
-    Py_DECREF(tag);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to add object to visited set");
     return -1;
   }
 
-  Py_INCREF((PyObject *)isolated_type);
-  value->ob_type = isolated_type;
-
-  return rc;
-}
-
-static bool Region_Check(PyObject *obj);
-
-/***************************************************************/
-/*                   Behavior Implementation                   */
-/***************************************************************/
-
-/** Singleton used to signal when the system can be shut down. */
-typedef struct terminator_s
-{
-  // Number of active behaviors in flight.
-  atomic_llong count;
-  // Set when the system can be shut down.
-  atomic_bool set;
-} Terminator;
-
-typedef struct behavior_s Behavior;
-
-/** A request to capture a region. */
-typedef struct request_s
-{
-  // The next Behavior that needs the region
-  volatile Behavior *next;
-  // Whether the request has been scheduled
-  volatile bool scheduled;
-  // The region to capture
-  RegionObject *target;
-} Request;
-
-/**
- * A callable bit of code that depends on capturing one or more
- * and can run on any interpreter.
- */
-typedef struct behavior_s
-{
-  // The source code for the callable thunk
-  PyObject *thunk_source;
-  // Pointers to the local variables captured by the thunk
-  PyObject *thunk_locals;
-  // Counter used to indicate when the behavior is ready to run
-  atomic_llong count;
-  // The number of requests
-  Py_ssize_t length;
-  // An array of requests
-  Request *requests;
-} Behavior;
-
-/** A node in a linked list of behaviors. */
-typedef struct node_s
-{
-  Behavior *behavior;
-  struct node_s *next;
-  struct node_s *prev;
-} Node;
+  if (state->length == state->capacity)
+  {
+    Py_ssize_t capacity = state->capacity * 2;
+    PyObject **stack = (PyObject **)realloc(state->stack, sizeof(PyObject *) * capacity);
+    if (stack == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
 
-/**
- * A thread-safe queue of behaviors. Will eventually be replaced with a lockless
- * data structure.
- */
-typedef struct pcqueue_s
-{
-  Node *front;
-  Node *back;
-  cnd_t available;
-  mtx_t mutex;
-  bool active;
-} PCQueue;
+    state->stack = stack;
+    state->capacity = capacity;
+  }
 
-/** The when decorator. */
-typedef struct when_object_s
-{
-  PyObject_HEAD;
-  // the regions needed by the behavior
-  PyObject *regions;
-} WhenObject;
+  Py_INCREF(value);
+  state->stack[state->length++] = value;
+  return 0;
+}
 
-/** Stores information when an exception is thrown in a behavior. */
-typedef struct behavior_exception_s
+/** Records that an object must be added to the object hashtables. */
+static int capture_tag(CaptureState *state, PyObject *value, RegionTagObject *tag)
 {
-  // The interpreter that the exception was thrown on
-  PyInterpreterState *interp;
-  // The name of the exception type
-  char *name;
-  // The exception message
-  char *msg;
-  // The next exception in the linked list
-  struct behavior_exception_s *next;
-} BehaviorException;
-
-// Atomic pointer to the front of the exception list.
-static atomic_voidptr_t behavior_exceptions = (voidptr_t)NULL;
-
-// Monitonically increasing ID for regions
-static atomic_llong region_identity = 0;
-
-// Whether the system is running
-static atomic_bool running = false;
-
-// The singleton instance of the terminator
-static Terminator *terminator;
-
-// The queue of behaviors that need to be scheduled
-static PCQueue *work_queue;
+  if (state->tagged_length == state->tagged_capacity)
+  {
+    Py_ssize_t capacity = state->tagged_capacity == 0 ? 64 : state->tagged_capacity * 2;
+    voidptr_t *tagged = (voidptr_t *)realloc(state->tagged, sizeof(voidptr_t) * capacity);
+    if (tagged == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
 
-// The number of workers (set later based on the number of processors or VPY_WORKER_COUNT)
-static Py_ssize_t worker_count = 1;
+    state->tagged = tagged;
+    voidptr_t *tags = (voidptr_t *)realloc(state->tags, sizeof(voidptr_t) * capacity);
+    if (tags == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
 
-// Array of worker threads
-static thrd_t *workers;
+    state->tags = tags;
+    state->tagged_capacity = capacity;
+  }
 
-// Array of subinterpreters
-static PyThreadState **subinterpreters;
+  state->tagged[state->tagged_length] = (voidptr_t)value;
+  state->tags[state->tagged_length] = (voidptr_t)tag;
+  state->tagged_length++;
+  return 0;
+}
 
-static void BehaviorException_new(PyObject *type, PyObject *value, PyObject *traceback)
+/** Pushes all the items produced by an iterable onto the worklist. */
+static int capture_push_items(CaptureState *state, PyObject *iterable)
 {
-  BehaviorException *ex;
-  voidptr_t next;
-  const char *str;
+  PyObject *iterator = PyObject_GetIter(iterable);
+  PyObject *item;
 
-  PRINTDBG("BehaviorException_new %p %p %p\n", type, value, traceback);
-  ex = (BehaviorException *)malloc(sizeof(BehaviorException));
-  if (ex == NULL)
+  if (iterator == NULL)
   {
-    PRINTDBG("Unable to allocate behavior exception\n");
-    goto unraisable;
+    PyErr_SetString(PyExc_RuntimeError, "Unable to get iterator from sequence");
+    return -1;
   }
 
-  if (traceback != NULL)
+  while ((item = PyIter_Next(iterator)))
   {
-    if (PyException_SetTraceback(value, traceback) < 0)
+    int rc = capture_push(state, item);
+    Py_DECREF(item);
+    if (rc != 0)
     {
-      PRINTDBG("Unable to set traceback\n");
-      goto unraisable;
+      Py_DECREF(iterator);
+      return rc;
     }
   }
 
-  PyObject *nameobj = PyUnicode_FromString(((PyTypeObject *)type)->tp_name);
-  if (nameobj == NULL)
-  {
-    PRINTDBG("Unable to get type name\n");
-    goto unraisable;
-  }
+  Py_DECREF(iterator);
 
-  str = PyUnicode_AsUTF8(nameobj);
-  if (str == NULL)
+  if (PyErr_Occurred())
   {
-    PRINTDBG("Unable to get type name\n");
-    goto unraisable;
+    return -1;
   }
 
-  ex->name = malloc(strlen(str) + 1);
-  if (ex->name == NULL)
+  return 0;
+}
+
+/** Pushes all the values of a mapping onto the worklist. */
+static int capture_push_values(CaptureState *state, PyObject *mapping)
+{
+  PyObject *values = PyMapping_Values(mapping);
+  if (values == NULL)
   {
-    PRINTDBG("Unable to allocate type name\n");
-    goto unraisable;
+    PyErr_SetString(PyExc_RuntimeError, "Unable to get values from mapping");
+    return -1;
   }
 
-  strcpy(ex->name, str);
-
-  Py_DECREF(nameobj);
+  int rc = capture_push_items(state, values);
+  Py_DECREF(values);
+  return rc;
+}
 
-  if (value != NULL)
+/**
+ * Pushes the references of an object which are reachable through the
+ * sequence, mapping and __dict__ protocols onto the worklist.
+ */
+static int capture_references(CaptureState *state, PyObject *value)
+{
+  int rc = 0;
+  if (PySequence_Check(value))
   {
-    PyObject *msgobj = PyUnicode_FromFormat("%S", value);
-    if (msgobj == NULL)
+    rc = capture_push_items(state, value);
+    if (rc != 0)
     {
-      PRINTDBG("Unable to get exception message\n");
-      goto unraisable;
+      return rc;
     }
-
-    str = PyUnicode_AsUTF8(msgobj);
-    if (str == NULL)
+  }
+  else if (PyMapping_Check(value))
+  {
+    rc = capture_push_values(state, value);
+    if (rc != 0)
     {
-      PRINTDBG("Unable to get exception message\n");
-      goto unraisable;
+      return rc;
     }
+  }
 
-    ex->msg = malloc(strlen(str) + 1);
-    if (ex->msg == NULL)
+  if (PyObject_HasAttrString(value, "__dict__"))
+  {
+    PyObject *dict = PyObject_GetAttrString(value, "__dict__");
+    if (dict == NULL)
     {
-      PRINTDBG("Unable to allocate exception message\n");
-      goto unraisable;
+      return -1;
     }
 
-    strcpy(ex->msg, str);
+    PyObject *values = PyDict_Values(dict);
+    Py_DECREF(dict);
+    if (values == NULL)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to get values from __dict__");
+      return -1;
+    }
 
-    Py_DECREF(msgobj);
-  }
-  else
-  {
-    ex->msg = NULL;
+    rc = capture_push_items(state, values);
+    Py_DECREF(values);
   }
 
-  ex->interp = PyInterpreterState_Get();
-
-  next = atomic_exchange_ptr(&behavior_exceptions, (voidptr_t)ex);
-  ex->next = (BehaviorException *)next;
-  goto end;
-
-unraisable:
-  PyErr_WriteUnraisable(value);
-
-end:
-  Py_XDECREF(type);
-  Py_XDECREF(value);
-  Py_XDECREF(traceback);
-  return;
+  return rc;
 }
 
-static void BehaviorException_free(BehaviorException *ex)
+/** Visit function used with tp_traverse to push the references of an object. */
+static int capture_visit(PyObject *value, void *arg)
 {
-  if (ex->name != NULL)
+  CaptureState *state = (CaptureState *)arg;
+  if (value == state->skip)
   {
-    free(ex->name);
+    return 0;
   }
 
-  if (ex->msg != NULL)
+  // these are shared by the interpreter, not owned by the object
+  if (PyType_Check(value) || PyModule_Check(value) || PyCode_Check(value))
   {
-    free(ex->msg);
+    return 0;
   }
 
-  free(ex);
+  return capture_push(state, value);
 }
 
-static PCQueue *PCQueue_new()
+/**
+ * Pushes every reference of an object onto the worklist using its tp_traverse.
+ * As with capture_references, the instance dictionary is not captured itself,
+ * only its values.
+ */
+static int capture_traverse(CaptureState *state, PyObject *value)
 {
-  PCQueue *queue;
-
-  PRINTDBG("PCQueue_new\n");
-
-  queue = (PCQueue *)malloc(sizeof(PCQueue));
-  if (queue == NULL)
-  {
-    VPY_ERROR("Unable to allocate queue");
-    return NULL;
-  }
+  int rc = 0;
+  PyObject *dict = NULL;
+  PyTypeObject *type = Py_TYPE(value);
 
-  queue->front = NULL;
-  queue->back = NULL;
-  queue->active = true;
-  if (cnd_init(&queue->available) != thrd_success)
+  if (type->tp_dictoffset != 0)
   {
-    VPY_ERROR("Unable to initialize queue condition");
-    return NULL;
+    dict = PyObject_GenericGetDict(value, NULL);
+    if (dict == NULL)
+    {
+      PyErr_Clear();
+    }
+    else
+    {
+      Py_ssize_t pos = 0;
+      PyObject *item;
+      while (rc == 0 && PyDict_Next(dict, &pos, NULL, &item))
+      {
+        rc = capture_push(state, item);
+      }
+    }
   }
 
-  if (mtx_init(&queue->mutex, mtx_plain) != thrd_success)
+  if (rc == 0)
   {
-    VPY_ERROR("Unable to initialize queue mutex");
-    return NULL;
+    state->skip = dict;
+    rc = type->tp_traverse(value, capture_visit, state);
+    state->skip = NULL;
   }
 
-  return queue;
+  Py_XDECREF(dict);
+  return rc;
 }
 
-static int PCQueue_enqueue(PCQueue *queue, Behavior *behavior)
+/**
+ * Captures a single object into the region and pushes the objects it refers
+ * to onto the worklist. The object is tagged before any of those are
+ * captured, so a cycle back to it will find it already in the region.
+ */
+static int capture_one(CaptureState *state, RegionObject *region, PyObject *value)
 {
-  PRINTDBG("PCQueue_enqueue\n");
-  Node *node = (Node *)malloc(sizeof(Node));
-  if (node == NULL)
+  RegionTagObject *tag;
+  PyTypeObject *isolated_type;
+  int rc = 0;
+  PyTypeObject *type = Py_TYPE(value);
+  RegionObject *value_region = get_region(value);
+
+  if (is_imm(value) || value_region == region)
   {
-    VPY_ERROR("Unable to allocate node");
+    // this value is either immutable, or already captured by the region.
+    return 0;
+  }
+
+  if (value_region != NULL)
+  {
+    // this value is captured by another region
+    PyErr_SetString(RegionIsolationError,
+                    "Object already captured by another region");
     return -1;
   }
 
-  node->behavior = behavior;
-  node->next = NULL;
-  node->prev = NULL;
-  PRINTDBG("Node created\n");
+  PRINTDBG("capture_object %p\n", value);
 
-  PRINTDBG("acquiring queue mutex\n");
-  if (mtx_lock(&queue->mutex) != thrd_success)
+  // ALERT THIS INCREF MAKES THIS OBJECT IMMORTAL
+  // Remove once we have region-based memory management
+  Py_INCREF(value);
+  // ALERT THIS INCREF MAKES THIS OBJECT IMMORTAL
+
+  if (value->ob_type == region->ob_base.ob_type)
   {
-    VPY_ERROR("Unable to lock queue mutex");
-    return -1;
+    // this is a region object, so we need to add it to our graph
+    RegionObject *child = (RegionObject *)value;
+    if (is_free(child))
+    {
+      Py_INCREF(region);
+      child->parent = (PyObject *)region;
+      return 0;
+    }
+    else if (!owns(region, child))
+    {
+      PyErr_SetString(RegionIsolationError,
+                      "Region already attached to a different region graph");
+      return -1;
+    }
   }
 
-  PRINTDBG("enqueueing node\n");
-  if (queue->front == NULL)
+  // the references are found while the object still has its original type
+  if (region->traverse && PyType_IS_GC(type) && type->tp_traverse != NULL)
   {
-    queue->front = node;
-    queue->back = node;
+    rc = capture_traverse(state, value);
+    if (rc != 0)
+    {
+      return rc;
+    }
   }
   else
   {
-    queue->back->next = node;
-    node->prev = queue->back;
-    queue->back = node;
+    rc = capture_references(state, value);
+    if (rc != 0)
+    {
+      return rc;
+    }
   }
 
-  PRINTDBG("signalling workers\n");
-  if (cnd_signal(&queue->available) != thrd_success)
+  isolated_type = (PyTypeObject *)ht_get(vpy_state->isolated_types, (voidptr_t)type);
+
+  if (isolated_type == NULL)
   {
-    VPY_ERROR("Unable to signal queue condition");
+    // first time we've seen this type on this interpreter, isolate it
+    isolated_type = isolate_type(type);
+    if (isolated_type == NULL)
+    {
+      return -1;
+    }
+
+    if (!ht_set(vpy_state->isolated_types, (voidptr_t)type, (voidptr_t)isolated_type))
+    {
+      PyErr_SetString(RegionIsolationError,
+                      "Unable to add isolated type to interpreter");
+      return -1;
+    }
+  }
+
+  PyTypeObject *region_type = get_region_type(region, isolated_type);
+  if (region_type != NULL)
+  {
+    // the type records the region, so no tag needs to be stored
+    Py_INCREF((PyObject *)region_type);
+    value->ob_type = region_type;
+    return rc;
+  }
+
+  tag = get_region_tag(region);
+  if (tag == NULL)
+  {
+    PyErr_SetString(RegionIsolationError, "Unable to create region tag");
     return -1;
   }
 
-  PRINTDBG("unlocking queue mutex\n");
-  if (mtx_unlock(&queue->mutex) != thrd_success)
+  // the visited set stops the object being seen again before it is published
+  if (capture_tag(state, value, tag) != 0)
   {
-    VPY_ERROR("Unable to unlock queue mutex");
     return -1;
   }
 
-  return 0;
+  Py_INCREF((PyObject *)isolated_type);
+  value->ob_type = isolated_type;
+
+  return rc;
 }
 
-static int PCQueue_dequeue(PCQueue *queue, Behavior **behavior)
+/** Prepares an empty capture. */
+static int capture_begin(CaptureState *state)
 {
-  Node *node;
-
-  *behavior = NULL;
-  if (mtx_lock(&queue->mutex) != thrd_success)
+  state->length = 0;
+  state->capacity = 64;
+  state->skip = NULL;
+  state->tagged = NULL;
+  state->tags = NULL;
+  state->tagged_length = 0;
+  state->tagged_capacity = 0;
+  state->stack = (PyObject **)malloc(sizeof(PyObject *) * state->capacity);
+  if (state->stack == NULL)
   {
-    VPY_ERROR("Unable to lock queue mutex");
+    PyErr_NoMemory();
     return -1;
   }
 
-  while (queue->front == NULL && queue->active)
+  state->visited = ht_create(64, false);
+  if (state->visited == NULL)
   {
-    if (cnd_wait(&queue->available, &queue->mutex) != thrd_success)
-    {
-      VPY_ERROR("Unable to wait on queue condition");
-      return -1;
-    }
+    free(state->stack);
+    PyErr_NoMemory();
+    return -1;
   }
 
-  if (!queue->active)
-  {
-    PRINTDBG("queue is inactive\n");
-    if (mtx_unlock(&queue->mutex) != thrd_success)
-    {
-      VPY_ERROR("Unable to unlock queue mutex");
-      return -1;
-    }
-
-    return 0;
-  }
+  return 0;
+}
 
-  node = queue->front;
-  queue->front = node->next;
-  if (queue->front == NULL)
-  {
-    queue->back = NULL;
-  }
-  else
+/** Captures the graph rooted at value as part of a larger capture. */
+static int capture_graph(CaptureState *state, RegionObject *region, PyObject *value)
+{
+  int rc = capture_push(state, value);
+  while (rc == 0 && state->length > 0)
   {
-    queue->front->prev = NULL;
+    PyObject *item = state->stack[--state->length];
+    rc = capture_one(state, region, item);
+    Py_DECREF(item);
   }
 
-  if (mtx_unlock(&queue->mutex) != thrd_success)
+  // on error, release whatever is still waiting
+  while (state->length > 0)
   {
-    VPY_ERROR("Unable to unlock queue mutex");
-    free(node);
-    return -1;
+    Py_DECREF(state->stack[--state->length]);
   }
 
-  PRINTDBG("dequeued node behavior %p\n", node->behavior);
-  *behavior = node->behavior;
-  free(node);
-  return 0;
+  return rc;
 }
 
-static int PCQueue_stop(PCQueue *queue)
+/**
+ * Finishes a capture by publishing the tags of the captured objects, first to
+ * the interpreter cache and then to the global table. This is done even if
+ * the capture failed, as the objects which were captured already have their
+ * isolated types.
+ */
+static int capture_end(CaptureState *state, int rc)
 {
-  PRINTDBG("PCQueue_stop\n");
-
-  PRINTDBG("acquiring queue mutex\n");
-  if (mtx_lock(&queue->mutex) != thrd_success)
+  if (!ht_set_many(vpy_state->object_regions, state->tagged, state->tags, state->tagged_length))
   {
-    VPY_ERROR("Unable to lock queue mutex");
-    return -1;
+    if (rc == 0)
+    {
+      PyErr_SetString(RegionIsolationError, "Unable to set region tag");
+    }
+
+    rc = -1;
   }
 
-  queue->active = false;
+  if (!ht_set_many(global_object_regions, state->tagged, state->tags, state->tagged_length))
+  {
+    if (rc == 0)
+    {
+      PyErr_SetString(RegionIsolationError, "Unable to set region tag in global object table");
+    }
 
-  PRINTDBG("broadcasting queue condition\n");
+    rc = -1;
+  }
 
-  if (cnd_broadcast(&queue->available) != thrd_success)
+  // the objects are recorded with the region which owns their tag, which is
+  // the same for runs of them
+  Py_ssize_t end;
+  for (Py_ssize_t start = 0; start < state->tagged_length; start = end)
   {
-    VPY_ERROR("Unable to broadcast queue condition");
-    return -1;
+    RegionTagObject *tag = (RegionTagObject *)state->tags[start];
+    for (end = start + 1; end < state->tagged_length && state->tags[end] == (voidptr_t)tag; ++end)
+    {
+    }
+
+    assert(tag->region->tag == tag);
+    if (record_tagged(tag->region, state->tagged + start, end - start) < 0)
+    {
+      rc = -1;
+      break;
+    }
   }
 
-  PRINTDBG("unlocking queue mutex\n");
+  ht_free(state->visited);
+  free(state->stack);
+  free(state->tagged);
+  free(state->tags);
+  return rc;
+}
 
-  if (mtx_unlock(&queue->mutex) != thrd_success)
+/**
+ * Attempts to capture an object into the given region.
+ * This function will find all the types of all the objects
+ * in the graph for which value is the root and capture them into the
+ * region. If they have already been captured, it will use the type it
+ * previously captured.
+ *
+ * The graph is walked depth-first using an explicit stack, so that the
+ * depth of the graph does not affect the native stack, and each object is
+ * visited at most once.
+ *
+ * This takes the writer lock of the global hashtable of captured objects
+ * once, to publish all of the captured objects together.
+ */
+static int capture_object(RegionObject *region, PyObject *value)
+{
+  CaptureState state;
+  if (capture_begin(&state) != 0)
   {
-    VPY_ERROR("Unable to unlock queue mutex");
     return -1;
   }
 
-  return 0;
+  return capture_end(&state, capture_graph(&state, region, value));
 }
 
-static void PCQueue_free(PCQueue *queue)
-{
-  mtx_destroy(&queue->mutex);
-  cnd_destroy(&queue->available);
-  free(queue);
-}
+static bool Region_Check(PyObject *obj);
 
-static Terminator *Terminator_new()
-{
-  Terminator *terminator;
+/***************************************************************/
+/*                   Behavior Implementation                   */
+/***************************************************************/
 
-  PRINTDBG("Terminator_new\n");
+/*
+ * Threads which have to wait for one another (a behavior being scheduled
+ * behind another, a request being released before its successor has linked
+ * to it, the main thread waiting for all behaviors) use a one-shot Event. The
+ * waiter spins for a while, as the wait is usually short, and then parks: on a
+ * futex on Linux, and otherwise on a condition variable shared by all events.
+ * The setter only makes a system call if someone is parked.
+ */
 
-  terminator = (Terminator *)malloc(sizeof(Terminator));
-  if (terminator == NULL)
-  {
-    VPY_ERROR("Unable to allocate terminator");
-    return NULL;
-  }
+#define EVENT_UNSET 0
+#define EVENT_SET 1
+#define EVENT_PARKED 2
+// Number of times a waiter checks the event before parking
+#define EVENT_SPIN_COUNT 64
 
-  terminator->count = 1;
-  terminator->set = false;
+/** A flag which can be set once and waited on. */
+typedef struct event_s
+{
+  atomic_int state;
+} Event;
 
-  return terminator;
-}
+#ifndef VPY_FUTEX
+// Shared by all events when futexes are not available
+static mtx_t parking_mutex;
+static cnd_t parking_available;
+#endif
 
-static void Terminator_free(Terminator *terminator)
+// Number of times each kind of wait had to park (see park_stats)
+static atomic_llong parks_scheduled = 0;
+static atomic_llong parks_linked = 0;
+static atomic_llong parks_terminator = 0;
+static atomic_llong parks_worker = 0;
+
+static void Event_init(Event *self)
 {
-  free(terminator);
+  self->state = EVENT_UNSET;
 }
 
-static void Terminator_increment(Terminator *terminator)
+static bool Event_is_set(Event *self)
 {
-  atomic_increment(&terminator->count);
+  return atomic_load_int(&self->state) == EVENT_SET;
 }
 
-static int Terminator_decrement(Terminator *terminator)
+/**
+ * Sets the event and wakes any parked waiters. The event may be freed by a
+ * waiter as soon as it is set, so it is not dereferenced afterwards.
+ */
+static void Event_set(Event *self)
 {
-  if (atomic_decrement(&terminator->count) == 0LL)
+  if (atomic_exchange_int(&self->state, EVENT_SET) != EVENT_PARKED)
   {
-    atomic_store_bool(&terminator->set, true);
+    return;
   }
 
-  return 0;
+#ifdef VPY_FUTEX
+  syscall(SYS_futex, &self->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  mtx_lock(&parking_mutex);
+  cnd_broadcast(&parking_available);
+  mtx_unlock(&parking_mutex);
+#endif
 }
 
-// GIL must be held
-static int Terminator_wait(Terminator *terminator)
+/**
+ * Waits for the event to be set, spinning before parking. Returns whether the
+ * caller had to park.
+ */
+static bool Event_wait(Event *self)
 {
-  int rc;
-
-  PRINTDBG("Terminator_wait\n");
+  int i, state;
 
-  rc = Terminator_decrement(terminator);
-  if (rc != 0)
+  for (i = 0; i < EVENT_SPIN_COUNT; ++i)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to decrement terminator");
-    return rc;
+    if (Event_is_set(self))
+    {
+      return false;
+    }
+
+    thrd_yield();
   }
 
-  while (!atomic_load_bool(&terminator->set))
+  state = EVENT_UNSET;
+  if (!atomic_compare_exchange_int(&self->state, &state, EVENT_PARKED) && state == EVENT_SET)
   {
-    Py_BEGIN_ALLOW_THREADS
-    thrd_yield();
-    Py_END_ALLOW_THREADS
+    return false;
   }
 
-  PRINTDBG("All work complete.\n");
+#ifdef VPY_FUTEX
+  while (!Event_is_set(self))
+  {
+    syscall(SYS_futex, &self->state, FUTEX_WAIT_PRIVATE, EVENT_PARKED, NULL, NULL, 0);
+  }
+#else
+  mtx_lock(&parking_mutex);
+  while (!Event_is_set(self))
+  {
+    cnd_wait(&parking_available, &parking_mutex);
+  }
+  mtx_unlock(&parking_mutex);
+#endif
 
-  return 0;
+  return true;
 }
 
-static void Request_init(Request *self, RegionObject *region);
-// static void Request_free(Request *self);
-static int Request_release(Request *self);
-static int Request_start_enqueue(Request *self, Behavior *behavior);
-static void Request_finish_enqueue(Request *self);
-
-// this must be called while holding the GIL
-static Behavior *Behavior_new(PyObject *thunk_source, PyObject *thunk_locals, PyObject *regions)
+/**
+ * Waits for the event to be set until the deadline (measured against
+ * TIME_UTC), spinning before parking. Returns whether the event was set.
+ */
+static bool Event_wait_until(Event *self, const struct timespec *deadline)
 {
-  Py_ssize_t i;
-  Request *r;
-  Behavior *b = (Behavior *)malloc(sizeof(Behavior));
-  if (b == NULL)
-  {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate behavior");
-    return NULL;
-  }
+  int i, state;
 
-  Py_INCREF(thunk_source);
-  b->thunk_source = thunk_source;
+  for (i = 0; i < EVENT_SPIN_COUNT; ++i)
+  {
+    if (Event_is_set(self))
+    {
+      return true;
+    }
 
-  Py_INCREF(thunk_locals);
-  b->thunk_locals = thunk_locals;
+    thrd_yield();
+  }
 
-  PyList_Sort(regions);
-  b->length = PyList_Size(regions);
-  PRINTDBG("Behavior_new %p r#: %li\n", b, b->length);
-  b->count = b->length + 1;
-  b->requests = (Request *)malloc(sizeof(Request) * b->length);
-  if (b->requests == NULL)
+  state = EVENT_UNSET;
+  if (!atomic_compare_exchange_int(&self->state, &state, EVENT_PARKED) && state == EVENT_SET)
   {
-    free(b);
-    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate requests");
-    return NULL;
+    return true;
   }
 
-  for (i = 0, r = b->requests; i < b->length; ++i, ++r)
+#ifdef VPY_FUTEX
+  while (!Event_is_set(self))
   {
-    PyObject *region = PyList_GetItem(regions, i);
-    if (region == NULL)
+    if (syscall(SYS_futex, &self->state, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                EVENT_PARKED, deadline, NULL, FUTEX_BITSET_MATCH_ANY) != 0 &&
+        errno == ETIMEDOUT)
     {
-      free(b);
-      PyErr_SetString(PyExc_RuntimeError, "Unable to get region from list");
-      return NULL;
+      break;
     }
-
-    Request_init(r, (RegionObject *)region);
   }
-
-  return b;
-}
-
-// this must be called while holding the GIL
-/* static void Behavior_free(Behavior *self)
-{
-  Py_ssize_t i;
-  Request *r;
-  Py_DECREF(self->thunk);
-  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
+#else
+  mtx_lock(&parking_mutex);
+  while (!Event_is_set(self))
   {
-    Request_free(r);
+    if (cnd_timedwait(&parking_available, &parking_mutex, deadline) == thrd_timedout)
+    {
+      break;
+    }
   }
+  mtx_unlock(&parking_mutex);
+#endif
 
-  PyMem_FREE(self->requests);
-  PyMem_FREE(self);
+  return Event_is_set(self);
 }
+
+/** Singleton used to signal when the system can be shut down. */
+typedef struct terminator_s
+{
+  // Number of active behaviors in flight.
+  atomic_llong count;
+  // Set when the system can be shut down.
+  Event set;
+} Terminator;
+
+// Whether an event loop awaits a future. Whichever of the loop and the
+// behavior gets there second hands the future over to the loop.
+#define FUTURE_UNWATCHED 0
+// An event loop awaits the future
+#define FUTURE_WATCHED 1
+// The behavior has finished
+#define FUTURE_FINISHED 2
+
+// How the result of a future is stored. The result of a behavior is a
+// marshalled 1-tuple in value (or is in shared, or is None).
+#define FUTURE_MARSHALLED 0
+// The result of a read is the raw bytes in value
+#define FUTURE_BYTES 1
+// The result of a write is the number of bytes in count
+#define FUTURE_COUNT 2
+
+/**
+ * The outcome of a behavior, shared between the behavior and the future
+ * objects which wait on it (which may belong to another interpreter). It is
+ * freed once both have released it.
  */
-static int Behavior_resolve_one(Behavior *self)
+typedef struct future_s
+{
+  // References held by the behavior and by future objects
+  atomic_llong refcount;
+  // Set once the behavior has finished
+  Event done;
+  // The marshalled 1-tuple holding the result, if it was copied
+  char *value;
+  Py_ssize_t value_size;
+  // The result if it is a region, which is handed over rather than copied
+  PyObject *shared;
+  // How the result is stored (see FUTURE_MARSHALLED)
+  int kind;
+  // The result if it is a count
+  long long count;
+  // The message of the exception raised by the behavior, or NULL
+  char *error;
+  // The errno of a failed I/O operation, or 0
+  int error_number;
+  // Whether an event loop awaits the future (see FUTURE_WATCHED)
+  atomic_int watch;
+  // The notifier of the awaiting interpreter
+  struct notifier_s *notifier;
+  // The future object which the loop awaits (owned by that interpreter)
+  void *waiter;
+  // The coroutine behavior which awaits the future, if it is not a loop
+  struct behavior_s *behavior;
+  // The next future on the ready stack of the notifier
+  struct future_s *next;
+} Future;
+
+/**
+ * Wakes the event loop of an interpreter when futures which it awaits have
+ * finished. Behaviors push their futures onto a lock-free stack as they
+ * finish, and a push onto an empty stack signals a file descriptor (an
+ * eventfd, or the write end of a pipe) which the loop watches.
+ */
+typedef struct notifier_s
 {
-  if (atomic_decrement(&self->count) != 0LL)
+  // Stack of finished futures which have not been handed to the loop yet
+  atomic_voidptr_t ready;
+  // The descriptor watched by the loop
+  int read_fd;
+  // The descriptor written to wake the loop (the same as read_fd for an
+  // eventfd)
+  int write_fd;
+} Notifier;
+
+/**
+ * The marshalled code object of a thunk (or, if it uses modules imported by
+ * the module which defines it, a tuple of the code and the names of those
+ * modules). Blobs are interned by content in a global registry, so that every
+ * interpreter shares a single immutable copy, and live until the system
+ * shuts down.
+ */
+typedef struct code_blob_s
+{
+  // FNV-1a hash of the data
+  uint64_t hash;
+  // Size of the data in bytes
+  Py_ssize_t size;
+  // Next blob in the list of all blobs
+  struct code_blob_s *next;
+  // The marshalled code object, or (code, ((name, module name), ...))
+  char data[];
+} CodeBlob;
+
+// Hashtable mapping content hashes to code blobs
+static ht *global_code_blobs;
+// List of all code blobs (including any which collided in the table)
+static CodeBlob *code_blob_list;
+// Serialises interning of code blobs
+static mtx_t code_blob_mutex;
+// Incremented whenever the code blobs are freed, so that cached blob
+// pointers can be recognised as stale
+static atomic_llong code_blob_generation = 0;
+
+static uint64_t CodeBlob_hash(const char *data, Py_ssize_t size)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (Py_ssize_t i = 0; i < size; ++i)
   {
-    return 0;
+    hash ^= (uint8_t)data[i];
+    hash *= 1099511628211ULL;
   }
 
-  PRINTDBG("enqueueing behavior\n");
-
-  return PCQueue_enqueue(work_queue, self);
+  return hash;
 }
 
-static int Behavior_schedule(Behavior *self)
+/** Returns the interned blob holding a copy of data, creating it if needed. */
+static CodeBlob *CodeBlob_intern(const char *data, Py_ssize_t size)
 {
-  int rc;
-  Py_ssize_t i;
-  Request *r;
-  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
+  uint64_t hash = CodeBlob_hash(data, size);
+  CodeBlob *blob;
+
+  mtx_lock(&code_blob_mutex);
+  blob = (CodeBlob *)ht_get(global_code_blobs, (voidptr_t)hash);
+  if (blob != NULL && blob->size == size && memcmp(blob->data, data, size) == 0)
   {
-    PRINTDBG("start enqueue request %li\n", i);
-    rc = Request_start_enqueue(r, self);
-    if (rc != 0)
-    {
-      return -1;
-    }
+    mtx_unlock(&code_blob_mutex);
+    return blob;
   }
 
-  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
+  blob = (CodeBlob *)malloc(sizeof(CodeBlob) + size);
+  if (blob == NULL)
   {
-    PRINTDBG("finish enqueue request %li\n", i);
-    Request_finish_enqueue(r);
+    mtx_unlock(&code_blob_mutex);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate code blob");
+    return NULL;
   }
 
-  rc = Behavior_resolve_one(self);
-  if (rc != 0)
+  blob->hash = hash;
+  blob->size = size;
+  memcpy(blob->data, data, size);
+  blob->next = code_blob_list;
+  code_blob_list = blob;
+
+  // on a (rare) hash collision the first blob keeps the slot and this one
+  // is simply not shared
+  if (ht_get(global_code_blobs, (voidptr_t)hash) == (voidptr_t)NULL)
   {
-    return rc;
+    ht_set(global_code_blobs, (voidptr_t)hash, (voidptr_t)blob);
   }
 
-  Terminator_increment(terminator);
-  return 0;
+  mtx_unlock(&code_blob_mutex);
+  return blob;
 }
 
-// this must be called while holding the GIL
-static void Request_init(Request *self, RegionObject *region)
+static void CodeBlob_free_all()
 {
-  self->next = NULL;
-  self->scheduled = false;
-  Py_INCREF(region);
-  self->target = region;
+  while (code_blob_list != NULL)
+  {
+    CodeBlob *next = code_blob_list->next;
+    free(code_blob_list);
+    code_blob_list = next;
+  }
 }
 
-// this must be called while holding the GIL
-/* static void Request_free(Request *self)
+typedef struct behavior_s Behavior;
+
+/** Backing object for `read`, which marks a region as only read by a behavior. */
+typedef struct read_object_s
 {
-  PRINTDBG("freeing request with region %s\n", PyUnicode_AsUTF8(self->target->name));
-  Py_DECREF(self->target);
-} */
+  PyObject_HEAD;
+  // The region which is read
+  RegionObject *region;
+} ReadObject;
 
-static int Request_release(Request *self)
+static PyTypeObject ReadType;
+
+/** Backing object for the futures returned by `when`. */
+typedef struct future_object_s
 {
-  voidptr_t self_ptr = (voidptr_t)self;
-  if (self->next == NULL)
-  {
-    if (atomic_compare_exchange_ptr(&self->target->last, &self_ptr, (voidptr_t)NULL))
-    {
-      PRINTDBG("No next request\n");
-      return 0;
-    }
+  PyObject_HEAD;
+  // The outcome of the behavior
+  Future *future;
+  // The result, once it has been loaded into this interpreter
+  PyObject *value;
+  // The asyncio futures awaiting the result, or NULL
+  PyObject *waiters;
+} FutureObject;
+
+static PyTypeObject FutureType;
+
+// The states used by a read request to pass its turn on to the next request
+// on the region. Whichever of the reader and the next request gets there
+// second passes the turn on.
+#define HANDOFF_NONE 0
+// The reader has started, and the next request can have a turn too
+#define HANDOFF_TURN 1
+// The next request has been linked to the reader
+#define HANDOFF_LINKED 2
 
-    PRINTDBG("Waiting for next request to be set\n");
-    while (self->next == NULL)
-    {
-      thrd_yield();
-    }
-  }
+/** A request to capture a region. */
+typedef struct request_s
+{
+  // The next request on the region
+  struct request_s *next;
+  // Set once next has been set
+  Event linked;
+  // Set once the request has been scheduled
+  Event scheduled;
+  // The region to capture
+  RegionObject *target;
+  // The position of the region in the arguments of the thunk
+  Py_ssize_t index;
+  // The behavior which made the request
+  Behavior *behavior;
+  // Whether the region is only read. Consecutive read requests on a region
+  // are granted together.
+  bool read;
+  // The handoff state of a read request
+  atomic_int handoff;
+} Request;
 
-  PRINTDBG("Resolving next request\n");
-  return Behavior_resolve_one((Behavior *)self->next);
-}
+/**
+ * The marshalled tuple of immutable arguments passed to behaviors after their
+ * regions. Behaviors scheduled together (e.g. by when_each) share one copy,
+ * which is freed by whichever of them is released last.
+ */
+typedef struct packed_args_s
+{
+  atomic_llong refcount;
+  Py_ssize_t size;
+  char data[];
+} PackedArgs;
 
-static int Request_start_enqueue(Request *self, Behavior *behavior)
+/** Copies marshalled arguments into a new packed buffer with one reference. */
+static PackedArgs *PackedArgs_new(PyObject *data)
 {
-  Request *prev;
-  voidptr_t prev_ptr = atomic_exchange_ptr(&self->target->last, (voidptr_t)self);
-  if (prev_ptr == (voidptr_t)NULL)
+  PackedArgs *args;
+
+  args = (PackedArgs *)malloc(sizeof(PackedArgs) + PyBytes_GET_SIZE(data));
+  if (args == NULL)
   {
-    PRINTDBG("No previous request\n");
-    return Behavior_resolve_one(behavior);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate behavior arguments");
+    return NULL;
   }
 
-  prev = (Request *)prev_ptr;
-  prev->next = behavior;
+  args->refcount = 1;
+  args->size = PyBytes_GET_SIZE(data);
+  memcpy(args->data, PyBytes_AS_STRING(data), args->size);
+  return args;
+}
 
-  while (!prev->scheduled)
+/** Drops a reference to the arguments. This can be called from any thread. */
+static void PackedArgs_release(PackedArgs *self)
+{
+  if (self != NULL && atomic_decrement(&self->refcount) == 0LL)
   {
-    thrd_yield();
+    free(self);
   }
-
-  return 0;
 }
 
-static void Request_finish_enqueue(Request *self)
+// Number of requests stored inline in a behavior
+#define BEHAVIOR_INLINE_REQUESTS 4
+// Maximum number of freed behaviors kept for reuse by each pool
+#define BEHAVIOR_POOL_CAPACITY 256
+
+typedef struct behavior_pool_s BehaviorPool;
+
+/**
+ * A callable bit of code that depends on capturing one or more
+ * and can run on any interpreter.
+ */
+typedef struct behavior_s
 {
-  self->scheduled = true;
-}
+  // The marshalled code of the callable thunk
+  CodeBlob *code;
+  // The immutable arguments passed after the regions, or NULL if there are
+  // none
+  struct packed_args_s *args;
+  // Where the result is stored, or NULL if nothing waits on it
+  Future *future;
+  // The coroutine returned by an async thunk, while it is suspended
+  PyObject *coroutine;
+  // The future object which the suspended coroutine awaits
+  PyObject *awaiting;
+  // The index of the worker which runs the coroutine. Only that worker's
+  // interpreter can resume it.
+  Py_ssize_t worker;
+  // Counter used to indicate when the behavior is ready to run
+  atomic_llong count;
+  // The number of requests
+  Py_ssize_t length;
+  // An array of requests
+  Request *requests;
+  // The pool of the interpreter which created the behavior (and owns the
+  // thunk objects)
+  BehaviorPool *owner;
+  // Intrusive link used by the overflow list of the work queue and by the
+  // pools
+  struct behavior_s *next;
+  // Storage for the requests of behaviors which need few regions
+  Request inline_requests[BEHAVIOR_INLINE_REQUESTS];
+} Behavior;
 
-/** The main loop of an interpreter. Will draw work off of the queue to
- *  perform until the system enters shutdown.
+/**
+ * Recycles behaviors for one interpreter (the main interpreter, or that of a
+ * worker). A behavior can finish on any worker, but its thunk objects must be
+ * released by the interpreter which created them, so finished behaviors are
+ * handed back to their owner through a lock-free stack and freed by the owner
+ * the next time it allocates (or exits). The free list is only touched while
+ * holding the owning interpreter's GIL.
  */
-static thrd_return_t worker(void *arg)
+typedef struct behavior_pool_s
 {
-  int rc;
-  Py_ssize_t index;
-  PyThreadState *ts;
-  PyObject *err_type, *err_value, *err_traceback, *veronapy;
+  // Stack of finished behaviors returned by other interpreters
+  atomic_voidptr_t returned;
+  // Freed behaviors ready for reuse
+  Behavior *free;
+  Py_ssize_t free_length;
+} BehaviorPool;
 
-  rc = 0;
-  err_type = err_value = err_traceback = NULL;
+/** A slot in the ring of the behavior queue. */
+typedef struct pcqueue_cell_s
+{
+  // The ring position at which the cell can next be written (if equal to the
+  // position) or read (if one past it)
+  atomic_llong sequence;
+  Behavior *behavior;
+} PCQueueCell;
 
-  PRINTDBG("worker starting\n");
+// Number of cells in the ring (must be a power of two)
+#define PCQUEUE_CAPACITY 4096
+// Number of failed attempts to take work before a worker parks
+#define PCQUEUE_SPIN_COUNT 64
+#define PCQUEUE_PAD 64
 
-  index = (Py_ssize_t)arg;
-  ts = subinterpreters[index];
-  alloc_id = index + 1;
-  PyEval_AcquireThread(ts);
+/**
+ * A thread-safe queue of behaviors. The queue is a bounded multi-producer,
+ * multi-consumer ring in the style of Vyukov: producers and consumers each
+ * claim a position with a CAS on their own counter, and each cell carries a
+ * sequence number which says whether it is ready to be written or read, so
+ * that neither side takes a lock. Should the ring fill up, behaviors spill into
+ * an overflow list guarded by the mutex. While the list is not empty new
+ * behaviors join the back of it, and the consumer which takes from the list
+ * moves as many of the rest as fit back into the ring, so behaviors keep the
+ * order in which they were pushed and none wait on the list indefinitely.
+ *
+ * Idle workers spin briefly and then park on the condition variable. A
+ * producer only takes the mutex to wake a worker if one is parked.
+ */
+typedef struct pcqueue_s
+{
+  PCQueueCell *cells;
+  char pad0[PCQUEUE_PAD];
+  atomic_llong enqueue_pos;
+  char pad1[PCQUEUE_PAD];
+  atomic_llong dequeue_pos;
+  char pad2[PCQUEUE_PAD];
+  // Number of behaviors in the overflow list
+  atomic_llong overflow_length;
+  // Number of workers parked (or about to park) on available
+  atomic_llong sleepers;
+  atomic_bool active;
+  // The overflow list (linked through Behavior.next), guarded by mutex
+  Behavior *front;
+  Behavior *back;
+  cnd_t available;
+  mtx_t mutex;
+} PCQueue;
 
-  // each process has its own copy of the veronapy module
-  veronapy = PyImport_ImportModule("veronapy");
-  if (veronapy == NULL)
-  {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to import veronapy module");
-    rc = -1;
-    goto end;
-  }
+// Number of behaviors a worker deque can hold (must be a power of two)
+#define WSDEQUE_CAPACITY 1024
 
-  vpy_state = (VPYState *)PyModule_GetState(veronapy);
+/**
+ * A Chase-Lev work-stealing deque. Each worker owns one, onto which it pushes
+ * the behaviors which become ready while it runs (by releasing its regions or
+ * through nested calls to when), so that they are likely to run on the
+ * interpreter which last touched their regions. The owner pushes and pops at
+ * the bottom without contention, while idle workers steal from the top. A
+ * full deque spills into the global work queue.
+ */
+typedef struct wsdeque_s
+{
+  atomic_llong top;
+  char pad0[PCQUEUE_PAD];
+  atomic_llong bottom;
+  char pad1[PCQUEUE_PAD];
+  atomic_voidptr_t buffer[WSDEQUE_CAPACITY];
+} WSDeque;
 
-  while (!atomic_load_bool(&terminator->set))
-  {
-    Py_ssize_t i;
-    Request *r;
-    PyObject *regions;
-    Behavior *b;
+/** The when decorator. */
+typedef struct when_object_s
+{
+  PyObject_HEAD;
+  // the regions needed by the behavior
+  PyObject *regions;
+} WhenObject;
 
-    ts = PyEval_SaveThread();
-    PRINTDBG("waiting for work...\n");
-    rc = PCQueue_dequeue(work_queue, &b);
-    PyEval_RestoreThread(ts);
+/** Stores information when an exception is thrown in a behavior. */
+typedef struct behavior_exception_s
+{
+  // The interpreter that the exception was thrown on
+  PyInterpreterState *interp;
+  // The name of the exception type
+  char *name;
+  // The exception message
+  char *msg;
+  // The next exception in the linked list
+  struct behavior_exception_s *next;
+} BehaviorException;
 
-    if (rc != 0)
-    {
-      PRINTDBG("error dequeuing work\n");
-      break;
-    }
+// Atomic pointer to the front of the exception list.
+static atomic_voidptr_t behavior_exceptions = (voidptr_t)NULL;
 
-    if (b == NULL)
-    {
-      PRINTDBG("received NULL behavior\n");
-      break;
-    }
+// Monitonically increasing ID for regions
+static atomic_llong region_identity = 0;
 
-    PRINTDBG("received work %p\n", b);
-    PRINTDBG("preparing regions...\n");
-    regions = PyTuple_New(b->length);
-    if (regions == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to allocate regions tuple");
-      rc = -1;
-      break;
-    }
+// Whether the system is running
+static atomic_bool running = false;
 
-    for (i = 0, r = b->requests; i < b->length; ++i, ++r)
-    {
-      RegionObject *region = resolve_region(r->target);
-      PRINTDBG("opening region %s\n", PyUnicode_AsUTF8(region->name));
-      region->is_open = true;
-      Py_INCREF(region);
-      PyTuple_SET_ITEM(regions, i, (PyObject *)region);
-    }
+// The singleton instance of the terminator
+static Terminator *terminator;
 
-    if (err_type == NULL)
-    {
-      PRINTDBG("Running thunk\n");
-      PyObject *result = PyRun_String(PyUnicode_AsUTF8(b->thunk_source), Py_file_input, b->thunk_locals, NULL);
-      if (result == NULL)
-      {
-        PyErr_Fetch(&err_type, &err_value, &err_traceback);
-      }
-      else
-      {
-        Py_DECREF(result);
-      }
+// The queue of behaviors that need to be scheduled
+static PCQueue *work_queue;
 
-      if (err_type != NULL)
-      {
-        BehaviorException_new(err_type, err_value, err_traceback);
-      }
-    }
-    else
-    {
-      PRINTDBG("Exception thrown in worker, skipping thunk\n");
-    }
-    Py_DECREF(regions);
+// Array of work-stealing deques (one per worker, plus one for the main
+// interpreter if it takes part in running behaviors)
+static WSDeque *deques;
 
-    PyObject* closed = PySet_New(NULL);
-    if(closed == NULL){
-      PyErr_SetString(PyExc_RuntimeError, "Unable to allocate closed set");
-      rc = -1;
-      break;
-    }
+// The number of deques
+static Py_ssize_t deque_count;
 
-    PRINTDBG("releasing requests\n");
-    for (i = 0, r = b->requests; i < b->length; ++i, ++r)
-    {
-      RegionObject *region = resolve_region(r->target);
-      PyObject* region_id = PyLong_FromLongLong(region->id);
-      if(!PySet_Contains(closed, region_id)){
-        PRINTDBG("closing region %s\n", PyUnicode_AsUTF8(region->name));
-        region->is_open = false;
-        PySet_Add(closed, region_id);
-      }
+// Array of stacks (one per deque) of suspended coroutine behaviors which can
+// be resumed. Anyone may push, but only the owning worker pops.
+static atomic_voidptr_t *resumed;
 
-      ts = PyEval_SaveThread();
-      rc = Request_release(r);
-      PyEval_RestoreThread(ts);
-      if (rc != 0)
-      {
-        PyErr_SetString(PyExc_RuntimeError, "Unable to release request");
-        continue;
-      }
-    }
+// The coroutine behavior being run on this thread, if any
+static thread_local Behavior *current_coroutine;
 
-    Py_DECREF(closed);
+// The behavior whose thunk is running on this thread, if any. Its read
+// requests are what allow the thread to use regions open for reading.
+static thread_local Behavior *running_behavior;
 
-    if (rc != 0)
-    {
-      break;
-    }
+// Whether the main interpreter runs behaviors while waiting for them
+static bool main_worker = false;
 
-    PRINTDBG("Decrementing terminator...\n");
-    rc = Terminator_decrement(terminator);
+// The deque of the worker running on this thread (NULL on other threads)
+static thread_local WSDeque *local_deque;
 
-    if (rc != 0)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to decrement terminator");
-      break;
-    }
-  }
+// Behavior pool of the main interpreter
+static BehaviorPool main_pool;
 
-  if (rc != 0)
-  {
-    PyErr_Fetch(&err_type, &err_value, &err_traceback);
-    BehaviorException_new(err_type, err_value, err_traceback);
-  }
+// Array of behavior pools (one per worker)
+static BehaviorPool *pools;
 
-  PRINTDBG("worker exiting\n");
+// The pool of the worker running on this thread (NULL on other threads)
+static thread_local BehaviorPool *local_pool;
 
-end:
+// The number of workers (set later based on the number of processors or VPY_WORKER_COUNT)
+static Py_ssize_t worker_count = 1;
 
-#ifdef VPY_MULTIGIL
-  PyThreadState *nts = PyThreadState_New(ts->interp);
-  PyThreadState_Clear(ts);
-  PyThreadState_DeleteCurrent();
-  subinterpreters[index] = nts;
-#else
-  PyEval_ReleaseThread(ts);
-#endif
+// Array of worker threads
+static thrd_t *workers;
 
-  return (thrd_return_t)0;
-}
+// Array of subinterpreters
+static PyThreadState **subinterpreters;
 
 /**
- * Sets the worker count. This will either be pulled from an environment variable
- * or based upon the number of processors on the system (obtained using
- * either sched_getaffinity or cpu_count).
+ * Records an exception thrown in a behavior so that `wait` can raise it.
+ * Steals the references to the exception. Returns the record, or NULL if
+ * the exception could only be reported as unraisable.
  */
-static int set_worker_count()
+static BehaviorException *BehaviorException_new(PyObject *type, PyObject *value, PyObject *traceback)
 {
-  PyObject *os_module, *os_dict, *function, *result, *key;
-  char *worker_count_env;
+  BehaviorException *ex;
+  voidptr_t next;
+  const char *str;
 
-  worker_count_env = getenv("VPY_WORKER_COUNT");
-  if (worker_count_env != NULL)
+  PRINTDBG("BehaviorException_new %p %p %p\n", type, value, traceback);
+  ex = (BehaviorException *)malloc(sizeof(BehaviorException));
+  if (ex == NULL)
   {
-    PRINTDBG("VPY_WORKER_COUNT: %s\n", worker_count_env);
-    worker_count = atoi(worker_count_env);
-    if (worker_count < 1)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "VPY_WORKER_COUNT must be greater than 0");
-      return -1;
-    }
+    PRINTDBG("Unable to allocate behavior exception\n");
+    goto unraisable;
+  }
 
-    if (worker_count > 0)
+  if (traceback != NULL)
+  {
+    if (PyException_SetTraceback(value, traceback) < 0)
     {
-      return 0;
+      PRINTDBG("Unable to set traceback\n");
+      goto unraisable;
     }
   }
 
-  PRINTDBG("Unable to load VPY_WORKER_COUNT, using default behavior\n");
-  os_module = PyImport_ImportModule("os");
-  if (os_module == NULL)
+  PyObject *nameobj = PyUnicode_FromString(((PyTypeObject *)type)->tp_name);
+  if (nameobj == NULL)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to import os module");
-    return -1;
+    PRINTDBG("Unable to get type name\n");
+    goto unraisable;
   }
 
-  os_dict = PyModule_GetDict(os_module);
-  if (os_dict == NULL)
+  str = PyUnicode_AsUTF8(nameobj);
+  if (str == NULL)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get os module dict");
-    return -1;
+    PRINTDBG("Unable to get type name\n");
+    goto unraisable;
   }
 
-  key = PyUnicode_FromString("sched_getaffinity");
-  if (PyDict_Contains(os_dict, key))
+  ex->name = malloc(strlen(str) + 1);
+  if (ex->name == NULL)
   {
-    function = PyDict_GetItemString(os_dict, "sched_getaffinity");
-    if (function == NULL)
+    PRINTDBG("Unable to allocate type name\n");
+    goto unraisable;
+  }
+
+  strcpy(ex->name, str);
+
+  Py_DECREF(nameobj);
+
+  if (value != NULL)
+  {
+    PyObject *msgobj = PyUnicode_FromFormat("%S", value);
+    if (msgobj == NULL)
     {
-      Py_DECREF(key);
-      PyErr_Format(PyExc_RuntimeError, "Unable to load sched_getaffinity from os module");
-      return -1;
+      PRINTDBG("Unable to get exception message\n");
+      goto unraisable;
     }
 
-    result = PyObject_CallOneArg(function, PyLong_FromLong(0));
-    worker_count = PySet_Size(result);
-    PRINTDBG("sched_getaffinity returned %li\n", worker_count);
+    str = PyUnicode_AsUTF8(msgobj);
+    if (str == NULL)
+    {
+      PRINTDBG("Unable to get exception message\n");
+      goto unraisable;
+    }
+
+    ex->msg = malloc(strlen(str) + 1);
+    if (ex->msg == NULL)
+    {
+      PRINTDBG("Unable to allocate exception message\n");
+      goto unraisable;
+    }
+
+    strcpy(ex->msg, str);
+
+    Py_DECREF(msgobj);
   }
   else
   {
-    function = PyDict_GetItemString(os_dict, "cpu_count");
-    if (function == NULL)
-    {
-      Py_DECREF(key);
-      PyErr_Format(PyExc_RuntimeError, "Unable to load cpu_count from os module");
-      return -1;
-    }
+    ex->msg = NULL;
+  }
 
-    result = PyObject_CallNoArgs(function);
-    worker_count = PyLong_AsLong(result);
-    PRINTDBG("cpu_count returned %li\n", worker_count);
+  ex->interp = PyInterpreterState_Get();
+
+  next = atomic_exchange_ptr(&behavior_exceptions, (voidptr_t)ex);
+  ex->next = (BehaviorException *)next;
+  goto end;
+
+unraisable:
+  PyErr_WriteUnraisable(value);
+  ex = NULL;
+
+end:
+  Py_XDECREF(type);
+  Py_XDECREF(value);
+  Py_XDECREF(traceback);
+  return ex;
+}
+
+static void BehaviorException_free(BehaviorException *ex)
+{
+  if (ex->name != NULL)
+  {
+    free(ex->name);
   }
 
-  Py_DECREF(key);
-  Py_DECREF(result);
-  if (worker_count < 1)
+  if (ex->msg != NULL)
   {
-    PyErr_SetString(PyExc_RuntimeError, "invalid worker count (< 1)");
-    return -1;
+    free(ex->msg);
   }
 
-  return 0;
+  free(ex);
 }
 
-#ifdef VPY_MULTIGIL
-static int create_subinterpreters()
+static PCQueue *PCQueue_new()
 {
+  PCQueue *queue;
   Py_ssize_t i;
-  PyThreadState *ts;
 
-  PRINTDBG("creating multi-gil subinterpreters\n");
+  PRINTDBG("PCQueue_new\n");
 
-  alloc_id = 0;
-  subinterpreters = (PyThreadState **)malloc(sizeof(PyThreadState *) * worker_count);
-  for (i = 0; i < worker_count; ++i)
+  queue = (PCQueue *)malloc(sizeof(PCQueue));
+  if (queue == NULL)
   {
-    PyStatus status;
-    PyInterpreterConfig config = {
-        .use_main_obmalloc = 0,
-        .allow_fork = 0,
-        .allow_exec = 0,
-        .allow_threads = 1,
-        .allow_daemon_threads = 0,
-        .check_multi_interp_extensions = 1,
-        .gil = PyInterpreterConfig_OWN_GIL,
-    };
-    subinterpreters[i] = NULL;
-
-    ts = PyThreadState_Get();
-    status = Py_NewInterpreterFromConfig(subinterpreters + i, &config);
-    subinterpreters[i] = PyEval_SaveThread();
-    PyEval_RestoreThread(ts);
-    if (PyStatus_Exception(status))
-    {
-      PyObject *exc;
-      _PyErr_SetFromPyStatus(status);
-      exc = PyErr_GetRaisedException();
-      PyErr_SetString(PyExc_RuntimeError, "interpreter creation failed");
-      _PyErr_ChainExceptions1(exc);
-      return -1;
-    }
+    VPY_ERROR("Unable to allocate queue");
+    return NULL;
+  }
 
-    PRINTDBG("starting subinterpreter %lu\n", PyInterpreterState_GetID(subinterpreters[i]->interp));
+  queue->cells = (PCQueueCell *)malloc(sizeof(PCQueueCell) * PCQUEUE_CAPACITY);
+  if (queue->cells == NULL)
+  {
+    free(queue);
+    VPY_ERROR("Unable to allocate queue cells");
+    return NULL;
   }
 
-  return 0;
-}
-#else
-static int create_subinterpreters()
-{
-  Py_ssize_t i;
-  PyThreadState *ts;
-  PRINTDBG("creating subinterpreters\n");
+  for (i = 0; i < PCQUEUE_CAPACITY; ++i)
+  {
+    queue->cells[i].sequence = i;
+    queue->cells[i].behavior = NULL;
+  }
 
-  subinterpreters = (PyThreadState **)malloc(sizeof(PyThreadState *) * worker_count);
-  ts = PyThreadState_Get();
-  for (i = 0; i < worker_count; ++i)
+  queue->enqueue_pos = 0;
+  queue->dequeue_pos = 0;
+  queue->overflow_length = 0;
+  queue->sleepers = 0;
+  queue->active = true;
+  queue->front = NULL;
+  queue->back = NULL;
+  if (cnd_init(&queue->available) != thrd_success)
   {
-    subinterpreters[i] = Py_NewInterpreter();
-    if (subinterpreters[i] == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to create subinterpreter");
-      return -1;
-    }
+    VPY_ERROR("Unable to initialize queue condition");
+    return NULL;
+  }
 
-    PRINTDBG("starting subinterpreter %lu\n", PyInterpreterState_GetID(subinterpreters[i]->interp));
-    PyThreadState_Swap(ts);
+  if (mtx_init(&queue->mutex, mtx_plain) != thrd_success)
+  {
+    VPY_ERROR("Unable to initialize queue mutex");
+    return NULL;
   }
 
-  return 0;
+  return queue;
 }
-#endif
 
-static void free_subinterpreters()
+/** Places the behavior in the ring. Returns false if the ring is full. */
+static bool PCQueue_try_push(PCQueue *queue, Behavior *behavior)
 {
-  PyThreadState *ts;
-  PRINTDBG("freeing subinterpreters\n");
-  for (Py_ssize_t i = 0; i < worker_count; ++i)
+  PCQueueCell *cell;
+  long long pos, diff;
+
+  pos = atomic_load_llong(&queue->enqueue_pos);
+  for (;;)
   {
-    PRINTDBG("ending subinterpreter %lu %p\n", PyInterpreterState_GetID(subinterpreters[i]->interp), subinterpreters[i]);
-    ts = PyThreadState_Swap(subinterpreters[i]);
-    Py_EndInterpreter(subinterpreters[i]);
-    PyThreadState_Swap(ts);
+    cell = queue->cells + (pos & (PCQUEUE_CAPACITY - 1));
+    diff = atomic_load_llong(&cell->sequence) - pos;
+    if (diff == 0)
+    {
+      // on failure pos is updated to the current position
+      if (atomic_compare_exchange_llong(&queue->enqueue_pos, &pos, pos + 1))
+      {
+        break;
+      }
+    }
+    else if (diff < 0)
+    {
+      // the cell still holds a behavior from the previous lap
+      return false;
+    }
+    else
+    {
+      pos = atomic_load_llong(&queue->enqueue_pos);
+    }
   }
 
-  free(subinterpreters);
+  cell->behavior = behavior;
+  atomic_store_llong(&cell->sequence, pos + 1);
+  return true;
 }
 
-static int startup_workers()
+/** Takes a behavior from the ring. Returns NULL if the ring is empty. */
+static Behavior *PCQueue_try_pop(PCQueue *queue)
 {
-  thrd_t *thr;
-  Py_ssize_t i;
-  int rc;
+  PCQueueCell *cell;
+  Behavior *behavior;
+  long long pos, diff;
 
-  terminator = Terminator_new();
-  work_queue = PCQueue_new();
-  if (work_queue == NULL)
+  pos = atomic_load_llong(&queue->dequeue_pos);
+  for (;;)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate work queue");
-    return -1;
+    cell = queue->cells + (pos & (PCQUEUE_CAPACITY - 1));
+    diff = atomic_load_llong(&cell->sequence) - (pos + 1);
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_llong(&queue->dequeue_pos, &pos, pos + 1))
+      {
+        break;
+      }
+    }
+    else if (diff < 0)
+    {
+      return NULL;
+    }
+    else
+    {
+      pos = atomic_load_llong(&queue->dequeue_pos);
+    }
   }
 
-  PRINTDBG("starting workers\n");
-  workers = (thrd_t *)malloc(sizeof(thrd_t) * worker_count);
-  for (i = 0, thr = workers; i < worker_count; ++i, ++thr)
+  behavior = cell->behavior;
+  atomic_store_llong(&cell->sequence, pos + PCQUEUE_CAPACITY);
+  return behavior;
+}
+
+/**
+ * Takes the behavior at the front of the overflow list, and moves as many of
+ * the others as fit into the ring. The queue mutex must be held.
+ */
+static Behavior *PCQueue_pop_overflow(PCQueue *queue)
+{
+  Behavior *behavior, *next;
+
+  behavior = queue->front;
+  if (behavior == NULL)
   {
-    rc = thrd_create(thr, worker, (void *)i);
-    if (rc != thrd_success)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to create worker thread");
-      return -1;
-    }
+    return NULL;
   }
 
-  return 0;
+  next = behavior->next;
+  behavior->next = NULL;
+  atomic_decrement(&queue->overflow_length);
+
+  while (next != NULL && PCQueue_try_push(queue, next))
+  {
+    Behavior *moved = next;
+    next = moved->next;
+    moved->next = NULL;
+    atomic_decrement(&queue->overflow_length);
+  }
+
+  queue->front = next;
+  if (next == NULL)
+  {
+    queue->back = NULL;
+  }
+
+  return behavior;
 }
 
-static int shutdown_workers()
+/** Takes a behavior from the ring or, if that is empty, the overflow list. */
+static int PCQueue_take(PCQueue *queue, Behavior **behavior)
 {
-  int rc;
+  *behavior = PCQueue_try_pop(queue);
+  if (*behavior != NULL || atomic_load_llong(&queue->overflow_length) == 0)
+  {
+    return 0;
+  }
 
-  PRINTDBG("shutting down workers\n");
+  if (mtx_lock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to lock queue mutex");
+    return -1;
+  }
 
-  PRINTDBG("stopping work queue\n");
-  Py_BEGIN_ALLOW_THREADS
-      rc = PCQueue_stop(work_queue);
-  Py_END_ALLOW_THREADS
+  *behavior = PCQueue_pop_overflow(queue);
 
-      if (rc != 0)
+  if (mtx_unlock(&queue->mutex) != thrd_success)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to stop work queue");
+    VPY_ERROR("Unable to unlock queue mutex");
     return -1;
   }
 
-  PRINTDBG("waiting for workers\n");
-  for (Py_ssize_t i = 0; i < worker_count; ++i)
+  return 0;
+}
+
+/**
+ * Wakes a parked worker, if there is one. Must be called after new work has
+ * been published, be it on the queue or on a worker's deque.
+ */
+static int PCQueue_notify(PCQueue *queue)
+{
+  // Pairs with the fence in worker_next: either this sees the parked worker,
+  // or the worker sees the behavior before it waits.
+  atomic_fence();
+  if (atomic_load_llong(&queue->sleepers) == 0)
   {
-    PRINTDBG("joining worker thread %li\n", i);
-    Py_BEGIN_ALLOW_THREADS;
-    rc = thrd_join(workers[i], NULL);
-    Py_END_ALLOW_THREADS;
+    return 0;
+  }
 
-    if (rc != thrd_success)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to join worker thread");
-      return -1;
-    }
+  PRINTDBG("signalling workers\n");
+  if (mtx_lock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to lock queue mutex");
+    return -1;
   }
-  free(workers);
 
-  PRINTDBG("freeing work queue\n");
-  PCQueue_free(work_queue);
+  if (cnd_signal(&queue->available) != thrd_success)
+  {
+    VPY_ERROR("Unable to signal queue condition");
+    return -1;
+  }
 
-  PRINTDBG("threading system shutdown complete\n");
+  if (mtx_unlock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to unlock queue mutex");
+    return -1;
+  }
 
   return 0;
 }
 
-static WhenObject *When_new(PyTypeObject *type, PyObject *args,
-                            PyObject *kwds)
+/** Wakes all parked workers (e.g. so that they can observe the terminator). */
+static int PCQueue_notify_all(PCQueue *queue)
 {
-  WhenObject *self = (WhenObject *)type->tp_alloc(type, 0);
-  if (self == NULL)
+  if (mtx_lock(&queue->mutex) != thrd_success)
   {
-    return NULL;
+    VPY_ERROR("Unable to lock queue mutex");
+    return -1;
   }
 
-  self->regions = NULL;
+  if (cnd_broadcast(&queue->available) != thrd_success)
+  {
+    VPY_ERROR("Unable to broadcast queue condition");
+    return -1;
+  }
 
-  return self;
+  if (mtx_unlock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to unlock queue mutex");
+    return -1;
+  }
+
+  return 0;
 }
 
-static int When_init(WhenObject *self, PyObject *args, PyObject *kwds)
+/** Pushes a behavior onto the queue without waking any workers. */
+static int PCQueue_push(PCQueue *queue, Behavior *behavior)
 {
-  Py_ssize_t i, num_regions;
-  PyObject *r;
-  num_regions = PyTuple_Size(args);
-  for (i = 0; i < num_regions; ++i)
+  PRINTDBG("PCQueue_push\n");
+  // behaviors waiting in the overflow list go first
+  if (atomic_load_llong(&queue->overflow_length) == 0 && PCQueue_try_push(queue, behavior))
   {
-    r = PyTuple_GetItem(args, i);
-    if (r == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to get region from tuple");
-      return -1;
-    }
+    return 0;
+  }
+
+  PRINTDBG("ring is full, using overflow list\n");
+  behavior->next = NULL;
+
+  if (mtx_lock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to lock queue mutex");
+    return -1;
+  }
 
-    if (!Region_Check(r))
+  // the list may have been drained in the meantime
+  if (queue->front != NULL || !PCQueue_try_push(queue, behavior))
+  {
+    if (queue->front == NULL)
     {
-      PyErr_SetString(PyExc_TypeError, "Expected region");
-      return -1;
+      queue->front = behavior;
     }
-
-    if (!((RegionObject *)r)->is_shared)
+    else
     {
-      PyErr_SetString(RegionIsolationError, "Region must be shared");
-      return -1;
+      queue->back->next = behavior;
     }
+
+    queue->back = behavior;
+    atomic_increment(&queue->overflow_length);
   }
 
-  Py_INCREF(args);
-  self->regions = args;
+  if (mtx_unlock(&queue->mutex) != thrd_success)
+  {
+    VPY_ERROR("Unable to unlock queue mutex");
+    return -1;
+  }
 
-  PRINTDBG("when initialized @ %p\n", self);
   return 0;
 }
 
-static void When_dealloc(WhenObject *self)
+static int PCQueue_enqueue(PCQueue *queue, Behavior *behavior)
 {
-  PRINTDBG("When_dealloc\n");
-  Py_XDECREF(self->regions);
-  Py_TYPE(self)->tp_free((PyObject *)self);
+  if (PCQueue_push(queue, behavior) != 0)
+  {
+    return -1;
+  }
+
+  return PCQueue_notify(queue);
 }
 
-/** This is called when the @when decorator is used on a function. */
-static PyObject *When_call(WhenObject *self, PyObject *args, PyObject *kwds)
+static int PCQueue_stop(PCQueue *queue)
 {
-  PyObject *thunk, *thunk_source, *thunk_name, *thunk_locals, *thunk_command;
-  Behavior *b;
-  PyObject *regions;
-  Py_ssize_t index;
-  int rc;
+  PRINTDBG("PCQueue_stop\n");
 
-  PRINTDBG("When_call\n");
-  if (PyTuple_Size(args) != 1)
+  PRINTDBG("acquiring queue mutex\n");
+  if (mtx_lock(&queue->mutex) != thrd_success)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Expected one argument");
-    return NULL;
+    VPY_ERROR("Unable to lock queue mutex");
+    return -1;
   }
 
-  // the decorator is passed the decorated function
-  thunk = PyTuple_GetItem(args, 0);
-  if (thunk == NULL)
-  {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get thunk from tuple");
-    return NULL;
-  }
+  atomic_store_bool(&queue->active, false);
 
-  if (!PyCallable_Check(thunk))
-  {
-    PyErr_SetString(PyExc_TypeError, "Expected callable");
-    return NULL;
-  }
+  PRINTDBG("broadcasting queue condition\n");
 
-  // The decorator instantiation indicates the regions that need to be
-  // obtained before the thunk can be run.
-  regions = PySequence_List(self->regions);
-  if (regions == NULL)
+  if (cnd_broadcast(&queue->available) != thrd_success)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to convert regions to list");
-    return NULL;
+    VPY_ERROR("Unable to broadcast queue condition");
+    return -1;
   }
 
-  // We have to get the source of the thunk to avoid race conditions on the
-  // refcounts of builtins.
-  thunk_source = get_source(thunk);
-  if (thunk_source == NULL)
-  {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get source of thunk");
-    return NULL;
-  }
+  PRINTDBG("unlocking queue mutex\n");
 
-  // We need to strip the decorator from the source
-  index = PyUnicode_Find(thunk_source, PyUnicode_FromString("def"), 0, PyUnicode_GET_LENGTH(thunk_source), 1);
-  if (index == -1)
+  if (mtx_unlock(&queue->mutex) != thrd_success)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to find def in thunk source");
-    return NULL;
+    VPY_ERROR("Unable to unlock queue mutex");
+    return -1;
   }
 
-  thunk_source = PyUnicode_Substring(thunk_source, index, PyUnicode_GET_LENGTH(thunk_source));
+  return 0;
+}
+
+static void PCQueue_free(PCQueue *queue)
+{
+  mtx_destroy(&queue->mutex);
+  cnd_destroy(&queue->available);
+  free(queue->cells);
+  free(queue);
+}
+
+static void WSDeque_init(WSDeque *deque)
+{
+  deque->top = 0;
+  deque->bottom = 0;
+}
+
+/**
+ * Pushes a behavior onto the bottom of the deque. Only the owning worker may
+ * call this. Returns false if the deque is full.
+ */
+static bool WSDeque_push(WSDeque *deque, Behavior *behavior)
+{
+  long long bottom, top;
 
-  thunk_name = PyObject_GetAttrString(thunk, "__name__");
-  if (thunk_name == NULL)
+  bottom = atomic_load_llong(&deque->bottom);
+  top = atomic_load_llong(&deque->top);
+  if (bottom - top >= WSDEQUE_CAPACITY)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to get name of thunk");
-    return NULL;
+    return false;
   }
 
-  thunk_locals = PyDict_New();
-  if (thunk_locals == NULL)
+  atomic_store_ptr(deque->buffer + (bottom & (WSDEQUE_CAPACITY - 1)), (voidptr_t)behavior);
+  atomic_store_llong(&deque->bottom, bottom + 1);
+  return true;
+}
+
+/**
+ * Pops a behavior from the bottom of the deque. Only the owning worker may
+ * call this. Returns NULL if the deque is empty.
+ */
+static Behavior *WSDeque_pop(WSDeque *deque)
+{
+  long long bottom, top;
+  Behavior *behavior;
+
+  bottom = atomic_load_llong(&deque->bottom) - 1;
+  atomic_store_llong(&deque->bottom, bottom);
+  atomic_fence();
+  top = atomic_load_llong(&deque->top);
+  if (top > bottom)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate thunk locals");
+    atomic_store_llong(&deque->bottom, bottom + 1);
     return NULL;
   }
 
-  thunk_command = PyUnicode_Concat(thunk_name, PyUnicode_FromString("("));
-
-  // Iterate through the regions, adding them to the code and to the locals
-  for (Py_ssize_t i = 0; i < PyList_Size(regions); ++i)
+  behavior = (Behavior *)atomic_load_ptr(deque->buffer + (bottom & (WSDEQUE_CAPACITY - 1)));
+  if (top == bottom)
   {
-    PyObject *region = PyList_GetItem(regions, i);
-    if (region == NULL)
+    // this is the last behavior, so we race the thieves for it
+    if (!atomic_compare_exchange_llong(&deque->top, &top, top + 1))
     {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to get region from list");
-      return NULL;
+      behavior = NULL;
     }
 
-    PyObject *name = PyUnicode_FromFormat("r_%li", i);
-    if (name == NULL)
-    {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to allocate region name");
-      return NULL;
-    }
+    atomic_store_llong(&deque->bottom, bottom + 1);
+  }
+
+  return behavior;
+}
+
+/**
+ * Steals a behavior from the top of another worker's deque. Returns NULL if
+ * the deque is empty.
+ */
+static Behavior *WSDeque_steal(WSDeque *deque)
+{
+  long long bottom, top;
+  Behavior *behavior;
 
-    if (PyDict_SetItem(thunk_locals, name, region) != 0)
+  for (;;)
+  {
+    top = atomic_load_llong(&deque->top);
+    atomic_fence();
+    bottom = atomic_load_llong(&deque->bottom);
+    if (top >= bottom)
     {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to set region in thunk locals");
       return NULL;
     }
 
-    PyUnicode_Append(&thunk_command, name);
-    if (i < PyList_Size(regions) - 1)
+    behavior = (Behavior *)atomic_load_ptr(deque->buffer + (top & (WSDEQUE_CAPACITY - 1)));
+    if (atomic_compare_exchange_llong(&deque->top, &top, top + 1))
     {
-      PyUnicode_Append(&thunk_command, PyUnicode_FromString(", "));
+      return behavior;
     }
   }
+}
 
-  PyUnicode_Append(&thunk_command, PyUnicode_FromString(")"));
-
-  thunk_source = PyUnicode_Concat(thunk_source, PyUnicode_FromString("\n"));
-  thunk_source = PyUnicode_Concat(thunk_source, thunk_command);
-
-  // PRINTDBG("thunk final: %s\n", PyUnicode_AsUTF8(thunk_source));
-
-  PRINTDBG("creating behavior\n");
-  b = Behavior_new(thunk_source, thunk_locals, regions);
-  Py_DECREF(regions);
+/**
+ * Looks for a behavior to run: first among the coroutines which the worker
+ * can resume, then on the worker's own deque, then on the global queue, and
+ * finally on the deques of the other workers. If locked is set then the
+ * caller holds the queue mutex.
+ */
+static int find_work(Py_ssize_t index, bool locked, Behavior **behavior)
+{
+  Py_ssize_t i;
+  voidptr_t head;
 
-  if (b == NULL)
+  // Only this worker pops from its stack, so the head cannot be popped and
+  // pushed again while this is in progress.
+  head = atomic_load_ptr(resumed + index);
+  while (head != (voidptr_t)NULL &&
+         !atomic_compare_exchange_ptr(resumed + index, &head, (voidptr_t)((Behavior *)head)->next))
   {
-    return NULL;
   }
 
-  PRINTDBG("scheduling behavior\n");
-  Py_BEGIN_ALLOW_THREADS;
-  rc = Behavior_schedule(b);
-  Py_END_ALLOW_THREADS;
-
-  if (rc != 0)
+  *behavior = (Behavior *)head;
+  if (*behavior != NULL)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to schedule behavior");
-    return NULL;
+    return 0;
   }
 
-  Py_RETURN_TRUE;
-}
-
-static PyTypeObject WhenType = {
-    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.when_factory",
-    .tp_doc = PyDoc_STR("When factory, returned by when()"),
-    .tp_basicsize = sizeof(WhenObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
-    .tp_new = (newfunc)When_new,
-    .tp_init = (initproc)When_init,
-    .tp_dealloc = (destructor)When_dealloc,
-    .tp_call = (ternaryfunc)When_call,
-};
-
-static PyObject *when(PyObject *module, PyObject *args)
-{
-  PyObject *when_factory;
-  when_factory = PyObject_CallObject((PyObject *)&WhenType, args);
-  return when_factory;
-}
+  *behavior = WSDeque_pop(deques + index);
+  if (*behavior != NULL)
+  {
+    return 0;
+  }
 
-/***************************************************************/
-/*              Isolated object methods                        */
-/***************************************************************/
+  if (locked)
+  {
+    *behavior = PCQueue_try_pop(work_queue);
+    if (*behavior == NULL)
+    {
+      *behavior = PCQueue_pop_overflow(work_queue);
+    }
+  }
+  else if (PCQueue_take(work_queue, behavior) != 0)
+  {
+    return -1;
+  }
 
-static void Isolated_finalize(PyObject *self)
-{
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  if (type == NULL)
+  for (i = 1; *behavior == NULL && i < deque_count; ++i)
   {
-    PyErr_SetString(PyExc_TypeError,
-                    "error obtaining internal type of isolated object");
-    return;
+    *behavior = WSDeque_steal(deques + (index + i) % deque_count);
   }
 
-  self->ob_type = type;
-  Py_DECREF(isolated_type);
+  return 0;
 }
 
 /**
- * This function serves as a nice example of the Isolated type pattern
- * used in the module. The result is that the repr of the isolated type
- * will be called, but only if the region is open.
+ * Waits for the next behavior for the worker to run. Idle workers spin for a
+ * while and then park on the work queue until they are notified. Sets
+ * behavior to NULL once the work queue has been stopped or all behaviors have
+ * completed.
  */
-static PyObject *Isolated_repr(PyObject *self)
+static int worker_next(Py_ssize_t index, Behavior **behavior)
 {
-  PyObject *repr;
-  // The object has had its ob_type pointer replaced with a pointer to the isolated type
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  // We get the inner type from the isolated type
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
-  // We get the region from the isolated object
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, NULL);
-  VPY_CHECKREGIONOPEN(region, NULL);
+  int spins;
+  PCQueue *queue = work_queue;
 
-  // swap in the original type object
-  self->ob_type = type;
-  // call the method
-  repr = type->tp_repr(self);
-  // swap back in the isolated type object
-  self->ob_type = isolated_type;
+  for (spins = 0;; ++spins)
+  {
+    if (!atomic_load_bool(&queue->active) || Event_is_set(&terminator->set))
+    {
+      PRINTDBG("queue is inactive\n");
+      *behavior = NULL;
+      return 0;
+    }
 
-  // this pattern is used in all Isolated methods
-  return repr;
-}
+    if (find_work(index, false, behavior) != 0)
+    {
+      return -1;
+    }
 
-static PyObject *Isolated_str(PyObject *self)
-{
-  PyObject *str;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, NULL);
-  VPY_CHECKREGIONOPEN(region, NULL);
+    if (*behavior != NULL)
+    {
+      PRINTDBG("found behavior %p\n", *behavior);
+      return 0;
+    }
 
-  self->ob_type = type;
-  str = type->tp_str(self);
-  self->ob_type = isolated_type;
-  return str;
-}
+    if (spins < PCQUEUE_SPIN_COUNT)
+    {
+      thrd_yield();
+      continue;
+    }
 
-static PyObject *Isolated_richcompare(PyObject *self, PyObject *other, int op)
-{
-  PyObject *result;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, NULL);
-  VPY_CHECKREGIONOPEN(region, NULL);
+    PRINTDBG("parking worker\n");
+    if (mtx_lock(&queue->mutex) != thrd_success)
+    {
+      VPY_ERROR("Unable to lock queue mutex");
+      return -1;
+    }
 
-  self->ob_type = type;
-  result = type->tp_richcompare(self, other, op);
-  self->ob_type = isolated_type;
-  return result;
-}
+    atomic_increment(&queue->sleepers);
+    atomic_fence();
+    while (atomic_load_bool(&queue->active) && !Event_is_set(&terminator->set))
+    {
+      if (find_work(index, true, behavior) != 0)
+      {
+        return -1;
+      }
 
-static PyObject *Isolated_iter(PyObject *self)
-{
-  PyObject *iter;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, NULL);
-  VPY_CHECKREGIONOPEN(region, NULL);
+      if (*behavior != NULL)
+      {
+        break;
+      }
 
-  self->ob_type = type;
-  iter = type->tp_iter(self);
-  self->ob_type = isolated_type;
-  return iter;
+      atomic_increment(&parks_worker);
+      if (cnd_wait(&queue->available, &queue->mutex) != thrd_success)
+      {
+        VPY_ERROR("Unable to wait on queue condition");
+        return -1;
+      }
+    }
+
+    atomic_decrement(&queue->sleepers);
+
+    if (mtx_unlock(&queue->mutex) != thrd_success)
+    {
+      VPY_ERROR("Unable to unlock queue mutex");
+      return -1;
+    }
+
+    if (*behavior != NULL)
+    {
+      PRINTDBG("found behavior %p\n", *behavior);
+      return 0;
+    }
+
+    spins = 0;
+  }
 }
 
-static PyObject *Isolated_iternext(PyObject *self)
+static Terminator *Terminator_new()
 {
-  PyObject *next;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, NULL);
-  VPY_CHECKREGIONOPEN(region, NULL);
+  Terminator *terminator;
 
-  self->ob_type = type;
-  next = type->tp_iternext(self);
-  self->ob_type = isolated_type;
-  return next;
+  PRINTDBG("Terminator_new\n");
+
+  terminator = (Terminator *)malloc(sizeof(Terminator));
+  if (terminator == NULL)
+  {
+    VPY_ERROR("Unable to allocate terminator");
+    return NULL;
+  }
+
+  terminator->count = 1;
+  Event_init(&terminator->set);
+
+  return terminator;
 }
 
-static Py_hash_t Isolated_hash(PyObject *self)
+static void Terminator_free(Terminator *terminator)
 {
-  Py_hash_t hash;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, 0);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, 0);
-  VPY_CHECKREGIONOPEN(region, 0);
+  free(terminator);
+}
 
-  self->ob_type = type;
-  hash = type->tp_hash(self);
-  self->ob_type = isolated_type;
-  return hash;
+static void Terminator_increment(Terminator *terminator)
+{
+  atomic_increment(&terminator->count);
 }
 
-static PyObject *Isolated_getattro(PyObject *self, PyObject *attr_name)
+static void Terminator_add(Terminator *terminator, long long count)
 {
-  PyObject *result;
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, NULL);
+  atomic_add(&terminator->count, count);
+}
 
-  // we want to allow access to any attributes of the isolated type itself
-  if (PyObject_HasAttr((PyObject *)isolated_type, attr_name))
+static int Terminator_decrement(Terminator *terminator)
+{
+  if (atomic_decrement(&terminator->count) == 0LL)
   {
-    return PyObject_GenericGetAttr(self, attr_name);
+    Event_set(&terminator->set);
+    // the main interpreter may be parked on the queue
+    return PCQueue_notify_all(work_queue);
   }
 
-  // now we check for the region tag
-  RegionTagObject *region_tag = get_tag(self, true);
-  VPY_CHECKREGION(region_tag, NULL);
-  RegionObject *region = region_tag->region;
+  return 0;
+}
 
-  if (strcmp(PyUnicode_AsUTF8(attr_name), "__region__") == 0)
+static int main_worker_run();
+
+// GIL must be held
+static int Terminator_wait(Terminator *terminator)
+{
+  int rc;
+
+  PRINTDBG("Terminator_wait\n");
+
+  rc = Terminator_decrement(terminator);
+  if (rc != 0)
   {
-    // this is a special attribute, which does not require the
-    // region to be open
-    result = (PyObject *)region_tag;
+    PyErr_SetString(PyExc_RuntimeError, "Unable to decrement terminator");
+    return rc;
   }
-  else if (region->is_open)
+
+  if (main_worker)
   {
-    self->ob_type = type;
-    result = PyObject_GenericGetAttr(self, attr_name);
-    self->ob_type = isolated_type;
+    rc = main_worker_run();
+    if (rc != 0)
+    {
+      return rc;
+    }
   }
-  else
+
+  Py_BEGIN_ALLOW_THREADS
+  if (Event_wait(&terminator->set))
   {
-    PyErr_SetString(RegionIsolationError, "Region is not open");
-    result = NULL;
+    atomic_increment(&parks_terminator);
   }
+  Py_END_ALLOW_THREADS
 
-  return result;
+  PRINTDBG("All work complete.\n");
+
+  return 0;
 }
 
-static int Isolated_setattro(PyObject *self, PyObject *attr_name,
-                             PyObject *arg0)
+static void Request_init(Request *self, RegionObject *region, Py_ssize_t index, bool read, Behavior *behavior);
+static void Request_free(Request *self);
+static int Request_release(Request *self);
+static int Request_start_enqueue(Request *self);
+static void Request_finish_enqueue(Request *self);
+static int Request_compare(const void *lhs, const void *rhs);
+
+/** Returns the behavior pool of the calling thread's interpreter. */
+static BehaviorPool *BehaviorPool_local()
 {
-  int rc;
+  return local_pool != NULL ? local_pool : &main_pool;
+}
 
-  PyTypeObject *isolated_type = Py_TYPE(self);
-  PyTypeObject *type = get_type(isolated_type);
-  VPY_CHECKTYPE(type, -1);
-  RegionObject *region = get_region(self);
-  VPY_CHECKREGION(region, -1);
+static void BehaviorPool_init(BehaviorPool *pool)
+{
+  pool->returned = (voidptr_t)NULL;
+  pool->free = NULL;
+  pool->free_length = 0;
+}
 
-  if (strcmp(PyUnicode_AsUTF8(attr_name), "__region__") == 0)
+// this must be called while holding the owner's GIL
+static void Behavior_free(Behavior *self)
+{
+  BehaviorPool *pool;
+  Py_ssize_t i;
+  Request *r;
+
+  PRINTDBG("Behavior_free %p\n", self);
+  PackedArgs_release(self->args);
+  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Cannot override region");
-    return -1;
+    Request_free(r);
   }
 
-  if (!region->is_open)
+  if (self->requests != self->inline_requests)
   {
-    PyErr_SetString(RegionIsolationError, "Region is not open");
-    return -1;
+    free(self->requests);
   }
 
-  VPY_CHECKARG0REGION(-1);
+  pool = self->owner;
+  if (pool->free_length < BEHAVIOR_POOL_CAPACITY)
+  {
+    self->next = pool->free;
+    pool->free = self;
+    pool->free_length += 1;
+    return;
+  }
 
-  self->ob_type = type;
-  rc = PyObject_GenericSetAttr(self, attr_name, arg0);
-  self->ob_type = isolated_type;
-  return rc;
+  free(self);
 }
 
-VPY_LENFUNC(tp_as_mapping, mp_length)
-VPY_BINARYFUNC(tp_as_mapping, mp_subscript)
-VPY_OBJOBJARGPROC(tp_as_mapping, mp_ass_subscript);
-VPY_LENFUNC(tp_as_sequence, sq_length);
-VPY_BINARYFUNC(tp_as_sequence, sq_concat);
-VPY_SSIZEARGFUNC(tp_as_sequence, sq_repeat);
-VPY_SSIZEARGFUNC(tp_as_sequence, sq_item);
-VPY_SSIZEOBJARGPROC(tp_as_sequence, sq_ass_item);
-VPY_OBJOBJPROC(tp_as_sequence, sq_contains);
-VPY_BINARYFUNC(tp_as_sequence, sq_inplace_concat);
-VPY_SSIZEARGFUNC(tp_as_sequence, sq_inplace_repeat);
-VPY_BINARYFUNC(tp_as_number, nb_add);
-VPY_BINARYFUNC(tp_as_number, nb_subtract);
-VPY_BINARYFUNC(tp_as_number, nb_multiply);
-VPY_BINARYFUNC(tp_as_number, nb_remainder);
-VPY_BINARYFUNC(tp_as_number, nb_divmod);
-VPY_TERNARYFUNC(tp_as_number, nb_power);
-VPY_UNARYFUNC(tp_as_number, nb_negative);
-VPY_UNARYFUNC(tp_as_number, nb_positive);
-VPY_UNARYFUNC(tp_as_number, nb_absolute);
-VPY_INQUIRY(tp_as_number, nb_bool);
-VPY_UNARYFUNC(tp_as_number, nb_invert);
-VPY_BINARYFUNC(tp_as_number, nb_lshift);
-VPY_BINARYFUNC(tp_as_number, nb_rshift);
-VPY_BINARYFUNC(tp_as_number, nb_and);
-VPY_BINARYFUNC(tp_as_number, nb_xor);
-VPY_BINARYFUNC(tp_as_number, nb_or);
-VPY_UNARYFUNC(tp_as_number, nb_int);
-VPY_UNARYFUNC(tp_as_number, nb_float);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_add);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_subtract);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_multiply);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_remainder);
-VPY_TERNARYFUNC(tp_as_number, nb_inplace_power);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_lshift);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_rshift);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_and);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_xor);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_or);
-VPY_BINARYFUNC(tp_as_number, nb_floor_divide);
-VPY_BINARYFUNC(tp_as_number, nb_true_divide);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_floor_divide);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_true_divide);
-VPY_UNARYFUNC(tp_as_number, nb_index);
-VPY_BINARYFUNC(tp_as_number, nb_matrix_multiply);
-VPY_BINARYFUNC(tp_as_number, nb_inplace_matrix_multiply);
-
-static Py_ssize_t ssize_length(Py_ssize_t value)
+/**
+ * Frees the behaviors which other interpreters have handed back to the pool.
+ * This must be called while holding the owner's GIL.
+ */
+static void BehaviorPool_collect(BehaviorPool *pool)
 {
-  if (value < 10)
-  {
-    return 1;
-  }
+  Behavior *b, *next;
 
-  if (value < 100)
+  if (atomic_load_ptr(&pool->returned) == (voidptr_t)NULL)
   {
-    return 2;
+    return;
   }
 
-  if (value < 1000)
+  b = (Behavior *)atomic_exchange_ptr(&pool->returned, (voidptr_t)NULL);
+  while (b != NULL)
   {
-    return 3;
+    next = b->next;
+    Behavior_free(b);
+    b = next;
   }
+}
 
-  Py_ssize_t length = 3;
-  value /= 1000;
-  do
+/** Releases the memory held by the free list of the pool. */
+static void BehaviorPool_clear(BehaviorPool *pool)
+{
+  Behavior *b;
+
+  while (pool->free != NULL)
   {
-    ++length;
-    value /= 10;
-  } while (value != 0);
+    b = pool->free;
+    pool->free = b->next;
+    free(b);
+  }
 
-  return length;
+  pool->free_length = 0;
 }
 
 /**
- * This is an attempt at making an object deeply immortal, but it does not quite work
- * for objects which contain callables, notably type objects, as it will not make the
- * objects referenced within them immortal (e.g. calls to built-ins)
+ * Called once a behavior has run and released all of its requests. The
+ * behavior is freed straight away if the calling interpreter owns it, and is
+ * otherwise handed back to its owner. This must be called while holding the
+ * GIL.
  */
-static int make_immortal(PyObject *obj)
+static void Behavior_finish(Behavior *self)
 {
-  Py_SET_REFCNT(obj, _Py_IMMORTAL_REFCNT);
+  BehaviorPool *pool = self->owner;
+  voidptr_t head;
 
-  PyObject **dict_ptr = _PyObject_GetDictPtr(obj);
-  if (dict_ptr == NULL)
+  if (pool == BehaviorPool_local())
   {
-    return 0;
+    Behavior_free(self);
+    return;
   }
 
-  PyObject *dict = *dict_ptr;
-  if (dict == NULL)
+  head = atomic_load_ptr(&pool->returned);
+  do
   {
-    return 0;
-  }
+    self->next = (Behavior *)head;
+  } while (!atomic_compare_exchange_ptr(&pool->returned, &head, (voidptr_t)self));
+}
 
-  PyObject *keys = PyDict_Keys(dict);
-  if (keys == NULL)
+// this must be called while holding the GIL
+static Behavior *Behavior_new(CodeBlob *code, PyObject *const *regions, Py_ssize_t length, PackedArgs *args)
+{
+  Py_ssize_t i;
+  Request *r;
+  Behavior *b;
+  BehaviorPool *pool = BehaviorPool_local();
+
+  BehaviorPool_collect(pool);
+
+  if (pool->free != NULL)
   {
-    return -1;
+    b = pool->free;
+    pool->free = b->next;
+    pool->free_length -= 1;
+  }
+  else
+  {
+    b = (Behavior *)malloc(sizeof(Behavior));
+    if (b == NULL)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to allocate behavior");
+      return NULL;
+    }
   }
 
-  Py_ssize_t length = PyList_Size(keys);
-  for (Py_ssize_t i = 0; i < length; ++i)
+  b->length = length;
+  PRINTDBG("Behavior_new %p r#: %li\n", b, b->length);
+  b->count = b->length + 1;
+  b->owner = pool;
+  b->next = NULL;
+  if (b->length <= BEHAVIOR_INLINE_REQUESTS)
   {
-    PyObject *key = PyList_GetItem(keys, i);
-    if (key == NULL)
+    b->requests = b->inline_requests;
+  }
+  else
+  {
+    b->requests = (Request *)malloc(sizeof(Request) * b->length);
+    if (b->requests == NULL)
     {
-      return -1;
+      free(b);
+      PyErr_SetString(PyExc_RuntimeError, "Unable to allocate requests");
+      return NULL;
     }
+  }
 
-    PyObject *value = PyDict_GetItem(*dict_ptr, key);
-    if (value == NULL)
+  for (i = 0, r = b->requests; i < b->length; ++i, ++r)
+  {
+    if (Py_IS_TYPE(regions[i], &ReadType))
     {
-      return -1;
+      Request_init(r, ((ReadObject *)regions[i])->region, i, true, b);
+    }
+    else
+    {
+      Request_init(r, (RegionObject *)regions[i], i, false, b);
     }
+  }
 
-    if (make_immortal(value) < 0)
+  qsort(b->requests, b->length, sizeof(Request), Request_compare);
+  b->code = code;
+  b->args = args;
+  b->future = NULL;
+  b->coroutine = NULL;
+  b->awaiting = NULL;
+  b->worker = 0;
+  if (args != NULL)
+  {
+    atomic_increment(&args->refcount);
+  }
+
+  return b;
+}
+
+static int Behavior_resolve_one(Behavior *self)
+{
+  if (atomic_decrement(&self->count) != 0LL)
+  {
+    return 0;
+  }
+
+  if (local_deque != NULL && WSDeque_push(local_deque, self))
+  {
+    PRINTDBG("pushed behavior onto local deque\n");
+    return PCQueue_notify(work_queue);
+  }
+
+  PRINTDBG("enqueueing behavior\n");
+
+  return PCQueue_enqueue(work_queue, self);
+}
+
+/**
+ * Links the requests of a behavior onto the request chains of its regions.
+ * The behavior keeps one outstanding count, which the caller must resolve.
+ */
+static int Behavior_link(Behavior *self)
+{
+  int rc;
+  Py_ssize_t i;
+  Request *r;
+
+  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
+  {
+    PRINTDBG("start enqueue request %li\n", i);
+    rc = Request_start_enqueue(r);
+    if (rc != 0)
     {
       return -1;
     }
   }
 
+  for (i = 0, r = self->requests; i < self->length; ++i, ++r)
+  {
+    PRINTDBG("finish enqueue request %li\n", i);
+    Request_finish_enqueue(r);
+  }
+
   return 0;
 }
 
+static int Behavior_schedule(Behavior *self)
+{
+  // The behavior must be counted before it can be published, otherwise a
+  // worker could run it and set the terminator before it is counted.
+  Terminator_increment(terminator);
+
+  if (Behavior_link(self) != 0)
+  {
+    return -1;
+  }
+
+  return Behavior_resolve_one(self);
+}
+
 /**
- * Creates a new isolated type for the given type. The new type will wrap all of the
- * methods of the given type to enforce that the region containing an object of this
- * type is open. The resulting type will wrap a new type object that is a copy of the
- * given type object.
+ * Schedules many behaviors at once. All of them are linked before any is
+ * published, and those which are ready are then published together with a
+ * single wake-up, instead of waking a worker for each one.
  */
-static PyTypeObject *isolate_type(PyTypeObject *type)
+static int Behavior_schedule_many(Behavior **behaviors, Py_ssize_t length)
 {
-  char *name;
-  // set up all the slots
-  PyType_Slot slots[] = {
-      {Py_tp_repr, NULL},
-      {Py_tp_str, NULL},
-      {Py_tp_traverse, NULL},
-      {Py_tp_clear, NULL},
-      {Py_tp_hash, NULL},
-      {Py_tp_iter, NULL},
-      {Py_tp_iternext, NULL},
-      {Py_tp_richcompare, NULL},
-      {Py_mp_length, NULL},
-      {Py_mp_subscript, NULL},
-      {Py_mp_ass_subscript, NULL},
-      {Py_sq_length, NULL},
-      {Py_sq_concat, NULL},
-      {Py_sq_repeat, NULL},
-      {Py_sq_item, NULL},
-      {Py_sq_ass_item, NULL},
-      {Py_sq_contains, NULL},
-      {Py_sq_inplace_concat, NULL},
-      {Py_sq_inplace_repeat, NULL},
-      {Py_nb_add, NULL},
-      {Py_nb_subtract, NULL},
-      {Py_nb_multiply, NULL},
-      {Py_nb_remainder, NULL},
-      {Py_nb_divmod, NULL},
-      {Py_nb_power, NULL},
-      {Py_nb_negative, NULL},
-      {Py_nb_positive, NULL},
-      {Py_nb_absolute, NULL},
-      {Py_nb_bool, NULL},
-      {Py_nb_invert, NULL},
-      {Py_nb_lshift, NULL},
-      {Py_nb_rshift, NULL},
-      {Py_nb_and, NULL},
-      {Py_nb_xor, NULL},
-      {Py_nb_or, NULL},
-      {Py_nb_int, NULL},
-      {Py_nb_float, NULL},
-      {Py_nb_inplace_add, NULL},
-      {Py_nb_inplace_subtract, NULL},
-      {Py_nb_inplace_multiply, NULL},
-      {Py_nb_inplace_remainder, NULL},
-      {Py_nb_inplace_power, NULL},
-      {Py_nb_inplace_lshift, NULL},
-      {Py_nb_inplace_rshift, NULL},
-      {Py_nb_inplace_and, NULL},
-      {Py_nb_inplace_xor, NULL},
-      {Py_nb_inplace_or, NULL},
-      {Py_nb_floor_divide, NULL},
-      {Py_nb_true_divide, NULL},
-      {Py_nb_inplace_floor_divide, NULL},
-      {Py_nb_inplace_true_divide, NULL},
-      {Py_nb_index, NULL},
-      {Py_nb_matrix_multiply, NULL},
-      {Py_nb_inplace_matrix_multiply, NULL},
-      {Py_tp_finalize, Isolated_finalize},
-      {Py_tp_getattro, Isolated_getattro},
-      {Py_tp_setattro, Isolated_setattro},
-      {0, NULL} /* Sentinel */
-  };
+  Py_ssize_t i, ready_length = 0;
+  Behavior *ready = NULL, *b;
+  Behavior **tail = &ready;
 
-  const int num_tp_slots = 8;
-  const int num_mp_slots = 3;
-  const int num_sq_slots = 8;
+  Terminator_add(terminator, length);
 
-  if (type->tp_repr != NULL)
+  for (i = 0; i < length; ++i)
   {
-    slots[0].pfunc = Isolated_repr;
+    b = behaviors[i];
+    if (Behavior_link(b) != 0)
+    {
+      return -1;
+    }
+
+    // once linked, only this thread or the release of a request on another
+    // thread can make the behavior ready
+    if (atomic_decrement(&b->count) == 0LL)
+    {
+      *tail = b;
+      tail = &b->next;
+      ready_length += 1;
+    }
   }
-  if (type->tp_str != NULL)
+
+  *tail = NULL;
+
+  while (ready != NULL)
   {
-    slots[1].pfunc = Isolated_str;
+    b = ready;
+    ready = b->next;
+    if (local_deque != NULL && WSDeque_push(local_deque, b))
+    {
+      continue;
+    }
+
+    if (PCQueue_push(work_queue, b) != 0)
+    {
+      return -1;
+    }
   }
-  if (type->tp_traverse != NULL)
+
+  if (ready_length == 1)
   {
-    // slots[2].pfunc = Isolated_traverse;
+    return PCQueue_notify(work_queue);
   }
-  if (type->tp_clear != NULL)
+
+  // see PCQueue_notify
+  atomic_fence();
+  if (ready_length == 0 || atomic_load_llong(&work_queue->sleepers) == 0)
   {
-    // slots[3].pfunc = Isolated_clear;
+    return 0;
   }
-  if (type->tp_hash != NULL)
+
+  return PCQueue_notify_all(work_queue);
+}
+
+// this must be called while holding the GIL
+static void Request_init(Request *self, RegionObject *region, Py_ssize_t index, bool read, Behavior *behavior)
+{
+  self->next = NULL;
+  Event_init(&self->linked);
+  Event_init(&self->scheduled);
+  Py_INCREF(region);
+  self->target = region;
+  self->index = index;
+  self->behavior = behavior;
+  self->read = read;
+  self->handoff = HANDOFF_NONE;
+}
+
+/**
+ * Orders requests by the ID of the region they capture, so that behaviors
+ * always enqueue on regions in the same order. Requests for the same region
+ * keep the order of the thunk's arguments.
+ */
+static int Request_compare(const void *lhs, const void *rhs)
+{
+  const Request *a = (const Request *)lhs;
+  const Request *b = (const Request *)rhs;
+  long long a_id = resolve_region(a->target)->id;
+  long long b_id = resolve_region(b->target)->id;
+
+  if (a_id != b_id)
   {
-    slots[4].pfunc = Isolated_hash;
+    return a_id < b_id ? -1 : 1;
   }
-  if (type->tp_iter != NULL)
+
+  return a->index < b->index ? -1 : (a->index > b->index ? 1 : 0);
+}
+
+// this must be called while holding the GIL
+static void Request_free(Request *self)
+{
+  Py_DECREF(self->target);
+}
+
+/**
+ * Called when it is the request's turn on its region. A read request is
+ * granted straight away. A write request must also wait for any readers
+ * before it to finish: it waits in the region's writer slot, and whichever
+ * of it and the last reader sees the other takes it back out and grants it.
+ */
+static int Request_acquire(Request *self)
+{
+  RegionObject *region = self->target;
+  voidptr_t expected = (voidptr_t)self;
+
+  if (self->read)
   {
-    slots[5].pfunc = Isolated_iter;
+    atomic_increment(&region->readers);
+    return Behavior_resolve_one(self->behavior);
   }
-  if (type->tp_iternext != NULL)
+
+  // readers before this request are counted before it gets its turn, so if
+  // there are none now then there are none to wait for
+  if (atomic_load_llong(&region->readers) == 0)
   {
-    slots[6].pfunc = Isolated_iternext;
+    return Behavior_resolve_one(self->behavior);
   }
-  if (type->tp_richcompare != NULL)
+
+  atomic_store_ptr(&region->writer, (voidptr_t)self);
+  atomic_fence();
+  if (atomic_load_llong(&region->readers) == 0 &&
+      atomic_compare_exchange_ptr(&region->writer, &expected, (voidptr_t)NULL))
   {
-    slots[7].pfunc = Isolated_richcompare;
+    return Behavior_resolve_one(self->behavior);
   }
 
-  if (type->tp_as_mapping != NULL)
+  return 0;
+}
+
+/**
+ * Called by a read request once its behavior has started (and it is safe for
+ * others to read the region), to give the next request its turn as well.
+ */
+static int Request_share(Request *self)
+{
+  if (atomic_exchange_int(&self->handoff, HANDOFF_TURN) == HANDOFF_LINKED)
   {
-    PyMappingMethods *mp_methods = type->tp_as_mapping;
-    PyType_Slot *mp_slots = slots + num_tp_slots;
-    if (mp_methods->mp_length != NULL)
-    {
-      mp_slots[0].pfunc = Isolated_mp_length;
-    }
-    if (mp_methods->mp_subscript != NULL)
-    {
-      mp_slots[1].pfunc = Isolated_mp_subscript;
-    }
-    if (mp_methods->mp_ass_subscript != NULL)
-    {
-      mp_slots[2].pfunc = Isolated_mp_ass_subscript;
-    }
+    return Request_acquire(self->next);
   }
 
-  if (type->tp_as_sequence != NULL)
+  return 0;
+}
+
+static int Request_release(Request *self)
+{
+  int rc = 0;
+  voidptr_t writer;
+  voidptr_t self_ptr = (voidptr_t)self;
+
+  if (self->read && atomic_decrement(&self->target->readers) == 0LL)
   {
-    PySequenceMethods *sq_methods = type->tp_as_sequence;
-    PyType_Slot *sq_slots = slots + num_tp_slots + num_mp_slots;
-    if (sq_methods->sq_length != NULL)
-    {
-      sq_slots[0].pfunc = Isolated_sq_length;
-    }
-    if (sq_methods->sq_concat != NULL)
-    {
-      sq_slots[1].pfunc = Isolated_sq_concat;
-    }
-    if (sq_methods->sq_repeat != NULL)
-    {
-      sq_slots[2].pfunc = Isolated_sq_repeat;
-    }
-    if (sq_methods->sq_item != NULL)
-    {
-      sq_slots[3].pfunc = Isolated_sq_item;
-    }
-    if (sq_methods->sq_ass_item != NULL)
-    {
-      sq_slots[4].pfunc = Isolated_sq_ass_item;
-    }
-    if (sq_methods->sq_contains != NULL)
-    {
-      sq_slots[5].pfunc = Isolated_sq_contains;
-    }
-    if (sq_methods->sq_inplace_concat != NULL)
+    writer = atomic_exchange_ptr(&self->target->writer, (voidptr_t)NULL);
+    if (writer != (voidptr_t)NULL)
     {
-      sq_slots[6].pfunc = Isolated_sq_inplace_concat;
-    }
-    if (sq_methods->sq_inplace_repeat != NULL)
-    {
-      sq_slots[7].pfunc = Isolated_sq_inplace_repeat;
+      PRINTDBG("Last reader granting waiting writer\n");
+      rc = Behavior_resolve_one(((Request *)writer)->behavior);
     }
   }
 
-  if (type->tp_as_number != NULL)
+  if (!Event_is_set(&self->linked))
   {
-    PyNumberMethods *nb_methods = type->tp_as_number;
-    PyType_Slot *nb_slots = slots + num_tp_slots + num_mp_slots + num_sq_slots;
-    if (nb_methods->nb_add != NULL)
-    {
-      nb_slots[0].pfunc = Isolated_nb_add;
-    }
-    if (nb_methods->nb_subtract != NULL)
-    {
-      nb_slots[1].pfunc = Isolated_nb_subtract;
-    }
-    if (nb_methods->nb_multiply != NULL)
-    {
-      nb_slots[2].pfunc = Isolated_nb_multiply;
-    }
-    if (nb_methods->nb_remainder != NULL)
-    {
-      nb_slots[3].pfunc = Isolated_nb_remainder;
-    }
-    if (nb_methods->nb_divmod != NULL)
-    {
-      nb_slots[4].pfunc = Isolated_nb_divmod;
-    }
-    if (nb_methods->nb_power != NULL)
-    {
-      nb_slots[5].pfunc = Isolated_nb_power;
-    }
-    if (nb_methods->nb_negative != NULL)
-    {
-      nb_slots[6].pfunc = Isolated_nb_negative;
-    }
-    if (nb_methods->nb_positive != NULL)
-    {
-      nb_slots[7].pfunc = Isolated_nb_positive;
-    }
-    if (nb_methods->nb_absolute != NULL)
-    {
-      nb_slots[8].pfunc = Isolated_nb_absolute;
-    }
-    if (nb_methods->nb_bool != NULL)
-    {
-      nb_slots[9].pfunc = Isolated_nb_bool;
-    }
-    if (nb_methods->nb_invert != NULL)
-    {
-      nb_slots[10].pfunc = Isolated_nb_invert;
-    }
-    if (nb_methods->nb_lshift != NULL)
-    {
-      nb_slots[11].pfunc = Isolated_nb_lshift;
-    }
-    if (nb_methods->nb_rshift != NULL)
-    {
-      nb_slots[12].pfunc = Isolated_nb_rshift;
-    }
-    if (nb_methods->nb_and != NULL)
-    {
-      nb_slots[13].pfunc = Isolated_nb_and;
-    }
-    if (nb_methods->nb_xor != NULL)
-    {
-      nb_slots[14].pfunc = Isolated_nb_xor;
-    }
-    if (nb_methods->nb_or != NULL)
-    {
-      nb_slots[15].pfunc = Isolated_nb_or;
-    }
-    if (nb_methods->nb_int != NULL)
-    {
-      nb_slots[16].pfunc = Isolated_nb_int;
-    }
-    if (nb_methods->nb_float != NULL)
-    {
-      nb_slots[17].pfunc = Isolated_nb_float;
-    }
-    if (nb_methods->nb_inplace_add != NULL)
-    {
-      nb_slots[18].pfunc = Isolated_nb_inplace_add;
-    }
-    if (nb_methods->nb_inplace_subtract != NULL)
+    if (atomic_compare_exchange_ptr(&self->target->last, &self_ptr, (voidptr_t)NULL))
     {
-      nb_slots[19].pfunc = Isolated_nb_inplace_subtract;
+      PRINTDBG("No next request\n");
+      return rc;
     }
-    if (nb_methods->nb_inplace_multiply != NULL)
+
+    PRINTDBG("Waiting for next request to be set\n");
+    if (Event_wait(&self->linked))
     {
-      nb_slots[20].pfunc = Isolated_nb_inplace_multiply;
+      atomic_increment(&parks_linked);
     }
-    if (nb_methods->nb_inplace_remainder != NULL)
+  }
+
+  if (self->read)
+  {
+    // the turn has already been passed on (see Request_share)
+    return rc;
+  }
+
+  PRINTDBG("Resolving next request\n");
+  return Request_acquire(self->next);
+}
+
+static int Request_start_enqueue(Request *self)
+{
+  Request *prev;
+  bool shared;
+  voidptr_t prev_ptr = atomic_exchange_ptr(&self->target->last, (voidptr_t)self);
+  if (prev_ptr == (voidptr_t)NULL)
+  {
+    PRINTDBG("No previous request\n");
+    return Request_acquire(self);
+  }
+
+  prev = (Request *)prev_ptr;
+
+  // Wait for the previous behavior to be fully scheduled before linking to
+  // it. Until linked is set the previous request cannot complete its release,
+  // but once it is set the previous behavior may finish and be freed at any
+  // moment, so it must not be touched again.
+  if (Event_wait(&prev->scheduled))
+  {
+    atomic_increment(&parks_scheduled);
+  }
+
+  prev->next = self;
+  shared = prev->read && atomic_exchange_int(&prev->handoff, HANDOFF_LINKED) == HANDOFF_TURN;
+  Event_set(&prev->linked);
+  if (shared)
+  {
+    // the previous reader has already started, so this request has its turn
+    return Request_acquire(self);
+  }
+
+  return 0;
+}
+
+static void Request_finish_enqueue(Request *self)
+{
+  Event_set(&self->scheduled);
+}
+
+static PyObject *pack_args(PyObject *const *args, Py_ssize_t nargs);
+static int pack_shared_args(PyObject *func, PyObject *const *args, Py_ssize_t nargs,
+                            PackedArgs **packed);
+
+static Future *Future_new()
+{
+  Future *future = (Future *)malloc(sizeof(Future));
+  if (future == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate future");
+    return NULL;
+  }
+
+  // one reference for the behavior and one for the future object
+  future->refcount = 2;
+  Event_init(&future->done);
+  future->value = NULL;
+  future->value_size = 0;
+  future->shared = NULL;
+  future->kind = FUTURE_MARSHALLED;
+  future->count = 0;
+  future->error = NULL;
+  future->error_number = 0;
+  future->watch = FUTURE_UNWATCHED;
+  future->notifier = NULL;
+  future->waiter = NULL;
+  future->behavior = NULL;
+  future->next = NULL;
+  return future;
+}
+
+static void Future_release(Future *self)
+{
+  if (atomic_decrement(&self->refcount) != 0LL)
+  {
+    return;
+  }
+
+  free(self->value);
+  free(self->error);
+  free(self);
+}
+
+/**
+ * Stores the value returned by a behavior. Regions are handed over as they
+ * are, and must be free. Anything else must be immutable, and is packed in
+ * the same way as behavior arguments. This must be called while holding the
+ * GIL of the interpreter which ran the behavior.
+ */
+static int Future_set_result(Future *self, PyObject *result)
+{
+  RegionObject *region;
+  PyObject *data;
+
+  if (result == Py_None)
+  {
+    return 0;
+  }
+
+  if (Region_Check(result))
+  {
+    region = resolve_region((RegionObject *)result);
+    if (!is_free(region))
     {
-      nb_slots[21].pfunc = Isolated_nb_inplace_remainder;
+      PyErr_SetString(RegionIsolationError, "Returned region must be free");
+      return -1;
     }
-    if (nb_methods->nb_inplace_power != NULL)
+
+    if (region->is_open && !region->is_shared)
     {
-      nb_slots[22].pfunc = Isolated_nb_inplace_power;
+      PyErr_SetString(RegionIsolationError, "Returned region must be closed");
+      return -1;
     }
-    if (nb_methods->nb_inplace_lshift != NULL)
-    {
-      nb_slots[23].pfunc = Isolated_nb_inplace_lshift;
+
+    // regions are immortal
+    self->shared = result;
+    return 0;
+  }
+
+  if (!is_imm(result))
+  {
+    PyErr_SetString(RegionIsolationError, "Behavior results must be immutable or a region");
+    return -1;
+  }
+
+  data = pack_args(&result, 1);
+  if (data == NULL)
+  {
+    return -1;
+  }
+
+  self->value_size = PyBytes_GET_SIZE(data);
+  self->value = (char *)malloc(self->value_size);
+  if (self->value == NULL)
+  {
+    Py_DECREF(data);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate behavior result");
+    return -1;
+  }
+
+  memcpy(self->value, PyBytes_AS_STRING(data), self->value_size);
+  Py_DECREF(data);
+  return 0;
+}
+
+/** Records that the behavior failed, in the form used by `wait`. */
+static void Future_set_error(Future *self, const char *name, const char *msg)
+{
+  size_t length = strlen(name) + (msg != NULL ? strlen(msg) + 2 : 0) + 1;
+
+  free(self->error);
+  self->error = (char *)malloc(length);
+  if (self->error == NULL)
+  {
+    return;
+  }
+
+  if (msg != NULL)
+  {
+    snprintf(self->error, length, "%s: %s", name, msg);
+  }
+  else
+  {
+    strcpy(self->error, name);
+  }
+}
+
+#ifndef _WIN32
+/**
+ * Opens a descriptor which can be signalled from any thread (an eventfd, or
+ * a pipe elsewhere). Both ends are non-blocking, and are the same descriptor
+ * for an eventfd. Returns -1 and sets errno on failure.
+ */
+static int signal_open(int fds[2])
+{
+#ifdef __linux__
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return fds[0] < 0 ? -1 : 0;
+#else
+  if (pipe(fds) != 0)
+  {
+    return -1;
+  }
+
+  if (fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 ||
+      fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  return 0;
+#endif
+}
+
+/** Signals a descriptor opened by signal_open. */
+static void signal_raise(int write_fd)
+{
+  ssize_t written;
+#ifdef __linux__
+  uint64_t signal = 1;
+#else
+  char signal = 0;
+#endif
+
+  // a full pipe is already readable, so a failed write can be ignored
+  written = write(write_fd, &signal, sizeof(signal));
+  (void)written;
+}
+
+/** Clears the signal of a descriptor opened by signal_open. */
+static void signal_clear(int read_fd)
+{
+#ifdef __linux__
+  uint64_t signal;
+#else
+  char signal[64];
+#endif
+
+  while (read(read_fd, &signal, sizeof(signal)) > 0)
+  {
+  }
+}
+
+/** Closes a descriptor opened by signal_open. */
+static void signal_close(int fds[2])
+{
+  close(fds[0]);
+  if (fds[1] != fds[0])
+  {
+    close(fds[1]);
+  }
+}
+
+static Notifier *Notifier_new()
+{
+  Notifier *notifier;
+  int fds[2];
+
+  notifier = (Notifier *)malloc(sizeof(Notifier));
+  if (notifier == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate notifier");
+    return NULL;
+  }
+
+  notifier->ready = (voidptr_t)NULL;
+  if (signal_open(fds) != 0)
+  {
+    free(notifier);
+    PyErr_SetFromErrno(PyExc_OSError);
+    return NULL;
+  }
+
+  notifier->read_fd = fds[0];
+  notifier->write_fd = fds[1];
+  return notifier;
+}
+
+static void Notifier_free(Notifier *self)
+{
+  int fds[2] = {self->read_fd, self->write_fd};
+  signal_close(fds);
+  free(self);
+}
+
+/** Hands a finished future over to the loop. This can be called from any thread. */
+static void Notifier_push(Notifier *self, Future *future)
+{
+  voidptr_t head = atomic_load_ptr(&self->ready);
+
+  do
+  {
+    future->next = (Future *)head;
+  } while (!atomic_compare_exchange_ptr(&self->ready, &head, (voidptr_t)future));
+
+  if (head != (voidptr_t)NULL)
+  {
+    // the loop has already been signalled, and has yet to take the stack
+    return;
+  }
+
+  signal_raise(self->write_fd);
+}
+
+/**
+ * Clears the signal and takes the futures which have finished, in the order
+ * in which they finished.
+ */
+static Future *Notifier_take(Notifier *self)
+{
+  Future *future, *next, *taken = NULL;
+
+  signal_clear(self->read_fd);
+  future = (Future *)atomic_exchange_ptr(&self->ready, (voidptr_t)NULL);
+  while (future != NULL)
+  {
+    next = future->next;
+    future->next = taken;
+    taken = future;
+    future = next;
+  }
+
+  return taken;
+}
+#endif
+
+/**
+ * Hands a suspended coroutine behavior back to the worker which runs it. This
+ * can be called from any thread.
+ */
+static int Behavior_resume(Behavior *self)
+{
+  atomic_voidptr_t *stack = resumed + self->worker;
+  voidptr_t head = atomic_load_ptr(stack);
+
+  do
+  {
+    self->next = (Behavior *)head;
+  } while (!atomic_compare_exchange_ptr(stack, &head, (voidptr_t)self));
+
+  // see PCQueue_notify
+  atomic_fence();
+  if (atomic_load_llong(&work_queue->sleepers) == 0)
+  {
+    return 0;
+  }
+
+  // the worker may be parked, and there is no way to wake just that one
+  return PCQueue_notify_all(work_queue);
+}
+
+/**
+ * Called once the behavior has released its regions. Wakes anything waiting
+ * on the future and drops the reference held by the behavior.
+ */
+static int Future_finish(Future *self)
+{
+  int rc = 0;
+
+  Event_set(&self->done);
+  if (atomic_exchange_int(&self->watch, FUTURE_FINISHED) == FUTURE_WATCHED)
+  {
+    if (self->behavior != NULL)
+    {
+      rc = Behavior_resume(self->behavior);
+    }
+#ifndef _WIN32
+    else
+    {
+      Notifier_push(self->notifier, self);
+    }
+#endif
+  }
+
+  Future_release(self);
+  return rc;
+}
+
+/**
+ * Returns the result of a finished behavior as an object of the calling
+ * interpreter, or raises the exception that the behavior raised as a
+ * WhenError (or the error of a failed I/O operation as an OSError).
+ */
+static PyObject *Future_load(Future *self)
+{
+  PyObject *value, *result;
+
+  if (self->error != NULL)
+  {
+    PyErr_SetString(WhenError, self->error);
+    return NULL;
+  }
+
+  if (self->error_number != 0)
+  {
+    errno = self->error_number;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+
+  if (self->kind == FUTURE_BYTES)
+  {
+    return PyBytes_FromStringAndSize(self->value, self->value_size);
+  }
+
+  if (self->kind == FUTURE_COUNT)
+  {
+    return PyLong_FromLongLong(self->count);
+  }
+
+  if (self->shared != NULL)
+  {
+    return Py_NewRef(self->shared);
+  }
+
+  if (self->value == NULL)
+  {
+    Py_RETURN_NONE;
+  }
+
+  value = PyMarshal_ReadObjectFromString(self->value, self->value_size);
+  if (value == NULL)
+  {
+    return NULL;
+  }
+
+  result = Py_NewRef(PyTuple_GET_ITEM(value, 0));
+  Py_DECREF(value);
+  return result;
+}
+
+/**
+ * Adds the names used by a code object (and the code nested in it) which the
+ * globals bind to modules to imports, mapped to the names of the modules.
+ */
+static int find_module_imports(PyObject *code, PyObject *globals, PyObject *imports)
+{
+  PyObject *names, *consts, *value;
+  Py_ssize_t i;
+  int rc = 0;
+
+  names = PyObject_GetAttrString(code, "co_names");
+  consts = names == NULL ? NULL : PyObject_GetAttrString(code, "co_consts");
+  if (consts == NULL)
+  {
+    Py_XDECREF(names);
+    return -1;
+  }
+
+  for (i = 0; i < PyTuple_GET_SIZE(names) && rc == 0; ++i)
+  {
+    value = PyDict_GetItemWithError(globals, PyTuple_GET_ITEM(names, i));
+    if (value != NULL && PyModule_Check(value))
+    {
+      PyObject *module_name = PyModule_GetNameObject(value);
+      rc = module_name == NULL ? -1 : PyDict_SetItem(imports, PyTuple_GET_ITEM(names, i), module_name);
+      Py_XDECREF(module_name);
+    }
+    else if (PyErr_Occurred())
+    {
+      rc = -1;
+    }
+  }
+
+  for (i = 0; i < PyTuple_GET_SIZE(consts) && rc == 0; ++i)
+  {
+    if (PyCode_Check(PyTuple_GET_ITEM(consts, i)))
+    {
+      rc = find_module_imports(PyTuple_GET_ITEM(consts, i), globals, imports);
+    }
+  }
+
+  Py_DECREF(names);
+  Py_DECREF(consts);
+  return rc;
+}
+
+/**
+ * Returns the interned code blob for a code object, marshalling it the first
+ * time it is scheduled from this interpreter. Thunks run with fresh globals,
+ * but modules imported by the defining module and used by the code (e.g. the
+ * helpers which pytest's assertion rewriting adds) are imported again for
+ * them, so the names of these are shipped with the code.
+ */
+static CodeBlob *get_code_blob(PyObject *code, PyObject *globals)
+{
+  PyObject *address, *data, *imports, *shipped;
+  CodeBlob *blob;
+
+  address = PyDict_GetItemWithError(vpy_state->code_blobs, code);
+  if (address != NULL)
+  {
+    return (CodeBlob *)PyLong_AsVoidPtr(address);
+  }
+
+  if (PyErr_Occurred())
+  {
+    return NULL;
+  }
+
+  imports = PyDict_New();
+  if (imports == NULL || find_module_imports(code, globals, imports) < 0)
+  {
+    Py_XDECREF(imports);
+    return NULL;
+  }
+
+  if (PyDict_GET_SIZE(imports) == 0)
+  {
+    shipped = Py_NewRef(code);
+  }
+  else
+  {
+    PyObject *items = PyDict_Items(imports);
+    PyObject *pairs = items == NULL ? NULL : PySequence_Tuple(items);
+    shipped = pairs == NULL ? NULL : PyTuple_Pack(2, code, pairs);
+    Py_XDECREF(items);
+    Py_XDECREF(pairs);
+  }
+
+  Py_DECREF(imports);
+  if (shipped == NULL)
+  {
+    return NULL;
+  }
+
+  data = PyMarshal_WriteObjectToString(shipped, Py_MARSHAL_VERSION);
+  Py_DECREF(shipped);
+  if (data == NULL)
+  {
+    return NULL;
+  }
+
+  blob = CodeBlob_intern(PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+  Py_DECREF(data);
+  if (blob == NULL)
+  {
+    return NULL;
+  }
+
+  address = PyLong_FromVoidPtr(blob);
+  if (address == NULL || PyDict_SetItem(vpy_state->code_blobs, code, address) < 0)
+  {
+    Py_XDECREF(address);
+    return NULL;
+  }
+
+  Py_DECREF(address);
+  return blob;
+}
+
+/**
+ * Imports the modules shipped with a code object into a dictionary, which is
+ * copied to make the globals of each call. A module which cannot be imported
+ * here is left out, so that the thunk only fails if it uses it.
+ */
+static PyObject *import_modules(PyObject *pairs)
+{
+  PyObject *modules, *module;
+  Py_ssize_t i;
+
+  modules = PyDict_New();
+  for (i = 0; modules != NULL && i < PyTuple_GET_SIZE(pairs); ++i)
+  {
+    PyObject *pair = PyTuple_GET_ITEM(pairs, i);
+    module = PyImport_Import(PyTuple_GET_ITEM(pair, 1));
+    if (module == NULL)
+    {
+      PyErr_Clear();
+      continue;
+    }
+
+    if (PyDict_SetItem(modules, PyTuple_GET_ITEM(pair, 0), module) < 0)
+    {
+      Py_CLEAR(modules);
+    }
+
+    Py_DECREF(module);
+  }
+
+  return modules;
+}
+
+/**
+ * Returns the code object for a code blob (as a borrowed reference),
+ * unmarshalling it the first time the blob is run on this interpreter. Sets
+ * modules to the modules to be placed in the globals of each call (borrowed),
+ * or to NULL if there are none.
+ */
+static PyObject *load_code(CodeBlob *blob, PyObject **modules)
+{
+  PyObject *key, *entry, *address, *code, *shipped;
+
+  key = PyLong_FromUnsignedLongLong(blob->hash);
+  if (key == NULL)
+  {
+    return NULL;
+  }
+
+  entry = PyDict_GetItemWithError(vpy_state->code_cache, key);
+  if (entry != NULL && PyLong_AsVoidPtr(PyTuple_GET_ITEM(entry, 0)) == blob)
+  {
+    Py_DECREF(key);
+    *modules = PyTuple_GET_ITEM(entry, 2) == Py_None ? NULL : PyTuple_GET_ITEM(entry, 2);
+    return PyTuple_GET_ITEM(entry, 1);
+  }
+
+  if (PyErr_Occurred())
+  {
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  shipped = PyMarshal_ReadObjectFromString(blob->data, blob->size);
+  if (shipped == NULL)
+  {
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  if (PyTuple_Check(shipped))
+  {
+    code = Py_NewRef(PyTuple_GET_ITEM(shipped, 0));
+    *modules = import_modules(PyTuple_GET_ITEM(shipped, 1));
+  }
+  else
+  {
+    code = Py_NewRef(shipped);
+    *modules = Py_NewRef(Py_None);
+  }
+
+  Py_DECREF(shipped);
+  if (*modules == NULL)
+  {
+    Py_DECREF(code);
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  address = PyLong_FromVoidPtr(blob);
+  entry = address == NULL ? NULL : PyTuple_Pack(3, address, code, *modules);
+  Py_XDECREF(address);
+  Py_DECREF(code);
+  Py_DECREF(*modules);
+  if (entry == NULL || PyDict_SetItem(vpy_state->code_cache, key, entry) < 0)
+  {
+    Py_XDECREF(entry);
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  Py_DECREF(entry);
+  Py_DECREF(key);
+  if (*modules == Py_None)
+  {
+    *modules = NULL;
+  }
+
+  return code;
+}
+
+/**
+ * Creates the closure of a thunk from the values it captured, which are
+ * passed ahead of its arguments.
+ */
+static PyObject *make_closure(PyObject *extra, Py_ssize_t nfree)
+{
+  PyObject *closure, *cell;
+
+  closure = PyTuple_New(nfree);
+  if (closure == NULL)
+  {
+    return NULL;
+  }
+
+  for (Py_ssize_t i = 0; i < nfree; ++i)
+  {
+    cell = PyCell_New(PyTuple_GET_ITEM(extra, i));
+    if (cell == NULL)
+    {
+      Py_DECREF(closure);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(closure, i, cell);
+  }
+
+  return closure;
+}
+
+/**
+ * Calls the thunk of a behavior with its regions, in the order they were
+ * given to `when`, followed by its immutable arguments. Each call gets fresh
+ * globals (holding only the modules shipped with the code), so behaviors
+ * cannot share state through them, and fresh cells holding copies of the
+ * values it captured from enclosing scopes.
+ */
+static PyObject *call_thunk(Behavior *b)
+{
+  Py_ssize_t i;
+  Request *r;
+  PyObject *code, *modules, *globals, *thunk, *result, *extra = NULL, *closure = NULL;
+  PyObject *inline_args[BEHAVIOR_INLINE_REQUESTS];
+  PyObject **args = inline_args;
+  Py_ssize_t nargs = b->length;
+  Py_ssize_t nfree;
+
+  code = load_code(b->code, &modules);
+  if (code == NULL)
+  {
+    return NULL;
+  }
+
+  nfree = PyCode_GetNumFree((PyCodeObject *)code);
+  if (b->args != NULL)
+  {
+    extra = PyMarshal_ReadObjectFromString(b->args->data, b->args->size);
+    if (extra == NULL)
+    {
+      return NULL;
+    }
+
+    nargs += PyTuple_GET_SIZE(extra) - nfree;
+  }
+
+  if (nfree > 0)
+  {
+    closure = extra == NULL ? NULL : make_closure(extra, nfree);
+    if (closure == NULL)
+    {
+      if (!PyErr_Occurred())
+      {
+        PyErr_SetString(PyExc_RuntimeError, "Thunk is missing its captured values");
+      }
+
+      Py_XDECREF(extra);
+      return NULL;
+    }
+  }
+
+  if (nargs > BEHAVIOR_INLINE_REQUESTS)
+  {
+    args = (PyObject **)PyMem_Malloc(sizeof(PyObject *) * nargs);
+    if (args == NULL)
+    {
+      Py_XDECREF(closure);
+      Py_XDECREF(extra);
+      return PyErr_NoMemory();
+    }
+  }
+
+  for (i = 0, r = b->requests; i < b->length; ++i, ++r)
+  {
+    args[r->index] = (PyObject *)r->target;
+  }
+
+  for (i = b->length; i < nargs; ++i)
+  {
+    args[i] = PyTuple_GET_ITEM(extra, i - b->length + nfree);
+  }
+
+  globals = modules == NULL ? PyDict_New() : PyDict_Copy(modules);
+  thunk = globals == NULL ? NULL : PyFunction_New(code, globals);
+  if (thunk != NULL && closure != NULL && PyFunction_SetClosure(thunk, closure) < 0)
+  {
+    Py_CLEAR(thunk);
+  }
+
+  result = thunk == NULL ? NULL : PyObject_Vectorcall(thunk, args, nargs, NULL);
+  Py_XDECREF(thunk);
+  Py_XDECREF(globals);
+  Py_XDECREF(closure);
+  Py_XDECREF(extra);
+
+  if (args != inline_args)
+  {
+    PyMem_Free(args);
+  }
+
+  return result;
+}
+
+/**
+ * Records the current exception so that it is raised by `wait`, and by the
+ * future of the behavior (if there is one).
+ */
+static void record_exception(Future *future)
+{
+  PyObject *err_type, *err_value, *err_traceback;
+  BehaviorException *ex;
+
+  PyErr_Fetch(&err_type, &err_value, &err_traceback);
+  PyErr_NormalizeException(&err_type, &err_value, &err_traceback);
+  ex = BehaviorException_new(err_type, err_value, err_traceback);
+  if (future != NULL && ex != NULL)
+  {
+    Future_set_error(future, ex->name, ex->msg);
+  }
+}
+
+/** Worklist used to seal the object graph of a region. */
+typedef struct seal_state_s
+{
+  PyObject **stack;
+  Py_ssize_t length;
+  Py_ssize_t capacity;
+  // Objects which have already been pushed
+  ht *seen;
+} SealState;
+
+static int seal_visit(PyObject *value, void *arg)
+{
+  SealState *state = (SealState *)arg;
+  PyObject **stack;
+
+  if (value == NULL || ht_get(state->seen, (voidptr_t)value) != (voidptr_t)NULL)
+  {
+    return 0;
+  }
+
+  if (!ht_set(state->seen, (voidptr_t)value, (voidptr_t)1))
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (state->length == state->capacity)
+  {
+    stack = (PyObject **)PyMem_Realloc(state->stack, sizeof(PyObject *) * state->capacity * 2);
+    if (stack == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    state->stack = stack;
+    state->capacity *= 2;
+  }
+
+  state->stack[state->length++] = value;
+  return 0;
+}
+
+/**
+ * Whether the behavior running on this thread holds a read request on the
+ * region. A region which is open for reading is open to those behaviors
+ * alone, and is still closed to everything else running at the time.
+ */
+static bool is_read_granted(RegionObject *region)
+{
+  Behavior *b = running_behavior;
+  Py_ssize_t i;
+
+  if (b == NULL)
+  {
+    return false;
+  }
+
+  for (i = 0; i < b->length; ++i)
+  {
+    if (b->requests[i].read && resolve_region(b->requests[i].target) == region)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/** Records the reference count of an object before it is sealed. */
+static int seal_object(RegionObject *region, PyObject *value)
+{
+  SealedObject *objects;
+  Py_ssize_t capacity;
+
+  if (region->sealed_length == region->sealed_capacity)
+  {
+    capacity = region->sealed_capacity == 0 ? 64 : region->sealed_capacity * 2;
+    objects = (SealedObject *)realloc(region->sealed_objects, sizeof(SealedObject) * capacity);
+    if (objects == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    region->sealed_objects = objects;
+    region->sealed_capacity = capacity;
+  }
+
+  region->sealed_objects[region->sealed_length].object = value;
+  region->sealed_objects[region->sealed_length].refcnt = Py_REFCNT(value);
+  region->sealed_length++;
+  return 0;
+}
+
+/**
+ * Seals the object graph of a region so that read requests on several
+ * interpreters can use it at once. Everything reachable from the region is
+ * made immortal until the readers have finished, so that they do not race on
+ * reference counts, and the instance dictionaries and hashes which would
+ * otherwise be created lazily are created now. Other regions, types, modules
+ * and functions are not entered. The sealed objects are recorded in target,
+ * to be unsealed by the next writer. This must be called while the caller has
+ * the region to itself.
+ */
+static int seal_region(RegionObject *target, RegionObject *region)
+{
+  SealState state;
+  PyObject *value;
+  PyTypeObject *type;
+  int rc = 0;
+
+  state.length = 0;
+  state.capacity = 64;
+  state.stack = (PyObject **)PyMem_Malloc(sizeof(PyObject *) * state.capacity);
+  state.seen = ht_create(64, false);
+  if (state.stack == NULL || state.seen == NULL)
+  {
+    PyMem_Free(state.stack);
+    if (state.seen != NULL)
+    {
+      ht_free(state.seen);
+    }
+
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  rc = seal_visit(region->objects, &state);
+  while (rc == 0 && state.length > 0)
+  {
+    value = state.stack[--state.length];
+    type = Py_TYPE(value);
+
+    if (PyType_Check(value) || PyModule_Check(value) || Region_Check(value) ||
+        Py_IS_TYPE(value, &RegionTagType))
+    {
+      continue;
+    }
+
+    if ((PyUnicode_CheckExact(value) || PyBytes_CheckExact(value) ||
+         PyFrozenSet_CheckExact(value)) &&
+        PyObject_Hash(value) == -1)
+    {
+      rc = -1;
+      break;
+    }
+
+    if (type->tp_dictoffset != 0)
+    {
+      _PyObject_GetDictPtr(value);
+    }
+
+    // objects which are already immortal are left as they are, but the
+    // objects they refer to may not be
+    if (!_Py_IsImmortal(value))
+    {
+#ifdef VPY_SEAL_REFCNT
+      if (seal_object(target, value) < 0)
+      {
+        rc = -1;
+        break;
+      }
+
+      value->ob_refcnt = VPY_SEAL_REFCNT;
+#else
+      Py_SET_REFCNT(value, _Py_IMMORTAL_REFCNT);
+#endif
+    }
+
+    if (!PyFunction_Check(value) && PyType_IS_GC(type) && type->tp_traverse != NULL)
+    {
+      rc = type->tp_traverse(value, seal_visit, &state);
+    }
+  }
+
+  PyMem_Free(state.stack);
+  ht_free(state.seen);
+  return rc;
+}
+
+/**
+ * Gives the objects sealed for readers their own reference counts back. This
+ * is called when the region is next opened for writing, once the readers have
+ * finished. An object which one of the readers took a reference to stays
+ * immortal, as the reference may have outlived the reader (e.g. in another
+ * region), but the rest are reclaimed as usual once the writer drops them.
+ */
+static void unseal_region(RegionObject *target)
+{
+#ifdef VPY_SEAL_REFCNT
+  SealedObject *sealed;
+  Py_ssize_t i;
+
+  for (i = 0, sealed = target->sealed_objects; i < target->sealed_length; ++i, ++sealed)
+  {
+    sealed->object->ob_refcnt = sealed->object->ob_refcnt == VPY_SEAL_REFCNT ? sealed->refcnt : _Py_IMMORTAL_REFCNT;
+  }
+#endif
+
+  target->sealed_length = 0;
+  target->sealed = false;
+}
+
+/**
+ * Opens the regions of a behavior which has been granted all of its
+ * requests.
+ */
+static int open_requests(Behavior *b, bool *failed)
+{
+  Py_ssize_t i;
+  Request *r;
+
+  PRINTDBG("preparing regions...\n");
+  for (i = 0, r = b->requests; i < b->length; ++i, ++r)
+  {
+    RegionObject *region = resolve_region(r->target);
+    if (!r->read)
+    {
+      PRINTDBG("opening region %s\n", PyUnicode_AsUTF8(region->name));
+      region->is_open = true;
+      unseal_region(r->target);
+      continue;
+    }
+
+    // Readers which follow this one run alongside it, so the region must be
+    // safe to share before they get their turn.
+    PRINTDBG("opening region %s for reading\n", PyUnicode_AsUTF8(region->name));
+    if (!r->target->sealed && !*failed)
+    {
+      if (seal_region(r->target, region) < 0)
+      {
+        record_exception(b->future);
+        *failed = true;
+      }
+      else
+      {
+        r->target->sealed = true;
+      }
+    }
+
+    if (Request_share(r) != 0)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to share request");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Stores what a thunk returned in the future of the behavior, or records the
+ * exception it raised if result is NULL. Steals the reference to result.
+ */
+static void finish_thunk(Behavior *b, PyObject *result, bool *failed)
+{
+  if (result != NULL && b->future != NULL && Future_set_result(b->future, result) < 0)
+  {
+    Py_CLEAR(result);
+  }
+
+  if (result == NULL)
+  {
+    record_exception(b->future);
+    *failed = true;
+    return;
+  }
+
+  Py_DECREF(result);
+}
+
+/**
+ * Runs the coroutine of an async thunk until it returns, or until it awaits
+ * a future which has not finished yet. In that case the behavior keeps its
+ * regions, its worker moves on to other work, and the behavior is handed
+ * back to the same worker once the future has finished. Returns whether the
+ * coroutine was suspended, and otherwise sets result to what it returned
+ * (or NULL if it raised).
+ */
+static bool resume_coroutine(Behavior *b, PyObject **result)
+{
+  PySendResult status;
+  PyObject *value;
+  Future *future;
+
+  for (;;)
+  {
+    current_coroutine = b;
+    running_behavior = b;
+    status = PyIter_Send(b->coroutine, Py_None, &value);
+    running_behavior = NULL;
+    current_coroutine = NULL;
+    if (status != PYGEN_NEXT)
+    {
+      Py_CLEAR(b->coroutine);
+      *result = status == PYGEN_RETURN ? value : NULL;
+      return false;
+    }
+
+    if (!Py_IS_TYPE(value, &FutureType))
+    {
+      // only an event loop could resume the coroutine
+      Py_DECREF(value);
+      value = PyObject_CallMethod(b->coroutine, "close", NULL);
+      Py_XDECREF(value);
+      PyErr_Clear();
+      Py_CLEAR(b->coroutine);
+      PyErr_SetString(PyExc_TypeError, "Behaviors can only await veronapy futures");
+      *result = NULL;
+      return false;
+    }
+
+    // this must all be in place before the handoff, as the future may
+    // finish and resume the behavior straight away
+    future = ((FutureObject *)value)->future;
+    b->awaiting = value;
+    b->worker = local_deque - deques;
+    future->behavior = b;
+    if (atomic_exchange_int(&future->watch, FUTURE_WATCHED) != FUTURE_FINISHED)
+    {
+      return true;
+    }
+
+    Py_CLEAR(b->awaiting);
+  }
+}
+
+/**
+ * Runs a behavior on the calling thread, which must hold the GIL, and then
+ * releases its requests. Once a thunk on the thread has raised an exception
+ * (recorded in failed) the thunks of later behaviors are skipped, but their
+ * requests are still released.
+ */
+static int run_behavior(Behavior *b, bool *failed)
+{
+  int rc = 0;
+  Py_ssize_t i;
+  Request *r;
+  PyThreadState *ts;
+  PyObject *result, *closed;
+
+  PRINTDBG("received work %p\n", b);
+  if (b->coroutine != NULL)
+  {
+    PRINTDBG("resuming coroutine\n");
+    Py_CLEAR(b->awaiting);
+    if (resume_coroutine(b, &result))
+    {
+      return 0;
+    }
+
+    finish_thunk(b, result, failed);
+  }
+  else
+  {
+    rc = open_requests(b, failed);
+    if (rc != 0)
+    {
+      return rc;
+    }
+
+    if (!*failed)
+    {
+      PRINTDBG("Running thunk\n");
+      running_behavior = b;
+      result = call_thunk(b);
+      running_behavior = NULL;
+      if (result != NULL && PyCoro_CheckExact(result))
+      {
+        b->coroutine = result;
+        if (resume_coroutine(b, &result))
+        {
+          PRINTDBG("coroutine suspended\n");
+          return 0;
+        }
+      }
+
+      finish_thunk(b, result, failed);
+    }
+    else
+    {
+      PRINTDBG("Exception thrown in worker, skipping thunk\n");
+      if (b->future != NULL)
+      {
+        Future_set_error(b->future, "RuntimeError", "Behavior skipped after an earlier behavior failed on its worker");
+      }
+    }
+  }
+
+  closed = PySet_New(NULL);
+  if (closed == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate closed set");
+    return -1;
+  }
+
+  PRINTDBG("releasing requests\n");
+  for (i = 0, r = b->requests; i < b->length; ++i, ++r)
+  {
+    RegionObject *region = resolve_region(r->target);
+    PyObject* region_id = PyLong_FromLongLong(region->id);
+    if(!r->read && !PySet_Contains(closed, region_id)){
+      PRINTDBG("closing region %s\n", PyUnicode_AsUTF8(region->name));
+      region->is_open = false;
+      PySet_Add(closed, region_id);
+    }
+    Py_XDECREF(region_id);
+
+    ts = PyEval_SaveThread();
+    rc = Request_release(r);
+    PyEval_RestoreThread(ts);
+    if (rc != 0)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to release request");
+      continue;
+    }
+  }
+
+  Py_DECREF(closed);
+
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  if (b->future != NULL)
+  {
+    rc = Future_finish(b->future);
+    b->future = NULL;
+    if (rc != 0)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to resume awaiting behavior");
+      return rc;
+    }
+  }
+
+  Behavior_finish(b);
+
+  PRINTDBG("Decrementing terminator...\n");
+  rc = Terminator_decrement(terminator);
+  if (rc != 0)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to decrement terminator");
+  }
+
+  return rc;
+}
+
+/**
+ * Runs behaviors on the main interpreter until they have all completed. This
+ * is called from wait() (holding the GIL), so that the main thread shares the
+ * work rather than idling while the workers drain the queue.
+ */
+static int main_worker_run()
+{
+  int rc = 0;
+  bool failed = false;
+  Behavior *b;
+
+  PRINTDBG("main interpreter joining workers\n");
+  local_deque = deques + worker_count;
+  while (!Event_is_set(&terminator->set))
+  {
+    BehaviorPool_collect(&main_pool);
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = worker_next(worker_count, &b);
+    Py_END_ALLOW_THREADS
+
+    if (rc != 0 || b == NULL)
+    {
+      break;
+    }
+
+    rc = run_behavior(b, &failed);
+    if (rc != 0)
+    {
+      break;
+    }
+  }
+
+  local_deque = NULL;
+  return rc;
+}
+
+/** The main loop of an interpreter. Will draw work off of the queue to
+ *  perform until the system enters shutdown.
+ */
+static thrd_return_t worker(void *arg)
+{
+  int rc;
+  bool failed;
+  Py_ssize_t index;
+  PyThreadState *ts;
+  PyObject *err_type, *err_value, *err_traceback, *veronapy;
+
+  rc = 0;
+  failed = false;
+
+  PRINTDBG("worker starting\n");
+
+  index = (Py_ssize_t)arg;
+  ts = subinterpreters[index];
+  alloc_id = index + 1;
+  local_deque = deques + index;
+  local_pool = pools + index;
+  PyEval_AcquireThread(ts);
+
+  // each process has its own copy of the veronapy module
+  veronapy = PyImport_ImportModule("veronapy");
+  if (veronapy == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to import veronapy module");
+    rc = -1;
+    goto end;
+  }
+
+  vpy_state = (VPYState *)PyModule_GetState(veronapy);
+
+  while (!Event_is_set(&terminator->set))
+  {
+    Behavior *b;
+
+    BehaviorPool_collect(local_pool);
+
+    ts = PyEval_SaveThread();
+    PRINTDBG("waiting for work...\n");
+    rc = worker_next(index, &b);
+    PyEval_RestoreThread(ts);
+
+    if (rc != 0)
+    {
+      PRINTDBG("error dequeuing work\n");
+      break;
+    }
+
+    if (b == NULL)
+    {
+      PRINTDBG("received NULL behavior\n");
+      break;
+    }
+
+    rc = run_behavior(b, &failed);
+    if (rc != 0)
+    {
+      break;
+    }
+  }
+
+  if (rc != 0)
+  {
+    PyErr_Fetch(&err_type, &err_value, &err_traceback);
+    BehaviorException_new(err_type, err_value, err_traceback);
+  }
+
+  PRINTDBG("worker exiting\n");
+
+  BehaviorPool_collect(local_pool);
+  BehaviorPool_clear(local_pool);
+
+end:
+
+#ifdef VPY_MULTIGIL
+  PyThreadState *nts = PyThreadState_New(ts->interp);
+  PyThreadState_Clear(ts);
+  PyThreadState_DeleteCurrent();
+  subinterpreters[index] = nts;
+#else
+  PyEval_ReleaseThread(ts);
+#endif
+
+  return (thrd_return_t)0;
+}
+
+/**
+ * Sets the worker count. This will either be pulled from an environment variable
+ * or based upon the number of processors on the system (obtained using
+ * either sched_getaffinity or cpu_count).
+ */
+static int set_worker_count()
+{
+  PyObject *os_module, *os_dict, *function, *result, *key;
+  char *worker_count_env, *main_worker_env;
+
+  // By default the main interpreter runs behaviors during wait() when the
+  // worker count is not given, i.e. when there is a worker per processor.
+  // VPY_MAIN_WORKER (0 or 1) overrides this.
+  main_worker_env = getenv("VPY_MAIN_WORKER");
+  worker_count_env = getenv("VPY_WORKER_COUNT");
+  main_worker = main_worker_env != NULL ? atoi(main_worker_env) != 0 : worker_count_env == NULL;
+
+  if (worker_count_env != NULL)
+  {
+    PRINTDBG("VPY_WORKER_COUNT: %s\n", worker_count_env);
+    worker_count = atoi(worker_count_env);
+    if (worker_count < 1)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "VPY_WORKER_COUNT must be greater than 0");
+      return -1;
+    }
+
+    if (worker_count > 0)
+    {
+      return 0;
+    }
+  }
+
+  PRINTDBG("Unable to load VPY_WORKER_COUNT, using default behavior\n");
+  os_module = PyImport_ImportModule("os");
+  if (os_module == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to import os module");
+    return -1;
+  }
+
+  os_dict = PyModule_GetDict(os_module);
+  if (os_dict == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to get os module dict");
+    return -1;
+  }
+
+  key = PyUnicode_FromString("sched_getaffinity");
+  if (PyDict_Contains(os_dict, key))
+  {
+    function = PyDict_GetItemString(os_dict, "sched_getaffinity");
+    if (function == NULL)
+    {
+      Py_DECREF(key);
+      PyErr_Format(PyExc_RuntimeError, "Unable to load sched_getaffinity from os module");
+      return -1;
+    }
+
+    result = PyObject_CallOneArg(function, PyLong_FromLong(0));
+    worker_count = PySet_Size(result);
+    PRINTDBG("sched_getaffinity returned %li\n", worker_count);
+  }
+  else
+  {
+    function = PyDict_GetItemString(os_dict, "cpu_count");
+    if (function == NULL)
+    {
+      Py_DECREF(key);
+      PyErr_Format(PyExc_RuntimeError, "Unable to load cpu_count from os module");
+      return -1;
+    }
+
+    result = PyObject_CallNoArgs(function);
+    worker_count = PyLong_AsLong(result);
+    PRINTDBG("cpu_count returned %li\n", worker_count);
+  }
+
+  Py_DECREF(key);
+  Py_DECREF(result);
+  if (worker_count < 1)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "invalid worker count (< 1)");
+    return -1;
+  }
+
+  return 0;
+}
+
+#ifdef VPY_MULTIGIL
+static int create_subinterpreters()
+{
+  Py_ssize_t i;
+  PyThreadState *ts;
+
+  PRINTDBG("creating multi-gil subinterpreters\n");
+
+  alloc_id = 0;
+  subinterpreters = (PyThreadState **)malloc(sizeof(PyThreadState *) * worker_count);
+  for (i = 0; i < worker_count; ++i)
+  {
+    PyStatus status;
+    PyInterpreterConfig config = {
+        .use_main_obmalloc = 0,
+        .allow_fork = 0,
+        .allow_exec = 0,
+        .allow_threads = 1,
+        .allow_daemon_threads = 0,
+        .check_multi_interp_extensions = 1,
+        .gil = PyInterpreterConfig_OWN_GIL,
+    };
+    subinterpreters[i] = NULL;
+
+    ts = PyThreadState_Get();
+    status = Py_NewInterpreterFromConfig(subinterpreters + i, &config);
+    subinterpreters[i] = PyEval_SaveThread();
+    PyEval_RestoreThread(ts);
+    if (PyStatus_Exception(status))
+    {
+      PyObject *exc;
+      _PyErr_SetFromPyStatus(status);
+      exc = PyErr_GetRaisedException();
+      PyErr_SetString(PyExc_RuntimeError, "interpreter creation failed");
+      _PyErr_ChainExceptions1(exc);
+      return -1;
+    }
+
+    PRINTDBG("starting subinterpreter %lu\n", PyInterpreterState_GetID(subinterpreters[i]->interp));
+  }
+
+  return 0;
+}
+#else
+static int create_subinterpreters()
+{
+  Py_ssize_t i;
+  PyThreadState *ts;
+  PRINTDBG("creating subinterpreters\n");
+
+  subinterpreters = (PyThreadState **)malloc(sizeof(PyThreadState *) * worker_count);
+  ts = PyThreadState_Get();
+  for (i = 0; i < worker_count; ++i)
+  {
+    subinterpreters[i] = Py_NewInterpreter();
+    if (subinterpreters[i] == NULL)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to create subinterpreter");
+      return -1;
+    }
+
+    PRINTDBG("starting subinterpreter %lu\n", PyInterpreterState_GetID(subinterpreters[i]->interp));
+    PyThreadState_Swap(ts);
+  }
+
+  return 0;
+}
+#endif
+
+static void free_subinterpreters()
+{
+  PyThreadState *ts;
+  PRINTDBG("freeing subinterpreters\n");
+  for (Py_ssize_t i = 0; i < worker_count; ++i)
+  {
+    PRINTDBG("ending subinterpreter %lu %p\n", PyInterpreterState_GetID(subinterpreters[i]->interp), subinterpreters[i]);
+    ts = PyThreadState_Swap(subinterpreters[i]);
+    Py_EndInterpreter(subinterpreters[i]);
+    PyThreadState_Swap(ts);
+  }
+
+  free(subinterpreters);
+}
+
+static int startup_workers()
+{
+  thrd_t *thr;
+  Py_ssize_t i;
+  int rc;
+
+#ifndef VPY_FUTEX
+  if (mtx_init(&parking_mutex, mtx_plain) != thrd_success || cnd_init(&parking_available) != thrd_success)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to initialize parking lot");
+    return -1;
+  }
+#endif
+
+  terminator = Terminator_new();
+  work_queue = PCQueue_new();
+  if (work_queue == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate work queue");
+    return -1;
+  }
+
+  deque_count = main_worker ? worker_count + 1 : worker_count;
+  deques = (WSDeque *)malloc(sizeof(WSDeque) * deque_count);
+  if (deques == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate worker deques");
+    return -1;
+  }
+
+  pools = (BehaviorPool *)malloc(sizeof(BehaviorPool) * worker_count);
+  if (pools == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate behavior pools");
+    return -1;
+  }
+
+  resumed = (atomic_voidptr_t *)malloc(sizeof(atomic_voidptr_t) * deque_count);
+  if (resumed == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate resumed stacks");
+    return -1;
+  }
+
+  for (i = 0; i < deque_count; ++i)
+  {
+    WSDeque_init(deques + i);
+    resumed[i] = (voidptr_t)NULL;
+  }
+
+  for (i = 0; i < worker_count; ++i)
+  {
+    BehaviorPool_init(pools + i);
+  }
+
+  PRINTDBG("starting workers\n");
+  workers = (thrd_t *)malloc(sizeof(thrd_t) * worker_count);
+  for (i = 0, thr = workers; i < worker_count; ++i, ++thr)
+  {
+    rc = thrd_create(thr, worker, (void *)i);
+    if (rc != thrd_success)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to create worker thread");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int shutdown_workers()
+{
+  int rc;
+
+  PRINTDBG("shutting down workers\n");
+
+  PRINTDBG("stopping work queue\n");
+  Py_BEGIN_ALLOW_THREADS
+      rc = PCQueue_stop(work_queue);
+  Py_END_ALLOW_THREADS
+
+      if (rc != 0)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to stop work queue");
+    return -1;
+  }
+
+  PRINTDBG("waiting for workers\n");
+  for (Py_ssize_t i = 0; i < worker_count; ++i)
+  {
+    PRINTDBG("joining worker thread %li\n", i);
+    Py_BEGIN_ALLOW_THREADS;
+    rc = thrd_join(workers[i], NULL);
+    Py_END_ALLOW_THREADS;
+
+    if (rc != thrd_success)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to join worker thread");
+      return -1;
+    }
+  }
+  free(workers);
+
+  PRINTDBG("freeing work queue\n");
+  PCQueue_free(work_queue);
+  free(deques);
+  free(resumed);
+  free(pools);
+
+#ifndef VPY_FUTEX
+  mtx_destroy(&parking_mutex);
+  cnd_destroy(&parking_available);
+#endif
+
+  PRINTDBG("threading system shutdown complete\n");
+
+  return 0;
+}
+
+static WhenObject *When_new(PyTypeObject *type, PyObject *args,
+                            PyObject *kwds)
+{
+  WhenObject *self = (WhenObject *)type->tp_alloc(type, 0);
+  if (self == NULL)
+  {
+    return NULL;
+  }
+
+  self->regions = NULL;
+
+  return self;
+}
+
+static PyObject *Read_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  ReadObject *self;
+  PyObject *region;
+
+  if (!PyArg_ParseTuple(args, "O", &region))
+  {
+    return NULL;
+  }
+
+  if (!Region_Check(region))
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected region");
+    return NULL;
+  }
+
+  self = (ReadObject *)type->tp_alloc(type, 0);
+  if (self == NULL)
+  {
+    return NULL;
+  }
+
+  Py_INCREF(region);
+  self->region = (RegionObject *)region;
+  return (PyObject *)self;
+}
+
+static void Read_dealloc(ReadObject *self)
+{
+  Py_XDECREF(self->region);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Read_repr(ReadObject *self)
+{
+  return PyUnicode_FromFormat("read(%S)", self->region);
+}
+
+static PyTypeObject ReadType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.read",
+    .tp_doc = PyDoc_STR("Marks a region as only read by a behavior"),
+    .tp_basicsize = sizeof(ReadObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .tp_new = (newfunc)Read_new,
+    .tp_dealloc = (destructor)Read_dealloc,
+    .tp_repr = (reprfunc)Read_repr,
+};
+
+/**
+ * Checks that a value passed to `when` is a shared region, or a shared
+ * region marked with `read`.
+ */
+static int check_request(PyObject *value)
+{
+  if (Py_IS_TYPE(value, &ReadType))
+  {
+    value = (PyObject *)((ReadObject *)value)->region;
+  }
+  else if (!Region_Check(value))
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected region");
+    return -1;
+  }
+
+  if (!((RegionObject *)value)->is_shared)
+  {
+    PyErr_SetString(RegionIsolationError, "Region must be shared");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int When_init(WhenObject *self, PyObject *args, PyObject *kwds)
+{
+  Py_ssize_t i, num_regions;
+  PyObject *r;
+  num_regions = PyTuple_Size(args);
+  for (i = 0; i < num_regions; ++i)
+  {
+    r = PyTuple_GetItem(args, i);
+    if (r == NULL)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to get region from tuple");
+      return -1;
+    }
+
+    if (check_request(r) < 0)
+    {
+      return -1;
+    }
+  }
+
+  Py_INCREF(args);
+  self->regions = args;
+
+  PRINTDBG("when initialized @ %p\n", self);
+  return 0;
+}
+
+static void When_dealloc(WhenObject *self)
+{
+  PRINTDBG("When_dealloc\n");
+  Py_XDECREF(self->regions);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/**
+ * Returns the interned code of a function to be run as a behavior. The
+ * function is shipped to the workers as its marshalled code object, which
+ * is compiled once and unmarshalled once per interpreter. Values captured
+ * from an enclosing scope cannot be shipped with it.
+ */
+static CodeBlob *get_thunk_code(PyObject *thunk)
+{
+  PyObject *code;
+
+  if (!PyFunction_Check(thunk))
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected function");
+    return NULL;
+  }
+
+  code = PyFunction_GetCode(thunk);
+  return get_code_blob(code, PyFunction_GetGlobals(thunk));
+}
+
+static void FutureObject_dealloc(FutureObject *self)
+{
+  if (self->future != NULL)
+  {
+    Future_release(self->future);
+  }
+
+  Py_XDECREF(self->value);
+  Py_XDECREF(self->waiters);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/**
+ * Converts a timeout in seconds (or None) into a deadline. Sets deadline to
+ * NULL if there is no timeout.
+ */
+static int get_deadline(PyObject *timeout, struct timespec *storage, struct timespec **deadline)
+{
+  double seconds;
+
+  *deadline = NULL;
+  if (timeout == NULL || timeout == Py_None)
+  {
+    return 0;
+  }
+
+  seconds = PyFloat_AsDouble(timeout);
+  if (seconds == -1.0 && PyErr_Occurred())
+  {
+    return -1;
+  }
+
+  if (seconds < 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+    return -1;
+  }
+
+  timespec_get(storage, TIME_UTC);
+  storage->tv_sec += (time_t)seconds;
+  storage->tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+  if (storage->tv_nsec >= 1000000000L)
+  {
+    storage->tv_sec += 1;
+    storage->tv_nsec -= 1000000000L;
+  }
+
+  *deadline = storage;
+  return 0;
+}
+
+/**
+ * Waits (without holding the GIL) for the behavior to finish, and returns
+ * its result. Raises TimeoutError if the deadline passes first.
+ */
+static PyObject *FutureObject_get(FutureObject *self, const struct timespec *deadline)
+{
+  Future *future = self->future;
+  bool done = true;
+
+  if (self->value != NULL)
+  {
+    return Py_NewRef(self->value);
+  }
+
+  if (!Event_is_set(&future->done))
+  {
+    Py_BEGIN_ALLOW_THREADS;
+    if (deadline == NULL)
+    {
+      Event_wait(&future->done);
+    }
+    else
+    {
+      done = Event_wait_until(&future->done, deadline);
+    }
+    Py_END_ALLOW_THREADS;
+  }
+
+  if (!done)
+  {
+    PyErr_SetString(PyExc_TimeoutError, "Behavior did not finish in time");
+    return NULL;
+  }
+
+  self->value = Future_load(future);
+  return Py_XNewRef(self->value);
+}
+
+static PyObject *FutureObject_result(FutureObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"timeout", NULL};
+  PyObject *timeout = NULL;
+  struct timespec storage, *deadline;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout))
+  {
+    return NULL;
+  }
+
+  if (get_deadline(timeout, &storage, &deadline) < 0)
+  {
+    return NULL;
+  }
+
+  return FutureObject_get(self, deadline);
+}
+
+static PyObject *FutureObject_done(FutureObject *self, PyObject *Py_UNUSED(ignored))
+{
+  return PyBool_FromLong(Event_is_set(&self->future->done));
+}
+
+/**
+ * Passes the result of a finished behavior (or the exception it raised) on
+ * to a list of asyncio futures. Futures which have been cancelled are
+ * skipped.
+ */
+static void resolve_waiters(FutureObject *self, PyObject *waiters)
+{
+  PyObject *value, *err_type, *err_value, *err_traceback, *waiter, *done, *result;
+  Py_ssize_t i;
+
+  err_type = err_value = err_traceback = NULL;
+  value = FutureObject_get(self, NULL);
+  if (value == NULL)
+  {
+    PyErr_Fetch(&err_type, &err_value, &err_traceback);
+    PyErr_NormalizeException(&err_type, &err_value, &err_traceback);
+    if (err_traceback != NULL)
+    {
+      PyException_SetTraceback(err_value, err_traceback);
+    }
+  }
+
+  for (i = 0; i < PyList_GET_SIZE(waiters); ++i)
+  {
+    waiter = PyList_GET_ITEM(waiters, i);
+    done = PyObject_CallMethod(waiter, "done", NULL);
+    if (done == Py_False)
+    {
+      if (value != NULL)
+      {
+        result = PyObject_CallMethod(waiter, "set_result", "O", value);
+      }
+      else
+      {
+        result = PyObject_CallMethod(waiter, "set_exception", "O", err_value);
+      }
+
+      Py_XDECREF(result);
+    }
+
+    if (done == NULL || (done == Py_False && result == NULL))
+    {
+      // the loop of the waiter may have been closed
+      PyErr_WriteUnraisable(waiter);
+    }
+
+    Py_XDECREF(done);
+  }
+
+  Py_XDECREF(value);
+  Py_XDECREF(err_type);
+  Py_XDECREF(err_value);
+  Py_XDECREF(err_traceback);
+}
+
+#ifndef _WIN32
+/** Called by the event loop when the notifier of this interpreter is signalled. */
+static PyObject *notifier_callback(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+  Future *future, *next;
+  FutureObject *waiter;
+  PyObject *waiters;
+
+  future = Notifier_take(vpy_state->notifier);
+  while (future != NULL)
+  {
+    next = future->next;
+    waiter = (FutureObject *)future->waiter;
+    waiters = waiter->waiters;
+    waiter->waiters = NULL;
+    resolve_waiters(waiter, waiters);
+    Py_DECREF(waiters);
+
+    // this may free the future object, and the future along with it
+    if (PySet_Discard(vpy_state->awaiting, (PyObject *)waiter) < 0)
+    {
+      PyErr_WriteUnraisable((PyObject *)waiter);
+    }
+
+    future = next;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef notifier_callback_def = {
+    "notify", (PyCFunction)notifier_callback, METH_NOARGS, "Hand finished behaviors over to the event loop."};
+
+/** Makes sure that the loop watches the notifier of this interpreter. */
+static int watch_notifier(PyObject *loop)
+{
+  PyObject *callback, *result;
+
+  if (vpy_state->notifier == NULL)
+  {
+    vpy_state->awaiting = PySet_New(NULL);
+    vpy_state->notifier = vpy_state->awaiting == NULL ? NULL : Notifier_new();
+    if (vpy_state->notifier == NULL)
+    {
+      Py_CLEAR(vpy_state->awaiting);
+      return -1;
+    }
+  }
+
+  if (vpy_state->notify_loop == loop)
+  {
+    return 0;
+  }
+
+  if (vpy_state->notify_loop != NULL)
+  {
+    // the previous loop may have been closed, in which case this fails
+    result = PyObject_CallMethod(vpy_state->notify_loop, "remove_reader", "i", vpy_state->notifier->read_fd);
+    if (result == NULL)
+    {
+      PyErr_Clear();
+    }
+
+    Py_XDECREF(result);
+    Py_CLEAR(vpy_state->notify_loop);
+  }
+
+  callback = PyCFunction_New(&notifier_callback_def, NULL);
+  if (callback == NULL)
+  {
+    return -1;
+  }
+
+  result = PyObject_CallMethod(loop, "add_reader", "iO", vpy_state->notifier->read_fd, callback);
+  Py_DECREF(callback);
+  if (result == NULL)
+  {
+    return -1;
+  }
+
+  Py_DECREF(result);
+  vpy_state->notify_loop = Py_NewRef(loop);
+  return 0;
+}
+#endif
+
+/** Iterator used to await a future inside a coroutine behavior. */
+typedef struct future_iter_object_s
+{
+  PyObject_HEAD;
+  // The future which is awaited
+  FutureObject *future;
+  // Whether the future has been handed to the worker
+  bool yielded;
+} FutureIterObject;
+
+static void FutureIter_dealloc(FutureIterObject *self)
+{
+  Py_XDECREF(self->future);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *FutureIter_next(FutureIterObject *self)
+{
+  PyObject *value, *stop;
+
+  if (!self->yielded && !Event_is_set(&self->future->future->done))
+  {
+    // the worker suspends the behavior until the future has finished
+    self->yielded = true;
+    return Py_NewRef(self->future);
+  }
+
+  value = FutureObject_get(self->future, NULL);
+  if (value == NULL)
+  {
+    return NULL;
+  }
+
+  // the result of the await is passed back through StopIteration
+  stop = PyObject_CallOneArg(PyExc_StopIteration, value);
+  Py_DECREF(value);
+  if (stop != NULL)
+  {
+    PyErr_SetObject(PyExc_StopIteration, stop);
+    Py_DECREF(stop);
+  }
+
+  return NULL;
+}
+
+static PyTypeObject FutureIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.future_iter",
+    .tp_doc = PyDoc_STR("Awaits a future inside a behavior"),
+    .tp_basicsize = sizeof(FutureIterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .tp_dealloc = (destructor)FutureIter_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)FutureIter_next,
+};
+
+/**
+ * Returns an iterator for `await`, which completes once the behavior has
+ * finished. Inside a coroutine behavior the worker suspends the behavior
+ * and runs other work in the meantime. Otherwise the running event loop is
+ * woken through a file descriptor, so no thread is spent waiting.
+ */
+static PyObject *FutureObject_await(FutureObject *self)
+{
+  FutureIterObject *iter;
+
+  if (current_coroutine != NULL)
+  {
+    if (self->waiters != NULL || (self->future->behavior != NULL && !Event_is_set(&self->future->done)))
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Future is already awaited");
+      return NULL;
+    }
+
+    iter = PyObject_New(FutureIterObject, &FutureIterType);
+    if (iter == NULL)
+    {
+      return NULL;
+    }
+
+    iter->future = (FutureObject *)Py_NewRef(self);
+    iter->yielded = false;
+    return (PyObject *)iter;
+  }
+
+#ifdef _WIN32
+  PyErr_SetString(PyExc_NotImplementedError, "Awaiting a future needs an event loop which can watch file descriptors");
+  return NULL;
+#else
+  PyObject *asyncio, *loop, *waiter, *waiters, *result;
+  Future *future = self->future;
+  int rc = 0;
+
+  asyncio = PyImport_ImportModule("asyncio");
+  if (asyncio == NULL)
+  {
+    return NULL;
+  }
+
+  loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+  Py_DECREF(asyncio);
+  if (loop == NULL)
+  {
+    return NULL;
+  }
+
+  waiter = PyObject_CallMethod(loop, "create_future", NULL);
+  if (waiter == NULL)
+  {
+    Py_DECREF(loop);
+    return NULL;
+  }
+
+  if (self->waiters != NULL)
+  {
+    // the loop already awaits the future
+    rc = PyList_Append(self->waiters, waiter);
+  }
+  else if (Event_is_set(&future->done))
+  {
+    waiters = PyList_New(1);
+    if (waiters == NULL)
+    {
+      rc = -1;
+    }
+    else
+    {
+      PyList_SET_ITEM(waiters, 0, Py_NewRef(waiter));
+      resolve_waiters(self, waiters);
+      Py_DECREF(waiters);
+    }
+  }
+  else if (watch_notifier(loop) < 0 || (self->waiters = PyList_New(0)) == NULL ||
+           PyList_Append(self->waiters, waiter) < 0 ||
+           PySet_Add(vpy_state->awaiting, (PyObject *)self) < 0)
+  {
+    Py_CLEAR(self->waiters);
+    rc = -1;
+  }
+  else
+  {
+    future->notifier = vpy_state->notifier;
+    future->waiter = self;
+    if (atomic_exchange_int(&future->watch, FUTURE_WATCHED) == FUTURE_FINISHED)
+    {
+      // finished in the meantime, so it will not be pushed
+      Notifier_push(future->notifier, future);
+    }
+  }
+
+  Py_DECREF(loop);
+  result = rc == 0 ? PyObject_CallMethod(waiter, "__await__", NULL) : NULL;
+  Py_DECREF(waiter);
+  return result;
+#endif
+}
+
+static PyAsyncMethods FutureObject_async = {
+    .am_await = (unaryfunc)FutureObject_await,
+};
+
+static PyMethodDef FutureObject_methods[] = {
+    {"result", (PyCFunction)FutureObject_result, METH_VARARGS | METH_KEYWORDS, "Wait for the behavior to finish and return its result."},
+    {"done", (PyCFunction)FutureObject_done, METH_NOARGS, "Whether the behavior has finished."},
+    {NULL} /* Sentinel */
+};
+
+static PyTypeObject FutureType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.future",
+    .tp_doc = PyDoc_STR("The result of a behavior"),
+    .tp_basicsize = sizeof(FutureObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .tp_dealloc = (destructor)FutureObject_dealloc,
+    .tp_as_async = &FutureObject_async,
+    .tp_methods = FutureObject_methods,
+};
+
+/**
+ * Creates a future object along with the future that it waits on. The
+ * future starts with a second reference, for whatever will complete it.
+ */
+static FutureObject *FutureObject_create()
+{
+  FutureObject *future;
+
+  future = PyObject_New(FutureObject, &FutureType);
+  if (future == NULL)
+  {
+    return NULL;
+  }
+
+  future->value = NULL;
+  future->waiters = NULL;
+  future->future = Future_new();
+  if (future->future == NULL)
+  {
+    Py_DECREF(future);
+    return NULL;
+  }
+
+  return future;
+}
+
+/**
+ * Schedules a behavior which calls the code with the regions, followed by
+ * the arguments packed by pack_shared_args (which may be NULL). Returns a future
+ * for the result of the behavior.
+ */
+static PyObject *when_schedule(CodeBlob *code, PyObject *regions, PackedArgs *args)
+{
+  Behavior *b;
+  FutureObject *future;
+  int rc;
+
+  future = FutureObject_create();
+  if (future == NULL)
+  {
+    return NULL;
+  }
+
+  PRINTDBG("creating behavior\n");
+  b = Behavior_new(code, PySequence_Fast_ITEMS(regions), PyTuple_GET_SIZE(regions), args);
+  if (b == NULL)
+  {
+    // drop the reference which the behavior would have held
+    Future_release(future->future);
+    Py_DECREF(future);
+    return NULL;
+  }
+
+  b->future = future->future;
+
+  PRINTDBG("scheduling behavior\n");
+  Py_BEGIN_ALLOW_THREADS;
+  rc = Behavior_schedule(b);
+  Py_END_ALLOW_THREADS;
+
+  if (rc != 0)
+  {
+    Py_DECREF(future);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to schedule behavior");
+    return NULL;
+  }
+
+  return (PyObject *)future;
+}
+
+/** This is called when the @when decorator is used on a function. */
+static PyObject *When_call(WhenObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *thunk, *result;
+  PackedArgs *data = NULL;
+  CodeBlob *code;
+
+  PRINTDBG("When_call\n");
+  if (PyTuple_Size(args) != 1)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Expected one argument");
+    return NULL;
+  }
+
+  // the decorator is passed the decorated function
+  thunk = PyTuple_GetItem(args, 0);
+  if (thunk == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to get thunk from tuple");
+    return NULL;
+  }
+
+  code = get_thunk_code(thunk);
+  if (code == NULL || pack_shared_args(thunk, NULL, 0, &data) < 0)
+  {
+    return NULL;
+  }
+
+  // The decorator instantiation indicates the regions that need to be
+  // obtained before the thunk can be run.
+  result = when_schedule(code, self->regions, data);
+  PackedArgs_release(data);
+  return result;
+}
+
+/** Backing object for the `behavior` decorator. */
+typedef struct behavior_function_object_s
+{
+  PyObject_HEAD;
+  // The decorated function
+  PyObject *func;
+  // The interned code of the function, or NULL if it has not been registered
+  CodeBlob *code;
+  // The code blob generation in which code was registered
+  long long generation;
+} BehaviorFunctionObject;
+
+static PyTypeObject BehaviorFunctionType;
+
+/**
+ * Returns the interned code of a behavior function, registering it again if
+ * the runtime has been restarted since it was last used.
+ */
+static CodeBlob *BehaviorFunction_code(BehaviorFunctionObject *self)
+{
+  long long generation = atomic_load_llong(&code_blob_generation);
+  if (self->code == NULL || self->generation != generation)
+  {
+    self->code = get_thunk_code(self->func);
+    self->generation = generation;
+  }
+
+  return self->code;
+}
+
+static PyObject *BehaviorFunction_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  BehaviorFunctionObject *self;
+  PyObject *func;
+
+  if (!PyArg_ParseTuple(args, "O", &func))
+  {
+    return NULL;
+  }
+
+  if (!PyFunction_Check(func))
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected function");
+    return NULL;
+  }
+
+  self = (BehaviorFunctionObject *)type->tp_alloc(type, 0);
+  if (self == NULL)
+  {
+    return NULL;
+  }
+
+  Py_INCREF(func);
+  self->func = func;
+  self->code = NULL;
+  self->generation = 0;
+
+  // register the function straight away if the runtime is running, so
+  // that scheduling it only needs to copy a pointer
+  if (atomic_load_bool(&running) && BehaviorFunction_code(self) == NULL)
+  {
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  return (PyObject *)self;
+}
+
+static void BehaviorFunction_dealloc(BehaviorFunctionObject *self)
+{
+  Py_XDECREF(self->func);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/** Calling a behavior function directly runs it on the calling thread. */
+static PyObject *BehaviorFunction_call(BehaviorFunctionObject *self, PyObject *args, PyObject *kwds)
+{
+  return PyObject_Call(self->func, args, kwds);
+}
+
+static PyObject *BehaviorFunction_get_wrapped(BehaviorFunctionObject *self, void *closure)
+{
+  return Py_NewRef(self->func);
+}
+
+static PyGetSetDef BehaviorFunction_getset[] = {
+    {"__wrapped__", (getter)BehaviorFunction_get_wrapped, NULL, "The decorated function", NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyTypeObject BehaviorFunctionType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.behavior",
+    .tp_doc = PyDoc_STR("A function registered to run as a behavior"),
+    .tp_basicsize = sizeof(BehaviorFunctionObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .tp_new = (newfunc)BehaviorFunction_new,
+    .tp_dealloc = (destructor)BehaviorFunction_dealloc,
+    .tp_call = (ternaryfunc)BehaviorFunction_call,
+    .tp_getset = BehaviorFunction_getset,
+};
+
+/** Returns the interned code of a behavior function or of a plain function. */
+static CodeBlob *get_function_code(PyObject *func)
+{
+  if (Py_IS_TYPE(func, &BehaviorFunctionType))
+  {
+    return BehaviorFunction_code((BehaviorFunctionObject *)func);
+  }
+
+  return get_thunk_code(func);
+}
+
+/**
+ * Marshals the arguments to be passed to a behavior after its regions into a
+ * bytes object. The arguments must be immutable.
+ */
+static PyObject *pack_args(PyObject *const *args, Py_ssize_t nargs)
+{
+  PyObject *extra, *data;
+
+  extra = PyTuple_New(nargs);
+  if (extra == NULL)
+  {
+    return NULL;
+  }
+
+  for (Py_ssize_t i = 0; i < nargs; ++i)
+  {
+    if (!is_imm(args[i]))
+    {
+      Py_DECREF(extra);
+      PyErr_SetString(RegionIsolationError, "Behavior arguments must be immutable");
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(extra, i, Py_NewRef(args[i]));
+  }
+
+  data = PyMarshal_WriteObjectToString(extra, Py_MARSHAL_VERSION);
+  Py_DECREF(extra);
+  return data;
+}
+
+/**
+ * Marshals the values which a function captured from its enclosing scopes,
+ * followed by the arguments, into a buffer which behaviors can share. The
+ * captured values are passed first so that call_thunk can put them in fresh
+ * cells. Sets packed to NULL if there is nothing to pass.
+ */
+static int pack_shared_args(PyObject *func, PyObject *const *args, Py_ssize_t nargs,
+                            PackedArgs **packed)
+{
+  PyObject *closure, *data, *names, *value;
+  PyObject *inline_values[BEHAVIOR_INLINE_REQUESTS];
+  PyObject **values = inline_values;
+  Py_ssize_t i, nfree = 0;
+
+  *packed = NULL;
+  if (Py_IS_TYPE(func, &BehaviorFunctionType))
+  {
+    func = ((BehaviorFunctionObject *)func)->func;
+  }
+
+  closure = PyFunction_GetClosure(func);
+  if (closure != NULL && closure != Py_None)
+  {
+    nfree = PyTuple_GET_SIZE(closure);
+  }
+
+  if (nfree + nargs == 0)
+  {
+    return 0;
+  }
+
+  if (nfree + nargs > BEHAVIOR_INLINE_REQUESTS)
+  {
+    values = (PyObject **)PyMem_Malloc(sizeof(PyObject *) * (nfree + nargs));
+    if (values == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+
+  for (i = 0; i < nfree; ++i)
+  {
+    value = PyCell_GET(PyTuple_GET_ITEM(closure, i));
+    if (value == NULL || !is_imm(value))
+    {
+      names = PyCode_GetFreevars((PyCodeObject *)PyFunction_GetCode(func));
+      if (names == NULL)
+      {
+        // the error from getting the names is raised instead
+      }
+      else if (value == NULL)
+      {
+        PyErr_Format(PyExc_NameError,
+                     "cannot access free variable '%U' where it is not associated with a value in enclosing scope",
+                     PyTuple_GET_ITEM(names, i));
+      }
+      else
+      {
+        PyErr_Format(RegionIsolationError,
+                     "Thunks can only capture immutable values, but '%U' is a %.100s",
+                     PyTuple_GET_ITEM(names, i), Py_TYPE(value)->tp_name);
+      }
+
+      Py_XDECREF(names);
+      if (values != inline_values)
+      {
+        PyMem_Free(values);
+      }
+
+      return -1;
+    }
+
+    values[i] = value;
+  }
+
+  for (i = 0; i < nargs; ++i)
+  {
+    values[nfree + i] = args[i];
+  }
+
+  data = pack_args(values, nfree + nargs);
+  if (values != inline_values)
+  {
+    PyMem_Free(values);
+  }
+
+  if (data == NULL)
+  {
+    return -1;
+  }
+
+  *packed = PackedArgs_new(data);
+  Py_DECREF(data);
+  return *packed == NULL ? -1 : 0;
+}
+
+/**
+ * Schedules a function to be called with the regions, followed by any
+ * number of immutable arguments.
+ */
+static PyObject *When_call_function(WhenObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+  PyObject *result;
+  PackedArgs *data = NULL;
+  CodeBlob *code;
+
+  if (nargs < 1)
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected a function");
+    return NULL;
+  }
+
+  code = get_function_code(args[0]);
+  if (code == NULL || pack_shared_args(args[0], args + 1, nargs - 1, &data) < 0)
+  {
+    return NULL;
+  }
+
+  result = when_schedule(code, self->regions, data);
+  PackedArgs_release(data);
+  return result;
+}
+
+static PyMethodDef When_methods[] = {
+    {"call", (PyCFunction)When_call_function, METH_FASTCALL, "Schedule a function to be called with the regions and some immutable arguments."},
+    {NULL} /* Sentinel */
+};
+
+static PyTypeObject WhenType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.when_factory",
+    .tp_doc = PyDoc_STR("When factory, returned by when()"),
+    .tp_basicsize = sizeof(WhenObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .tp_new = (newfunc)When_new,
+    .tp_init = (initproc)When_init,
+    .tp_dealloc = (destructor)When_dealloc,
+    .tp_call = (ternaryfunc)When_call,
+    .tp_methods = When_methods,
+};
+
+static PyObject *when(PyObject *module, PyObject *args)
+{
+  PyObject *when_factory;
+  when_factory = PyObject_CallObject((PyObject *)&WhenType, args);
+  return when_factory;
+}
+
+/**
+ * Schedules a function to be called once for each of a sequence of regions,
+ * followed by any number of immutable arguments. This is equivalent to
+ * calling `when(r).call(fn, *args)` for each region, but the behaviors are
+ * created and published in a single batch.
+ */
+static PyObject *when_each(PyObject *module, PyObject *const *args, Py_ssize_t nargs)
+{
+  PyObject *regions, **items;
+  PackedArgs *data = NULL;
+  Py_ssize_t i, length;
+  Behavior **behaviors;
+  CodeBlob *code;
+  int rc;
+
+  if (nargs < 2)
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected regions and a function");
+    return NULL;
+  }
+
+  regions = PySequence_Fast(args[0], "Expected a sequence of regions");
+  if (regions == NULL)
+  {
+    return NULL;
+  }
+
+  length = PySequence_Fast_GET_SIZE(regions);
+  items = PySequence_Fast_ITEMS(regions);
+  for (i = 0; i < length; ++i)
+  {
+    if (check_request(items[i]) < 0)
+    {
+      Py_DECREF(regions);
+      return NULL;
+    }
+  }
+
+  code = get_function_code(args[1]);
+  if (code == NULL)
+  {
+    Py_DECREF(regions);
+    return NULL;
+  }
+
+  // the behaviors share a single copy of the arguments
+  if (pack_shared_args(args[1], args + 2, nargs - 2, &data) < 0)
+  {
+    Py_DECREF(regions);
+    return NULL;
+  }
+
+  behaviors = (Behavior **)PyMem_Malloc(sizeof(Behavior *) * (length + 1));
+  if (behaviors == NULL)
+  {
+    Py_DECREF(regions);
+    PackedArgs_release(data);
+    return PyErr_NoMemory();
+  }
+
+  for (i = 0; i < length; ++i)
+  {
+    behaviors[i] = Behavior_new(code, items + i, 1, data);
+    if (behaviors[i] == NULL)
+    {
+      while (i-- > 0)
+      {
+        Behavior_free(behaviors[i]);
+      }
+
+      PyMem_Free(behaviors);
+      Py_DECREF(regions);
+      PackedArgs_release(data);
+      return NULL;
+    }
+  }
+
+  Py_DECREF(regions);
+  PackedArgs_release(data);
+
+  PRINTDBG("scheduling %li behaviors\n", length);
+  Py_BEGIN_ALLOW_THREADS;
+  rc = Behavior_schedule_many(behaviors, length);
+  Py_END_ALLOW_THREADS;
+
+  PyMem_Free(behaviors);
+  if (rc != 0)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to schedule behaviors");
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/***************************************************************/
+/*              Isolated object methods                        */
+/***************************************************************/
+
+/*
+ * A behavior holding a read request shares the region with the other readers,
+ * which may be running on other threads at the same time. Writers swap the
+ * inner type into an object for the length of a call, but readers cannot, as
+ * the other readers would see the inner type and bypass the checks of the
+ * isolated type. The slots of built-in types do not depend on the type of the
+ * object and are called directly. The slots of classes would look the method
+ * up on the isolated type (and find the isolated method again), so instead
+ * the method is looked up on the inner type by name.
+ */
+
+/**
+ * Looks up a special method on the inner type of an object which is open for
+ * reading. Returns a new reference, or NULL (without an exception) if the type
+ * does not define it.
+ */
+static PyObject *lookup_special(PyTypeObject *type, const char *name)
+{
+  PyObject *descr;
+  PyObject *method_name = PyUnicode_InternFromString(name);
+  if (method_name == NULL)
+  {
+    PyErr_Clear();
+    return NULL;
+  }
+
+  descr = _PyType_Lookup(type, method_name);
+  Py_DECREF(method_name);
+  if (descr == NULL || descr == Py_None)
+  {
+    return NULL;
+  }
+
+  return Py_NewRef(descr);
+}
+
+/** Calls a special method of an object which is open for reading. */
+static PyObject *call_special(PyObject *self, PyTypeObject *type, const char *name,
+                              PyObject *const *args, size_t nargs)
+{
+  PyObject *descr, *method, *result;
+  descrgetfunc get;
+
+  descr = lookup_special(type, name);
+  if (descr == NULL)
+  {
+    PyErr_Format(PyExc_TypeError, "'%.200s' object has no method %s", type->tp_name, name);
+    return NULL;
+  }
+
+  get = Py_TYPE(descr)->tp_descr_get;
+  if (get == NULL)
+  {
+    method = descr;
+  }
+  else
+  {
+    method = get(descr, self, (PyObject *)type);
+    Py_DECREF(descr);
+    if (method == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  result = PyObject_Vectorcall(method, args, nargs, NULL);
+  Py_DECREF(method);
+  return result;
+}
+
+/**
+ * Gives a reader its own reference to a value borrowed from a region which is
+ * open for reading. Strings, bytes and numbers which are still sealed are
+ * copied, rather than referenced, so that they can be reclaimed once the
+ * readers have finished (see unseal_region).
+ */
+static PyObject *read_borrowed(PyObject *value)
+{
+#ifdef VPY_SEAL_REFCNT
+  if (Py_REFCNT(value) == VPY_SEAL_REFCNT)
+  {
+    if (PyUnicode_CheckExact(value))
+    {
+      return PyUnicode_FromKindAndData(PyUnicode_KIND(value), PyUnicode_DATA(value),
+                                       PyUnicode_GET_LENGTH(value));
+    }
+
+    if (PyBytes_CheckExact(value))
+    {
+      return PyBytes_FromStringAndSize(PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
+    }
+
+    if (PyLong_CheckExact(value))
+    {
+      return _PyLong_Copy((PyLongObject *)value);
+    }
+
+    if (PyFloat_CheckExact(value))
+    {
+      return PyFloat_FromDouble(PyFloat_AS_DOUBLE(value));
+    }
+  }
+#endif
+
+  return Py_NewRef(value);
+}
+
+static Py_ssize_t read_length(PyObject *self, PyTypeObject *type, lenfunc func)
+{
+  PyObject *result;
+  Py_ssize_t length;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return func(self);
+  }
+
+  result = call_special(self, type, "__len__", NULL, 0);
+  if (result == NULL)
+  {
+    return -1;
+  }
+
+  length = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+  Py_DECREF(result);
+  if (length < 0 && !PyErr_Occurred())
+  {
+    PyErr_SetString(PyExc_ValueError, "__len__() should return >= 0");
+  }
+
+  return length;
+}
+
+static int read_bool(PyObject *self, PyTypeObject *type, inquiry func)
+{
+  PyObject *result;
+  Py_ssize_t length;
+  int rc;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return func(self);
+  }
+
+  result = lookup_special(type, "__bool__");
+  if (result == NULL)
+  {
+    // the truth of classes without __bool__ comes from __len__
+    length = read_length(self, type, NULL);
+    return length < 0 ? -1 : length > 0;
+  }
+
+  Py_DECREF(result);
+  result = call_special(self, type, "__bool__", NULL, 0);
+  if (result == NULL)
+  {
+    return -1;
+  }
+
+  if (!PyBool_Check(result))
+  {
+    PyErr_Format(PyExc_TypeError, "__bool__ should return bool, returned %.200s",
+                 Py_TYPE(result)->tp_name);
+    Py_DECREF(result);
+    return -1;
+  }
+
+  rc = result == Py_True;
+  Py_DECREF(result);
+  return rc;
+}
+
+static PyObject *read_unary(PyObject *self, PyTypeObject *type, unaryfunc func, const char *method)
+{
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return func(self);
+  }
+
+  return call_special(self, type, method, NULL, 0);
+}
+
+static PyObject *read_binary(PyObject *self, PyTypeObject *type, binaryfunc func,
+                             const char *method, PyObject *arg0)
+{
+  PyObject *value;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    if (type == &PyDict_Type && func == PyDict_Type.tp_as_mapping->mp_subscript)
+    {
+      value = PyDict_GetItemWithError(self, arg0);
+      if (value != NULL)
+      {
+        return read_borrowed(value);
+      }
+
+      if (PyErr_Occurred())
+      {
+        return NULL;
+      }
+    }
+
+    return func(self, arg0);
+  }
+
+  return call_special(self, type, method, &arg0, 1);
+}
+
+static PyObject *read_ternary(PyObject *self, PyTypeObject *type, ternaryfunc func,
+                              const char *method, PyObject *arg0, PyObject *arg1)
+{
+  PyObject *args[2] = {arg0, arg1};
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return func(self, arg0, arg1);
+  }
+
+  return call_special(self, type, method, args, arg1 == Py_None ? 1 : 2);
+}
+
+static PyObject *read_ssize(PyObject *self, PyTypeObject *type, ssizeargfunc func,
+                            const char *method, Py_ssize_t arg)
+{
+  PyObject *index, *result;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    if (type == &PyList_Type && func == PyList_Type.tp_as_sequence->sq_item &&
+        arg >= 0 && arg < PyList_GET_SIZE(self))
+    {
+      return read_borrowed(PyList_GET_ITEM(self, arg));
+    }
+
+    return func(self, arg);
+  }
+
+  index = PyLong_FromSsize_t(arg);
+  if (index == NULL)
+  {
+    return NULL;
+  }
+
+  result = call_special(self, type, method, &index, 1);
+  Py_DECREF(index);
+  return result;
+}
+
+static int read_contains(PyObject *self, PyTypeObject *type, objobjproc func, PyObject *arg0)
+{
+  PyObject *result;
+  int rc;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return func(self, arg0);
+  }
+
+  result = call_special(self, type, "__contains__", &arg0, 1);
+  if (result == NULL)
+  {
+    return -1;
+  }
+
+  rc = PyObject_IsTrue(result);
+  Py_DECREF(result);
+  return rc;
+}
+
+static Py_hash_t read_hash(PyObject *self, PyTypeObject *type)
+{
+  PyObject *result;
+  Py_hash_t hash;
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return type->tp_hash(self);
+  }
+
+  result = lookup_special(type, "__hash__");
+  if (result == NULL)
+  {
+    PyErr_Format(PyExc_TypeError, "unhashable type: '%.200s'", type->tp_name);
+    return -1;
+  }
+
+  Py_DECREF(result);
+  result = call_special(self, type, "__hash__", NULL, 0);
+  if (result == NULL)
+  {
+    return -1;
+  }
+
+  if (!PyLong_Check(result))
+  {
+    PyErr_SetString(PyExc_TypeError, "__hash__ method should return an integer");
+    Py_DECREF(result);
+    return -1;
+  }
+
+  hash = PyLong_AsSsize_t(result);
+  Py_DECREF(result);
+  if (hash == -1 && !PyErr_Occurred())
+  {
+    hash = -2;
+  }
+
+  return hash;
+}
+
+static PyObject *read_richcompare(PyObject *self, PyTypeObject *type, PyObject *other, int op)
+{
+  static const char *names[] = {"__lt__", "__le__", "__eq__", "__ne__", "__gt__", "__ge__"};
+
+  if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+  {
+    return type->tp_richcompare(self, other, op);
+  }
+
+  return call_special(self, type, names[op], &other, 1);
+}
+
+// the special methods whose slots the isolated type only calls for writers
+static const char *write_slot_names[] = {
+    "__setattr__", "__delattr__", "__setitem__", "__delitem__", "__set__",
+    "__delete__", "__init__", "__next__", "__iadd__", "__isub__", "__imul__",
+    "__imatmul__", "__itruediv__", "__ifloordiv__", "__imod__", "__ipow__",
+    "__ilshift__", "__irshift__", "__iand__", "__ixor__", "__ior__", NULL};
+
+// the methods of the built-in containers which change them
+static const char *list_write_methods[] = {
+    "append", "clear", "extend", "insert", "pop", "remove", "reverse", "sort", NULL};
+static const char *dict_write_methods[] = {
+    "clear", "pop", "popitem", "setdefault", "update", NULL};
+static const char *set_write_methods[] = {
+    "add", "clear", "difference_update", "discard", "intersection_update", "pop",
+    "remove", "symmetric_difference_update", "update", NULL};
+static const char *bytearray_write_methods[] = {
+    "append", "clear", "extend", "insert", "pop", "remove", "reverse", NULL};
+
+static bool name_in(const char *name, const char *const *names)
+{
+  for (; *names != NULL; names++)
+  {
+    if (strcmp(name, *names) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Whether calling a method found on the inner type of an object leaves the
+ * object unchanged. Methods written in Python are always allowed, as they can
+ * only change the object through its isolated slots, which are checked. The
+ * methods of built-in types work on the object directly, so the only ones
+ * allowed are those known not to change it.
+ */
+static bool is_read_method(PyObject *descr)
+{
+  PyTypeObject *owner;
+  const char *name;
+
+  if (Py_IS_TYPE(descr, &PyWrapperDescr_Type))
+  {
+    name = PyUnicode_AsUTF8(PyDescr_NAME(descr));
+    return name != NULL && !name_in(name, write_slot_names);
+  }
+
+  if (!Py_IS_TYPE(descr, &PyMethodDescr_Type))
+  {
+    return true;
+  }
+
+  owner = PyDescr_TYPE(descr);
+  if (is_imm_type(owner) || owner == &PyTuple_Type || owner == &PyFrozenSet_Type ||
+      owner == &PyBaseObject_Type)
+  {
+    return true;
+  }
+
+  name = PyUnicode_AsUTF8(PyDescr_NAME(descr));
+  if (name == NULL)
+  {
+    return false;
+  }
+
+  if (owner == &PyList_Type)
+  {
+    return !name_in(name, list_write_methods);
+  }
+
+  if (owner == &PyDict_Type)
+  {
+    return !name_in(name, dict_write_methods);
+  }
+
+  if (owner == &PySet_Type)
+  {
+    return !name_in(name, set_write_methods);
+  }
+
+  if (owner == &PyByteArray_Type)
+  {
+    return !name_in(name, bytearray_write_methods);
+  }
+
+  // other built-in types may change themselves in any method
+  return false;
+}
+
+/**
+ * Raises RegionIsolationError if an attribute of an object in a region which
+ * is not open for writing is a method which would change the object.
+ */
+static int check_read_method(RegionObject *region, PyTypeObject *type, PyObject *attr_name)
+{
+  PyObject *descr = _PyType_Lookup(type, attr_name);
+  if (descr == NULL || is_read_method(descr))
+  {
+    return 0;
+  }
+
+  PyErr_Clear();
+  VPY_CHECKREGIONWRITABLE(region, -1);
+  return 0;
+}
+
+/**
+ * Looks up an attribute of an object which is open for reading, as
+ * PyObject_GenericGetAttr would with the inner type swapped in.
+ */
+static PyObject *read_attribute(PyObject *self, PyTypeObject *type, PyObject *attr_name)
+{
+  PyObject *descr, **dict, *value;
+  descrgetfunc get = NULL;
+
+  descr = _PyType_Lookup(type, attr_name);
+  if (descr != NULL)
+  {
+    get = Py_TYPE(descr)->tp_descr_get;
+    if (get != NULL && Py_TYPE(descr)->tp_descr_set != NULL)
+    {
+      return get(descr, self, (PyObject *)type);
+    }
+  }
+
+  // the instance dictionary was created when the region was sealed
+  dict = _PyObject_GetDictPtr(self);
+  if (dict != NULL && *dict != NULL)
+  {
+    value = PyDict_GetItemWithError(*dict, attr_name);
+    if (value != NULL)
+    {
+      return read_borrowed(value);
+    }
+
+    if (PyErr_Occurred())
+    {
+      return NULL;
+    }
+  }
+
+  if (get != NULL)
+  {
+    return get(descr, self, (PyObject *)type);
+  }
+
+  if (descr != NULL)
+  {
+    return Py_NewRef(descr);
+  }
+
+  PyErr_Format(PyExc_AttributeError, "'%.100s' object has no attribute '%U'",
+               type->tp_name, attr_name);
+  return NULL;
+}
+
+static void Isolated_finalize(PyObject *self)
+{
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  if (type == NULL)
+  {
+    PyErr_SetString(PyExc_TypeError,
+                    "error obtaining internal type of isolated object");
+    return;
+  }
+
+  // the address may be reused, so the object must no longer map to its tag
+  release_tag(self);
+
+  self->ob_type = type;
+  Py_DECREF(isolated_type);
+}
+
+/**
+ * This function serves as a nice example of the Isolated type pattern
+ * used in the module. The result is that the repr of the isolated type
+ * will be called, but only if the region is open.
+ */
+static PyObject *Isolated_repr(PyObject *self)
+{
+  PyObject *repr;
+  // The object has had its ob_type pointer replaced with a pointer to the isolated type
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  // We get the inner type from the isolated type
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+  // We get the region from the isolated object
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, NULL);
+  VPY_CHECKREGIONOPEN(region, NULL);
+
+  if (!region->is_open)
+  {
+    // a reader must leave the type alone (see read_unary)
+    return read_unary(self, type, type->tp_repr, "__repr__");
+  }
+
+  // swap in the original type object
+  self->ob_type = type;
+  // call the method
+  repr = type->tp_repr(self);
+  // swap back in the isolated type object
+  self->ob_type = isolated_type;
+
+  // this pattern is used in all Isolated methods
+  return repr;
+}
+
+static PyObject *Isolated_str(PyObject *self)
+{
+  PyObject *str;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, NULL);
+  VPY_CHECKREGIONOPEN(region, NULL);
+
+  if (!region->is_open)
+  {
+    return read_unary(self, type, type->tp_str, "__str__");
+  }
+
+  self->ob_type = type;
+  str = type->tp_str(self);
+  self->ob_type = isolated_type;
+  return str;
+}
+
+static PyObject *Isolated_richcompare(PyObject *self, PyObject *other, int op)
+{
+  PyObject *result;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, NULL);
+  VPY_CHECKREGIONOPEN(region, NULL);
+
+  if (!region->is_open)
+  {
+    return read_richcompare(self, type, other, op);
+  }
+
+  self->ob_type = type;
+  result = type->tp_richcompare(self, other, op);
+  self->ob_type = isolated_type;
+  return result;
+}
+
+static PyObject *Isolated_iter(PyObject *self)
+{
+  PyObject *iter;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, NULL);
+  VPY_CHECKREGIONOPEN(region, NULL);
+
+  if (!region->is_open)
+  {
+    return read_unary(self, type, type->tp_iter, "__iter__");
+  }
+
+  self->ob_type = type;
+  iter = type->tp_iter(self);
+  self->ob_type = isolated_type;
+  return iter;
+}
+
+static PyObject *Isolated_iternext(PyObject *self)
+{
+  PyObject *next;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, NULL);
+  // advancing an iterator changes it, so readers cannot share one
+  VPY_CHECKREGIONWRITABLE(region, NULL);
+
+  self->ob_type = type;
+  next = type->tp_iternext(self);
+  self->ob_type = isolated_type;
+  return next;
+}
+
+static Py_hash_t Isolated_hash(PyObject *self)
+{
+  Py_hash_t hash;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, 0);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, 0);
+  VPY_CHECKREGIONOPEN(region, 0);
+
+  if (!region->is_open)
+  {
+    return read_hash(self, type);
+  }
+
+  self->ob_type = type;
+  hash = type->tp_hash(self);
+  self->ob_type = isolated_type;
+  return hash;
+}
+
+static PyObject *Isolated_getattro(PyObject *self, PyObject *attr_name)
+{
+  PyObject *result;
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, NULL);
+
+  // we want to allow access to any attributes of the isolated type itself
+  if (PyObject_HasAttr((PyObject *)isolated_type, attr_name))
+  {
+    RegionObject *region = get_region(self);
+    if (region != NULL && !region->is_open)
+    {
+      // isinstance() falls back on the class of an object, which for a writer
+      // is the inner type it has swapped in. A reader has to be told.
+      if (strcmp(PyUnicode_AsUTF8(attr_name), "__class__") == 0 && is_read_granted(region))
+      {
+        return Py_NewRef((PyObject *)type);
+      }
+
+      // the methods of the isolated type are those of the inner type, and
+      // would run on the object without any checks
+      if (check_read_method(region, type, attr_name) < 0)
+      {
+        return NULL;
+      }
+    }
+
+    return PyObject_GenericGetAttr(self, attr_name);
+  }
+
+  // now we check for the region tag
+  RegionTagObject *region_tag = get_tag(self, true);
+  VPY_CHECKREGION(region_tag, NULL);
+  RegionObject *region = region_tag->region;
+
+  if (strcmp(PyUnicode_AsUTF8(attr_name), "__region__") == 0)
+  {
+    // this is a special attribute, which does not require the
+    // region to be open
+    result = (PyObject *)region_tag;
+  }
+  else if (region->is_open)
+  {
+    self->ob_type = type;
+    result = PyObject_GenericGetAttr(self, attr_name);
+    self->ob_type = isolated_type;
+  }
+  else if (is_read_granted(region))
+  {
+    result = check_read_method(region, type, attr_name) < 0
+                 ? NULL
+                 : read_attribute(self, type, attr_name);
+  }
+  else
+  {
+    PyErr_SetString(RegionIsolationError, "Region is not open");
+    result = NULL;
+  }
+
+  return result;
+}
+
+static int Isolated_setattro(PyObject *self, PyObject *attr_name,
+                             PyObject *arg0)
+{
+  int rc;
+
+  PyTypeObject *isolated_type = Py_TYPE(self);
+  PyTypeObject *type = get_type(isolated_type);
+  VPY_CHECKTYPE(type, -1);
+  RegionObject *region = get_region(self);
+  VPY_CHECKREGION(region, -1);
+
+  if (strcmp(PyUnicode_AsUTF8(attr_name), "__region__") == 0)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Cannot override region");
+    return -1;
+  }
+
+  VPY_CHECKREGIONWRITABLE(region, -1);
+  VPY_CHECKARG0REGION(-1);
+
+  self->ob_type = type;
+  rc = PyObject_GenericSetAttr(self, attr_name, arg0);
+  self->ob_type = isolated_type;
+  return rc;
+}
+
+VPY_LENFUNC(tp_as_mapping, mp_length)
+VPY_BINARYFUNC(tp_as_mapping, mp_subscript, "__getitem__")
+VPY_OBJOBJARGPROC(tp_as_mapping, mp_ass_subscript);
+VPY_LENFUNC(tp_as_sequence, sq_length);
+VPY_BINARYFUNC(tp_as_sequence, sq_concat, "__add__");
+VPY_SSIZEARGFUNC(tp_as_sequence, sq_repeat, "__mul__");
+VPY_SSIZEARGFUNC(tp_as_sequence, sq_item, "__getitem__");
+VPY_SSIZEOBJARGPROC(tp_as_sequence, sq_ass_item);
+VPY_OBJOBJPROC(tp_as_sequence, sq_contains);
+VPY_INPLACEBINARYFUNC(tp_as_sequence, sq_inplace_concat, "__iadd__");
+VPY_INPLACESSIZEARGFUNC(tp_as_sequence, sq_inplace_repeat, "__imul__");
+VPY_BINARYFUNC(tp_as_number, nb_add, "__add__");
+VPY_BINARYFUNC(tp_as_number, nb_subtract, "__sub__");
+VPY_BINARYFUNC(tp_as_number, nb_multiply, "__mul__");
+VPY_BINARYFUNC(tp_as_number, nb_remainder, "__mod__");
+VPY_BINARYFUNC(tp_as_number, nb_divmod, "__divmod__");
+VPY_TERNARYFUNC(tp_as_number, nb_power, "__pow__");
+VPY_UNARYFUNC(tp_as_number, nb_negative, "__neg__");
+VPY_UNARYFUNC(tp_as_number, nb_positive, "__pos__");
+VPY_UNARYFUNC(tp_as_number, nb_absolute, "__abs__");
+VPY_INQUIRY(tp_as_number, nb_bool);
+VPY_UNARYFUNC(tp_as_number, nb_invert, "__invert__");
+VPY_BINARYFUNC(tp_as_number, nb_lshift, "__lshift__");
+VPY_BINARYFUNC(tp_as_number, nb_rshift, "__rshift__");
+VPY_BINARYFUNC(tp_as_number, nb_and, "__and__");
+VPY_BINARYFUNC(tp_as_number, nb_xor, "__xor__");
+VPY_BINARYFUNC(tp_as_number, nb_or, "__or__");
+VPY_UNARYFUNC(tp_as_number, nb_int, "__int__");
+VPY_UNARYFUNC(tp_as_number, nb_float, "__float__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_add, "__iadd__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_subtract, "__isub__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_multiply, "__imul__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_remainder, "__imod__");
+VPY_INPLACETERNARYFUNC(tp_as_number, nb_inplace_power, "__ipow__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_lshift, "__ilshift__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_rshift, "__irshift__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_and, "__iand__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_xor, "__ixor__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_or, "__ior__");
+VPY_BINARYFUNC(tp_as_number, nb_floor_divide, "__floordiv__");
+VPY_BINARYFUNC(tp_as_number, nb_true_divide, "__truediv__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_floor_divide, "__ifloordiv__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_true_divide, "__itruediv__");
+VPY_UNARYFUNC(tp_as_number, nb_index, "__index__");
+VPY_BINARYFUNC(tp_as_number, nb_matrix_multiply, "__matmul__");
+VPY_INPLACEBINARYFUNC(tp_as_number, nb_inplace_matrix_multiply, "__imatmul__");
+
+static Py_ssize_t ssize_length(Py_ssize_t value)
+{
+  if (value < 10)
+  {
+    return 1;
+  }
+
+  if (value < 100)
+  {
+    return 2;
+  }
+
+  if (value < 1000)
+  {
+    return 3;
+  }
+
+  Py_ssize_t length = 3;
+  value /= 1000;
+  do
+  {
+    ++length;
+    value /= 10;
+  } while (value != 0);
+
+  return length;
+}
+
+/**
+ * This is an attempt at making an object deeply immortal, but it does not quite work
+ * for objects which contain callables, notably type objects, as it will not make the
+ * objects referenced within them immortal (e.g. calls to built-ins)
+ */
+static int make_immortal(PyObject *obj)
+{
+  Py_SET_REFCNT(obj, _Py_IMMORTAL_REFCNT);
+
+  PyObject **dict_ptr = _PyObject_GetDictPtr(obj);
+  if (dict_ptr == NULL)
+  {
+    return 0;
+  }
+
+  PyObject *dict = *dict_ptr;
+  if (dict == NULL)
+  {
+    return 0;
+  }
+
+  PyObject *keys = PyDict_Keys(dict);
+  if (keys == NULL)
+  {
+    return -1;
+  }
+
+  Py_ssize_t length = PyList_Size(keys);
+  for (Py_ssize_t i = 0; i < length; ++i)
+  {
+    PyObject *key = PyList_GetItem(keys, i);
+    if (key == NULL)
+    {
+      return -1;
+    }
+
+    PyObject *value = PyDict_GetItem(*dict_ptr, key);
+    if (value == NULL)
+    {
+      return -1;
+    }
+
+    if (make_immortal(value) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Creates a new isolated type for the given type. The new type will wrap all of the
+ * methods of the given type to enforce that the region containing an object of this
+ * type is open. The resulting type will wrap a new type object that is a copy of the
+ * given type object.
+ */
+static PyTypeObject *isolate_type(PyTypeObject *type)
+{
+  char *name;
+  // set up all the slots
+  PyType_Slot slots[] = {
+      {Py_tp_repr, NULL},
+      {Py_tp_str, NULL},
+      {Py_tp_traverse, NULL},
+      {Py_tp_clear, NULL},
+      {Py_tp_hash, NULL},
+      {Py_tp_iter, NULL},
+      {Py_tp_iternext, NULL},
+      {Py_tp_richcompare, NULL},
+      {Py_mp_length, NULL},
+      {Py_mp_subscript, NULL},
+      {Py_mp_ass_subscript, NULL},
+      {Py_sq_length, NULL},
+      {Py_sq_concat, NULL},
+      {Py_sq_repeat, NULL},
+      {Py_sq_item, NULL},
+      {Py_sq_ass_item, NULL},
+      {Py_sq_contains, NULL},
+      {Py_sq_inplace_concat, NULL},
+      {Py_sq_inplace_repeat, NULL},
+      {Py_nb_add, NULL},
+      {Py_nb_subtract, NULL},
+      {Py_nb_multiply, NULL},
+      {Py_nb_remainder, NULL},
+      {Py_nb_divmod, NULL},
+      {Py_nb_power, NULL},
+      {Py_nb_negative, NULL},
+      {Py_nb_positive, NULL},
+      {Py_nb_absolute, NULL},
+      {Py_nb_bool, NULL},
+      {Py_nb_invert, NULL},
+      {Py_nb_lshift, NULL},
+      {Py_nb_rshift, NULL},
+      {Py_nb_and, NULL},
+      {Py_nb_xor, NULL},
+      {Py_nb_or, NULL},
+      {Py_nb_int, NULL},
+      {Py_nb_float, NULL},
+      {Py_nb_inplace_add, NULL},
+      {Py_nb_inplace_subtract, NULL},
+      {Py_nb_inplace_multiply, NULL},
+      {Py_nb_inplace_remainder, NULL},
+      {Py_nb_inplace_power, NULL},
+      {Py_nb_inplace_lshift, NULL},
+      {Py_nb_inplace_rshift, NULL},
+      {Py_nb_inplace_and, NULL},
+      {Py_nb_inplace_xor, NULL},
+      {Py_nb_inplace_or, NULL},
+      {Py_nb_floor_divide, NULL},
+      {Py_nb_true_divide, NULL},
+      {Py_nb_inplace_floor_divide, NULL},
+      {Py_nb_inplace_true_divide, NULL},
+      {Py_nb_index, NULL},
+      {Py_nb_matrix_multiply, NULL},
+      {Py_nb_inplace_matrix_multiply, NULL},
+      {Py_tp_finalize, Isolated_finalize},
+      {Py_tp_getattro, Isolated_getattro},
+      {Py_tp_setattro, Isolated_setattro},
+      {0, NULL} /* Sentinel */
+  };
+
+  const int num_tp_slots = 8;
+  const int num_mp_slots = 3;
+  const int num_sq_slots = 8;
+
+  if (type->tp_repr != NULL)
+  {
+    slots[0].pfunc = Isolated_repr;
+  }
+  if (type->tp_str != NULL)
+  {
+    slots[1].pfunc = Isolated_str;
+  }
+  if (type->tp_traverse != NULL)
+  {
+    // slots[2].pfunc = Isolated_traverse;
+  }
+  if (type->tp_clear != NULL)
+  {
+    // slots[3].pfunc = Isolated_clear;
+  }
+  if (type->tp_hash != NULL)
+  {
+    slots[4].pfunc = Isolated_hash;
+  }
+  if (type->tp_iter != NULL)
+  {
+    slots[5].pfunc = Isolated_iter;
+  }
+  if (type->tp_iternext != NULL)
+  {
+    slots[6].pfunc = Isolated_iternext;
+  }
+  if (type->tp_richcompare != NULL)
+  {
+    slots[7].pfunc = Isolated_richcompare;
+  }
+
+  if (type->tp_as_mapping != NULL)
+  {
+    PyMappingMethods *mp_methods = type->tp_as_mapping;
+    PyType_Slot *mp_slots = slots + num_tp_slots;
+    if (mp_methods->mp_length != NULL)
+    {
+      mp_slots[0].pfunc = Isolated_mp_length;
+    }
+    if (mp_methods->mp_subscript != NULL)
+    {
+      mp_slots[1].pfunc = Isolated_mp_subscript;
+    }
+    if (mp_methods->mp_ass_subscript != NULL)
+    {
+      mp_slots[2].pfunc = Isolated_mp_ass_subscript;
+    }
+  }
+
+  if (type->tp_as_sequence != NULL)
+  {
+    PySequenceMethods *sq_methods = type->tp_as_sequence;
+    PyType_Slot *sq_slots = slots + num_tp_slots + num_mp_slots;
+    if (sq_methods->sq_length != NULL)
+    {
+      sq_slots[0].pfunc = Isolated_sq_length;
+    }
+    if (sq_methods->sq_concat != NULL)
+    {
+      sq_slots[1].pfunc = Isolated_sq_concat;
+    }
+    if (sq_methods->sq_repeat != NULL)
+    {
+      sq_slots[2].pfunc = Isolated_sq_repeat;
+    }
+    if (sq_methods->sq_item != NULL)
+    {
+      sq_slots[3].pfunc = Isolated_sq_item;
+    }
+    if (sq_methods->sq_ass_item != NULL)
+    {
+      sq_slots[4].pfunc = Isolated_sq_ass_item;
+    }
+    if (sq_methods->sq_contains != NULL)
+    {
+      sq_slots[5].pfunc = Isolated_sq_contains;
+    }
+    if (sq_methods->sq_inplace_concat != NULL)
+    {
+      sq_slots[6].pfunc = Isolated_sq_inplace_concat;
+    }
+    if (sq_methods->sq_inplace_repeat != NULL)
+    {
+      sq_slots[7].pfunc = Isolated_sq_inplace_repeat;
+    }
+  }
+
+  if (type->tp_as_number != NULL)
+  {
+    PyNumberMethods *nb_methods = type->tp_as_number;
+    PyType_Slot *nb_slots = slots + num_tp_slots + num_mp_slots + num_sq_slots;
+    if (nb_methods->nb_add != NULL)
+    {
+      nb_slots[0].pfunc = Isolated_nb_add;
+    }
+    if (nb_methods->nb_subtract != NULL)
+    {
+      nb_slots[1].pfunc = Isolated_nb_subtract;
+    }
+    if (nb_methods->nb_multiply != NULL)
+    {
+      nb_slots[2].pfunc = Isolated_nb_multiply;
+    }
+    if (nb_methods->nb_remainder != NULL)
+    {
+      nb_slots[3].pfunc = Isolated_nb_remainder;
+    }
+    if (nb_methods->nb_divmod != NULL)
+    {
+      nb_slots[4].pfunc = Isolated_nb_divmod;
+    }
+    if (nb_methods->nb_power != NULL)
+    {
+      nb_slots[5].pfunc = Isolated_nb_power;
+    }
+    if (nb_methods->nb_negative != NULL)
+    {
+      nb_slots[6].pfunc = Isolated_nb_negative;
+    }
+    if (nb_methods->nb_positive != NULL)
+    {
+      nb_slots[7].pfunc = Isolated_nb_positive;
+    }
+    if (nb_methods->nb_absolute != NULL)
+    {
+      nb_slots[8].pfunc = Isolated_nb_absolute;
+    }
+    if (nb_methods->nb_bool != NULL)
+    {
+      nb_slots[9].pfunc = Isolated_nb_bool;
+    }
+    if (nb_methods->nb_invert != NULL)
+    {
+      nb_slots[10].pfunc = Isolated_nb_invert;
+    }
+    if (nb_methods->nb_lshift != NULL)
+    {
+      nb_slots[11].pfunc = Isolated_nb_lshift;
+    }
+    if (nb_methods->nb_rshift != NULL)
+    {
+      nb_slots[12].pfunc = Isolated_nb_rshift;
+    }
+    if (nb_methods->nb_and != NULL)
+    {
+      nb_slots[13].pfunc = Isolated_nb_and;
+    }
+    if (nb_methods->nb_xor != NULL)
+    {
+      nb_slots[14].pfunc = Isolated_nb_xor;
+    }
+    if (nb_methods->nb_or != NULL)
+    {
+      nb_slots[15].pfunc = Isolated_nb_or;
+    }
+    if (nb_methods->nb_int != NULL)
+    {
+      nb_slots[16].pfunc = Isolated_nb_int;
+    }
+    if (nb_methods->nb_float != NULL)
+    {
+      nb_slots[17].pfunc = Isolated_nb_float;
+    }
+    if (nb_methods->nb_inplace_add != NULL)
+    {
+      nb_slots[18].pfunc = Isolated_nb_inplace_add;
+    }
+    if (nb_methods->nb_inplace_subtract != NULL)
+    {
+      nb_slots[19].pfunc = Isolated_nb_inplace_subtract;
+    }
+    if (nb_methods->nb_inplace_multiply != NULL)
+    {
+      nb_slots[20].pfunc = Isolated_nb_inplace_multiply;
+    }
+    if (nb_methods->nb_inplace_remainder != NULL)
+    {
+      nb_slots[21].pfunc = Isolated_nb_inplace_remainder;
+    }
+    if (nb_methods->nb_inplace_power != NULL)
+    {
+      nb_slots[22].pfunc = Isolated_nb_inplace_power;
+    }
+    if (nb_methods->nb_inplace_lshift != NULL)
+    {
+      nb_slots[23].pfunc = Isolated_nb_inplace_lshift;
+    }
+    if (nb_methods->nb_inplace_rshift != NULL)
+    {
+      nb_slots[24].pfunc = Isolated_nb_inplace_rshift;
+    }
+    if (nb_methods->nb_inplace_and != NULL)
+    {
+      nb_slots[25].pfunc = Isolated_nb_inplace_and;
+    }
+    if (nb_methods->nb_inplace_xor != NULL)
+    {
+      nb_slots[26].pfunc = Isolated_nb_inplace_xor;
+    }
+    if (nb_methods->nb_inplace_or != NULL)
+    {
+      nb_slots[27].pfunc = Isolated_nb_inplace_or;
+    }
+    if (nb_methods->nb_floor_divide != NULL)
+    {
+      nb_slots[28].pfunc = Isolated_nb_floor_divide;
+    }
+    if (nb_methods->nb_true_divide != NULL)
+    {
+      nb_slots[29].pfunc = Isolated_nb_true_divide;
+    }
+    if (nb_methods->nb_inplace_floor_divide != NULL)
+    {
+      nb_slots[30].pfunc = Isolated_nb_inplace_floor_divide;
+    }
+    if (nb_methods->nb_inplace_true_divide != NULL)
+    {
+      nb_slots[31].pfunc = Isolated_nb_inplace_true_divide;
+    }
+    if (nb_methods->nb_index != NULL)
+    {
+      nb_slots[32].pfunc = Isolated_nb_index;
+    }
+    if (nb_methods->nb_matrix_multiply != NULL)
+    {
+      nb_slots[33].pfunc = Isolated_nb_matrix_multiply;
+    }
+    if (nb_methods->nb_inplace_matrix_multiply != NULL)
+    {
+      nb_slots[34].pfunc = Isolated_nb_inplace_matrix_multiply;
+    }
+  }
+
+  // create the new type
+  const char *name_format = "interp_%li.isolated.%s";
+  name = (char *)malloc(strlen(name_format) + strlen(type->tp_name) + ssize_length(alloc_id) + 1);
+  sprintf(name, name_format, alloc_id, type->tp_name);
+  PyType_Spec spec = {
+      .name = name,
+      .basicsize = (int)type->tp_basicsize,
+      .itemsize = (int)type->tp_itemsize,
+      // per-region types derive from the isolated type
+      .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HEAPTYPE | Py_TPFLAGS_BASETYPE,
+      .slots = slots,
+  };
+
+  Py_INCREF((PyObject *)type);
+  PyTypeObject *isolated_type = (PyTypeObject *)PyType_FromSpecWithBases(&spec, (PyObject *)type);
+  if (isolated_type == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Unable to create isolated type");
+    return NULL;
+  }
+
+  Py_SET_REFCNT((PyObject *)isolated_type, _Py_IMMORTAL_REFCNT);
+
+  PRINTDBG("created isolated type %p for %s\n", isolated_type, type->tp_name);
+
+  // we need to store the inner type is it can be used in different interpreters
+  PyObject *source = get_source((PyObject *)type);
+  if (source == NULL)
+  {
+    // this is a builtin type or an extension type. We freeze it and hope for the best.
+    PyErr_Clear();
+
+    Py_INCREF((PyObject *)type);
+    if (PyDict_SetItemString(PyType_GetDict(isolated_type), "__isolated__", (PyObject *)type) < 0)
+    {
+      Py_DECREF((PyObject *)isolated_type);
+      PyErr_SetString(PyExc_TypeError,
+                      "error adding internal type to isolated type dictionary");
+      return NULL;
+    }
+
+    type->tp_flags = Py_TPFLAGS_IMMUTABLETYPE | type->tp_flags;
+    if (make_immortal((PyObject *)type) < 0)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Unable to make type immortal");
+      return NULL;
     }
-    if (nb_methods->nb_inplace_rshift != NULL)
+
+    return isolated_type;
+  }
+  else
+  {
+    // add the type name to the end so we can use it later
+    source = PyUnicode_Concat(source, PyUnicode_FromString("\n"));
+    source = PyUnicode_Concat(source, PyUnicode_FromString(type->tp_name));
+  }
+
+  // generate the unique type ID
+  long long type_id = atomic_increment(&frozen_type_count);
+  PyObject *type_id_long = PyLong_FromLongLong(type_id);
+
+  if (PyDict_SetItemString(PyType_GetDict(isolated_type), "__isolated__", type_id_long) < 0)
+  {
+    Py_DECREF((PyObject *)isolated_type);
+    PyErr_SetString(PyExc_TypeError,
+                    "error adding frozen type source to isolated type dictionary");
+    return NULL;
+  }
+
+  // first we store the type object and source string on the local interpreter
+  // these objects will live for the duration of the interpreter and can be
+  // safely used from other interpreters
+  PyObject *type_tuple = PyTuple_Pack(2, (PyObject *)type, source);
+  if (type_tuple == NULL)
+  {
+    Py_DECREF((PyObject *)isolated_type);
+    PyErr_SetString(PyExc_TypeError,
+                    "error creating frozen type tuple");
+    return NULL;
+  }
+
+  if (PyDict_SetItem(vpy_state->frozen_types, type_id_long, type_tuple) < 0)
+  {
+    Py_DECREF((PyObject *)isolated_type);
+    PyErr_SetString(PyExc_TypeError,
+                    "error adding frozen type to frozen types dictionary");
+    return NULL;
+  }
+
+  // we then store the pointers in the global type hashtable so it can be
+  // obtained when first referenced in another interpreter
+  if (!ht_set(global_frozen_types, (voidptr_t)type_id, (voidptr_t)source))
+  {
+    Py_DECREF((PyObject *)isolated_type);
+    PyErr_SetString(PyExc_TypeError,
+                    "error adding frozen type source to global frozen types dictionary");
+    return NULL;
+  }
+
+  return isolated_type;
+}
+
+/***************************************************************/
+/*              Merge struct and methods                       */
+/***************************************************************/
+
+typedef struct merge_object_s
+{
+  PyObject_HEAD;
+  PyObject *objects;
+} MergeObject;
+
+static PyObject *Merge_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  MergeObject *self;
+  self = (MergeObject *)type->tp_alloc(type, 0);
+  if (self != NULL)
+  {
+    self->objects = NULL;
+  }
+
+  return (PyObject *)self;
+}
+
+static void Merge_dealloc(MergeObject *self)
+{
+  Py_XDECREF(self->objects);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Merge_init(MergeObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *objects = NULL;
+
+  if (!PyArg_ParseTuple(args, "O", &objects))
+    return -1;
+
+  if (objects)
+  {
+    Py_INCREF(objects);
+    self->objects = objects;
+  }
+
+  return 0;
+}
+
+static PyObject *Merge_getattro(MergeObject *self, PyObject *name)
+{
+  return PyObject_GetItem(self->objects, name);
+}
+
+static PyTypeObject MergeType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.merge",
+    .tp_doc = PyDoc_STR("Merge object"),
+    .tp_basicsize = sizeof(MergeObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Merge_new,
+    .tp_init = (initproc)Merge_init,
+    .tp_dealloc = (destructor)Merge_dealloc,
+    .tp_getattro = (getattrofunc)Merge_getattro,
+};
+
+/***************************************************************/
+/*              Region object methods                          */
+/***************************************************************/
+
+/* static int Region_clear(RegionObject *self)
+{
+  Py_CLEAR(self->objects);
+  Py_CLEAR(self->types);
+  Py_CLEAR(self->alias);
+  Py_CLEAR(self->parent);
+  return 0;
+}
+
+static int Region_traverse(RegionObject *self, visitproc visit, void *arg)
+{
+  Py_VISIT(self->objects);
+  Py_VISIT(self->types);
+  Py_VISIT(self->alias);
+  Py_VISIT(self->parent);
+  return 0;
+} */
+
+static void Region_dealloc(RegionObject *self)
+{
+  // PyObject_GC_UnTrack(self);
+  // Region_clear(self);
+  PRINTDBG("deallocating region %llu\n", self->id);
+  Py_XDECREF(self->name);
+  Py_XDECREF(self->alias);
+  release_tagged(self);
+  Py_XDECREF(self->tag);
+  if (self->types != NULL)
+  {
+    ht_free(self->types);
+  }
+
+  free(self->sealed_objects);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Region_new(PyTypeObject *type, PyObject *args,
+                            PyObject *kwds)
+{
+  RegionObject *self;
+  self = (RegionObject *)type->tp_alloc(type, 0);
+  if (self != NULL)
+  {
+    self->name = PyUnicode_FromString("");
+    if (self->name == NULL)
     {
-      nb_slots[24].pfunc = Isolated_nb_inplace_rshift;
+      Py_DECREF(self);
+      return NULL;
     }
-    if (nb_methods->nb_inplace_and != NULL)
+
+    // The region is its own alias by default
+    Py_INCREF((PyObject *)self);
+    self->alias = (PyObject *)self;
+    self->rank = 0;
+    self->parent = NULL;
+    self->is_open = false;
+    self->is_shared = false;
+    self->traverse = false;
+    self->id = 0;
+    self->types = NULL;
+    self->tag = NULL;
+    self->objects = PyDict_New();
+    if (self->objects == NULL)
     {
-      nb_slots[25].pfunc = Isolated_nb_inplace_and;
+      Py_DECREF(self);
+      return NULL;
     }
-    if (nb_methods->nb_inplace_xor != NULL)
+  }
+
+  return (PyObject *)self;
+}
+
+static int Region_init(RegionObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"name", "traverse", NULL};
+  PyObject *name = NULL, *tmp, *typedict, *key;
+  int traverse = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Op", kwlist, &name, &traverse))
+    return -1;
+
+  self->traverse = traverse;
+
+  self->id = atomic_increment(&region_identity);
+  key = PyUnicode_FromFormat("region_%llu", self->id);
+
+  if (name)
+  {
+    tmp = self->name;
+    Py_INCREF(name);
+    self->name = name;
+    Py_XDECREF(tmp);
+  }
+  else
+  {
+    self->name = PyUnicode_FromFormat("region_%llu", self->id);
+    if (self->name == NULL)
+    {
+      Py_DECREF(self);
+      return -1;
+    }
+  }
+
+  typedict = PyType_GetDict(self->ob_base.ob_type);
+  if (typedict == NULL)
+  {
+    Py_DECREF(self);
+    return -1;
+  }
+
+  Py_INCREF(self);
+  if (PyDict_SetItem(typedict, key, (PyObject *)self) < 0)
+  {
+    Py_DECREF(self);
+    return -1;
+  }
+
+  PRINTDBG("region init %s %lu @ %p\n", PyUnicode_AsUTF8(self->name), self->id, self);
+
+  Py_SET_REFCNT((PyObject *)self, _Py_IMMORTAL_REFCNT);
+
+  return 0;
+}
+
+static PyObject *Region_getname(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  Py_INCREF(region->name);
+  return region->name;
+}
+
+static int Region_setname(RegionObject *self, PyObject *value, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  PyObject *tmp;
+  if (value == NULL)
+  {
+    PyErr_SetString(PyExc_TypeError, "Cannot delete the name attribute");
+    return -1;
+  }
+
+  if (!PyUnicode_Check(value))
+  {
+    PyErr_SetString(PyExc_TypeError,
+                    "The name attribute value must be a string");
+    return -1;
+  }
+
+  tmp = region->name;
+  Py_INCREF(value);
+  region->name = value;
+  Py_XDECREF(tmp);
+  return 0;
+}
+
+static PyObject *Region_getidentity(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  return PyLong_FromUnsignedLongLong(region->id);
+}
+
+static PyObject *Region_getparent(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  Py_INCREF(region->parent);
+  return region->parent;
+}
+
+static PyObject *Region_getisopen(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  return PyBool_FromLong(region->is_open);
+}
+
+static PyObject *Region_getisshared(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  return PyBool_FromLong(region->is_shared);
+}
+
+static PyObject *Region_getisfree(RegionObject *self, void *closure)
+{
+  RegionObject *region = resolve_region(self);
+  return PyBool_FromLong(is_free(region));
+}
+
+static PyGetSetDef Region_getsetters[] = {
+    {"name", (getter)Region_getname, (setter)Region_setname,
+     "Human-readable name for the region", NULL},
+    {"id", (getter)Region_getidentity, NULL,
+     "The immutable, unique identity for the region", NULL},
+    {"parent", (getter)Region_getparent, NULL, "The parent region", NULL},
+    {"is_open", (getter)Region_getisopen, NULL,
+     "Whether the region is currently open", NULL},
+    {"is_shared", (getter)Region_getisshared, NULL,
+     "Whether the region is shared", NULL},
+    {"is_free", (getter)Region_getisfree, NULL, "Whether the region is free",
+     NULL},
+    {NULL} /* Sentinel */
+};
+
+/**
+ * Exchanges everything which makes up the identity and state of two regions,
+ * but not their positions in the alias trees. The behavior queues (last) are
+ * also left in place, as behaviors are scheduled on the region objects which
+ * they were given.
+ */
+static void swap_region_payload(RegionObject *lhs, RegionObject *rhs)
+{
+  RegionObject tmp;
+  tmp.name = lhs->name;
+  tmp.id = lhs->id;
+  tmp.is_open = lhs->is_open;
+  tmp.is_shared = lhs->is_shared;
+  tmp.traverse = lhs->traverse;
+  tmp.parent = lhs->parent;
+  tmp.objects = lhs->objects;
+
+  lhs->name = rhs->name;
+  lhs->id = rhs->id;
+  lhs->is_open = rhs->is_open;
+  lhs->is_shared = rhs->is_shared;
+  lhs->traverse = rhs->traverse;
+  lhs->parent = rhs->parent;
+  lhs->objects = rhs->objects;
+
+  rhs->name = tmp.name;
+  rhs->id = tmp.id;
+  rhs->is_open = tmp.is_open;
+  rhs->is_shared = tmp.is_shared;
+  rhs->traverse = tmp.traverse;
+  rhs->parent = tmp.parent;
+  rhs->objects = tmp.objects;
+}
+
+static PyObject *Region_merge(RegionObject *self, PyObject *args,
+                              PyObject *kwds)
+{
+  PyObject *arg;
+  RegionObject *other;
+  RegionObject *region = resolve_region(self);
+
+  if (!PyArg_ParseTuple(args, "O", &arg))
+    return NULL;
+
+  if (!Region_Check(arg))
+  {
+    PyErr_SetString(PyExc_TypeError, "Argument must be a region");
+    return NULL;
+  }
+
+  other = resolve_region((RegionObject *)arg);
+
+  VPY_CHECKREGIONWRITABLE(region, NULL);
+
+  if (!is_free(region))
+  {
+    PyErr_SetString(RegionIsolationError, "Region is not free");
+    return NULL;
+  }
+
+  PyObject *objects = other->objects;
+  if (other != region)
+  {
+    if (other->rank > region->rank)
     {
-      nb_slots[26].pfunc = Isolated_nb_inplace_xor;
+      // the other tree is taller, so its root stays the root and takes
+      // on the identity of this region
+      swap_region_payload(region, other);
+      RegionObject *tmp = region;
+      region = other;
+      other = tmp;
     }
-    if (nb_methods->nb_inplace_or != NULL)
+    else if (other->rank == region->rank)
     {
-      nb_slots[27].pfunc = Isolated_nb_inplace_or;
+      region->rank++;
     }
-    if (nb_methods->nb_floor_divide != NULL)
+
+    Py_INCREF(region);
+    Py_SETREF(other->alias, (PyObject *)region);
+
+    if (redirect_tagged(other, region) < 0)
     {
-      nb_slots[28].pfunc = Isolated_nb_floor_divide;
+      return NULL;
     }
-    if (nb_methods->nb_true_divide != NULL)
+  }
+
+  PyObject *argList = Py_BuildValue("(O)", objects);
+  PyObject *merged = PyObject_Call((PyObject *)&MergeType, argList, NULL);
+  if (merged == NULL)
+  {
+    return NULL;
+  }
+
+  Py_INCREF(merged);
+  return merged;
+}
+
+static PyObject *Region_makeshareable(RegionObject *self, PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+
+  region->is_shared = true;
+  region->last = 0;
+  region->readers = 0;
+  region->writer = 0;
+  region->sealed = false;
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *Region_detachall(RegionObject *self, PyObject *args)
+{
+  PyObject *objects;
+  RegionObject *detached;
+  RegionObject *region = resolve_region(self);
+
+  if (!region->is_open)
+  {
+    PyErr_SetString(RegionIsolationError,
+                    is_read_granted(region) ? "Region is open read-only" : "Region must be open");
+    return NULL;
+  }
+
+  if (!region->is_shared)
+  {
+    PyErr_SetString(RegionIsolationError, "Region must be shared");
+    return NULL;
+  }
+
+  detached = (RegionObject *)PyObject_CallObject((PyObject *)self->ob_base.ob_type, args);
+  if (detached == NULL)
+  {
+    return NULL;
+  }
+
+  objects = region->objects;
+  region->objects = detached->objects;
+  detached->objects = objects;
+
+  Py_INCREF(detached);
+  return (PyObject *)detached;
+}
+
+static PyObject *Region_str(RegionObject *self, PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+  return PyUnicode_FromFormat("Region(%S)", region->name);
+}
+
+static PyObject *Region_repr(RegionObject *self, PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+  return PyUnicode_FromFormat("Region(%S%s%s)", region->name,
+                              region->id, region->is_open ? " open" : "",
+                              region->is_shared ? " shared" : "");
+}
+
+static PyObject *Region_enter(RegionObject *self,
+                              PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+  region->is_open = true;
+  Py_INCREF((PyObject *)region);
+  return (PyObject *)region;
+}
+
+static PyObject *Region_exit(RegionObject *self, PyObject *args,
+                             PyObject *kwds)
+{
+  RegionObject *region = resolve_region(self);
+  PyObject *type, *value, *traceback;
+  if (!PyArg_ParseTuple(args, "OOO", &type, &value, &traceback))
+    return NULL;
+
+  if (type == Py_None)
+  {
+    region->is_open = false;
+  }
+  else
+  {
+    Py_INCREF(type);
+    Py_INCREF(value);
+    Py_INCREF(traceback);
+    PyErr_Restore(type, value, traceback);
+    return NULL;
+  }
+
+  Py_RETURN_FALSE;
+}
+
+/** Whether the name is one of the attributes of the region itself. */
+static bool is_region_attr(PyObject *attr_name)
+{
+  const char *name = PyUnicode_AsUTF8(attr_name);
+  for (int i = 0; REGION_ATTRS[i] != NULL; i++)
+  {
+    if (strcmp(name, REGION_ATTRS[i]) == 0)
     {
-      nb_slots[29].pfunc = Isolated_nb_true_divide;
+      return true;
     }
-    if (nb_methods->nb_inplace_floor_divide != NULL)
+  }
+
+  return false;
+}
+
+/**
+ * Sets many attributes of the region at once. All of the values are captured
+ * together and published to the object tables in a single batch.
+ */
+static PyObject *Region_update(RegionObject *self, PyObject *args)
+{
+  PyObject *mapping;
+  int rc = 0;
+
+  if (!PyArg_ParseTuple(args, "O", &mapping))
+  {
+    return NULL;
+  }
+
+  RegionObject *region = resolve_region(self);
+  VPY_CHECKREGIONWRITABLE(region, NULL);
+
+  PyObject *items = PyMapping_Items(mapping);
+  if (items == NULL)
+  {
+    return NULL;
+  }
+
+  Py_ssize_t length = PyList_GET_SIZE(items);
+  for (Py_ssize_t i = 0; i < length; i++)
+  {
+    PyObject *key = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0);
+    if (!PyUnicode_Check(key))
     {
-      nb_slots[30].pfunc = Isolated_nb_inplace_floor_divide;
+      PyErr_SetString(PyExc_TypeError, "Region attribute names must be strings");
+      Py_DECREF(items);
+      return NULL;
     }
-    if (nb_methods->nb_inplace_true_divide != NULL)
+
+    if (is_region_attr(key))
     {
-      nb_slots[31].pfunc = Isolated_nb_inplace_true_divide;
+      PyErr_Format(PyExc_ValueError, "Cannot update region attribute %U", key);
+      Py_DECREF(items);
+      return NULL;
     }
-    if (nb_methods->nb_index != NULL)
+  }
+
+  CaptureState state;
+  if (capture_begin(&state) != 0)
+  {
+    Py_DECREF(items);
+    return NULL;
+  }
+
+  for (Py_ssize_t i = 0; i < length && rc == 0; i++)
+  {
+    PyObject *value = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 1);
+    RegionObject *value_region = get_region(value);
+    if (value_region == NULL)
     {
-      nb_slots[32].pfunc = Isolated_nb_index;
+      rc = capture_graph(&state, region, value);
     }
-    if (nb_methods->nb_matrix_multiply != NULL)
+    else if (value_region != region)
     {
-      nb_slots[33].pfunc = Isolated_nb_matrix_multiply;
+      PyErr_SetString(RegionIsolationError, "Value belongs to another region");
+      rc = -1;
     }
-    if (nb_methods->nb_inplace_matrix_multiply != NULL)
+  }
+
+  rc = capture_end(&state, rc);
+
+  for (Py_ssize_t i = 0; i < length && rc == 0; i++)
+  {
+    PyObject *item = PyList_GET_ITEM(items, i);
+    rc = PyDict_SetItem(region->objects, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+  }
+
+  Py_DECREF(items);
+
+  if (rc < 0)
+  {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef Region_methods[] = {
+    {"__enter__", (PyCFunction)Region_enter, METH_NOARGS, "Enter the region"},
+    {"__exit__", (PyCFunction)Region_exit, METH_VARARGS,
+     "Exit the region, returning a Boolean flag indicating whether any "
+     "exception that occurred should be suppressed."},
+    {"merge", (PyCFunction)Region_merge, METH_VARARGS,
+     "Merge the other region into this one"},
+    {"make_shareable", (PyCFunction)Region_makeshareable, METH_NOARGS,
+     "Make the region shareable"},
+    {"detach_all", (PyCFunction)Region_detachall, METH_VARARGS,
+     "Detach all objects from the region"},
+    {"update", (PyCFunction)Region_update, METH_VARARGS,
+     "Set many attributes of the region at once"},
+    {NULL} /* Sentinel */
+};
+
+static PyObject *Region_getattro(RegionObject *self, PyObject *attr_name)
+{
+  RegionObject *region = resolve_region(self);
+  for (int i = 0; REGION_ATTRS[i] != NULL; i++)
+  {
+    if (strcmp(PyUnicode_AsUTF8(attr_name), REGION_ATTRS[i]) == 0)
     {
-      nb_slots[34].pfunc = Isolated_nb_inplace_matrix_multiply;
+      return PyObject_GenericGetAttr((PyObject *)region, attr_name);
     }
   }
 
-  // create the new type
-  const char *name_format = "interp_%li.isolated.%s";
-  name = (char *)malloc(strlen(name_format) + strlen(type->tp_name) + ssize_length(alloc_id) + 1);
-  sprintf(name, name_format, alloc_id, type->tp_name);
-  PyType_Spec spec = {
-      .name = name,
-      .basicsize = (int)type->tp_basicsize,
-      .itemsize = (int)type->tp_itemsize,
-      .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HEAPTYPE,
-      .slots = slots,
-  };
+  VPY_CHECKREGIONOPEN(region, NULL);
 
-  Py_INCREF((PyObject *)type);
-  PyTypeObject *isolated_type = (PyTypeObject *)PyType_FromSpecWithBases(&spec, (PyObject *)type);
-  if (isolated_type == NULL)
+  PyObject *obj = PyDict_GetItemWithError(region->objects, attr_name);
+  if (obj == NULL)
   {
-    PyErr_SetString(PyExc_RuntimeError, "Unable to create isolated type");
-    return NULL;
+    Py_RETURN_NONE;
   }
 
-  Py_SET_REFCNT((PyObject *)isolated_type, _Py_IMMORTAL_REFCNT);
-
-  PRINTDBG("created isolated type %p for %s\n", isolated_type, type->tp_name);
+  return region->is_open ? Py_NewRef(obj) : read_borrowed(obj);
+}
 
-  // we need to store the inner type is it can be used in different interpreters
-  PyObject *source = get_source((PyObject *)type);
-  if (source == NULL)
+static int Region_setattro(RegionObject *self, PyObject *attr_name,
+                           PyObject *value)
+{
+  int rc;
+  RegionObject *region = resolve_region(self);
+  for (int i = 0; REGION_ATTRS[i] != NULL; i++)
   {
-    // this is a builtin type or an extension type. We freeze it and hope for the best.
-    PyErr_Clear();
-
-    Py_INCREF((PyObject *)type);
-    if (PyDict_SetItemString(PyType_GetDict(isolated_type), "__isolated__", (PyObject *)type) < 0)
+    if (strcmp(PyUnicode_AsUTF8(attr_name), REGION_ATTRS[i]) == 0)
     {
-      Py_DECREF((PyObject *)isolated_type);
-      PyErr_SetString(PyExc_TypeError,
-                      "error adding internal type to isolated type dictionary");
-      return NULL;
+      return PyObject_GenericSetAttr((PyObject *)region, attr_name, value);
     }
+  }
 
-    type->tp_flags = Py_TPFLAGS_IMMUTABLETYPE | type->tp_flags;
-    if (make_immortal((PyObject *)type) < 0)
+  VPY_CHECKREGIONWRITABLE(region, -1);
+
+  RegionObject *value_region = get_region(value);
+  if (value_region == NULL)
+  {
+    rc = capture_object(region, value);
+    if (rc < 0)
     {
-      PyErr_SetString(PyExc_RuntimeError, "Unable to make type immortal");
-      return NULL;
+      return rc;
     }
 
-    return isolated_type;
+    value_region = region;
   }
-  else
+
+  if (value_region == region)
   {
-    // add the type name to the end so we can use it later
-    source = PyUnicode_Concat(source, PyUnicode_FromString("\n"));
-    source = PyUnicode_Concat(source, PyUnicode_FromString(type->tp_name));
+    Py_INCREF(value);
+    rc = PyDict_SetItem(region->objects, attr_name, value);
+    return rc;
   }
 
-  // generate the unique type ID
-  long long type_id = atomic_increment(&frozen_type_count);
-  PyObject *type_id_long = PyLong_FromLongLong(type_id);
+  PyErr_SetString(RegionIsolationError, "Value belongs to another region");
+  return -1;
+}
 
-  if (PyDict_SetItemString(PyType_GetDict(isolated_type), "__isolated__", type_id_long) < 0)
+static Py_hash_t Region_hash(RegionObject *self)
+{
+  RegionObject *region = resolve_region(self);
+  return (Py_hash_t)region->id;
+}
+
+static PyObject *Region_richcompare(PyObject *lhs, PyObject *rhs, int op)
+{
+  RegionObject *lhs_region, *rhs_region;
+  if (!Region_Check(rhs))
   {
-    Py_DECREF((PyObject *)isolated_type);
-    PyErr_SetString(PyExc_TypeError,
-                    "error adding frozen type source to isolated type dictionary");
-    return NULL;
+    Py_RETURN_NOTIMPLEMENTED;
   }
 
-  // first we store the type object and source string on the local interpreter
-  // these objects will live for the duration of the interpreter and can be
-  // safely used from other interpreters
-  PyObject *type_tuple = PyTuple_Pack(2, (PyObject *)type, source);
-  if (type_tuple == NULL)
+  lhs_region = (RegionObject *)lhs;
+  rhs_region = (RegionObject *)rhs;
+  if (lhs_region->alias != lhs)
   {
-    Py_DECREF((PyObject *)isolated_type);
-    PyErr_SetString(PyExc_TypeError,
-                    "error creating frozen type tuple");
-    return NULL;
+    lhs_region = resolve_region(lhs_region);
+  }
+  if (rhs_region->alias != rhs)
+  {
+    rhs_region = resolve_region(rhs_region);
   }
 
-  if (PyDict_SetItem(vpy_state->frozen_types, type_id_long, type_tuple) < 0)
+  Py_RETURN_RICHCOMPARE(lhs_region->id, rhs_region->id, op);
+}
+
+static PyTypeObject RegionType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.region",
+    .tp_doc = PyDoc_STR("Region object"),
+    .tp_basicsize = sizeof(RegionObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT, //  | Py_TPFLAGS_HAVE_GC
+    .tp_new = Region_new,
+    .tp_init = (initproc)Region_init,
+    .tp_dealloc = (destructor)Region_dealloc,
+    .tp_methods = Region_methods,
+    .tp_getset = Region_getsetters,
+    .tp_repr = (reprfunc)Region_repr,
+    .tp_str = (reprfunc)Region_str,
+    .tp_setattro = (setattrofunc)Region_setattro,
+    .tp_getattro = (getattrofunc)Region_getattro,
+    //.tp_traverse = (traverseproc)Region_traverse,
+    //.tp_clear = (inquiry)Region_clear,
+    .tp_hash = (hashfunc)Region_hash,
+    .tp_richcompare = (richcmpfunc)Region_richcompare,
+};
+
+static bool Region_Check(PyObject *obj)
+{
+  PyTypeObject *obj_type = Py_TYPE(obj);
+  PyTypeObject *region_type = (PyTypeObject *)&RegionType;
+  return obj_type == region_type;
+}
+
+/***************************************************************/
+/*                 RegionTag setup                             */
+/***************************************************************/
+
+static void RegionTag_dealloc(RegionTagObject *self)
+{
+  Py_XDECREF(self->region);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *RegionTag_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kwds)
+{
+  RegionTagObject *self;
+  self = (RegionTagObject *)type->tp_alloc(type, 0);
+  if (self != NULL)
   {
-    Py_DECREF((PyObject *)isolated_type);
-    PyErr_SetString(PyExc_TypeError,
-                    "error adding frozen type to frozen types dictionary");
-    return NULL;
+    self->region = NULL;
   }
 
-  // we then store the pointers in the global type hashtable so it can be
-  // obtained when first referenced in another interpreter
-  if (!ht_set(global_frozen_types, (voidptr_t)type_id, (voidptr_t)source))
+  return (PyObject *)self;
+}
+
+static int RegionTag_init(RegionTagObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *region = NULL;
+
+  if (!PyArg_ParseTuple(args, "O", &region))
+    return -1;
+
+  self->region = (RegionObject *)region;
+
+  Py_SET_REFCNT((PyObject *)self, _Py_IMMORTAL_REFCNT);
+
+  return 0;
+}
+
+static PyObject *RegionTag_str(RegionTagObject *self, PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+  return PyUnicode_FromFormat("RegionTag(%S)", region->name, region->id);
+}
+
+static PyObject *RegionTag_repr(RegionTagObject *self, PyObject *Py_UNUSED(ignored))
+{
+  RegionObject *region = resolve_region(self);
+  return PyUnicode_FromFormat("RegionTag(%S%s%s)", region->name,
+                              region->id, region->is_open ? " open" : "",
+                              region->is_shared ? " shared" : "");
+}
+
+static PyObject *RegionTag_richcompare(PyObject *lhs, PyObject *rhs, int op)
+{
+  RegionTagObject *lhs_tag, *rhs_tag;
+  RegionObject *lhs_region, *rhs_region;
+  if (Region_Check(rhs))
   {
-    Py_DECREF((PyObject *)isolated_type);
-    PyErr_SetString(PyExc_TypeError,
-                    "error adding frozen type source to global frozen types dictionary");
-    return NULL;
+    rhs_region = (RegionObject *)rhs;
+  }
+  else if (rhs->ob_type == &RegionTagType)
+  {
+    rhs_tag = (RegionTagObject *)rhs;
+    rhs_region = rhs_tag->region;
   }
+  else
+  {
+    Py_RETURN_NOTIMPLEMENTED;
+  }
+
+  lhs_tag = (RegionTagObject *)lhs;
+  lhs_region = lhs_tag->region;
+
+  if (lhs_region->alias != lhs)
+  {
+    lhs_region = resolve_region(lhs_region);
+  }
+  if (rhs_region->alias != rhs)
+  {
+    rhs_region = resolve_region(rhs_region);
+  }
+
+  Py_RETURN_RICHCOMPARE(lhs_region->id, rhs_region->id, op);
+}
+
+static PyTypeObject RegionTagType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.regiontag",
+    .tp_doc = PyDoc_STR("Region tag object"),
+    .tp_basicsize = sizeof(RegionTagObject),
+    .tp_itemsize = 0,
+    .tp_new = RegionTag_new,
+    .tp_init = (initproc)RegionTag_init,
+    .tp_dealloc = (destructor)RegionTag_dealloc,
+    .tp_repr = (reprfunc)RegionTag_repr,
+    .tp_str = (reprfunc)RegionTag_str,
+    .tp_richcompare = (richcmpfunc)RegionTag_richcompare,
+};
 
-  return isolated_type;
-}
+/***************************************************************/
+/*                 IsolatedType setup                          */
+/***************************************************************/
+
+static PyTypeObject IsolatedTypeType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.isolatedtype",
+    .tp_doc = PyDoc_STR("Metatype of per-region isolated types"),
+    .tp_basicsize = sizeof(IsolatedTypeObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
 
 /***************************************************************/
-/*              Merge struct and methods                       */
+/*                       I/O Reactor                           */
 /***************************************************************/
 
-typedef struct merge_object_s
-{
-  PyObject_HEAD;
-  PyObject *objects;
-} MergeObject;
+#ifndef _WIN32
+
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_SLEEP 2
+
+// The most events handled each time the reactor waits
+#define REACTOR_MAX_EVENTS 64
+
+/** A read, write or sleep submitted to the reactor. */
+typedef struct io_op_s
+{
+  // IO_READ, IO_WRITE or IO_SLEEP
+  int kind;
+  // The descriptor to read from or write to
+  int fd;
+  // Whether the descriptor is in blocking mode, in which case a write only
+  // sends as much as the descriptor is sure to take at once
+  bool blocking;
+  // The data which was read, or which is to be written
+  char *buffer;
+  // The size of the buffer
+  Py_ssize_t size;
+  // The number of bytes read or written so far
+  Py_ssize_t done;
+  // When a sleep ends (on the monotonic clock, in nanoseconds)
+  long long deadline;
+  // The errno of the operation if it failed, or 0
+  int error_number;
+  // Completed with the result of the operation
+  Future *future;
+  // The next operation which was submitted, or which waits on the descriptor
+  struct io_op_s *next;
+} IoOp;
+
+/** The operations waiting on a descriptor, in the order they were submitted. */
+typedef struct io_watch_s
+{
+  IoOp *reads;
+  IoOp *writes;
+  // The events which the descriptor is registered for
+  int events;
+} IoWatch;
 
-static PyObject *Merge_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-  MergeObject *self;
-  self = (MergeObject *)type->tp_alloc(type, 0);
-  if (self != NULL)
-  {
-    self->objects = NULL;
-  }
+/**
+ * Runs reads, writes and sleeps on a thread of its own, so that a behavior
+ * which awaits I/O gives its worker back in the meantime. Operations are
+ * pushed onto a lock-free stack from any thread and the reactor is signalled
+ * to take them. Descriptors are watched with epoll on Linux and poll
+ * elsewhere, and sleeps are kept in a heap ordered by deadline. Each
+ * operation completes a future, which resumes whoever awaits it.
+ */
+typedef struct reactor_s
+{
+  thrd_t thread;
+  // The stack of operations which have been submitted
+  atomic_voidptr_t submitted;
+  // Set to stop the reactor
+  atomic_bool stopping;
+  // Signalled when operations are submitted (see signal_open)
+  int signal_fds[2];
+#ifdef __linux__
+  int epoll_fd;
+#else
+  // The descriptors passed to poll
+  struct pollfd *polls;
+  Py_ssize_t poll_capacity;
+#endif
+  // The following are only used by the reactor thread.
+  // The watches, indexed by descriptor
+  IoWatch *watches;
+  int watch_capacity;
+  // A min-heap of sleeps ordered by deadline
+  IoOp **timers;
+  Py_ssize_t timer_count;
+  Py_ssize_t timer_capacity;
+} Reactor;
 
-  return (PyObject *)self;
-}
+// The reactor, once the first operation has been submitted
+static Reactor *reactor = NULL;
 
-static void Merge_dealloc(MergeObject *self)
+// Serialises starting and stopping the reactor
+static mtx_t reactor_mutex;
+
+static long long monotonic_ns()
 {
-  Py_XDECREF(self->objects);
-  Py_TYPE(self)->tp_free((PyObject *)self);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-static int Merge_init(MergeObject *self, PyObject *args, PyObject *kwds)
+/** Completes the future of an operation with its result, and frees it. */
+static void IoOp_complete(IoOp *self)
 {
-  PyObject *objects = NULL;
+  Future *future = self->future;
+  char *buffer;
 
-  if (!PyArg_ParseTuple(args, "O", &objects))
-    return -1;
+  if (self->error_number != 0)
+  {
+    future->error_number = self->error_number;
+  }
+  else if (self->kind == IO_READ)
+  {
+    // the buffer becomes the result, trimmed to what was read
+    buffer = self->done < self->size ? (char *)realloc(self->buffer, self->done > 0 ? self->done : 1) : NULL;
+    future->kind = FUTURE_BYTES;
+    future->value = buffer == NULL ? self->buffer : buffer;
+    future->value_size = self->done;
+    self->buffer = NULL;
+  }
+  else if (self->kind == IO_WRITE)
+  {
+    future->kind = FUTURE_COUNT;
+    future->count = self->done;
+  }
 
-  if (objects)
+  if (Future_finish(future) != 0)
   {
-    Py_INCREF(objects);
-    self->objects = objects;
+    VPY_ERROR("Unable to complete I/O operation");
   }
 
-  return 0;
+  free(self->buffer);
+  free(self);
+  Terminator_decrement(terminator);
 }
 
-static PyObject *Merge_getattro(MergeObject *self, PyObject *name)
+/**
+ * Tries to read or write once the descriptor is ready. Returns true if the
+ * operation is done (with error_number set if it failed), or false if it has
+ * to wait until the descriptor is ready again.
+ */
+static bool IoOp_perform(IoOp *self)
 {
-  return PyObject_GetItem(self->objects, name);
-}
-
-static PyTypeObject MergeType = {
-    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.merge",
-    .tp_doc = PyDoc_STR("Merge object"),
-    .tp_basicsize = sizeof(MergeObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = Merge_new,
-    .tp_init = (initproc)Merge_init,
-    .tp_dealloc = (destructor)Merge_dealloc,
-    .tp_getattro = (getattrofunc)Merge_getattro,
-};
+  ssize_t n;
+  Py_ssize_t size;
 
-/***************************************************************/
-/*              Region object methods                          */
-/***************************************************************/
+  if (self->kind == IO_READ)
+  {
+    do
+    {
+      n = read(self->fd, self->buffer, self->size);
+    } while (n < 0 && errno == EINTR);
 
-/* static int Region_clear(RegionObject *self)
-{
-  Py_CLEAR(self->objects);
-  Py_CLEAR(self->types);
-  Py_CLEAR(self->alias);
-  Py_CLEAR(self->parent);
-  return 0;
-}
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return false;
+      }
 
-static int Region_traverse(RegionObject *self, visitproc visit, void *arg)
-{
-  Py_VISIT(self->objects);
-  Py_VISIT(self->types);
-  Py_VISIT(self->alias);
-  Py_VISIT(self->parent);
-  return 0;
-} */
+      self->error_number = errno;
+      return true;
+    }
 
-static void Region_dealloc(RegionObject *self)
-{
-  // PyObject_GC_UnTrack(self);
-  // Region_clear(self);
-  PRINTDBG("deallocating region %llu\n", self->id);
-  Py_XDECREF(self->name);
-  Py_XDECREF(self->alias);
-  Py_TYPE(self)->tp_free((PyObject *)self);
-}
+    self->done = n;
+    return true;
+  }
 
-static PyObject *Region_new(PyTypeObject *type, PyObject *args,
-                            PyObject *kwds)
-{
-  RegionObject *self;
-  self = (RegionObject *)type->tp_alloc(type, 0);
-  if (self != NULL)
+  while (self->done < self->size)
   {
-    self->name = PyUnicode_FromString("");
-    if (self->name == NULL)
+    size = self->size - self->done;
+    if (self->blocking && size > PIPE_BUF)
     {
-      Py_DECREF(self);
-      return NULL;
+      // a ready pipe takes at least this much without blocking
+      size = PIPE_BUF;
     }
 
-    // The region is its own alias by default
-    Py_INCREF((PyObject *)self);
-    self->alias = (PyObject *)self;
-    self->parent = NULL;
-    self->is_open = false;
-    self->is_shared = false;
-    self->id = 0;
-    self->objects = PyDict_New();
-    if (self->objects == NULL)
+    n = write(self->fd, self->buffer + self->done, size);
+    if (n < 0)
     {
-      Py_DECREF(self);
-      return NULL;
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return false;
+      }
+
+      self->error_number = errno;
+      return true;
+    }
+
+    self->done += n;
+    if (self->blocking && self->done < self->size)
+    {
+      // wait for the descriptor to be ready again rather than block
+      return false;
     }
   }
 
-  return (PyObject *)self;
+  return true;
 }
 
-static int Region_init(RegionObject *self, PyObject *args, PyObject *kwds)
+static void Reactor_push_timer(Reactor *self, IoOp *op)
 {
-  static char *kwlist[] = {"name", NULL};
-  PyObject *name = NULL, *tmp, *typedict, *key;
+  IoOp **timers;
+  Py_ssize_t i, parent;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &name))
-    return -1;
-
-  self->id = atomic_increment(&region_identity);
-  key = PyUnicode_FromFormat("region_%llu", self->id);
-
-  if (name)
-  {
-    tmp = self->name;
-    Py_INCREF(name);
-    self->name = name;
-    Py_XDECREF(tmp);
-  }
-  else
+  if (self->timer_count == self->timer_capacity)
   {
-    self->name = PyUnicode_FromFormat("region_%llu", self->id);
-    if (self->name == NULL)
+    timers = (IoOp **)realloc(self->timers, sizeof(IoOp *) * (self->timer_capacity * 2 + 16));
+    if (timers == NULL)
     {
-      Py_DECREF(self);
-      return -1;
+      op->error_number = ENOMEM;
+      IoOp_complete(op);
+      return;
     }
+
+    self->timers = timers;
+    self->timer_capacity = self->timer_capacity * 2 + 16;
   }
 
-  typedict = PyType_GetDict(self->ob_base.ob_type);
-  if (typedict == NULL)
+  for (i = self->timer_count++; i > 0; i = parent)
   {
-    Py_DECREF(self);
-    return -1;
+    parent = (i - 1) / 2;
+    if (self->timers[parent]->deadline <= op->deadline)
+    {
+      break;
+    }
+
+    self->timers[i] = self->timers[parent];
   }
 
-  Py_INCREF(self);
-  if (PyDict_SetItem(typedict, key, (PyObject *)self) < 0)
+  self->timers[i] = op;
+}
+
+static IoOp *Reactor_pop_timer(Reactor *self)
+{
+  IoOp *op = self->timers[0];
+  IoOp *last = self->timers[--self->timer_count];
+  Py_ssize_t i = 0, child;
+
+  while ((child = 2 * i + 1) < self->timer_count)
   {
-    Py_DECREF(self);
-    return -1;
-  }
+    if (child + 1 < self->timer_count && self->timers[child + 1]->deadline < self->timers[child]->deadline)
+    {
+      ++child;
+    }
 
-  PRINTDBG("region init %s %lu @ %p\n", PyUnicode_AsUTF8(self->name), self->id, self);
+    if (last->deadline <= self->timers[child]->deadline)
+    {
+      break;
+    }
 
-  Py_SET_REFCNT((PyObject *)self, _Py_IMMORTAL_REFCNT);
+    self->timers[i] = self->timers[child];
+    i = child;
+  }
 
-  return 0;
+  self->timers[i] = last;
+  return op;
 }
 
-static PyObject *Region_getname(RegionObject *self, void *closure)
+/** Completes the sleeps which have ended, and returns how long to wait in milliseconds (or -1). */
+static int Reactor_expire_timers(Reactor *self)
 {
-  RegionObject *region = resolve_region(self);
-  Py_INCREF(region->name);
-  return region->name;
-}
+  long long now = monotonic_ns();
+  long long remaining;
 
-static int Region_setname(RegionObject *self, PyObject *value, void *closure)
-{
-  RegionObject *region = resolve_region(self);
-  PyObject *tmp;
-  if (value == NULL)
+  while (self->timer_count > 0 && self->timers[0]->deadline <= now)
   {
-    PyErr_SetString(PyExc_TypeError, "Cannot delete the name attribute");
-    return -1;
+    IoOp_complete(Reactor_pop_timer(self));
   }
 
-  if (!PyUnicode_Check(value))
+  if (self->timer_count == 0)
   {
-    PyErr_SetString(PyExc_TypeError,
-                    "The name attribute value must be a string");
     return -1;
   }
 
-  tmp = region->name;
-  Py_INCREF(value);
-  region->name = value;
-  Py_XDECREF(tmp);
-  return 0;
+  // round up, so that the reactor does not wake just before the deadline
+  remaining = (self->timers[0]->deadline - now + 999999) / 1000000;
+  return remaining > INT_MAX ? INT_MAX : (int)remaining;
 }
 
-static PyObject *Region_getidentity(RegionObject *self, void *closure)
+/**
+ * Registers a descriptor for the events which its waiting operations need.
+ * Returns 0, or an errno on failure.
+ */
+static int Reactor_update(Reactor *self, int fd)
 {
-  RegionObject *region = resolve_region(self);
-  return PyLong_FromUnsignedLongLong(region->id);
-}
+  IoWatch *watch = self->watches + fd;
+  int events = 0;
 
-static PyObject *Region_getparent(RegionObject *self, void *closure)
-{
-  RegionObject *region = resolve_region(self);
-  Py_INCREF(region->parent);
-  return region->parent;
-}
+  if (watch->reads != NULL)
+  {
+    events |= POLLIN;
+  }
 
-static PyObject *Region_getisopen(RegionObject *self, void *closure)
-{
-  RegionObject *region = resolve_region(self);
-  return PyBool_FromLong(region->is_open);
-}
+  if (watch->writes != NULL)
+  {
+    events |= POLLOUT;
+  }
 
-static PyObject *Region_getisshared(RegionObject *self, void *closure)
-{
-  RegionObject *region = resolve_region(self);
-  return PyBool_FromLong(region->is_shared);
-}
+  if (events == watch->events)
+  {
+    return 0;
+  }
 
-static PyObject *Region_getisfree(RegionObject *self, void *closure)
-{
-  RegionObject *region = resolve_region(self);
-  return PyBool_FromLong(is_free(region));
-}
+#ifdef __linux__
+  struct epoll_event event;
+  int op;
 
-static PyGetSetDef Region_getsetters[] = {
-    {"name", (getter)Region_getname, (setter)Region_setname,
-     "Human-readable name for the region", NULL},
-    {"id", (getter)Region_getidentity, NULL,
-     "The immutable, unique identity for the region", NULL},
-    {"parent", (getter)Region_getparent, NULL, "The parent region", NULL},
-    {"is_open", (getter)Region_getisopen, NULL,
-     "Whether the region is currently open", NULL},
-    {"is_shared", (getter)Region_getisshared, NULL,
-     "Whether the region is shared", NULL},
-    {"is_free", (getter)Region_getisfree, NULL, "Whether the region is free",
-     NULL},
-    {NULL} /* Sentinel */
-};
+  event.events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+  event.data.fd = fd;
+  op = watch->events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+  if (epoll_ctl(self->epoll_fd, op, fd, &event) != 0)
+  {
+    if (errno != ENOENT)
+    {
+      return errno;
+    }
+
+    // closing the descriptor removed it, and the number may since have been
+    // reused for another
+    if (op == EPOLL_CTL_MOD && epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      return errno;
+    }
+  }
+#else
+  if (fcntl(fd, F_GETFD) < 0)
+  {
+    return errno;
+  }
+#endif
 
-static PyObject *Region_merge(RegionObject *self, PyObject *args,
-                              PyObject *kwds)
-{
-  PyObject *arg;
-  RegionObject *other;
-  RegionObject *region = resolve_region(self);
+  watch->events = events;
+  return 0;
+}
 
-  if (!PyArg_ParseTuple(args, "O", &arg))
-    return NULL;
+/** Starts an operation which has been submitted. */
+static void Reactor_start_op(Reactor *self, IoOp *op)
+{
+  IoWatch *watches, *watch;
+  IoOp **queue;
+  int capacity, rc;
 
-  if (!Region_Check(arg))
+  if (op->kind == IO_SLEEP)
   {
-    PyErr_SetString(PyExc_TypeError, "Argument must be a region");
-    return NULL;
+    Reactor_push_timer(self, op);
+    return;
   }
 
-  other = (RegionObject *)arg;
-
-  if (!region->is_open)
+  if (op->fd >= self->watch_capacity)
   {
-    PyErr_SetString(RegionIsolationError, "Region is not open");
-    return NULL;
+    capacity = self->watch_capacity * 2 > op->fd + 1 ? self->watch_capacity * 2 : op->fd + 1;
+    watches = (IoWatch *)realloc(self->watches, sizeof(IoWatch) * capacity);
+    if (watches == NULL)
+    {
+      op->error_number = ENOMEM;
+      IoOp_complete(op);
+      return;
+    }
+
+    memset(watches + self->watch_capacity, 0, sizeof(IoWatch) * (capacity - self->watch_capacity));
+    self->watches = watches;
+    self->watch_capacity = capacity;
   }
 
-  if (!is_free(region))
+  watch = self->watches + op->fd;
+  queue = op->kind == IO_READ ? &watch->reads : &watch->writes;
+  while (*queue != NULL)
   {
-    PyErr_SetString(RegionIsolationError, "Region is not free");
-    return NULL;
+    queue = &(*queue)->next;
   }
 
-  other->alias = (PyObject *)region;
-  Py_INCREF(region);
+  op->next = NULL;
+  *queue = op;
 
-  PyObject *argList = Py_BuildValue("(O)", other->objects);
-  PyObject *merged = PyObject_Call((PyObject *)&MergeType, argList, NULL);
-  if (merged == NULL)
+  rc = Reactor_update(self, op->fd);
+  if (rc == 0)
   {
-    return NULL;
+    return;
   }
 
-  Py_INCREF(merged);
-  return merged;
-}
-
-static PyObject *Region_makeshareable(RegionObject *self, PyObject *Py_UNUSED(ignored))
-{
-  RegionObject *region = resolve_region(self);
+  *queue = NULL;
+  if (rc == EPERM)
+  {
+    // regular files cannot be watched, but are always ready
+    op->blocking = false;
+    IoOp_perform(op);
+  }
+  else
+  {
+    op->error_number = rc;
+  }
 
-  region->is_shared = true;
-  region->last = 0;
-  Py_INCREF(self);
-  return (PyObject *)self;
+  IoOp_complete(op);
 }
 
-static PyObject *Region_detachall(RegionObject *self, PyObject *args)
+/** Runs the operations which a descriptor is ready for. */
+static void Reactor_ready(Reactor *self, int fd, bool readable, bool writable)
 {
-  PyObject *objects;
-  RegionObject *detached;
-  RegionObject *region = resolve_region(self);
+  IoWatch *watch = self->watches + fd;
+  IoOp *op;
 
-  if (!region->is_open)
+  // a read is only tried once per readiness, as the next may block
+  if (readable && watch->reads != NULL && IoOp_perform(watch->reads))
   {
-    PyErr_SetString(RegionIsolationError, "Region must be open");
-    return NULL;
+    op = watch->reads;
+    watch->reads = op->next;
+    IoOp_complete(op);
   }
 
-  if (!region->is_shared)
+  while (writable && watch->writes != NULL && IoOp_perform(watch->writes))
   {
-    PyErr_SetString(RegionIsolationError, "Region must be shared");
-    return NULL;
+    op = watch->writes;
+    watch->writes = op->next;
+    // a blocking descriptor is only sure to take one write per readiness
+    writable = !op->blocking;
+    IoOp_complete(op);
   }
 
-  detached = (RegionObject *)PyObject_CallObject((PyObject *)self->ob_base.ob_type, args);
-  if (detached == NULL)
+  if (Reactor_update(self, fd) != 0)
   {
-    return NULL;
-  }
+    // the descriptor was closed while operations were waiting on it
+    while ((op = watch->reads) != NULL || (op = watch->writes) != NULL)
+    {
+      if (op == watch->reads)
+      {
+        watch->reads = op->next;
+      }
+      else
+      {
+        watch->writes = op->next;
+      }
 
-  objects = self->objects;
-  self->objects = detached->objects;
-  detached->objects = objects;
+      op->error_number = EBADF;
+      IoOp_complete(op);
+    }
 
-  Py_INCREF(detached);
-  return (PyObject *)detached;
+    watch->events = 0;
+  }
 }
 
-static PyObject *Region_str(RegionObject *self, PyObject *Py_UNUSED(ignored))
+/** Starts the operations which have been submitted, in the order they were submitted. */
+static void Reactor_take(Reactor *self)
 {
-  RegionObject *region = resolve_region(self);
-  return PyUnicode_FromFormat("Region(%S)", region->name);
-}
+  IoOp *op, *next, *taken = NULL;
 
-static PyObject *Region_repr(RegionObject *self, PyObject *Py_UNUSED(ignored))
-{
-  RegionObject *region = resolve_region(self);
-  return PyUnicode_FromFormat("Region(%S%s%s)", region->name,
-                              region->id, region->is_open ? " open" : "",
-                              region->is_shared ? " shared" : "");
-}
+  signal_clear(self->signal_fds[0]);
+  op = (IoOp *)atomic_exchange_ptr(&self->submitted, (voidptr_t)NULL);
+  while (op != NULL)
+  {
+    next = op->next;
+    op->next = taken;
+    taken = op;
+    op = next;
+  }
 
-static PyObject *Region_enter(RegionObject *self,
-                              PyObject *Py_UNUSED(ignored))
-{
-  RegionObject *region = resolve_region(self);
-  region->is_open = true;
-  Py_INCREF((PyObject *)region);
-  return (PyObject *)region;
+  while (taken != NULL)
+  {
+    next = taken->next;
+    Reactor_start_op(self, taken);
+    taken = next;
+  }
 }
 
-static PyObject *Region_exit(RegionObject *self, PyObject *args,
-                             PyObject *kwds)
+/** Waits for descriptors to be ready (or for the timeout) and runs their operations. */
+static void Reactor_poll(Reactor *self, int timeout)
 {
-  RegionObject *region = resolve_region(self);
-  PyObject *type, *value, *traceback;
-  if (!PyArg_ParseTuple(args, "OOO", &type, &value, &traceback))
-    return NULL;
+  int i, count;
+#ifdef __linux__
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  uint32_t flags;
 
-  if (type == Py_None)
-  {
-    region->is_open = false;
-  }
-  else
+  count = epoll_wait(self->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+  for (i = 0; i < count; ++i)
   {
-    Py_INCREF(type);
-    Py_INCREF(value);
-    Py_INCREF(traceback);
-    PyErr_Restore(type, value, traceback);
-    return NULL;
+    if (events[i].data.fd == self->signal_fds[0])
+    {
+      continue;
+    }
+
+    flags = events[i].events;
+    Reactor_ready(self, events[i].data.fd,
+                  (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0,
+                  (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0);
   }
+#else
+  struct pollfd *polls;
+  Py_ssize_t capacity;
+  int fd;
 
-  Py_RETURN_FALSE;
-}
+  capacity = self->watch_capacity + 1;
+  if (capacity > self->poll_capacity)
+  {
+    polls = (struct pollfd *)realloc(self->polls, sizeof(struct pollfd) * capacity);
+    if (polls == NULL)
+    {
+      VPY_ERROR("Unable to allocate reactor poll set");
+      return;
+    }
 
-static PyMethodDef Region_methods[] = {
-    {"__enter__", (PyCFunction)Region_enter, METH_NOARGS, "Enter the region"},
-    {"__exit__", (PyCFunction)Region_exit, METH_VARARGS,
-     "Exit the region, returning a Boolean flag indicating whether any "
-     "exception that occurred should be suppressed."},
-    {"merge", (PyCFunction)Region_merge, METH_VARARGS,
-     "Merge the other region into this one"},
-    {"make_shareable", (PyCFunction)Region_makeshareable, METH_NOARGS,
-     "Make the region shareable"},
-    {"detach_all", (PyCFunction)Region_detachall, METH_VARARGS,
-     "Detach all objects from the region"},
-    {NULL} /* Sentinel */
-};
+    self->polls = polls;
+    self->poll_capacity = capacity;
+  }
 
-static PyObject *Region_getattro(RegionObject *self, PyObject *attr_name)
-{
-  RegionObject *region = resolve_region(self);
-  for (int i = 0; REGION_ATTRS[i] != NULL; i++)
+  self->polls[0].fd = self->signal_fds[0];
+  self->polls[0].events = POLLIN;
+  count = 1;
+  for (fd = 0; fd < self->watch_capacity; ++fd)
   {
-    if (strcmp(PyUnicode_AsUTF8(attr_name), REGION_ATTRS[i]) == 0)
+    if (self->watches[fd].events != 0)
     {
-      return PyObject_GenericGetAttr((PyObject *)region, attr_name);
+      self->polls[count].fd = fd;
+      self->polls[count].events = self->watches[fd].events;
+      ++count;
     }
   }
 
-  if (!region->is_open)
+  if (poll(self->polls, count, timeout) <= 0)
   {
-    PyErr_SetString(RegionIsolationError, "Region is not open");
-    return NULL;
+    return;
   }
 
-  PyObject *obj = PyDict_GetItemWithError(region->objects, attr_name);
-  if (obj == NULL)
+  for (i = 1; i < count; ++i)
   {
-    Py_RETURN_NONE;
+    if (self->polls[i].revents & POLLNVAL)
+    {
+      // the descriptor was closed, which Reactor_update will find
+      Reactor_ready(self, self->polls[i].fd, false, false);
+    }
+    else if (self->polls[i].revents != 0)
+    {
+      Reactor_ready(self, self->polls[i].fd,
+                    (self->polls[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0,
+                    (self->polls[i].revents & (POLLOUT | POLLHUP | POLLERR)) != 0);
+    }
   }
+#endif
+}
+
+static thrd_return_t reactor_main(void *arg)
+{
+  Reactor *self = (Reactor *)arg;
+  int timeout;
 
-  Py_INCREF(obj);
-  return obj;
+  while (!atomic_load_bool(&self->stopping))
+  {
+    Reactor_take(self);
+    timeout = Reactor_expire_timers(self);
+    Reactor_poll(self, timeout);
+  }
+
+  return (thrd_return_t)0;
 }
 
-static int Region_setattro(RegionObject *self, PyObject *attr_name,
-                           PyObject *value)
+/** Returns the reactor, starting it if need be. */
+static Reactor *Reactor_get()
 {
-  int rc;
-  RegionObject *region = resolve_region(self);
-  for (int i = 0; REGION_ATTRS[i] != NULL; i++)
+  Reactor *self;
+
+  mtx_lock(&reactor_mutex);
+  if (reactor != NULL)
   {
-    if (strcmp(PyUnicode_AsUTF8(attr_name), REGION_ATTRS[i]) == 0)
-    {
-      return PyObject_GenericSetAttr((PyObject *)region, attr_name, value);
-    }
+    mtx_unlock(&reactor_mutex);
+    return reactor;
   }
 
-  if (!region->is_open)
+  self = (Reactor *)calloc(1, sizeof(Reactor));
+  if (self == NULL)
   {
-    PyErr_SetString(RegionIsolationError, "Region is not open");
-    return -1;
+    mtx_unlock(&reactor_mutex);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to allocate reactor");
+    return NULL;
   }
 
-  RegionObject *value_region = get_region(value);
-  if (value_region == NULL)
+  if (signal_open(self->signal_fds) != 0)
   {
-    rc = capture_object(region, value);
-    if (rc < 0)
+    free(self);
+    mtx_unlock(&reactor_mutex);
+    PyErr_SetFromErrno(PyExc_OSError);
+    return NULL;
+  }
+
+#ifdef __linux__
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.fd = self->signal_fds[0];
+  self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (self->epoll_fd < 0 || epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->signal_fds[0], &event) != 0)
+  {
+    PyErr_SetFromErrno(PyExc_OSError);
+    if (self->epoll_fd >= 0)
     {
-      return rc;
+      close(self->epoll_fd);
     }
 
-    value_region = region;
+    signal_close(self->signal_fds);
+    free(self);
+    mtx_unlock(&reactor_mutex);
+    return NULL;
   }
+#endif
 
-  if (value_region == region)
+  if (thrd_create(&self->thread, reactor_main, self) != thrd_success)
   {
-    Py_INCREF(value);
-    rc = PyDict_SetItem(region->objects, attr_name, value);
-    return rc;
+#ifdef __linux__
+    close(self->epoll_fd);
+#endif
+    signal_close(self->signal_fds);
+    free(self);
+    mtx_unlock(&reactor_mutex);
+    PyErr_SetString(PyExc_RuntimeError, "Unable to create reactor thread");
+    return NULL;
   }
 
-  PyErr_SetString(RegionIsolationError, "Value belongs to another region");
-  return -1;
+  reactor = self;
+  mtx_unlock(&reactor_mutex);
+  return self;
 }
 
-static Py_hash_t Region_hash(RegionObject *self)
+/** Hands an operation to the reactor. This can be called from any thread. */
+static void Reactor_submit(Reactor *self, IoOp *op)
 {
-  RegionObject *region = resolve_region(self);
-  return (Py_hash_t)region->id;
-}
+  voidptr_t head = atomic_load_ptr(&self->submitted);
 
-static PyObject *Region_richcompare(PyObject *lhs, PyObject *rhs, int op)
-{
-  RegionObject *lhs_region, *rhs_region;
-  if (!Region_Check(rhs))
+  Terminator_increment(terminator);
+  do
   {
-    Py_RETURN_NOTIMPLEMENTED;
-  }
+    op->next = (IoOp *)head;
+  } while (!atomic_compare_exchange_ptr(&self->submitted, &head, (voidptr_t)op));
 
-  lhs_region = (RegionObject *)lhs;
-  rhs_region = (RegionObject *)rhs;
-  if (lhs_region->alias != lhs)
-  {
-    lhs_region = resolve_region(lhs_region);
-  }
-  if (rhs_region->alias != rhs)
+  if (head == (voidptr_t)NULL)
   {
-    rhs_region = resolve_region(rhs_region);
+    signal_raise(self->signal_fds[1]);
   }
-
-  Py_RETURN_RICHCOMPARE(lhs_region->id, rhs_region->id, op);
 }
 
-static PyTypeObject RegionType = {
-    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.region",
-    .tp_doc = PyDoc_STR("Region object"),
-    .tp_basicsize = sizeof(RegionObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT, //  | Py_TPFLAGS_HAVE_GC
-    .tp_new = Region_new,
-    .tp_init = (initproc)Region_init,
-    .tp_dealloc = (destructor)Region_dealloc,
-    .tp_methods = Region_methods,
-    .tp_getset = Region_getsetters,
-    .tp_repr = (reprfunc)Region_repr,
-    .tp_str = (reprfunc)Region_str,
-    .tp_setattro = (setattrofunc)Region_setattro,
-    .tp_getattro = (getattrofunc)Region_getattro,
-    //.tp_traverse = (traverseproc)Region_traverse,
-    //.tp_clear = (inquiry)Region_clear,
-    .tp_hash = (hashfunc)Region_hash,
-    .tp_richcompare = (richcmpfunc)Region_richcompare,
-};
-
-static bool Region_Check(PyObject *obj)
+/**
+ * Stops the reactor. This is called once all behaviors have finished, and so
+ * once every operation has completed.
+ */
+static void Reactor_stop()
 {
-  PyTypeObject *obj_type = Py_TYPE(obj);
-  PyTypeObject *region_type = (PyTypeObject *)&RegionType;
-  return obj_type == region_type;
-}
+  Reactor *self = reactor;
 
-/***************************************************************/
-/*                 RegionTag setup                             */
-/***************************************************************/
+  if (self == NULL)
+  {
+    return;
+  }
+
+  atomic_store_bool(&self->stopping, true);
+  signal_raise(self->signal_fds[1]);
+  thrd_join(self->thread, NULL);
+
+#ifdef __linux__
+  close(self->epoll_fd);
+#else
+  free(self->polls);
+#endif
+  signal_close(self->signal_fds);
+  free(self->watches);
+  free(self->timers);
+  free(self);
+  reactor = NULL;
+}
 
-static void RegionTag_dealloc(RegionTagObject *self)
+/**
+ * Creates an operation for a module function, or sets an exception and
+ * returns NULL if I/O cannot be submitted from here.
+ */
+static IoOp *IoOp_new(int kind)
 {
-  Py_XDECREF(self->region);
-  Py_TYPE(self)->tp_free((PyObject *)self);
+  IoOp *op;
+
+  // behaviors may submit I/O while the main interpreter waits for them
+  if (!atomic_load_bool(&running) && local_deque == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "The runtime is not running");
+    return NULL;
+  }
+
+  op = (IoOp *)calloc(1, sizeof(IoOp));
+  if (op == NULL)
+  {
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  op->kind = kind;
+  op->fd = -1;
+  return op;
 }
 
-static PyObject *RegionTag_new(PyTypeObject *type, PyObject *args,
-                               PyObject *kwds)
+/** Submits an operation to the reactor and returns the future which it completes. */
+static PyObject *IoOp_submit(IoOp *op)
 {
-  RegionTagObject *self;
-  self = (RegionTagObject *)type->tp_alloc(type, 0);
-  if (self != NULL)
+  Reactor *r;
+  FutureObject *future;
+
+  r = Reactor_get();
+  if (r == NULL)
   {
-    self->region = NULL;
+    free(op->buffer);
+    free(op);
+    return NULL;
   }
 
-  return (PyObject *)self;
+  future = FutureObject_create();
+  if (future == NULL)
+  {
+    free(op->buffer);
+    free(op);
+    return NULL;
+  }
+
+  op->future = future->future;
+  Reactor_submit(r, op);
+  return (PyObject *)future;
 }
 
-static int RegionTag_init(RegionTagObject *self, PyObject *args, PyObject *kwds)
+/** Sets up an operation on the descriptor of a file object (or int). */
+static int IoOp_set_fd(IoOp *op, PyObject *file)
 {
-  PyObject *region = NULL;
+  int flags;
 
-  if (!PyArg_ParseTuple(args, "O", &region))
+  op->fd = PyObject_AsFileDescriptor(file);
+  if (op->fd < 0)
+  {
     return -1;
+  }
 
-  self->region = (RegionObject *)region;
-
-  Py_SET_REFCNT((PyObject *)self, _Py_IMMORTAL_REFCNT);
+  flags = fcntl(op->fd, F_GETFL);
+  if (flags < 0)
+  {
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
 
+  op->blocking = (flags & O_NONBLOCK) == 0;
   return 0;
 }
+#endif
 
-static PyObject *RegionTag_str(RegionTagObject *self, PyObject *Py_UNUSED(ignored))
+static PyObject *veronapy_io_read(PyObject *veronapymodule, PyObject *args)
 {
-  RegionObject *region = resolve_region(self);
-  return PyUnicode_FromFormat("RegionTag(%S)", region->name, region->id);
-}
+#ifdef _WIN32
+  PyErr_SetString(PyExc_NotImplementedError, "Asynchronous I/O is not supported on Windows");
+  return NULL;
+#else
+  PyObject *file;
+  Py_ssize_t size;
+  IoOp *op;
 
-static PyObject *RegionTag_repr(RegionTagObject *self, PyObject *Py_UNUSED(ignored))
-{
-  RegionObject *region = resolve_region(self);
-  return PyUnicode_FromFormat("RegionTag(%S%s%s)", region->name,
-                              region->id, region->is_open ? " open" : "",
-                              region->is_shared ? " shared" : "");
+  if (!PyArg_ParseTuple(args, "On", &file, &size))
+  {
+    return NULL;
+  }
+
+  if (size < 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "size must be non-negative");
+    return NULL;
+  }
+
+  op = IoOp_new(IO_READ);
+  if (op == NULL)
+  {
+    return NULL;
+  }
+
+  op->size = size;
+  op->buffer = (char *)malloc(size > 0 ? size : 1);
+  if (op->buffer == NULL || IoOp_set_fd(op, file) != 0)
+  {
+    if (op->buffer == NULL)
+    {
+      PyErr_NoMemory();
+    }
+
+    free(op->buffer);
+    free(op);
+    return NULL;
+  }
+
+  return IoOp_submit(op);
+#endif
 }
 
-static PyObject *RegionTag_richcompare(PyObject *lhs, PyObject *rhs, int op)
+static PyObject *veronapy_io_write(PyObject *veronapymodule, PyObject *args)
 {
-  RegionTagObject *lhs_tag, *rhs_tag;
-  RegionObject *lhs_region, *rhs_region;
-  if (Region_Check(rhs))
+#ifdef _WIN32
+  PyErr_SetString(PyExc_NotImplementedError, "Asynchronous I/O is not supported on Windows");
+  return NULL;
+#else
+  PyObject *file;
+  Py_buffer data;
+  IoOp *op;
+
+  if (!PyArg_ParseTuple(args, "Oy*", &file, &data))
   {
-    rhs_region = (RegionObject *)rhs;
+    return NULL;
   }
-  else if (rhs->ob_type == &RegionTagType)
+
+  op = IoOp_new(IO_WRITE);
+  if (op == NULL)
   {
-    rhs_tag = (RegionTagObject *)rhs;
-    rhs_region = rhs_tag->region;
+    PyBuffer_Release(&data);
+    return NULL;
   }
-  else
+
+  // the data is copied, as the caller may change it before it is written
+  op->size = data.len;
+  op->buffer = (char *)malloc(data.len > 0 ? data.len : 1);
+  if (op->buffer != NULL)
   {
-    Py_RETURN_NOTIMPLEMENTED;
+    memcpy(op->buffer, data.buf, data.len);
   }
 
-  lhs_tag = (RegionTagObject *)lhs;
-  lhs_region = lhs_tag->region;
+  PyBuffer_Release(&data);
+  if (op->buffer == NULL || IoOp_set_fd(op, file) != 0)
+  {
+    if (op->buffer == NULL)
+    {
+      PyErr_NoMemory();
+    }
 
-  if (lhs_region->alias != lhs)
+    free(op->buffer);
+    free(op);
+    return NULL;
+  }
+
+  return IoOp_submit(op);
+#endif
+}
+
+static PyObject *veronapy_io_sleep(PyObject *veronapymodule, PyObject *args)
+{
+#ifdef _WIN32
+  PyErr_SetString(PyExc_NotImplementedError, "Asynchronous I/O is not supported on Windows");
+  return NULL;
+#else
+  double seconds;
+  IoOp *op;
+
+  if (!PyArg_ParseTuple(args, "d", &seconds))
   {
-    lhs_region = resolve_region(lhs_region);
+    return NULL;
   }
-  if (rhs_region->alias != rhs)
+
+  if (!(seconds >= 0))
   {
-    rhs_region = resolve_region(rhs_region);
+    PyErr_SetString(PyExc_ValueError, "seconds must be non-negative");
+    return NULL;
   }
 
-  Py_RETURN_RICHCOMPARE(lhs_region->id, rhs_region->id, op);
-}
+  op = IoOp_new(IO_SLEEP);
+  if (op == NULL)
+  {
+    return NULL;
+  }
 
-static PyTypeObject RegionTagType = {
-    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "veronapy.regiontag",
-    .tp_doc = PyDoc_STR("Region tag object"),
-    .tp_basicsize = sizeof(RegionTagObject),
-    .tp_itemsize = 0,
-    .tp_new = RegionTag_new,
-    .tp_init = (initproc)RegionTag_init,
-    .tp_dealloc = (destructor)RegionTag_dealloc,
-    .tp_repr = (reprfunc)RegionTag_repr,
-    .tp_str = (reprfunc)RegionTag_str,
-    .tp_richcompare = (richcmpfunc)RegionTag_richcompare,
-};
+  op->deadline = monotonic_ns() + (seconds > 1e9 ? (long long)1e18 : (long long)(seconds * 1e9));
+  return IoOp_submit(op);
+#endif
+}
 
 /***************************************************************/
 /*                  Module setup                               */
@@ -4019,6 +10514,19 @@ static int VPY_run()
     return -1;
   }
 
+  global_code_blobs = ht_create(128, true);
+  if (global_code_blobs == NULL || mtx_init(&code_blob_mutex, mtx_plain) != thrd_success)
+  {
+    return -1;
+  }
+
+#ifndef _WIN32
+  if (mtx_init(&reactor_mutex, mtx_plain) != thrd_success)
+  {
+    return -1;
+  }
+#endif
+
   rc = set_worker_count();
   if (rc != 0)
   {
@@ -4060,6 +10568,13 @@ static int VPY_wait()
     return rc;
   }
 
+#ifndef _WIN32
+  // the reactor has no more operations, and must be joined before the
+  // workers go as completing its last one may wake them
+  Reactor_stop();
+  mtx_destroy(&reactor_mutex);
+#endif
+
   PRINTDBG("Shutting down workers\n");
   rc = shutdown_workers();
   if (rc != 0)
@@ -4069,10 +10584,23 @@ static int VPY_wait()
 
   Terminator_free(terminator);
 
+  // all behaviors have finished, so any still owed to this interpreter have
+  // been handed back
+  BehaviorPool_collect(&main_pool);
+
   PRINTDBG("done waiting\n");
 
   ht_free(global_frozen_types);
   ht_free(global_object_regions);
+  global_object_regions = NULL;
+
+  // the blobs go with the system, so this interpreter must forget them too
+  PyDict_Clear(vpy_state->code_blobs);
+  PyDict_Clear(vpy_state->code_cache);
+  ht_free(global_code_blobs);
+  mtx_destroy(&code_blob_mutex);
+  CodeBlob_free_all();
+  atomic_increment(&code_blob_generation);
 
   // raise any exceptions which were thrown during execution
   ex = (BehaviorException *)atomic_load_ptr(&behavior_exceptions);
@@ -4126,17 +10654,120 @@ static PyObject *veronapy_workercount(PyObject *veronapymodule, PyObject *Py_UNU
   return PyLong_FromSsize_t(worker_count);
 }
 
+static PyObject *veronapy_tablestats(PyObject *veronapymodule, PyObject *Py_UNUSED(ignored))
+{
+  double mean_probe;
+  Py_ssize_t max_probe;
+  ht *table = global_object_regions;
+  if (!atomic_load_bool(&running) || table == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "The runtime is not running");
+    return NULL;
+  }
+
+  ht_probe_stats(table, &mean_probe, &max_probe);
+
+  // the array may be retired and freed by a writer once the lock is released
+  Py_ssize_t capacity, length, tombstones, retired = 0;
+  ht_lock(table);
+  capacity = ((ht_array *)atomic_load_ptr(&table->array))->capacity;
+  length = table->length;
+  tombstones = table->tombstones;
+  for (ht_array *array = table->retired; array != NULL; array = array->retired)
+  {
+    retired++;
+  }
+  ht_unlock(table);
+
+  return Py_BuildValue("{s:n,s:n,s:n,s:d,s:n,s:n}",
+                       "capacity", capacity,
+                       "length", length,
+                       "tombstones", tombstones,
+                       "mean_probe", mean_probe,
+                       "max_probe", max_probe,
+                       "retired", retired);
+}
+
+static PyObject *veronapy_parkstats(PyObject *veronapymodule, PyObject *Py_UNUSED(ignored))
+{
+  return Py_BuildValue("{s:L,s:L,s:L,s:L}",
+                       "scheduled", (long long)atomic_load_llong(&parks_scheduled),
+                       "linked", (long long)atomic_load_llong(&parks_linked),
+                       "terminator", (long long)atomic_load_llong(&parks_terminator),
+                       "worker", (long long)atomic_load_llong(&parks_worker));
+}
+
+/** Waits for all of the futures, and returns a tuple of their results. */
+static PyObject *veronapy_join(PyObject *veronapymodule, PyObject *args, PyObject *kwds)
+{
+  PyObject *timeout = NULL, *results, *result;
+  struct timespec storage, *deadline;
+  Py_ssize_t i, length;
+
+  if (kwds != NULL)
+  {
+    timeout = PyDict_GetItemString(kwds, "timeout");
+    if (PyDict_Size(kwds) != (timeout != NULL ? 1 : 0))
+    {
+      PyErr_SetString(PyExc_TypeError, "join() only accepts a timeout keyword argument");
+      return NULL;
+    }
+  }
+
+  if (get_deadline(timeout, &storage, &deadline) < 0)
+  {
+    return NULL;
+  }
+
+  length = PyTuple_GET_SIZE(args);
+  for (i = 0; i < length; ++i)
+  {
+    if (!Py_IS_TYPE(PyTuple_GET_ITEM(args, i), &FutureType))
+    {
+      PyErr_SetString(PyExc_TypeError, "Expected future");
+      return NULL;
+    }
+  }
+
+  results = PyTuple_New(length);
+  if (results == NULL)
+  {
+    return NULL;
+  }
+
+  for (i = 0; i < length; ++i)
+  {
+    result = FutureObject_get((FutureObject *)PyTuple_GET_ITEM(args, i), deadline);
+    if (result == NULL)
+    {
+      Py_DECREF(results);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(results, i, result);
+  }
+
+  return results;
+}
+
 static PyMethodDef veronapy_methods[] = {
     {"when", when, METH_VARARGS, "when decorator"},
+    {"when_each", (PyCFunction)when_each, METH_FASTCALL, "schedule a function once for each region"},
     {"wait", (PyCFunction)veronapy_wait, METH_NOARGS, "wait for all behaviors to complete"},
+    {"join", (PyCFunction)veronapy_join, METH_VARARGS | METH_KEYWORDS, "wait for some futures and return their results"},
+    {"io_read", veronapy_io_read, METH_VARARGS, "read from a file descriptor without holding a worker"},
+    {"io_write", veronapy_io_write, METH_VARARGS, "write to a file descriptor without holding a worker"},
+    {"io_sleep", veronapy_io_sleep, METH_VARARGS, "return a future which completes after a delay"},
     {"run", (PyCFunction)veronapy_run, METH_NOARGS, "start the runtime."},
     {"worker_count", (PyCFunction)veronapy_workercount, METH_NOARGS, "get the number of workers."},
+    {"table_stats", (PyCFunction)veronapy_tablestats, METH_NOARGS, "get probe statistics for the global object table."},
+    {"park_stats", (PyCFunction)veronapy_parkstats, METH_NOARGS, "get the number of times each kind of wait has parked a thread."},
     {NULL} /* Sentinel */
 };
 
 static int veronapy_exec(PyObject *module)
 {
-  PyTypeObject *region_type, *merge_type, *when_type, *regiontag_type;
+  PyTypeObject *region_type, *merge_type, *when_type, *behavior_type, *read_type, *future_type, *regiontag_type, *isolatedtype_type;
 
   region_type = &RegionType;
   if (PyType_Ready(region_type) < 0)
@@ -4156,12 +10787,37 @@ static int veronapy_exec(PyObject *module)
     return -1;
   }
 
+  behavior_type = &BehaviorFunctionType;
+  if (PyType_Ready(behavior_type) < 0)
+  {
+    return -1;
+  }
+
+  read_type = &ReadType;
+  if (PyType_Ready(read_type) < 0)
+  {
+    return -1;
+  }
+
+  future_type = &FutureType;
+  if (PyType_Ready(future_type) < 0 || PyType_Ready(&FutureIterType) < 0)
+  {
+    return -1;
+  }
+
   regiontag_type = &RegionTagType;
   if (PyType_Ready(regiontag_type) < 0)
   {
     return -1;
   }
 
+  isolatedtype_type = &IsolatedTypeType;
+  isolatedtype_type->tp_base = &PyType_Type;
+  if (PyType_Ready(isolatedtype_type) < 0)
+  {
+    return -1;
+  }
+
   PyModule_AddStringConstant(module, "__version__", "0.0.3");
   RegionIsolationError = PyErr_NewException("veronapy.RegionIsolationError", NULL, NULL);
   Py_XINCREF(RegionIsolationError);
@@ -4203,6 +10859,27 @@ static int veronapy_exec(PyObject *module)
     return -1;
   }
 
+  Py_INCREF(behavior_type);
+  if (PyModule_AddObject(module, "behavior", (PyObject *)behavior_type) < 0)
+  {
+    Py_DECREF(behavior_type);
+    return -1;
+  }
+
+  Py_INCREF(read_type);
+  if (PyModule_AddObject(module, "read", (PyObject *)read_type) < 0)
+  {
+    Py_DECREF(read_type);
+    return -1;
+  }
+
+  Py_INCREF(future_type);
+  if (PyModule_AddObject(module, "future", (PyObject *)future_type) < 0)
+  {
+    Py_DECREF(future_type);
+    return -1;
+  }
+
   Py_INCREF(regiontag_type);
   if (PyModule_AddObject(module, "regiontag", (PyObject *)regiontag_type) < 0)
   {
@@ -4211,13 +10888,13 @@ static int veronapy_exec(PyObject *module)
   }
 
   vpy_state = (VPYState *)PyModule_GetState(module);
-  vpy_state->isolated_types = PyDict_New();
+  vpy_state->isolated_types = ht_create(64, false);
   if (vpy_state->isolated_types == NULL)
   {
     return -1;
   }
 
-  vpy_state->object_regions = PyDict_New();
+  vpy_state->object_regions = ht_create(1024, false);
   if (vpy_state->object_regions == NULL)
   {
     return -1;
@@ -4229,6 +10906,36 @@ static int veronapy_exec(PyObject *module)
     return -1;
   }
 
+  vpy_state->immutables = ht_create(2 * IMM_CACHE_SIZE, false);
+  if (vpy_state->immutables == NULL)
+  {
+    return -1;
+  }
+
+  vpy_state->immutables_ring = (PyObject **)calloc(IMM_CACHE_SIZE, sizeof(PyObject *));
+  if (vpy_state->immutables_ring == NULL)
+  {
+    return -1;
+  }
+
+  vpy_state->immutables_next = 0;
+
+  vpy_state->code_blobs = PyDict_New();
+  if (vpy_state->code_blobs == NULL)
+  {
+    return -1;
+  }
+
+  vpy_state->code_cache = PyDict_New();
+  if (vpy_state->code_cache == NULL)
+  {
+    return -1;
+  }
+
+  vpy_state->notifier = NULL;
+  vpy_state->notify_loop = NULL;
+  vpy_state->awaiting = NULL;
+
   if (alloc_id == 0)
   {
     return VPY_run();
@@ -4242,8 +10949,46 @@ void veronapy_free(PyObject *module)
   VPYState *state = (VPYState *)PyModule_GetState(module);
   if (state != NULL)
   {
-    Py_XDECREF(state->isolated_types);
-    Py_XDECREF(state->object_regions);
+    if (state->isolated_types != NULL)
+    {
+      ht_free(state->isolated_types);
+      state->isolated_types = NULL;
+    }
+
+    if (state->object_regions != NULL)
+    {
+      ht_free(state->object_regions);
+      state->object_regions = NULL;
+    }
+
+    if (state->immutables_ring != NULL)
+    {
+      for (Py_ssize_t i = 0; i < IMM_CACHE_SIZE; i++)
+      {
+        Py_XDECREF(state->immutables_ring[i]);
+      }
+
+      free(state->immutables_ring);
+      state->immutables_ring = NULL;
+    }
+
+    if (state->immutables != NULL)
+    {
+      ht_free(state->immutables);
+      state->immutables = NULL;
+    }
+
+    Py_CLEAR(state->code_blobs);
+    Py_CLEAR(state->code_cache);
+    Py_CLEAR(state->notify_loop);
+    Py_CLEAR(state->awaiting);
+#ifndef _WIN32
+    if (state->notifier != NULL)
+    {
+      Notifier_free(state->notifier);
+      state->notifier = NULL;
+    }
+#endif
   }
 }
 
@@ -0,0 +1,120 @@
+import os
+import socket
+import tempfile
+import time
+
+from veronapy import io_read, io_sleep, io_write, join, region, when
+from conftest import vpy_run
+import pytest
+
+
+def test_io_pipe():
+    read_fd, write_fd = os.pipe()
+    os.set_blocking(read_fd, False)
+    r = region("pipe")
+    with r:
+        r.fd = read_fd
+        r.data = b""
+
+    r.make_shareable()
+
+    # the reader gives its worker back until the data arrives
+    @when(r)
+    async def reader(p):
+        from veronapy import io_read
+
+        while len(p.data) < 100000:
+            chunk = await io_read(p.fd, 65536)
+            assert chunk
+            p.data += chunk
+
+        return len(p.data)
+
+    data = bytes(range(256)) * 390 + b"0123456789" * 16
+    assert io_write(write_fd, data).result(10) == len(data)
+    assert reader.result(10) == 100000
+
+    @when(r)
+    def check(p):
+        return p.data
+
+    assert check.result(10) == data
+    os.close(read_fd)
+    os.close(write_fd)
+
+
+def test_io_file():
+    with tempfile.TemporaryFile() as f:
+        assert io_write(f, b"hello world").result(10) == 11
+        f.seek(0)
+        assert io_read(f, 5).result(10) == b"hello"
+        assert io_read(f.fileno(), 100).result(10) == b" world"
+        assert io_read(f, 100).result(10) == b""
+
+
+def test_io_socket():
+    listener = socket.socket()
+    listener.bind(("127.0.0.1", 0))
+    listener.listen()
+    client = socket.create_connection(listener.getsockname())
+    server, _ = listener.accept()
+    server.setblocking(False)
+
+    reply = io_read(server, 5)
+    assert not reply.done()
+    client.sendall(b"ping!")
+    assert reply.result(10) == b"ping!"
+
+    assert io_write(server, b"pong!").result(10) == 5
+    assert client.recv(5) == b"pong!"
+
+    for s in (client, server, listener):
+        s.close()
+
+
+def test_io_sleep():
+    start = time.monotonic()
+    futures = [io_sleep(0.2) for _ in range(50)]
+    join(*futures)
+    # the sleeps overlap, rather than taking a worker each
+    assert 0.2 <= time.monotonic() - start < 2
+
+    sleepers = []
+    for delay in (0.3, 0.1, 0.2):
+        sleeper = region()
+        with sleeper:
+            sleeper.delay = delay
+
+        sleeper.make_shareable()
+
+        @when(sleeper)
+        async def woke(s):
+            import time
+            from veronapy import io_sleep
+
+            await io_sleep(s.delay)
+            return time.monotonic()
+
+        sleepers.append(woke)
+
+    c, a, b = join(*sleepers)
+    assert a < b < c
+
+
+def test_io_error():
+    read_fd, write_fd = os.pipe()
+    os.close(read_fd)
+    os.close(write_fd)
+    with pytest.raises(OSError):
+        io_read(read_fd, 10)
+
+    with pytest.raises(ValueError):
+        io_sleep(-1)
+
+
+if __name__ == "__main__":
+    vpy_run(test_io_pipe)
+    vpy_run(test_io_file)
+    vpy_run(test_io_socket)
+    vpy_run(test_io_sleep)
+    vpy_run(test_io_error)
@@ -1,5 +1,6 @@
 """Region tests."""
 
+import abc
 import json
 
 import veronapy as vp
@@ -176,6 +177,185 @@ def test_merge():
         assert r2.o2.__region__ == r1    # validate r2 is an alias for r1
 
 
+class MockABC(abc.ABC):
+    """Mock class with a metaclass."""
+    pass
+
+
+def test_ownership_by_type():
+    r1 = vp.region()
+    r2 = vp.region()
+
+    with r1, r2:
+        r1.a = MockObject()
+        r1.b = MockABC()       # objects with a metaclass are tagged separately
+        r2.a = MockObject()    # same type, different region
+        assert r1.a.__region__ == r1
+        assert r1.b.__region__ == r1
+        assert r2.a.__region__ == r2
+        x = r2.a
+        try:
+            r2.b = r1.b
+        except vp.RegionIsolationError:
+            pass
+        else:
+            raise AssertionError
+
+    try:
+        print(x.field)
+    except vp.RegionIsolationError:
+        pass
+    else:
+        raise AssertionError
+
+    # small regions tag their objects through the tables, and larger ones
+    # switch to a type of their own part way through
+    r3 = vp.region()
+    with r3:
+        r3.items = [MockObject() for _ in range(100)]
+        assert all(item.__region__ == r3 for item in r3.items)
+        y = r3.items[-1]
+
+    try:
+        print(y.field)
+    except vp.RegionIsolationError:
+        pass
+    else:
+        raise AssertionError
+
+
+def test_capture_deep_and_cyclic():
+    head = None
+    for _ in range(100000):
+        node = MockObject()
+        node.next = head
+        head = node
+
+    a = MockObject()
+    b = MockObject()
+    a.next = b
+    b.next = a
+    items = [a]
+    items.append(items)
+
+    r = vp.region()
+    with r:
+        r.head = head
+        r.items = items
+        assert r.head.next.next.__region__ == r
+        assert r.items[0].next.next.__region__ == r
+        assert r.items[1].__region__ == r
+
+
+class MockSlots:
+    """Mock object with slots."""
+    __slots__ = ("field",)
+
+
+def test_capture_traverse():
+    o = MockSlots()
+    o.field = MockObject()
+    o.field.items = [MockObject()]
+
+    r = vp.region(traverse=True)
+    with r:
+        r.o = o
+        assert r.o.field.__region__ == r
+        assert r.o.field.items[0].__region__ == r
+
+
+def test_update():
+    r1 = vp.region()
+    r2 = vp.region()
+    shared = MockObject()
+    with r1, r2:
+        r1.update({"a": MockObject(), "b": [shared], "c": shared, "d": 1})
+        assert r1.a.__region__ == r1
+        assert r1.b[0] is r1.c
+        assert r1.c.__region__ == r1
+        assert r1.d == 1
+        try:
+            r2.update({"x": r1.a})
+        except vp.RegionIsolationError:
+            pass
+        else:
+            raise AssertionError
+
+    try:
+        r1.update({"e": 1})
+    except vp.RegionIsolationError:
+        pass
+    else:
+        raise AssertionError
+
+
+def test_immutable_tuples():
+    r1 = vp.region()
+    r2 = vp.region()
+    key = tuple((i, str(i), frozenset([i])) for i in range(100))
+    with r1, r2:
+        for _ in range(2):
+            # deeply immutable values can be shared between regions
+            r1.key = key
+            r2.key = key
+
+        r1.mutable = tuple([i] for i in range(100))
+        try:
+            r2.mutable = r1.mutable
+        except vp.RegionIsolationError:
+            pass
+        else:
+            raise AssertionError
+
+
+def test_merge_ranked():
+    r1 = vp.region("r1")
+    r2 = vp.region("r2")
+    r3 = vp.region("r3")
+
+    with r1, r2, r3:
+        r1.o1 = MockObject()
+        r2.o2 = MockObject()
+        r3.o3 = MockObject()
+        o3 = r2.merge(r3).o3
+
+        # r2 now heads a taller tree than r1, but r1 must survive the merge
+        merged = r1.merge(r2)
+        assert r1.name == "r1"
+        assert r2.name == "r1"
+        assert r1 == r2 and r2 == r3
+        assert merged.o2.__region__ == r1
+        assert r1.o1.__region__ == r1
+        assert o3.__region__ == r1
+        r1.o4 = merged.o2
+
+    assert not r1.is_open
+    assert not r3.is_open
+
+
+def test_merge_tagged():
+    r1 = vp.region("r1")
+    r2 = vp.region("r2")
+    r3 = vp.region("r3")
+
+    with r1, r2, r3:
+        r1.a = MockABC()       # tagged in the object tables
+        r2.a = MockABC()
+        r2.b = MockABC()
+        r3.a = MockABC()
+        length = vp.table_stats()["length"]
+
+        # the entries of r3 are moved over to r2, and then to r1
+        a = r2.merge(r3).a
+        b = r1.merge(r2).b
+        assert vp.table_stats()["length"] == length
+        assert a.__region__ == r1
+        assert b.__region__ == r1
+        assert r1.a.__region__ == r1
+        r1.c = MockABC()
+        assert vp.table_stats()["length"] == length + 1
+
+
 if __name__ == "__main__":
     vpy_run(test_creation)
     vpy_run(test_open)
@@ -186,3 +366,10 @@ if __name__ == "__main__":
     vpy_run(test_ownership_with_merging)
     vpy_run(test_region_ownership)
     vpy_run(test_merge)
+    vpy_run(test_ownership_by_type)
+    vpy_run(test_capture_deep_and_cyclic)
+    vpy_run(test_capture_traverse)
+    vpy_run(test_update)
+    vpy_run(test_immutable_tuples)
+    vpy_run(test_merge_ranked)
+    vpy_run(test_merge_tagged)
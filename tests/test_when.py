@@ -1,4 +1,6 @@
-from veronapy import region, RegionIsolationError, when
+import operator
+
+from veronapy import behavior, join, read, region, RegionIsolationError, when, when_each
 from conftest import vpy_run
 
 
@@ -73,8 +75,383 @@ def test_when_private():
         raise AssertionError
 
 
+def test_when_closure():
+    r = region("closure").make_shareable()
+    amount = 10
+    names = ("a", "b")
+
+    # immutable values from the enclosing scope are copied into the thunk
+    @when(r)
+    def captured(r):
+        r.amount = amount
+        return r.amount, names
+
+    assert captured.result(10) == (10, ("a", "b"))
+
+    items = [amount]
+
+    try:
+        @when(r)
+        def _(r):
+            r.items = items
+    except RegionIsolationError:
+        # mutable values cannot be captured
+        pass
+    else:
+        raise AssertionError
+
+
+def test_when_nested():
+    counter = region("counter")
+
+    with counter:
+        counter.count = 0
+
+    counter.make_shareable()
+
+    # when counter as c:
+    @when(counter)
+    def _(c):
+        from veronapy import when
+
+        c.count = 1
+
+        # when c:
+        @when(c)
+        def _(c):
+            assert c.count == 1
+            c.count = 2
+
+
+@behavior
+def deposit(account, amount):
+    account.balance = account.balance + amount
+
+
+def test_when_call():
+    account = region("account")
+
+    with account:
+        account.balance = 0
+
+    account.make_shareable()
+
+    for amount in range(1, 11):
+        when(account).call(deposit, amount)
+
+    try:
+        when(account).call(deposit, [1])
+    except RegionIsolationError:
+        # arguments must be immutable
+        pass
+    else:
+        raise AssertionError
+
+    # when account as a:
+    @when(account)
+    def _(a):
+        assert a.balance == 55
+
+
+@behavior
+def check_balance(account, expected):
+    assert account.balance == expected
+
+
+def test_when_each():
+    accounts = [region("account" + str(i)) for i in range(100)]
+
+    for account in accounts:
+        with account:
+            account.balance = 0
+
+        account.make_shareable()
+
+    when_each(accounts, deposit, 10)
+    when_each(accounts, check_balance, 10)
+
+
+@behavior
+def store_length(r, data, names):
+    r.length = len(data) + len(names)
+
+
+@behavior
+def check_length(r, expected):
+    assert r.length == expected
+
+
+def test_when_call_large():
+    r = region("payload")
+
+    with r:
+        r.length = 0
+
+    r.make_shareable()
+
+    payload = b"x" * (1 << 20)
+    when(r).call(store_length, payload, ("a", "b"))
+    when(r).call(check_length, len(payload) + 2)
+
+
+def test_when_read():
+    config = region("config")
+    results = region("results")
+
+    with config, results:
+        config.rate = 2
+        results.before = 0
+        results.after = 0
+        results.error = None
+
+    config.make_shareable()
+    results.make_shareable()
+
+    @when(read(config), results)
+    def _(c, r):
+        r.before = c.rate
+
+    @when(config)
+    def _(c):
+        c.rate = 3
+
+    @when(read(config), results)
+    def _(c, r):
+        r.after = c.rate
+        try:
+            c.rate = 4
+        except Exception as e:
+            r.error = str(e)
+
+    @when(results)
+    def _(r):
+        assert r.before == 2
+        assert r.after == 3
+        assert r.error == "Region is open read-only"
+
+    try:
+        read(object())
+    except TypeError:
+        pass
+    else:
+        raise AssertionError
+
+
+class Settings:
+    def __init__(self, rate):
+        self.rate = rate
+
+
+@behavior
+def write_while_reading(c, rounds):
+    from veronapy import RegionIsolationError
+
+    writes = 0
+    changed = 0
+    for i in range(rounds):
+        if c.settings.rate != 1:
+            changed += 1
+
+        try:
+            c.settings.rate = i
+            writes += 1
+        except RegionIsolationError:
+            pass
+
+    return writes, changed
+
+
+def test_when_read_concurrent():
+    config = region("config")
+
+    with config:
+        config.settings = Settings(1)
+
+    config.make_shareable()
+
+    # readers run at the same time, and none of them may write
+    futures = [when(read(config)).call(write_while_reading, 20000) for _ in range(4)]
+    assert join(*futures) == ((0, 0),) * 4
+
+    @when(config)
+    def rate(c):
+        return c.settings.rate
+
+    assert rate.result(10) == 1
+
+
+@behavior
+def mutate_while_reading(c):
+    from veronapy import RegionIsolationError
+
+    mutations = (
+        lambda: c.items.append(3),
+        lambda: c.items.clear(),
+        lambda: c.items.__setitem__(0, 3),
+        lambda: c.table.update(b=2),
+        lambda: c.table.__setitem__("b", 2),
+    )
+
+    rejected = 0
+    for mutate in mutations:
+        try:
+            mutate()
+        except RegionIsolationError:
+            rejected += 1
+
+    # methods which only read are still allowed
+    return rejected, c.items.index(2), c.items.count(1), c.table.get("a")
+
+
+def test_when_read_methods():
+    config = region("config")
+
+    with config:
+        config.items = [1, 2]
+        config.table = {"a": 1}
+
+    config.make_shareable()
+
+    reading = when(read(config)).call(mutate_while_reading)
+    assert reading.result(10) == (5, 1, 1, 1)
+
+    @when(config)
+    def contents(c):
+        return tuple(c.items), tuple(c.table.items())
+
+    assert contents.result(10) == ((1, 2), (("a", 1),))
+
+
+@behavior
+def add_to_count(r, amount):
+    return r.count + amount
+
+
+def test_when_future():
+    r = region("future")
+
+    with r:
+        r.count = 1
+
+    r.make_shareable()
+
+    @when(r)
+    def incremented(r):
+        r.count += 1
+        return r.count
+
+    @when(r)
+    def copied(r):
+        from veronapy import region
+
+        result = region("copy")
+        with result:
+            result.count = r.count
+
+        return result
+
+    @when(r)
+    def slow(r):
+        import time
+
+        time.sleep(0.2)
+
+    assert incremented.result() == 2
+
+    result = copied.result()
+    with result:
+        assert result.count == 2
+
+    try:
+        slow.result(timeout=0)
+    except TimeoutError:
+        pass
+    else:
+        raise AssertionError
+
+    assert join(slow, when(r).call(add_to_count, 3)) == (None, 5)
+    assert slow.done()
+
+
+def test_when_await():
+    import asyncio
+
+    counters = [region("await%d" % i) for i in range(4)]
+    for r in counters:
+        with r:
+            r.count = 0
+
+        r.make_shareable()
+
+    async def main():
+        futures = [when(counters[i % 4]).call(add_to_count, i) for i in range(100)]
+        assert await asyncio.gather(*futures) == list(range(100))
+        # a finished future can be awaited again
+        assert await futures[0] == 0
+
+    asyncio.run(main())
+
+
+def test_when_coroutine():
+    parents = [region("parent%d" % i) for i in range(8)]
+    for i, r in enumerate(parents):
+        with r:
+            r.count = i
+
+        r.make_shareable()
+
+    futures = []
+    for r in parents:
+        # the parent keeps its region while it waits for the child
+        @when(r)
+        async def parent(p):
+            from veronapy import region, when
+
+            child = region()
+            with child:
+                child.count = p.count
+
+            child.make_shareable()
+
+            @when(child)
+            def doubled(c):
+                return c.count * 2
+
+            p.count = await doubled
+            assert await doubled == p.count
+            return p.count
+
+        futures.append(parent)
+
+    assert join(*futures) == tuple(2 * i for i in range(8))
+
+
+def test_when_module_globals():
+    r = region().make_shareable()
+
+    # modules imported by the defining module are imported for the thunk too,
+    # which is also how pytest's rewritten asserts find their helpers
+    @when(r)
+    def add(_):
+        return operator.add(1, 2)
+
+    assert add.result(10) == 3
+
+
 if __name__ == "__main__":
     vpy_run(test_shareable)
     vpy_run(test_when)
     vpy_run(test_detach)
     vpy_run(test_when_private)
+    vpy_run(test_when_closure)
+    vpy_run(test_when_nested)
+    vpy_run(test_when_call)
+    vpy_run(test_when_each)
+    vpy_run(test_when_call_large)
+    vpy_run(test_when_read)
+    vpy_run(test_when_read_concurrent)
+    vpy_run(test_when_read_methods)
+    vpy_run(test_when_future)
+    vpy_run(test_when_await)
+    vpy_run(test_when_coroutine)
+    vpy_run(test_when_module_globals)